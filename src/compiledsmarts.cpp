@@ -0,0 +1,111 @@
+#include "compiledsmarts.h"
+#include "smartsscores.h"
+
+namespace SC {
+
+  /**
+   * The shared pattern. The reference count is updated with atomic
+   * operations (GCC builtins), everything else is read-only once the
+   * pattern is compiled.
+   */
+  struct CompiledSmartsData
+  {
+    CompiledSmartsData(const std::string &smarts_, Smarts *pattern_) : refs(1), smarts(smarts_), pattern(pattern_),
+        requiredCounts(GetRequiredCounts(pattern_))
+    {
+    }
+
+    ~CompiledSmartsData()
+    {
+      delete pattern;
+    }
+
+    volatile int refs;
+    const std::string smarts;
+    Smarts * const pattern;
+    const SmartsCounts requiredCounts;
+  };
+
+  static const std::string emptySmarts;
+  static const SmartsCounts emptyCounts;
+
+  CompiledSmarts::CompiledSmarts() : d(0), m_pattern(0)
+  {
+  }
+
+  CompiledSmarts::CompiledSmarts(const std::string &smarts, SmartsScores *scores, int opts) : d(0), m_pattern(0)
+  {
+    Smarts *pattern = parse(smarts);
+    if (!pattern)
+      return;
+
+    PrettySmartsScores defaultScores;
+    SmartsOptimizer optimizer(scores ? scores : &defaultScores);
+    optimizer.Optimize(pattern, opts);
+
+    init(smarts, pattern);
+  }
+
+  CompiledSmarts::CompiledSmarts(const std::string &smarts, Smarts *pattern) : d(0), m_pattern(0)
+  {
+    if (pattern)
+      init(smarts, pattern);
+  }
+
+  CompiledSmarts::CompiledSmarts(const CompiledSmarts &other) : d(other.d), m_pattern(other.m_pattern)
+  {
+    if (d)
+      __sync_add_and_fetch(&d->refs, 1);
+  }
+
+  CompiledSmarts::~CompiledSmarts()
+  {
+    release();
+  }
+
+  CompiledSmarts& CompiledSmarts::operator=(const CompiledSmarts &other)
+  {
+    if (d == other.d)
+      return *this;
+    // take the new reference before dropping the old one
+    if (other.d)
+      __sync_add_and_fetch(&other.d->refs, 1);
+    release();
+    d = other.d;
+    m_pattern = other.m_pattern;
+    return *this;
+  }
+
+  const std::string& CompiledSmarts::smarts() const
+  {
+    return d ? d->smarts : emptySmarts;
+  }
+
+  int CompiledSmarts::refCount() const
+  {
+    return d ? d->refs : 0;
+  }
+
+  const SmartsCounts& CompiledSmarts::requiredCounts() const
+  {
+    return d ? d->requiredCounts : emptyCounts;
+  }
+
+  void CompiledSmarts::init(const std::string &smarts, Smarts *pattern)
+  {
+    // the plan is part of the immutable pattern, matching must not create it
+    if (pattern->plan.empty())
+      pattern->plan = CreateSearchPlan(pattern);
+    d = new CompiledSmartsData(smarts, pattern);
+    m_pattern = pattern;
+  }
+
+  void CompiledSmarts::release()
+  {
+    if (d && __sync_sub_and_fetch(&d->refs, 1) == 0)
+      delete d;
+    d = 0;
+    m_pattern = 0;
+  }
+
+}
@@ -0,0 +1,157 @@
+#ifndef SC_COMPILEDSMARTS_H
+#define SC_COMPILEDSMARTS_H
+
+#include "smarts.h"
+#include "smartsoptimizer.h"
+#include "smartsmatcher.h"
+#include "smartsanalysis.h"
+
+#include <string>
+
+namespace SC {
+
+  class SmartsScores;
+  struct CompiledSmartsData;
+
+  /**
+   * A parsed, optimized and planned SMARTS pattern.
+   *
+   * CompiledSmarts is an immutable value type. Copies share the pattern
+   * through an atomic reference count and the pattern is only accessible
+   * through const members, it is never modified after construction. Since
+   * the matcher keeps all search state on the stack, a CompiledSmarts can be
+   * matched from any number of threads at the same time without locking.
+   *
+   * @code
+   * CompiledSmarts pattern("c1ccccc1[OH]");
+   * // copies are cheap and can be handed to other threads
+   * bool found = match(&mol, pattern);
+   * @endcode
+   *
+   * The counts a molecule needs to contain a match are computed once, a
+   * screener can reject molecules before searching:
+   *
+   * @code
+   * if (GetMoleculeCounts(&mol).contains(pattern.requiredCounts()))
+   *   found = match(&mol, pattern);
+   * @endcode
+   */
+  class CompiledSmarts
+  {
+    public:
+      typedef const SmartsAtom& atom_type;
+      typedef const SmartsBond& bond_type;
+
+      /**
+       * Create a null pattern.
+       */
+      CompiledSmarts();
+      /**
+       * Parse, optimize and plan a SMARTS. The @p scores are only used
+       * while compiling (PrettySmartsScores if none are given), concurrent
+       * compilations need their own scores.
+       */
+      explicit CompiledSmarts(const std::string &smarts, SmartsScores *scores = 0,
+          int opts = SmartsOptimizer::O5);
+      /**
+       * Take ownership of an already optimized @p pattern. The default
+       * search plan is created if the pattern has none.
+       */
+      CompiledSmarts(const std::string &smarts, Smarts *pattern);
+      CompiledSmarts(const CompiledSmarts &other);
+      ~CompiledSmarts();
+
+      CompiledSmarts& operator=(const CompiledSmarts &other);
+
+      bool isNull() const
+      {
+        return !m_pattern;
+      }
+
+      /**
+       * The SMARTS string the pattern was compiled from.
+       */
+      const std::string& smarts() const;
+
+      const Smarts* pattern() const
+      {
+        return m_pattern;
+      }
+
+      /**
+       * The number of CompiledSmarts sharing the pattern.
+       */
+      int refCount() const;
+
+      /**
+       * The minimum molecule counts for a match (see GetRequiredCounts()).
+       */
+      const SmartsCounts& requiredCounts() const;
+
+      int numAtoms() const
+      {
+        return m_pattern ? m_pattern->numAtoms() : 0;
+      }
+
+      const SmartsAtom& atom(int index) const
+      {
+        return m_pattern->atom(index);
+      }
+
+      int numBonds() const
+      {
+        return m_pattern ? m_pattern->numBonds() : 0;
+      }
+
+      const SmartsBond& bond(int index) const
+      {
+        return m_pattern->bond(index);
+      }
+
+      const std::vector<SmartsSearchStep>& searchPlan() const
+      {
+        return m_pattern->searchPlan();
+      }
+
+      template<typename AtomType>
+      bool matchAtom(const SmartsAtom &smartsAtom, const AtomType &atom) const
+      {
+        return m_pattern->matchAtom(smartsAtom, atom);
+      }
+
+      template<typename BondType>
+      bool matchBond(const SmartsBond &smartsBond, const BondType &bond) const
+      {
+        return m_pattern->matchBond(smartsBond, bond);
+      }
+
+    private:
+      void init(const std::string &smarts, Smarts *pattern);
+      void release();
+
+      CompiledSmartsData *d;
+      const Smarts *m_pattern; // d->pattern, kept here for inlining
+  };
+
+  /**
+   * Match a compiled SMARTS against a molecule.
+   */
+  template<typename MoleculeType, typename MappingType>
+  bool match(MoleculeType *mol, const CompiledSmarts &smarts, MappingType &mapping)
+  {
+    return match(mol, &smarts, mapping);
+  }
+
+  /**
+   * @overload
+   */
+  template<typename MoleculeType>
+  bool match(MoleculeType *mol, const CompiledSmarts &smarts)
+  {
+    NoMapping mapping;
+    return match(mol, &smarts, mapping);
+  }
+
+}
+
+#endif
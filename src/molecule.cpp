@@ -2,98 +2,227 @@
 
 namespace SC {
 
+  /**
+   * The text *.scm format version, version 2 added the ring sizes.
+   */
+  static const int moleculeTextVersion = 2;
+
+  void writeMoleculeHeader(std::ostream &os)
+  {
+    os << "SCM " << moleculeTextVersion << std::endl;
+  }
+
+  bool readMoleculeHeader(std::istream &is)
+  {
+    std::string magic;
+    int version;
+    return is >> magic >> version && magic == "SCM" && version == moleculeTextVersion;
+  }
+
   void writeMolecule(std::ostream &os, OpenBabel::OBMol *mol)
   {
-    int numAtoms = 0;
-    FOR_ATOMS_OF_MOL (a, mol)
-      if (!a->IsHydrogen())
-        ++numAtoms;
-    int numBonds = 0;
-    FOR_BONDS_OF_MOL (b, mol)
-      if (!b->GetBeginAtom()->IsHydrogen() && !b->GetEndAtom()->IsHydrogen())
-        ++numBonds;
+    Molecule snapshot;
+    SnapshotHeavyAtoms(mol, snapshot);
+    writeMolecule(os, snapshot);
+  }
 
+  void writeMolecule(std::ostream &os, const Molecule &mol)
+  {
+    os << mol.numAtoms() << " " << mol.numBonds() << std::endl;
+    for (unsigned int i = 0; i < mol.numAtoms(); ++i) {
+      os << mol.isAromatic(i) << " ";
+      os << mol.isCyclic(i) << " ";
+      os << mol.element(i) << " ";
+      os << mol.mass(i) << " ";
+      os << mol.degree(i) << " ";
+      os << mol.valence(i) << " ";
+      os << mol.connectivity(i) << " ";
+      os << mol.totalHydrogens(i) << " ";
+      os << mol.implicitHydrogens(i) << " ";
+      os << mol.ringMembership(i) << " ";
+      os << mol.ringConnectivity(i) << " ";
+      os << mol.charge(i) << " ";
+      os << mol.atomClass(i) << " ";
+      os << mol.ringSizes(i) << std::endl;
+    }
 
-    os << numAtoms << " " << numBonds << std::endl;
-    FOR_ATOMS_OF_MOL (a, mol) {
-      if (a->IsHydrogen())
-        continue;
-      OpenBabelAtom atom(&*a);
-      // TODO isInRingSize
-      os << atom.isAromatic() << " ";
-      os << atom.isCyclic() << " ";
-      os << atom.element() << " ";
-      os << atom.mass() << " ";
-      os << atom.degree() << " ";
-      os << atom.valence() << " ";
-      os << atom.connectivity() << " ";
-      os << atom.totalHydrogens() << " ";
-      os << atom.implicitHydrogens() << " ";
-      os << atom.ringMembership() << " ";
-      os << atom.ringConnectivity() << " ";
-      os << atom.charge() << " ";
-      os << atom.atomClass() << std::endl;
+    for (unsigned int i = 0; i < mol.numBonds(); ++i) {
+      os << mol.source(i) << " ";
+      os << mol.target(i) << " ";
+      os << mol.isBondAromatic(i) << " ";
+      os << mol.isBondCyclic(i) << " ";
+      os << mol.order(i) << std::endl;
     }
+  }
 
-    FOR_BONDS_OF_MOL (b, mol) {
-      if (b->GetBeginAtom()->IsHydrogen() || b->GetEndAtom()->IsHydrogen())
-        continue;
-      OpenBabelBond bond(&*b);
-      os << b->GetBeginAtom()->GetIndex() << " ";
-      os << b->GetEndAtom()->GetIndex() << " ";
-      os << bond.isAromatic() << " ";
-      os << bond.isCyclic() << " ";
-      os << bond.order() << std::endl;
+  void Molecule::clear()
+  {
+    m_atomFlags.clear();
+    m_element.clear();
+    m_mass.clear();
+    m_degree.clear();
+    m_valence.clear();
+    m_connectivity.clear();
+    m_totalH.clear();
+    m_implicitH.clear();
+    m_ringMembership.clear();
+    m_ringConnectivity.clear();
+    m_charge.clear();
+    m_atomClass.clear();
+    m_ringSizes.clear();
+    m_source.clear();
+    m_target.clear();
+    m_bondFlags.clear();
+    m_order.clear();
+    m_nbrOffsets.clear();
+    m_nbrBonds.clear();
+    m_nbrNext.clear();
+  }
+
+  void Molecule::addAtom(bool aromatic, bool cyclic, int element, int mass, int degree,
+      int valence, int connectivity, int totalH, int implicitH, int ringMembership,
+      int ringConnectivity, int charge, int atomClass, unsigned int ringSizes)
+  {
+    m_atomFlags.push_back((aromatic ? Aromatic : 0) | (cyclic ? Cyclic : 0));
+    m_element.push_back(element);
+    m_mass.push_back(mass);
+    m_degree.push_back(degree);
+    m_valence.push_back(valence);
+    m_connectivity.push_back(connectivity);
+    m_totalH.push_back(totalH);
+    m_implicitH.push_back(implicitH);
+    m_ringMembership.push_back(ringMembership);
+    m_ringConnectivity.push_back(ringConnectivity);
+    m_charge.push_back(charge);
+    m_atomClass.push_back(atomClass);
+    m_ringSizes.push_back(ringSizes);
+  }
+
+  void Molecule::addBond(unsigned int source, unsigned int target, bool aromatic, bool cyclic, int order)
+  {
+    m_source.push_back(source);
+    m_target.push_back(target);
+    m_bondFlags.push_back((aromatic ? Aromatic : 0) | (cyclic ? Cyclic : 0));
+    m_order.push_back(order);
+  }
+
+  void Molecule::buildAdjacency()
+  {
+    unsigned int n = numAtoms();
+    unsigned int m = numBonds();
+
+    // count the bonds around each atom (shifted by one for the prefix sum)
+    m_nbrOffsets.assign(n + 1, 0);
+    for (unsigned int i = 0; i < m; ++i) {
+      ++m_nbrOffsets[m_source[i] + 1];
+      ++m_nbrOffsets[m_target[i] + 1];
+    }
+    for (unsigned int i = 0; i < n; ++i)
+      m_nbrOffsets[i + 1] += m_nbrOffsets[i];
+
+    m_nbrBonds.resize(2 * m);
+    m_nbrNext.assign(m_nbrOffsets.begin(), m_nbrOffsets.end() - 1);
+    for (unsigned int i = 0; i < m; ++i) {
+      m_nbrBonds[m_nbrNext[m_source[i]]++] = i;
+      m_nbrBonds[m_nbrNext[m_target[i]]++] = i;
     }
   }
 
   bool readMolecule(std::istream &is, Molecule &mol)
   {
-    mol.m_atoms.clear();
-    mol.m_atomPtrs.clear();
-    mol.m_bonds.clear();
+    mol.clear();
 
     int numAtoms, numBonds;
-    if (!(is >> numAtoms >> numBonds))
+    if (!(is >> numAtoms >> numBonds) || numAtoms < 0 || numBonds < 0)
       return false;
 
-    mol.m_atoms.reserve(numAtoms);
-    mol.m_atomPtrs.reserve(numAtoms);
-    mol.m_bonds.reserve(numBonds);
-
     bool aromatic, cyclic;
     int element, mass, degree, valence, connectivity, totalH, implicitH;
     int ringMembership, ringConnectivity, charge, atomClass;
+    unsigned int ringSizes;
     for (int i = 0; i < numAtoms; ++i) {
       is >> aromatic >> cyclic;
       is >> element >> mass >> degree >> valence;
       is >> connectivity >> totalH >> implicitH;
       is >> ringMembership >> ringConnectivity;
-      is >> charge >> atomClass;
-      std::vector<int> ringSizes;
-
-      mol.m_atoms.push_back(Atom(i, ringSizes, aromatic, cyclic,
-                                 element, mass, degree, valence, connectivity,
-                                 totalH, implicitH, ringMembership,
-                                 ringConnectivity, charge, atomClass));
-      mol.m_atomPtrs.push_back(&mol.m_atoms.back());
+      is >> charge >> atomClass >> ringSizes;
+
+      mol.addAtom(aromatic, cyclic, element, mass, degree, valence, connectivity,
+                  totalH, implicitH, ringMembership, ringConnectivity, charge,
+                  atomClass, ringSizes);
     }
 
     int source, target, order;
     for (int i = 0; i < numBonds; ++i) {
       is >> source >> target >> aromatic;
       is >> cyclic >> order;
+      if (source < 0 || target < 0 || source >= numAtoms || target >= numAtoms)
+        return false;
+
+      mol.addBond(source, target, aromatic, cyclic, order);
+    }
+
+    mol.buildAdjacency();
+
+    return is;
+  }
 
-      Atom *s = mol.m_atomPtrs[source];
-      Atom *t = mol.m_atomPtrs[target];
+  void SnapshotMolecule(OpenBabel::OBMol *obmol, Molecule &mol)
+  {
+    mol.clear();
 
-      mol.m_bonds.push_back(Bond(s, t, aromatic, cyclic, order));
+    FOR_ATOMS_OF_MOL (a, obmol) {
+      OpenBabelAtom atom(&*a);
+      mol.addAtom(atom.isAromatic(), atom.isCyclic(), atom.element(), atom.mass(),
+                  atom.degree(), atom.valence(), atom.connectivity(),
+                  atom.totalHydrogens(), atom.implicitHydrogens(),
+                  atom.ringMembership(), atom.ringConnectivity(), atom.charge(),
+                  atom.atomClass(), 0);
+    }
+    // one pass over the SSSR instead of IsInRingSize() calls
+    GetRingSizeMasks(obmol, mol.m_ringSizes);
 
-      s->addBond(&mol.m_bonds.back());
-      t->addBond(&mol.m_bonds.back());
+    FOR_BONDS_OF_MOL (b, obmol) {
+      OpenBabelBond bond(&*b);
+      mol.addBond(b->GetBeginAtom()->GetIndex(), b->GetEndAtom()->GetIndex(),
+                  bond.isAromatic(), bond.isCyclic(), bond.order());
     }
 
-    return is;
+    mol.buildAdjacency();
+  }
+
+  void SnapshotHeavyAtoms(OpenBabel::OBMol *obmol, Molecule &mol)
+  {
+    mol.clear();
+
+    std::vector<unsigned int> ringSizes;
+    GetRingSizeMasks(obmol, ringSizes);
+
+    // heavy atom indices
+    std::vector<int> indices(obmol->NumAtoms(), -1);
+    int numAtoms = 0;
+    FOR_ATOMS_OF_MOL (a, obmol) {
+      if (a->IsHydrogen())
+        continue;
+      indices[a->GetIndex()] = numAtoms++;
+      OpenBabelAtom atom(&*a);
+      mol.addAtom(atom.isAromatic(), atom.isCyclic(), atom.element(), atom.mass(),
+                  atom.degree(), atom.valence(), atom.connectivity(),
+                  atom.totalHydrogens(), atom.implicitHydrogens(),
+                  atom.ringMembership(), atom.ringConnectivity(), atom.charge(),
+                  atom.atomClass(), ringSizes[a->GetIndex()]);
+    }
+
+    FOR_BONDS_OF_MOL (b, obmol) {
+      int source = indices[b->GetBeginAtom()->GetIndex()];
+      int target = indices[b->GetEndAtom()->GetIndex()];
+      if (source == -1 || target == -1)
+        continue;
+      OpenBabelBond bond(&*b);
+      mol.addBond(source, target, bond.isAromatic(), bond.isCyclic(), bond.order());
+    }
+
+    mol.buildAdjacency();
   }
 
 }
@@ -1,366 +1,594 @@
+#ifndef SC_MOLECULE_H
+#define SC_MOLECULE_H
+
 #include "openbabel.h"
+#include "smartsmatcher.h"
 
 namespace SC {
 
-  class Bond;
+  class Molecule;
 
+  /**
+   * Handle for an atom in a Molecule (the molecule and a 32-bit index).
+   */
   class Atom
   {
     public:
-      Atom(int index, const std::vector<int> &ringSizes, bool aromatic, bool cyclic, int element, 
-           int mass, int degree, int valence, int connectivity, int totalH, int implicitH,
-           int ringMembership, int ringConnectivity, int charge, int atomClass) : m_ringSizes(ringSizes),
-           m_index(index), m_aromatic(aromatic), m_cyclic(cyclic), m_element(element),
-           m_mass(mass), m_degree(degree), m_valence(valence), m_connectivity(connectivity),
-           m_totalH(totalH), m_implicitH(implicitH), m_ringMembership(ringMembership),
-           m_charge(charge), m_atomClass(atomClass)
+      Atom(const Molecule *mol = 0, unsigned int index = 0) : m_mol(mol), m_index(index)
       {
       }
 
-      void addBond(Bond *bond)
+      const Molecule* molecule() const
       {
-        m_bonds.push_back(bond);
+        return m_mol;
       }
 
-      std::vector<Bond*>::iterator beginBonds()
+      unsigned int index() const
       {
-        return m_bonds.begin();
+        return m_index;
       }
 
-      std::vector<Bond*>::iterator endBonds()
+    private:
+      const Molecule *m_mol;
+      unsigned int m_index;
+  };
+
+  /**
+   * Handle for a bond in a Molecule (the molecule and a 32-bit index).
+   */
+  class Bond
+  {
+    public:
+      Bond(const Molecule *mol = 0, unsigned int index = 0) : m_mol(mol), m_index(index)
       {
-        return m_bonds.end();
       }
 
-      int index() const
+      const Molecule* molecule() const
+      {
+        return m_mol;
+      }
+
+      unsigned int index() const
       {
         return m_index;
       }
 
-      bool isAromatic() const
+    private:
+      const Molecule *m_mol;
+      unsigned int m_index;
+  };
+
+  /**
+   * Iterator over the atoms in a Molecule, dereferences to an Atom handle.
+   */
+  class MoleculeAtomIter
+  {
+    public:
+      MoleculeAtomIter(const Molecule *mol = 0, unsigned int index = 0) : m_mol(mol), m_index(index)
       {
-        return m_aromatic;
       }
 
-      bool isAliphatic() const
+      Atom operator*() const
       {
-        return !m_aromatic;
+        return Atom(m_mol, m_index);
       }
 
-      bool isCyclic() const
+      MoleculeAtomIter& operator++()
       {
-        return m_cyclic;
+        ++m_index;
+        return *this;
       }
 
-      bool isAcyclic() const
+      bool operator==(const MoleculeAtomIter &other) const
       {
-        return !m_cyclic;
+        return m_index == other.m_index;
       }
 
-      int element() const
+      bool operator!=(const MoleculeAtomIter &other) const
       {
-        return m_element;
+        return m_index != other.m_index;
       }
 
-      int mass() const
+    private:
+      const Molecule *m_mol;
+      unsigned int m_index;
+  };
+
+  /**
+   * Iterator over the bonds around an atom, walks the atom's slice of the
+   * molecule's CSR bond indices.
+   */
+  class MoleculeBondIter
+  {
+    public:
+      MoleculeBondIter(const Molecule *mol = 0, const unsigned int *index = 0) : m_mol(mol), m_index(index)
       {
-        return m_mass;
       }
 
-      int degree() const
+      Bond operator*() const
       {
-        return m_degree;
+        return Bond(m_mol, *m_index);
       }
 
-      int valence() const
+      MoleculeBondIter& operator++()
       {
-        return m_valence;
+        ++m_index;
+        return *this;
       }
 
-      int connectivity() const
+      bool operator==(const MoleculeBondIter &other) const
       {
-        return m_connectivity;
+        return m_index == other.m_index;
       }
 
-      int totalHydrogens() const
+      bool operator!=(const MoleculeBondIter &other) const
       {
-        return m_totalH;
+        return m_index != other.m_index;
       }
 
-      int implicitHydrogens() const
+    private:
+      const Molecule *m_mol;
+      const unsigned int *m_index;
+  };
+
+  /**
+   * Molecule read from a (text) *.scm file.
+   *
+   * The molecule is stored as a structure of arrays: one column per atom
+   * and bond property and compressed sparse row (CSR) arrays for the bonds
+   * around each atom. The bonds of atom i are
+   * m_nbrBonds[m_nbrOffsets[i]] ... m_nbrBonds[m_nbrOffsets[i + 1] - 1].
+   * Atoms and bonds are referred to by 32-bit indices (Atom and Bond
+   * handles) instead of pointers so walking the adjacency only touches a
+   * few small contiguous arrays.
+   *
+   * The columns keep their capacity when a molecule is cleared, reading
+   * molecules into the same Molecule object does not allocate once it has
+   * grown to the size of the largest molecule:
+   *
+   * @code
+   * Molecule mol;
+   * readMoleculeHeader(ifs);
+   * while (readMolecule(ifs, mol))
+   *   match(&mol, pattern);
+   * @endcode
+   */
+  class Molecule
+  {
+    public:
+      enum Flags {
+        Aromatic = 1,
+        Cyclic = 2
+      };
+
+      /**
+       * Remove all atoms and bonds (the storage is kept for reuse).
+       */
+      void clear();
+
+      unsigned int numAtoms() const
       {
-        return m_implicitH;
+        return m_atomFlags.size();
       }
 
-      int ringMembership() const
+      unsigned int numBonds() const
       {
-        return m_ringMembership;
+        return m_bondFlags.size();
       }
 
-      bool isInRingSize(int size) const
+      MoleculeAtomIter beginAtoms() const
       {
-        return std::find(m_ringSizes.begin(), m_ringSizes.end(), size) != m_ringSizes.end();
+        return MoleculeAtomIter(this, 0);
       }
 
-      int ringConnectivity() const
+      MoleculeAtomIter endAtoms() const
       {
-        return m_ringConnectivity;
+        return MoleculeAtomIter(this, numAtoms());
       }
 
-      int charge() const
+      MoleculeBondIter beginBonds(unsigned int atom) const
       {
-        return m_charge;
+        return MoleculeBondIter(this, nbrBonds() + m_nbrOffsets[atom]);
       }
 
-      int atomClass() const
+      MoleculeBondIter endBonds(unsigned int atom) const
       {
-        return m_atomClass;
+        return MoleculeBondIter(this, nbrBonds() + m_nbrOffsets[atom + 1]);
       }
 
-    private:
-      std::vector<Bond*> m_bonds;
-      std::vector<int> m_ringSizes;
-      int m_index;
-      bool m_aromatic;
-      bool m_cyclic;
-      int m_element;
-      int m_mass;
-      int m_degree;
-      int m_valence;
-      int m_connectivity;
-      int m_totalH;
-      int m_implicitH;
-      int m_ringMembership;
-      int m_ringConnectivity;
-      int m_charge;
-      int m_atomClass;
-  };
+      /**
+       * Atom properties.
+       */
+      bool isAromatic(unsigned int atom) const
+      {
+        return m_atomFlags[atom] & Aromatic;
+      }
 
-  class AtomWrapper
-  {
-    public:
-      AtomWrapper(Atom *atom) : m_atom(atom)
+      bool isCyclic(unsigned int atom) const
       {
+        return m_atomFlags[atom] & Cyclic;
       }
 
-      bool isAromatic() const
+      int element(unsigned int atom) const
       {
-        return m_atom->isAromatic();
+        return m_element[atom];
       }
 
-      bool isAliphatic() const
+      int mass(unsigned int atom) const
       {
-        return m_atom->isAliphatic();
+        return m_mass[atom];
       }
 
-      bool isCyclic() const
+      int degree(unsigned int atom) const
       {
-        return m_atom->isCyclic();
+        return m_degree[atom];
       }
 
-      bool isAcyclic() const
+      int valence(unsigned int atom) const
       {
-        return m_atom->isAcyclic();
+        return m_valence[atom];
       }
 
-      int element() const
+      int connectivity(unsigned int atom) const
       {
-        return m_atom->element();
+        return m_connectivity[atom];
       }
 
-      int mass() const
+      int totalHydrogens(unsigned int atom) const
       {
-        return m_atom->mass();
+        return m_totalH[atom];
       }
 
-      int degree() const
+      int implicitHydrogens(unsigned int atom) const
       {
-        return m_atom->degree();
+        return m_implicitH[atom];
       }
 
-      int valence() const
+      int ringMembership(unsigned int atom) const
       {
-        return m_atom->valence();
+        return m_ringMembership[atom];
       }
 
-      int connectivity() const
+      bool isInRingSize(unsigned int atom, int size) const
       {
-        return m_atom->connectivity();
+        return IsInRingSize(m_ringSizes[atom], size);
       }
 
-      int totalHydrogens() const
+      unsigned int ringSizes(unsigned int atom) const
       {
-        return m_atom->totalHydrogens();
+        return m_ringSizes[atom];
       }
 
-      int implicitHydrogens() const
+      int ringConnectivity(unsigned int atom) const
       {
-        return m_atom->implicitHydrogens();
+        return m_ringConnectivity[atom];
       }
 
-      int ringMembership() const
+      int charge(unsigned int atom) const
       {
-        return m_atom->ringMembership();
+        return m_charge[atom];
       }
 
-      bool isInRingSize(int size) const
+      int atomClass(unsigned int atom) const
       {
-        return m_atom->isInRingSize(size);
+        return m_atomClass[atom];
       }
 
-      int ringConnectivity() const
+      /**
+       * Bond properties.
+       */
+      unsigned int source(unsigned int bond) const
       {
-        return m_atom->ringConnectivity();
+        return m_source[bond];
       }
 
-      int charge() const
+      unsigned int target(unsigned int bond) const
       {
-        return m_atom->charge();
+        return m_target[bond];
       }
 
-      int atomClass() const
+      unsigned int other(unsigned int bond, unsigned int atom) const
+      {
+        return m_source[bond] == atom ? m_target[bond] : m_source[bond];
+      }
+
+      bool isBondAromatic(unsigned int bond) const
       {
-        return m_atom->atomClass();
+        return m_bondFlags[bond] & Aromatic;
+      }
+
+      bool isBondCyclic(unsigned int bond) const
+      {
+        return m_bondFlags[bond] & Cyclic;
+      }
+
+      int order(unsigned int bond) const
+      {
+        return m_order[bond];
       }
 
     private:
-      Atom *m_atom;
+      friend bool readMolecule(std::istream &is, Molecule &mol);
+      friend void SnapshotMolecule(OpenBabel::OBMol *obmol, Molecule &mol);
+      friend void SnapshotHeavyAtoms(OpenBabel::OBMol *obmol, Molecule &mol);
+      friend struct SmilesReaderPrivate;
+      friend class MoleculeStoreChunk;
+
+      void addAtom(bool aromatic, bool cyclic, int element, int mass, int degree,
+          int valence, int connectivity, int totalH, int implicitH, int ringMembership,
+          int ringConnectivity, int charge, int atomClass, unsigned int ringSizes);
+      void addBond(unsigned int source, unsigned int target, bool aromatic, bool cyclic, int order);
+      /**
+       * Build the CSR bond indices once all atoms and bonds are added.
+       */
+      void buildAdjacency();
+
+      const unsigned int* nbrBonds() const
+      {
+        return m_nbrBonds.empty() ? 0 : &m_nbrBonds[0];
+      }
+
+      // atom columns
+      std::vector<unsigned char> m_atomFlags;
+      std::vector<unsigned char> m_element;
+      std::vector<int> m_mass;
+      std::vector<unsigned char> m_degree;
+      std::vector<unsigned char> m_valence;
+      std::vector<unsigned char> m_connectivity;
+      std::vector<unsigned char> m_totalH;
+      std::vector<unsigned char> m_implicitH;
+      std::vector<unsigned char> m_ringMembership;
+      std::vector<unsigned char> m_ringConnectivity;
+      std::vector<signed char> m_charge;
+      std::vector<int> m_atomClass;
+      std::vector<unsigned int> m_ringSizes; // bitmask, see IsInRingSize()
+      // bond columns
+      std::vector<unsigned int> m_source;
+      std::vector<unsigned int> m_target;
+      std::vector<unsigned char> m_bondFlags;
+      std::vector<unsigned char> m_order;
+      // bonds around each atom (CSR)
+      std::vector<unsigned int> m_nbrOffsets; // numAtoms + 1
+      std::vector<unsigned int> m_nbrBonds; // 2 * numBonds
+      std::vector<unsigned int> m_nbrNext; // scratch for buildAdjacency()
   };
 
-
-  class Bond
+  class AtomWrapper
   {
     public:
-      Bond(Atom *source, Atom *target, bool aromatic, bool cyclic, int order) :
-           m_source(source), m_target(target), m_aromatic(aromatic), m_cyclic(cyclic),
-           m_order(order)
+      AtomWrapper(const Atom &atom) : m_mol(atom.molecule()), m_index(atom.index())
       {
       }
 
-      Atom* other(const Atom *atom) const
+      bool isAromatic() const
       {
-        return m_source == atom ? m_target : m_source;
+        return m_mol->isAromatic(m_index);
       }
 
-      bool isAromatic() const
+      bool isAliphatic() const
       {
-        return m_aromatic;
+        return !m_mol->isAromatic(m_index);
       }
 
       bool isCyclic() const
       {
-        return m_cyclic;
+        return m_mol->isCyclic(m_index);
       }
 
-      int order() const
+      bool isAcyclic() const
       {
-        return m_order;
+        return !m_mol->isCyclic(m_index);
       }
 
-    private:
-      Atom *m_source;
-      Atom *m_target;
-      bool m_aromatic;
-      bool m_cyclic;
-      int m_order;
-  };
+      int element() const
+      {
+        return m_mol->element(m_index);
+      }
 
-  class BondWrapper
-  {
-    public:
-      BondWrapper(Bond *bond) : m_bond(bond)
+      int mass() const
       {
+        return m_mol->mass(m_index);
       }
 
-      bool isAromatic() const
+      int degree() const
       {
-        return m_bond->isAromatic();
+        return m_mol->degree(m_index);
       }
 
-      bool isCyclic() const
+      int valence() const
       {
-        return m_bond->isCyclic();
+        return m_mol->valence(m_index);
       }
 
-      int order() const
+      int connectivity() const
+      {
+        return m_mol->connectivity(m_index);
+      }
+
+      int totalHydrogens() const
+      {
+        return m_mol->totalHydrogens(m_index);
+      }
+
+      int implicitHydrogens() const
+      {
+        return m_mol->implicitHydrogens(m_index);
+      }
+
+      int ringMembership() const
+      {
+        return m_mol->ringMembership(m_index);
+      }
+
+      bool isInRingSize(int size) const
       {
-        return m_bond->order();
+        return m_mol->isInRingSize(m_index, size);
+      }
+
+      int ringConnectivity() const
+      {
+        return m_mol->ringConnectivity(m_index);
+      }
+
+      int charge() const
+      {
+        return m_mol->charge(m_index);
+      }
+
+      int atomClass() const
+      {
+        return m_mol->atomClass(m_index);
       }
 
     private:
-      Bond *m_bond;
+      const Molecule *m_mol;
+      unsigned int m_index;
   };
 
-
-  class Molecule
+  class BondWrapper
   {
     public:
-      std::vector<Atom*>::iterator beginAtoms()
+      BondWrapper(const Bond &bond) : m_mol(bond.molecule()), m_index(bond.index())
       {
-        return m_atomPtrs.begin();
       }
 
-      std::vector<Atom*>::iterator endAtoms()
+      bool isAromatic() const
       {
-        return m_atomPtrs.end();
+        return m_mol->isBondAromatic(m_index);
       }
 
-    private:
-      friend bool readMolecule(std::istream &is, Molecule &mol);
+      bool isCyclic() const
+      {
+        return m_mol->isBondCyclic(m_index);
+      }
+
+      int order() const
+      {
+        return m_mol->order(m_index);
+      }
 
-      std::vector<Atom> m_atoms;
-      std::vector<Bond> m_bonds;
-      std::vector<Atom*> m_atomPtrs;
+    private:
+      const Molecule *m_mol;
+      unsigned int m_index;
   };
 
   template<>
-  inline std::vector<Atom*>::iterator GetBeginAtoms<Molecule*, std::vector<Atom*>::iterator>(Molecule *mol)
+  inline MoleculeAtomIter GetBeginAtoms<Molecule*, MoleculeAtomIter>(Molecule *mol)
   {
     return mol->beginAtoms();
   }
   template<>
-  inline std::vector<Atom*>::iterator GetEndAtoms<Molecule*, std::vector<Atom*>::iterator>(Molecule *mol)
+  inline MoleculeAtomIter GetEndAtoms<Molecule*, MoleculeAtomIter>(Molecule *mol)
   {
     return mol->endAtoms();
   }
   template<>
-  inline std::vector<Bond*>::iterator GetBeginBonds<Molecule*, Atom*, std::vector<Bond*>::iterator>(Molecule *mol, Atom *atom)
+  inline MoleculeBondIter GetBeginBonds<Molecule*, Atom, MoleculeBondIter>(Molecule *mol, Atom atom)
   {
-    return atom->beginBonds();
+    return mol->beginBonds(atom.index());
   }
   template<>
-  inline std::vector<Bond*>::iterator GetEndBonds<Molecule*, Atom*, std::vector<Bond*>::iterator>(Molecule *mol, Atom *atom)
+  inline MoleculeBondIter GetEndBonds<Molecule*, Atom, MoleculeBondIter>(Molecule *mol, Atom atom)
   {
-    return atom->endBonds();
+    return mol->endBonds(atom.index());
   }
 
   template<>
-  inline std::size_t GetAtomIndex<Molecule*, Atom*>(Molecule*, Atom *atom)
+  inline std::size_t GetAtomIndex<Molecule*, Atom>(Molecule*, Atom atom)
   {
-    return atom->index();
+    return atom.index();
   }
 
   template<>
-  inline Atom* GetOtherAtom<Molecule*, Bond*, Atom*>(Molecule *mol, Bond *bond, Atom *atom)
+  inline Atom GetOtherAtom<Molecule*, Bond, Atom>(Molecule *mol, Bond bond, Atom atom)
   {
-    return bond->other(atom);
+    return Atom(mol, mol->other(bond.index(), atom.index()));
   }
- 
+
   template<>
   struct molecule_traits<Molecule>
   {
-    typedef Atom* atom_arg_type;
-    typedef Bond* bond_arg_type;
+    typedef Atom atom_arg_type;
+    typedef Bond bond_arg_type;
 
-    typedef std::vector<Atom*>::iterator mol_atom_iterator_type;
-    typedef std::vector<Bond*>::iterator atom_bond_iterator_type;
+    typedef MoleculeAtomIter mol_atom_iterator_type;
+    typedef MoleculeBondIter atom_bond_iterator_type;
 
     typedef AtomWrapper atom_wrapper_type;
     typedef BondWrapper bond_wrapper_type;
   };
 
+  /**
+   * Write the first line of a text *.scm file ("SCM <version>").
+   */
+  void writeMoleculeHeader(std::ostream &os);
+
+  /**
+   * Read the first line of a text *.scm file.
+   *
+   * @return False if the header is missing or the file was written in
+   *         another version of the format (e.g. without ring sizes).
+   */
+  bool readMoleculeHeader(std::istream &is);
+
+  /**
+   * Write the heavy atoms of an OBMol (see SnapshotHeavyAtoms()), the
+   * atoms are renumbered so explicit hydrogens can be in any position.
+   */
   void writeMolecule(std::ostream &os, OpenBabel::OBMol *mol);
 
+  /**
+   * Write a Molecule in the same format (all atoms are written).
+   */
+  void writeMolecule(std::ostream &os, const Molecule &mol);
+
+  /**
+   * Read the next molecule of a text *.scm file, call readMoleculeHeader()
+   * before reading the first molecule.
+   */
   bool readMolecule(std::istream &is, Molecule &mol);
 
+  /**
+   * Copy the SMARTS properties of all atoms and bonds (including explicit
+   * hydrogens) of an OBMol into @p mol. The atom and bond indices are the
+   * same as in the OBMol (OBAtom::GetIndex(), OBBond::GetIdx()), mappings
+   * found in the snapshot can be used with the OBMol.
+   *
+   * OpenBabelAtom calls into OpenBabel for every primitive that is
+   * evaluated (and again for every backtracking step), some of these calls
+   * (implicit hydrogens, ring membership and sizes) are expensive. The
+   * snapshot pays this cost once per molecule. Reuse the Molecule to avoid
+   * allocations.
+   */
+  void SnapshotMolecule(OpenBabel::OBMol *obmol, Molecule &mol);
+
+  /**
+   * Same as SnapshotMolecule() without the hydrogens (the atoms and bonds
+   * writeMolecule() writes). The properties of the heavy atoms are those of
+   * the OBMol (explicit hydrogens still count for the degree), the atoms
+   * are renumbered.
+   */
+  void SnapshotHeavyAtoms(OpenBabel::OBMol *obmol, Molecule &mol);
+
+  /**
+   * Match a SMARTS against an OBMol by matching a snapshot of its
+   * properties (see SnapshotMolecule()). This is faster than matching the
+   * OBMol directly unless the pattern fails on the first atoms it tries.
+   *
+   * @code
+   * Molecule snapshot;
+   * while (conv.Read(&obmol))
+   *   if (match(&obmol, pattern, mapping, snapshot))
+   *     ...
+   * @endcode
+   */
+  template<typename SmartsType, typename MappingType>
+  bool match(OpenBabel::OBMol *mol, SmartsType *smarts, MappingType &mapping, Molecule &snapshot)
+  {
+    SnapshotMolecule(mol, snapshot);
+    return match(&snapshot, smarts, mapping);
+  }
+
 }
+
+#endif
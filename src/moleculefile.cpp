@@ -0,0 +1,230 @@
+#include "moleculefile.h"
+#include "util.h"
+
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace SC {
+
+  MoleculeFile::MoleculeFile() : m_header(0), m_index(0), m_mapped(0), m_mappedSize(0)
+  {
+  }
+
+  MoleculeFile::~MoleculeFile()
+  {
+    close();
+  }
+
+  bool MoleculeFile::isBinary(const std::string &filename)
+  {
+    std::ifstream ifs(filename.c_str(), std::ios::binary);
+    MoleculeFileHeader header;
+    if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(MoleculeFileHeader)))
+      return false;
+    return header.magic == MoleculeFileHeader::Magic;
+  }
+
+  bool MoleculeFile::open(const std::string &filename)
+  {
+    close();
+
+    const void *data;
+    std::size_t size;
+#ifdef _WIN32
+    std::ifstream ifs(filename.c_str(), std::ios::binary);
+    ifs.seekg(0, std::ios::end);
+    size = ifs.tellg();
+    ifs.seekg(0, std::ios::beg);
+    m_buffer.resize((size + 3) / 4);
+    if (!size || !ifs.read(reinterpret_cast<char*>(&m_buffer[0]), size))
+      return false;
+    data = &m_buffer[0];
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(MoleculeFileHeader))) {
+      ::close(fd);
+      return false;
+    }
+    size = st.st_size;
+    void *mapped = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+      return false;
+    m_mapped = mapped;
+    m_mappedSize = size;
+    data = mapped;
+#endif
+
+    const MoleculeFileHeader *header = static_cast<const MoleculeFileHeader*>(data);
+    if (size < sizeof(MoleculeFileHeader) || header->magic != MoleculeFileHeader::Magic ||
+        header->version != MoleculeFileHeader::Version ||
+        (static_cast<std::size_t>(header->indexOffset) + header->numMolecules) * 4 > size) {
+      close();
+      return false;
+    }
+
+    m_header = header;
+    m_index = static_cast<const unsigned int*>(data) + header->indexOffset;
+    return true;
+  }
+
+  void MoleculeFile::close()
+  {
+#ifndef _WIN32
+    if (m_mapped)
+      munmap(m_mapped, m_mappedSize);
+#endif
+    m_mapped = 0;
+    m_mappedSize = 0;
+    m_buffer.clear();
+    m_header = 0;
+    m_index = 0;
+  }
+
+  MoleculeFileWriter::MoleculeFileWriter(const std::string &filename)
+      : m_ofs(filename.c_str(), std::ios::binary), m_offset(sizeof(MoleculeFileHeader) / 4)
+  {
+    // the header is written by close()
+    MoleculeFileHeader header;
+    std::memset(&header, 0, sizeof(MoleculeFileHeader));
+    m_ofs.write(reinterpret_cast<const char*>(&header), sizeof(MoleculeFileHeader));
+  }
+
+  MoleculeFileWriter::~MoleculeFileWriter()
+  {
+    close();
+  }
+
+  namespace {
+
+    /**
+     * Append a molecule record, padded to 4 bytes.
+     */
+    void AppendRecord(std::string &buffer, const std::vector<AtomRecord> &atoms,
+        const std::vector<BondRecord> &bonds, const std::vector<unsigned short> &bondIndices)
+    {
+      MoleculeRecord molecule;
+      molecule.numAtoms = atoms.size();
+      molecule.numBonds = bonds.size();
+
+      buffer.append(reinterpret_cast<const char*>(&molecule), sizeof(MoleculeRecord));
+      if (!atoms.empty())
+        buffer.append(reinterpret_cast<const char*>(&atoms[0]), atoms.size() * sizeof(AtomRecord));
+      if (!bonds.empty()) {
+        buffer.append(reinterpret_cast<const char*>(&bonds[0]), bonds.size() * sizeof(BondRecord));
+        buffer.append(reinterpret_cast<const char*>(&bondIndices[0]), bondIndices.size() * sizeof(unsigned short));
+      }
+      std::size_t size = MoleculeView::recordSize(atoms.size(), bonds.size());
+      buffer.append((4 - size % 4) % 4, '\0');
+    }
+
+  }
+
+  bool MoleculeFileWriter::pack(OpenBabel::OBMol *mol, std::string &buffer)
+  {
+    Molecule snapshot;
+    SnapshotHeavyAtoms(mol, snapshot);
+    return pack(snapshot, buffer);
+  }
+
+  bool MoleculeFileWriter::pack(const Molecule &mol, std::string &buffer)
+  {
+    // firstBond indexes the 2 * numBonds bond indices
+    if (mol.numAtoms() > 65535 || 2 * mol.numBonds() > 65535)
+      return false;
+
+    std::vector<BondRecord> bonds(mol.numBonds());
+    for (unsigned int i = 0; i < mol.numBonds(); ++i) {
+      BondRecord &record = bonds[i];
+      record.source = mol.source(i);
+      record.target = mol.target(i);
+      record.flags = (mol.isBondAromatic(i) ? BondRecord::Aromatic : 0) | (mol.isBondCyclic(i) ? BondRecord::Cyclic : 0);
+      record.order = ClampField<unsigned char>(mol.order(i), 0, 255);
+      record.reserved = 0;
+    }
+
+    std::vector<AtomRecord> atoms(mol.numAtoms());
+    std::vector<unsigned short> bondIndices;
+    for (unsigned int i = 0; i < mol.numAtoms(); ++i) {
+      AtomRecord &record = atoms[i];
+      std::memset(&record, 0, sizeof(AtomRecord));
+      record.ringSizes = mol.ringSizes(i);
+      record.mass = ClampField<unsigned short>(mol.mass(i), 0, 65535);
+      record.atomClass = ClampField<unsigned short>(mol.atomClass(i), 0, 65535);
+      record.firstBond = bondIndices.size();
+      for (MoleculeBondIter bond = mol.beginBonds(i); bond != mol.endBonds(i); ++bond)
+        bondIndices.push_back((*bond).index());
+      if (bondIndices.size() - record.firstBond > 255)
+        return false;
+      record.numBonds = bondIndices.size() - record.firstBond;
+      record.flags = (mol.isAromatic(i) ? AtomRecord::Aromatic : 0) | (mol.isCyclic(i) ? AtomRecord::Cyclic : 0);
+      record.element = ClampField<unsigned char>(mol.element(i), 0, 255);
+      record.degree = ClampField<unsigned char>(mol.degree(i), 0, 255);
+      record.valence = ClampField<unsigned char>(mol.valence(i), 0, 255);
+      record.connectivity = ClampField<unsigned char>(mol.connectivity(i), 0, 255);
+      record.totalH = ClampField<unsigned char>(mol.totalHydrogens(i), 0, 255);
+      record.implicitH = ClampField<unsigned char>(mol.implicitHydrogens(i), 0, 255);
+      record.ringMembership = ClampField<unsigned char>(mol.ringMembership(i), 0, 255);
+      record.ringConnectivity = ClampField<unsigned char>(mol.ringConnectivity(i), 0, 255);
+      record.charge = ClampField<signed char>(mol.charge(i), -128, 127);
+    }
+
+    AppendRecord(buffer, atoms, bonds, bondIndices);
+    return true;
+  }
+
+  bool MoleculeFileWriter::writeRecord(const char *record, std::size_t size)
+  {
+    if (!m_ofs.is_open())
+      return false;
+
+    m_ofs.write(record, size);
+    m_offsets.push_back(m_offset);
+    m_offset += size / 4;
+    return m_ofs.good();
+  }
+
+  bool MoleculeFileWriter::write(OpenBabel::OBMol *mol)
+  {
+    m_record.clear();
+    if (!m_ofs.is_open() || !pack(mol, m_record))
+      return false;
+    return writeRecord(m_record.data(), m_record.size());
+  }
+
+  bool MoleculeFileWriter::write(const Molecule &mol)
+  {
+    m_record.clear();
+    if (!m_ofs.is_open() || !pack(mol, m_record))
+      return false;
+    return writeRecord(m_record.data(), m_record.size());
+  }
+
+  void MoleculeFileWriter::close()
+  {
+    if (!m_ofs.is_open())
+      return;
+
+    if (!m_offsets.empty())
+      m_ofs.write(reinterpret_cast<const char*>(&m_offsets[0]), m_offsets.size() * sizeof(unsigned int));
+
+    MoleculeFileHeader header;
+    header.magic = MoleculeFileHeader::Magic;
+    header.version = MoleculeFileHeader::Version;
+    header.numMolecules = m_offsets.size();
+    header.indexOffset = m_offset;
+    m_ofs.seekp(0);
+    m_ofs.write(reinterpret_cast<const char*>(&header), sizeof(MoleculeFileHeader));
+    m_ofs.close();
+  }
+
+}
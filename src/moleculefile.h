@@ -0,0 +1,506 @@
+#ifndef SC_MOLECULEFILE_H
+#define SC_MOLECULEFILE_H
+
+#include "molecule.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace SC {
+
+  /**
+   * Binary *.scm file layout (native byte order):
+   *
+   * @code
+   * MoleculeFileHeader
+   * for each molecule (starting on a 4 byte boundary):
+   *   MoleculeRecord
+   *   AtomRecord[numAtoms]
+   *   BondRecord[numBonds]
+   *   unsigned short[2 * numBonds] // bond indices, grouped by atom
+   * unsigned int[numMolecules]     // molecule offsets in 4 byte words
+   * @endcode
+   *
+   * The offsets are stored in 4 byte words which limits files to 16GB.
+   */
+  struct MoleculeFileHeader
+  {
+    enum {
+      Magic = 0x4d435342, // "BSCM"
+      Version = 2
+    };
+
+    unsigned int magic;
+    unsigned int version;
+    unsigned int numMolecules;
+    unsigned int indexOffset; // in 4 byte words
+  };
+
+  struct MoleculeRecord
+  {
+    unsigned short numAtoms;
+    unsigned short numBonds;
+  };
+
+  struct AtomRecord
+  {
+    enum Flags {
+      Aromatic = 1,
+      Cyclic = 2
+    };
+
+    unsigned int ringSizes; // bitmask, see IsInRingSize()
+    unsigned short mass;
+    unsigned short atomClass;
+    unsigned short firstBond; // index in the molecule's bond indices
+    unsigned char numBonds;
+    unsigned char flags;
+    unsigned char element;
+    unsigned char degree;
+    unsigned char valence;
+    unsigned char connectivity;
+    unsigned char totalH;
+    unsigned char implicitH;
+    unsigned char ringMembership;
+    unsigned char ringConnectivity;
+    signed char charge;
+    unsigned char reserved[3];
+  };
+
+  struct BondRecord
+  {
+    enum Flags {
+      Aromatic = 1,
+      Cyclic = 2
+    };
+
+    unsigned short source;
+    unsigned short target;
+    unsigned char flags;
+    unsigned char order;
+    unsigned short reserved;
+  };
+
+  /**
+   * Iterator over the atoms of a MoleculeView, dereferences to the record.
+   */
+  class MoleculeViewAtomIter
+  {
+    public:
+      MoleculeViewAtomIter(const AtomRecord *atom = 0) : m_atom(atom)
+      {
+      }
+
+      const AtomRecord* operator*() const
+      {
+        return m_atom;
+      }
+
+      MoleculeViewAtomIter& operator++()
+      {
+        ++m_atom;
+        return *this;
+      }
+
+      bool operator==(const MoleculeViewAtomIter &other) const
+      {
+        return m_atom == other.m_atom;
+      }
+
+      bool operator!=(const MoleculeViewAtomIter &other) const
+      {
+        return m_atom != other.m_atom;
+      }
+
+    private:
+      const AtomRecord *m_atom;
+  };
+
+  /**
+   * Iterator over the bonds around an atom of a MoleculeView.
+   */
+  class MoleculeViewBondIter
+  {
+    public:
+      MoleculeViewBondIter(const unsigned short *index = 0, const BondRecord *bonds = 0)
+          : m_index(index), m_bonds(bonds)
+      {
+      }
+
+      const BondRecord* operator*() const
+      {
+        return m_bonds + *m_index;
+      }
+
+      MoleculeViewBondIter& operator++()
+      {
+        ++m_index;
+        return *this;
+      }
+
+      bool operator==(const MoleculeViewBondIter &other) const
+      {
+        return m_index == other.m_index;
+      }
+
+      bool operator!=(const MoleculeViewBondIter &other) const
+      {
+        return m_index != other.m_index;
+      }
+
+    private:
+      const unsigned short *m_index;
+      const BondRecord *m_bonds;
+  };
+
+  /**
+   * A molecule in a binary *.scm file. The view points directly into the
+   * (memory mapped) file, nothing is parsed or copied. It is only valid as
+   * long as the MoleculeFile is open.
+   */
+  class MoleculeView
+  {
+    public:
+      MoleculeView(const MoleculeRecord *record = 0) : m_record(record)
+      {
+      }
+
+      int numAtoms() const
+      {
+        return m_record ? m_record->numAtoms : 0;
+      }
+
+      int numBonds() const
+      {
+        return m_record ? m_record->numBonds : 0;
+      }
+
+      const AtomRecord* atoms() const
+      {
+        return reinterpret_cast<const AtomRecord*>(m_record + 1);
+      }
+
+      const BondRecord* bonds() const
+      {
+        return reinterpret_cast<const BondRecord*>(atoms() + numAtoms());
+      }
+
+      const unsigned short* bondIndices() const
+      {
+        return reinterpret_cast<const unsigned short*>(bonds() + numBonds());
+      }
+
+      MoleculeViewAtomIter beginAtoms() const
+      {
+        return MoleculeViewAtomIter(atoms());
+      }
+
+      MoleculeViewAtomIter endAtoms() const
+      {
+        return MoleculeViewAtomIter(atoms() + numAtoms());
+      }
+
+      MoleculeViewBondIter beginBonds(const AtomRecord *atom) const
+      {
+        return MoleculeViewBondIter(bondIndices() + atom->firstBond, bonds());
+      }
+
+      MoleculeViewBondIter endBonds(const AtomRecord *atom) const
+      {
+        return MoleculeViewBondIter(bondIndices() + atom->firstBond + atom->numBonds, bonds());
+      }
+
+      /**
+       * The size of the molecule's records in bytes (without padding).
+       */
+      static std::size_t recordSize(int numAtoms, int numBonds)
+      {
+        return sizeof(MoleculeRecord) + numAtoms * sizeof(AtomRecord) +
+               numBonds * (sizeof(BondRecord) + 2 * sizeof(unsigned short));
+      }
+
+    private:
+      const MoleculeRecord *m_record;
+  };
+
+  class MoleculeViewAtom
+  {
+    public:
+      MoleculeViewAtom(const AtomRecord *atom) : m_atom(atom)
+      {
+      }
+
+      bool isAromatic() const
+      {
+        return m_atom->flags & AtomRecord::Aromatic;
+      }
+
+      bool isAliphatic() const
+      {
+        return !isAromatic();
+      }
+
+      bool isCyclic() const
+      {
+        return m_atom->flags & AtomRecord::Cyclic;
+      }
+
+      bool isAcyclic() const
+      {
+        return !isCyclic();
+      }
+
+      int element() const
+      {
+        return m_atom->element;
+      }
+
+      int mass() const
+      {
+        return m_atom->mass;
+      }
+
+      int degree() const
+      {
+        return m_atom->degree;
+      }
+
+      int valence() const
+      {
+        return m_atom->valence;
+      }
+
+      int connectivity() const
+      {
+        return m_atom->connectivity;
+      }
+
+      int totalHydrogens() const
+      {
+        return m_atom->totalH;
+      }
+
+      int implicitHydrogens() const
+      {
+        return m_atom->implicitH;
+      }
+
+      int ringMembership() const
+      {
+        return m_atom->ringMembership;
+      }
+
+      bool isInRingSize(int size) const
+      {
+        return IsInRingSize(m_atom->ringSizes, size);
+      }
+
+      int ringConnectivity() const
+      {
+        return m_atom->ringConnectivity;
+      }
+
+      int charge() const
+      {
+        return m_atom->charge;
+      }
+
+      int atomClass() const
+      {
+        return m_atom->atomClass;
+      }
+
+    private:
+      const AtomRecord *m_atom;
+  };
+
+  class MoleculeViewBond
+  {
+    public:
+      MoleculeViewBond(const BondRecord *bond) : m_bond(bond)
+      {
+      }
+
+      bool isAromatic() const
+      {
+        return m_bond->flags & BondRecord::Aromatic;
+      }
+
+      bool isCyclic() const
+      {
+        return m_bond->flags & BondRecord::Cyclic;
+      }
+
+      int order() const
+      {
+        return m_bond->order;
+      }
+
+    private:
+      const BondRecord *m_bond;
+  };
+
+  template<>
+  inline MoleculeViewAtomIter GetBeginAtoms<MoleculeView*, MoleculeViewAtomIter>(MoleculeView *mol)
+  {
+    return mol->beginAtoms();
+  }
+  template<>
+  inline MoleculeViewAtomIter GetEndAtoms<MoleculeView*, MoleculeViewAtomIter>(MoleculeView *mol)
+  {
+    return mol->endAtoms();
+  }
+  template<>
+  inline MoleculeViewBondIter GetBeginBonds<MoleculeView*, const AtomRecord*, MoleculeViewBondIter>(MoleculeView *mol, const AtomRecord *atom)
+  {
+    return mol->beginBonds(atom);
+  }
+  template<>
+  inline MoleculeViewBondIter GetEndBonds<MoleculeView*, const AtomRecord*, MoleculeViewBondIter>(MoleculeView *mol, const AtomRecord *atom)
+  {
+    return mol->endBonds(atom);
+  }
+
+  template<>
+  inline std::size_t GetAtomIndex<MoleculeView*, const AtomRecord*>(MoleculeView *mol, const AtomRecord *atom)
+  {
+    return atom - mol->atoms();
+  }
+
+  template<>
+  inline const AtomRecord* GetOtherAtom<MoleculeView*, const BondRecord*, const AtomRecord*>(MoleculeView *mol, const BondRecord *bond, const AtomRecord *atom)
+  {
+    const AtomRecord *atoms = mol->atoms();
+    return atoms + (atoms + bond->source == atom ? bond->target : bond->source);
+  }
+
+  template<>
+  struct molecule_traits<MoleculeView>
+  {
+    typedef const AtomRecord* atom_arg_type;
+    typedef const BondRecord* bond_arg_type;
+
+    typedef MoleculeViewAtomIter mol_atom_iterator_type;
+    typedef MoleculeViewBondIter atom_bond_iterator_type;
+
+    typedef MoleculeViewAtom atom_wrapper_type;
+    typedef MoleculeViewBond bond_wrapper_type;
+  };
+
+  /**
+   * A memory mapped binary *.scm file.
+   *
+   * @code
+   * MoleculeFile file;
+   * if (file.open("molecules.scm"))
+   *   for (std::size_t i = 0; i < file.numMolecules(); ++i) {
+   *     MoleculeView mol = file.molecule(i);
+   *     if (match(&mol, pattern))
+   *       ++hits;
+   *   }
+   * @endcode
+   */
+  class MoleculeFile
+  {
+    public:
+      MoleculeFile();
+      ~MoleculeFile();
+
+      /**
+       * Check if a file is a binary *.scm file (text *.scm files are read
+       * using readMolecule()).
+       */
+      static bool isBinary(const std::string &filename);
+
+      bool open(const std::string &filename);
+      void close();
+
+      bool isOpen() const
+      {
+        return m_header;
+      }
+
+      std::size_t numMolecules() const
+      {
+        return m_header ? m_header->numMolecules : 0;
+      }
+
+      MoleculeView molecule(std::size_t index) const
+      {
+        const unsigned int *words = reinterpret_cast<const unsigned int*>(m_header);
+        return MoleculeView(reinterpret_cast<const MoleculeRecord*>(words + m_index[index]));
+      }
+
+    private:
+      // not copyable
+      MoleculeFile(const MoleculeFile&);
+      MoleculeFile& operator=(const MoleculeFile&);
+
+      const MoleculeFileHeader *m_header;
+      const unsigned int *m_index;
+      void *m_mapped;
+      std::size_t m_mappedSize;
+      std::vector<unsigned int> m_buffer; // without mmap
+  };
+
+  /**
+   * Write molecules to a binary *.scm file. Hydrogens are removed (same as
+   * writeMolecule()), the molecule index and header are written by close().
+   *
+   * Records can also be packed separately (e.g. by worker threads) and
+   * written in order with writeRecord():
+   *
+   * @code
+   * std::string buffer;
+   * MoleculeFileWriter::pack(&mol, buffer);
+   * ...
+   * writer.writeRecord(buffer.data(), buffer.size());
+   * @endcode
+   */
+  class MoleculeFileWriter
+  {
+    public:
+      MoleculeFileWriter(const std::string &filename);
+      ~MoleculeFileWriter();
+
+      bool isOpen() const
+      {
+        return m_ofs.is_open();
+      }
+
+      bool write(OpenBabel::OBMol *mol);
+      /**
+       * Write a Molecule, the atoms are written as they are (SmilesReader
+       * already removes hydrogens, SnapshotMolecule() doesn't).
+       */
+      bool write(const Molecule &mol);
+
+      /**
+       * Append the record for a molecule to @p buffer. This doesn't use the
+       * file and can be called from multiple threads.
+       *
+       * @return False if the molecule has more than 65535 atoms, more
+       *         than 32767 bonds or an atom with more than 255 bonds (the
+       *         record fields would overflow).
+       */
+      static bool pack(OpenBabel::OBMol *mol, std::string &buffer);
+      static bool pack(const Molecule &mol, std::string &buffer);
+
+      /**
+       * Write a single record created by pack().
+       */
+      bool writeRecord(const char *record, std::size_t size);
+
+      void close();
+
+    private:
+      std::string m_record;
+      std::ofstream m_ofs;
+      std::vector<unsigned int> m_offsets;
+      unsigned int m_offset; // in 4 byte words
+  };
+
+}
+
+#endif
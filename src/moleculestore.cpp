@@ -0,0 +1,564 @@
+#include "moleculestore.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace SC {
+
+  namespace {
+
+    /**
+     * The columns of a chunk in file order.
+     */
+    enum Column {
+      AtomOffsets,
+      BondOffsets,
+      RingSizes,
+      Mass,
+      AtomClass,
+      Source,
+      Target,
+      AtomFlags,
+      Element,
+      Degree,
+      Valence,
+      Connectivity,
+      TotalH,
+      ImplicitH,
+      RingMembership,
+      RingConnectivity,
+      Charge,
+      BondFlags,
+      Order,
+      NumColumns
+    };
+
+    enum ColumnLength {
+      PerMolecule, // numMolecules + 1
+      PerAtom,
+      PerBond
+    };
+
+    const unsigned char columnSizes[NumColumns] = {
+      4, 4, 4, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+    };
+
+    const unsigned char columnLengths[NumColumns] = {
+      PerMolecule, PerMolecule, PerAtom, PerAtom, PerAtom, PerBond, PerBond,
+      PerAtom, PerAtom, PerAtom, PerAtom, PerAtom, PerAtom, PerAtom, PerAtom,
+      PerAtom, PerAtom, PerBond, PerBond
+    };
+
+    /**
+     * Compute the byte offset of each column from the start of the chunk,
+     * offsets[NumColumns] is the end of the last column.
+     */
+    void GetColumnOffsets(const MoleculeStoreChunkHeader &header, std::size_t *offsets)
+    {
+      offsets[0] = sizeof(MoleculeStoreChunkHeader);
+      for (int i = 0; i < NumColumns; ++i) {
+        std::size_t length = columnLengths[i] == PerMolecule ? header.numMolecules + 1 :
+                             (columnLengths[i] == PerAtom ? header.numAtoms : header.numBonds);
+        std::size_t size = length * columnSizes[i];
+        offsets[i + 1] = offsets[i] + (size + 3) / 4 * 4;
+      }
+    }
+
+    template<typename T>
+    const T* GetColumn(const MoleculeStoreChunkHeader *header, const std::size_t *offsets, Column column)
+    {
+      return reinterpret_cast<const T*>(reinterpret_cast<const char*>(header) + offsets[column]);
+    }
+
+    /**
+     * Copy the [begin, end) range of a column into a Molecule column.
+     */
+    template<typename T, typename U>
+    void ReadColumn(std::vector<U> &values, const MoleculeStoreChunkHeader *header,
+        const std::size_t *offsets, Column column, unsigned int begin, unsigned int end)
+    {
+      const T *data = GetColumn<T>(header, offsets, column);
+      values.assign(data + begin, data + end);
+    }
+
+    /**
+     * Check that the per molecule offsets into the atom or bond columns
+     * are increasing and end inside the column.
+     */
+    bool CheckOffsets(const unsigned int *offsets, unsigned int numMolecules, unsigned int total)
+    {
+      for (unsigned int i = 0; i < numMolecules; ++i)
+        if (offsets[i] > offsets[i + 1])
+          return false;
+      return offsets[numMolecules] <= total;
+    }
+
+    /**
+     * Append a column, padded to 4 bytes.
+     */
+    template<typename T>
+    void AppendColumn(std::string &buffer, const std::vector<T> &column)
+    {
+      std::size_t size = column.size() * sizeof(T);
+      if (size)
+        buffer.append(reinterpret_cast<const char*>(&column[0]), size);
+      buffer.append((4 - size % 4) % 4, '\0');
+    }
+
+  }
+
+  SmartsCounts MoleculeStoreChunkSummary::counts() const
+  {
+    SmartsCounts counts;
+    counts.numAtoms = maxAtoms;
+    counts.numBonds = maxBonds;
+    counts.numAromaticAtoms = maxAromaticAtoms;
+    counts.numRingAtoms = maxRingAtoms;
+    counts.numSingleBonds = maxSingleBonds;
+    counts.numDoubleBonds = maxDoubleBonds;
+    counts.numTripleBonds = maxTripleBonds;
+    counts.numAromaticBonds = maxAromaticBonds;
+    counts.numRingBonds = maxRingBonds;
+    counts.ringSizes = ringSizes;
+    for (int i = 0; i < NumElements; ++i)
+      if (maxElements[i])
+        counts.elements[i] = maxElements[i];
+    return counts;
+  }
+
+  void MoleculeStoreChunkSummary::add(const SmartsCounts &counts)
+  {
+    maxAtoms = std::max<unsigned int>(maxAtoms, counts.numAtoms);
+    maxBonds = std::max<unsigned int>(maxBonds, counts.numBonds);
+    maxAromaticAtoms = std::max<unsigned int>(maxAromaticAtoms, counts.numAromaticAtoms);
+    maxRingAtoms = std::max<unsigned int>(maxRingAtoms, counts.numRingAtoms);
+    maxSingleBonds = std::max<unsigned int>(maxSingleBonds, counts.numSingleBonds);
+    maxDoubleBonds = std::max<unsigned int>(maxDoubleBonds, counts.numDoubleBonds);
+    maxTripleBonds = std::max<unsigned int>(maxTripleBonds, counts.numTripleBonds);
+    maxAromaticBonds = std::max<unsigned int>(maxAromaticBonds, counts.numAromaticBonds);
+    maxRingBonds = std::max<unsigned int>(maxRingBonds, counts.numRingBonds);
+    ringSizes |= counts.ringSizes;
+    for (std::map<int, int>::const_iterator i = counts.elements.begin(); i != counts.elements.end(); ++i)
+      if (i->first >= 0 && i->first < NumElements)
+        maxElements[i->first] = std::max(maxElements[i->first], ClampField<unsigned short>(i->second, 0, 65535));
+  }
+
+  bool MoleculeStoreChunkSummary::mayContain(const SmartsCounts &required) const
+  {
+    SmartsCounts available = counts();
+    // elements outside the summary are not tracked, assume they are present
+    for (std::map<int, int>::const_iterator i = required.elements.begin(); i != required.elements.end(); ++i)
+      if (i->first < 0 || i->first >= NumElements)
+        available.elements[i->first] = i->second;
+    return available.contains(required);
+  }
+
+  bool MoleculeStoreChunk::read(std::size_t index, Molecule &mol) const
+  {
+    std::size_t offsets[NumColumns + 1];
+    GetColumnOffsets(*m_header, offsets);
+
+    const unsigned int *atomOffsets = GetColumn<unsigned int>(m_header, offsets, AtomOffsets);
+    const unsigned int *bondOffsets = GetColumn<unsigned int>(m_header, offsets, BondOffsets);
+    unsigned int begin = atomOffsets[index];
+    unsigned int end = atomOffsets[index + 1];
+    unsigned int numAtoms = end - begin;
+    ReadColumn<unsigned char>(mol.m_atomFlags, m_header, offsets, AtomFlags, begin, end);
+    ReadColumn<unsigned char>(mol.m_element, m_header, offsets, Element, begin, end);
+    ReadColumn<unsigned short>(mol.m_mass, m_header, offsets, Mass, begin, end);
+    ReadColumn<unsigned char>(mol.m_degree, m_header, offsets, Degree, begin, end);
+    ReadColumn<unsigned char>(mol.m_valence, m_header, offsets, Valence, begin, end);
+    ReadColumn<unsigned char>(mol.m_connectivity, m_header, offsets, Connectivity, begin, end);
+    ReadColumn<unsigned char>(mol.m_totalH, m_header, offsets, TotalH, begin, end);
+    ReadColumn<unsigned char>(mol.m_implicitH, m_header, offsets, ImplicitH, begin, end);
+    ReadColumn<unsigned char>(mol.m_ringMembership, m_header, offsets, RingMembership, begin, end);
+    ReadColumn<unsigned char>(mol.m_ringConnectivity, m_header, offsets, RingConnectivity, begin, end);
+    ReadColumn<signed char>(mol.m_charge, m_header, offsets, Charge, begin, end);
+    ReadColumn<unsigned short>(mol.m_atomClass, m_header, offsets, AtomClass, begin, end);
+    ReadColumn<unsigned int>(mol.m_ringSizes, m_header, offsets, RingSizes, begin, end);
+
+    begin = bondOffsets[index];
+    end = bondOffsets[index + 1];
+    ReadColumn<unsigned short>(mol.m_source, m_header, offsets, Source, begin, end);
+    ReadColumn<unsigned short>(mol.m_target, m_header, offsets, Target, begin, end);
+    ReadColumn<unsigned char>(mol.m_bondFlags, m_header, offsets, BondFlags, begin, end);
+    ReadColumn<unsigned char>(mol.m_order, m_header, offsets, Order, begin, end);
+
+    for (std::size_t i = 0; i < mol.m_source.size(); ++i)
+      if (mol.m_source[i] >= numAtoms || mol.m_target[i] >= numAtoms) {
+        mol.clear();
+        return false;
+      }
+
+    mol.buildAdjacency();
+    return true;
+  }
+
+  MoleculeStore::MoleculeStore() : m_header(0), m_directory(0), m_mapped(0), m_mappedSize(0)
+  {
+  }
+
+  MoleculeStore::~MoleculeStore()
+  {
+    close();
+  }
+
+  bool MoleculeStore::isStore(const std::string &filename)
+  {
+    std::ifstream ifs(filename.c_str(), std::ios::binary);
+    MoleculeStoreHeader header;
+    if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(MoleculeStoreHeader)))
+      return false;
+    return header.magic == MoleculeStoreHeader::Magic;
+  }
+
+  bool MoleculeStore::open(const std::string &filename)
+  {
+    close();
+
+    const void *data;
+    std::size_t size;
+#ifdef _WIN32
+    std::ifstream ifs(filename.c_str(), std::ios::binary);
+    ifs.seekg(0, std::ios::end);
+    size = ifs.tellg();
+    ifs.seekg(0, std::ios::beg);
+    m_buffer.resize((size + 3) / 4);
+    if (!size || !ifs.read(reinterpret_cast<char*>(&m_buffer[0]), size))
+      return false;
+    data = &m_buffer[0];
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(MoleculeStoreHeader))) {
+      ::close(fd);
+      return false;
+    }
+    size = st.st_size;
+    void *mapped = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+      return false;
+    m_mapped = mapped;
+    m_mappedSize = size;
+    data = mapped;
+#endif
+
+    const MoleculeStoreHeader *header = static_cast<const MoleculeStoreHeader*>(data);
+    if (size < sizeof(MoleculeStoreHeader) || header->magic != MoleculeStoreHeader::Magic ||
+        header->version != MoleculeStoreHeader::Version || header->directoryOffset() > size ||
+        (size - header->directoryOffset()) / sizeof(MoleculeStoreChunkInfo) < header->numChunks) {
+      close();
+      return false;
+    }
+
+    const MoleculeStoreChunkInfo *directory = reinterpret_cast<const MoleculeStoreChunkInfo*>(
+        static_cast<const char*>(data) + header->directoryOffset());
+    m_firstMolecule.resize(header->numChunks + 1);
+    m_firstMolecule[0] = 0;
+    for (unsigned int i = 0; i < header->numChunks; ++i) {
+      const MoleculeStoreChunkInfo &info = directory[i];
+      if (info.offset() % 8 || info.offset() > size || info.size > size - info.offset() ||
+          info.size < sizeof(MoleculeStoreChunkHeader)) {
+        close();
+        return false;
+      }
+      // the columns have to fit in the chunk
+      const MoleculeStoreChunkHeader *chunkHeader = reinterpret_cast<const MoleculeStoreChunkHeader*>(
+          static_cast<const char*>(data) + info.offset());
+      std::size_t offsets[NumColumns + 1];
+      GetColumnOffsets(*chunkHeader, offsets);
+      if (chunkHeader->numMolecules != info.numMolecules || offsets[NumColumns] > info.size ||
+          !CheckOffsets(GetColumn<unsigned int>(chunkHeader, offsets, AtomOffsets),
+                        chunkHeader->numMolecules, chunkHeader->numAtoms) ||
+          !CheckOffsets(GetColumn<unsigned int>(chunkHeader, offsets, BondOffsets),
+                        chunkHeader->numMolecules, chunkHeader->numBonds)) {
+        close();
+        return false;
+      }
+      m_firstMolecule[i + 1] = m_firstMolecule[i] + info.numMolecules;
+    }
+
+    m_header = header;
+    m_directory = directory;
+    return true;
+  }
+
+  void MoleculeStore::close()
+  {
+#ifndef _WIN32
+    if (m_mapped)
+      munmap(m_mapped, m_mappedSize);
+#endif
+    m_mapped = 0;
+    m_mappedSize = 0;
+    m_buffer.clear();
+    m_firstMolecule.clear();
+    m_header = 0;
+    m_directory = 0;
+  }
+
+  MoleculeStoreChunk MoleculeStore::chunk(std::size_t chunk) const
+  {
+    const char *data = reinterpret_cast<const char*>(m_header);
+    return MoleculeStoreChunk(reinterpret_cast<const MoleculeStoreChunkHeader*>(data + m_directory[chunk].offset()));
+  }
+
+  namespace {
+
+    /**
+     * The chunks left to scan, shared by the threads.
+     */
+    struct ScanQueue
+    {
+      const MoleculeStore *store;
+      const CompiledSmarts *pattern;
+      std::vector<std::size_t> chunks;
+      std::size_t next;
+      pthread_mutex_t mutex;
+    };
+
+    struct ScanWorker
+    {
+      ScanQueue *queue;
+      std::vector<std::size_t> hits;
+    };
+
+    void* ScanThread(void *arg)
+    {
+      ScanWorker *worker = static_cast<ScanWorker*>(arg);
+      ScanQueue *queue = worker->queue;
+
+      Molecule mol;
+      while (true) {
+        pthread_mutex_lock(&queue->mutex);
+        if (queue->next == queue->chunks.size()) {
+          pthread_mutex_unlock(&queue->mutex);
+          break;
+        }
+        std::size_t index = queue->chunks[queue->next++];
+        pthread_mutex_unlock(&queue->mutex);
+
+        MoleculeStoreChunk chunk = queue->store->chunk(index);
+        std::size_t first = queue->store->firstMolecule(index);
+        for (std::size_t i = 0; i < chunk.numMolecules(); ++i) {
+          if (!chunk.read(i, mol))
+            continue;
+          if (match(&mol, *queue->pattern))
+            worker->hits.push_back(first + i);
+        }
+      }
+
+      return 0;
+    }
+
+  }
+
+  std::size_t MoleculeStore::scan(const CompiledSmarts &pattern, std::vector<std::size_t> &hits,
+      int numThreads) const
+  {
+    hits.clear();
+    if (!m_header || pattern.isNull())
+      return 0;
+
+    ScanQueue queue;
+    queue.store = this;
+    queue.pattern = &pattern;
+    queue.next = 0;
+    const SmartsCounts &required = pattern.requiredCounts();
+    for (std::size_t i = 0; i < numChunks(); ++i)
+      if (m_directory[i].summary.mayContain(required))
+        queue.chunks.push_back(i);
+
+    numThreads = std::max(1, std::min<int>(numThreads, queue.chunks.size()));
+    std::vector<ScanWorker> workers(numThreads);
+    for (int i = 0; i < numThreads; ++i)
+      workers[i].queue = &queue;
+
+    pthread_mutex_init(&queue.mutex, 0);
+    if (numThreads == 1)
+      ScanThread(&workers[0]);
+    else {
+      // the queue hands out all chunks to the threads that did start
+      std::vector<pthread_t> threads;
+      for (int i = 0; i < numThreads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, &ScanThread, &workers[i]))
+          break;
+        threads.push_back(thread);
+      }
+      if (threads.empty())
+        ScanThread(&workers[0]);
+      for (std::size_t i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], 0);
+    }
+    pthread_mutex_destroy(&queue.mutex);
+
+    for (int i = 0; i < numThreads; ++i)
+      hits.insert(hits.end(), workers[i].hits.begin(), workers[i].hits.end());
+    std::sort(hits.begin(), hits.end());
+
+    return numChunks() - queue.chunks.size();
+  }
+
+  MoleculeStoreWriter::MoleculeStoreWriter(const std::string &filename, unsigned int chunkSize)
+      : m_ofs(filename.c_str(), std::ios::binary), m_offset(sizeof(MoleculeStoreHeader)),
+      m_chunkSize(chunkSize ? chunkSize : 1)
+  {
+    // the header is written by close()
+    MoleculeStoreHeader header;
+    std::memset(&header, 0, sizeof(MoleculeStoreHeader));
+    m_ofs.write(reinterpret_cast<const char*>(&header), sizeof(MoleculeStoreHeader));
+
+    std::memset(&m_summary, 0, sizeof(MoleculeStoreChunkSummary));
+    m_atomOffsets.push_back(0);
+    m_bondOffsets.push_back(0);
+  }
+
+  MoleculeStoreWriter::~MoleculeStoreWriter()
+  {
+    close();
+  }
+
+  bool MoleculeStoreWriter::write(const Molecule &mol)
+  {
+    if (!m_ofs.is_open() || mol.numAtoms() > 65535)
+      return false;
+
+    for (unsigned int i = 0; i < mol.numAtoms(); ++i) {
+      m_ringSizes.push_back(mol.ringSizes(i));
+      m_mass.push_back(ClampField<unsigned short>(mol.mass(i), 0, 65535));
+      m_atomClass.push_back(ClampField<unsigned short>(mol.atomClass(i), 0, 65535));
+      m_atomFlags.push_back((mol.isAromatic(i) ? Molecule::Aromatic : 0) | (mol.isCyclic(i) ? Molecule::Cyclic : 0));
+      m_element.push_back(mol.element(i));
+      m_degree.push_back(mol.degree(i));
+      m_valence.push_back(mol.valence(i));
+      m_connectivity.push_back(mol.connectivity(i));
+      m_totalH.push_back(mol.totalHydrogens(i));
+      m_implicitH.push_back(mol.implicitHydrogens(i));
+      m_ringMembership.push_back(mol.ringMembership(i));
+      m_ringConnectivity.push_back(mol.ringConnectivity(i));
+      m_charge.push_back(mol.charge(i));
+    }
+
+    for (unsigned int i = 0; i < mol.numBonds(); ++i) {
+      m_source.push_back(mol.source(i));
+      m_target.push_back(mol.target(i));
+      m_bondFlags.push_back((mol.isBondAromatic(i) ? Molecule::Aromatic : 0) | (mol.isBondCyclic(i) ? Molecule::Cyclic : 0));
+      m_order.push_back(mol.order(i));
+    }
+
+    m_atomOffsets.push_back(m_atomFlags.size());
+    m_bondOffsets.push_back(m_bondFlags.size());
+    m_summary.add(GetMoleculeCounts(const_cast<Molecule*>(&mol)));
+
+    if (m_atomOffsets.size() > m_chunkSize)
+      writeChunk();
+
+    return m_ofs.good();
+  }
+
+  void MoleculeStoreWriter::writeChunk()
+  {
+    if (m_atomOffsets.size() == 1)
+      return;
+
+    MoleculeStoreChunkHeader header;
+    header.numMolecules = m_atomOffsets.size() - 1;
+    header.numAtoms = m_atomFlags.size();
+    header.numBonds = m_bondFlags.size();
+    header.reserved = 0;
+
+    // same order as the Column enum
+    std::string buffer;
+    buffer.append(reinterpret_cast<const char*>(&header), sizeof(MoleculeStoreChunkHeader));
+    AppendColumn(buffer, m_atomOffsets);
+    AppendColumn(buffer, m_bondOffsets);
+    AppendColumn(buffer, m_ringSizes);
+    AppendColumn(buffer, m_mass);
+    AppendColumn(buffer, m_atomClass);
+    AppendColumn(buffer, m_source);
+    AppendColumn(buffer, m_target);
+    AppendColumn(buffer, m_atomFlags);
+    AppendColumn(buffer, m_element);
+    AppendColumn(buffer, m_degree);
+    AppendColumn(buffer, m_valence);
+    AppendColumn(buffer, m_connectivity);
+    AppendColumn(buffer, m_totalH);
+    AppendColumn(buffer, m_implicitH);
+    AppendColumn(buffer, m_ringMembership);
+    AppendColumn(buffer, m_ringConnectivity);
+    AppendColumn(buffer, m_charge);
+    AppendColumn(buffer, m_bondFlags);
+    AppendColumn(buffer, m_order);
+    buffer.append((8 - buffer.size() % 8) % 8, '\0');
+
+    MoleculeStoreChunkInfo info;
+    info.offsetLow = m_offset & 0xffffffff;
+    info.offsetHigh = m_offset >> 16 >> 16;
+    info.size = buffer.size();
+    info.numMolecules = header.numMolecules;
+    info.summary = m_summary;
+    m_directory.push_back(info);
+
+    m_ofs.write(buffer.data(), buffer.size());
+    m_offset += buffer.size();
+
+    // start the next chunk
+    m_atomOffsets.resize(1);
+    m_bondOffsets.resize(1);
+    m_ringSizes.clear();
+    m_mass.clear();
+    m_atomClass.clear();
+    m_source.clear();
+    m_target.clear();
+    m_atomFlags.clear();
+    m_element.clear();
+    m_degree.clear();
+    m_valence.clear();
+    m_connectivity.clear();
+    m_totalH.clear();
+    m_implicitH.clear();
+    m_ringMembership.clear();
+    m_ringConnectivity.clear();
+    m_charge.clear();
+    m_bondFlags.clear();
+    m_order.clear();
+    std::memset(&m_summary, 0, sizeof(MoleculeStoreChunkSummary));
+  }
+
+  void MoleculeStoreWriter::close()
+  {
+    if (!m_ofs.is_open())
+      return;
+
+    writeChunk();
+
+    MoleculeStoreHeader header;
+    header.magic = MoleculeStoreHeader::Magic;
+    header.version = MoleculeStoreHeader::Version;
+    header.numChunks = m_directory.size();
+    header.chunkSize = m_chunkSize;
+    header.directoryOffsetLow = m_offset & 0xffffffff;
+    header.directoryOffsetHigh = m_offset >> 16 >> 16;
+
+    if (!m_directory.empty())
+      m_ofs.write(reinterpret_cast<const char*>(&m_directory[0]), m_directory.size() * sizeof(MoleculeStoreChunkInfo));
+    m_ofs.seekp(0);
+    m_ofs.write(reinterpret_cast<const char*>(&header), sizeof(MoleculeStoreHeader));
+    m_ofs.close();
+  }
+
+}
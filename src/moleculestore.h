@@ -0,0 +1,288 @@
+#ifndef SC_MOLECULESTORE_H
+#define SC_MOLECULESTORE_H
+
+#include "compiledsmarts.h"
+#include "molecule.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace SC {
+
+  /**
+   * Binary molecule store for very large collections (*.scs).
+   *
+   * The molecules are stored in chunks (64k molecules by default). Each
+   * chunk stores its atom and bond properties column-wise and can be read
+   * without any other chunk. A directory at the end of the file has the
+   * location of each chunk and a summary of its molecules (the maximum
+   * counts of GetMoleculeCounts() over the chunk and the ring sizes that
+   * occur). A scan uses the summaries to skip chunks in which no molecule
+   * can contain a match (see GetRequiredCounts()), these chunks are never
+   * read from disk.
+   *
+   * @code
+   * MoleculeStoreHeader
+   * for each chunk (starting on an 8 byte boundary):
+   *   MoleculeStoreChunkHeader
+   *   unsigned int[numMolecules + 1]   // first atom of each molecule
+   *   unsigned int[numMolecules + 1]   // first bond of each molecule
+   *   unsigned int[numAtoms]           // ring sizes
+   *   unsigned short[numAtoms]         // mass, atom class
+   *   unsigned short[numBonds]         // source, target (molecule atom index)
+   *   unsigned char[numAtoms]          // flags, element, degree, valence,
+   *                                    // connectivity, total H, implicit H,
+   *                                    // ring membership, ring connectivity
+   *   signed char[numAtoms]            // charge
+   *   unsigned char[numBonds]          // flags, order
+   * MoleculeStoreChunkInfo[numChunks]  // the directory
+   * @endcode
+   *
+   * Each column starts on a 4 byte boundary. The bonds around each atom
+   * are not stored, they are rebuilt when a molecule is read.
+   */
+  struct MoleculeStoreHeader
+  {
+    enum {
+      Magic = 0x53434353, // "SCCS"
+      Version = 1
+    };
+
+    std::size_t directoryOffset() const
+    {
+      return static_cast<std::size_t>(directoryOffsetHigh) << 16 << 16 | directoryOffsetLow;
+    }
+
+    unsigned int magic;
+    unsigned int version;
+    unsigned int numChunks;
+    unsigned int chunkSize; // maximum number of molecules per chunk
+    unsigned int directoryOffsetLow; // in bytes
+    unsigned int directoryOffsetHigh;
+  };
+
+  struct MoleculeStoreChunkHeader
+  {
+    unsigned int numMolecules;
+    unsigned int numAtoms;
+    unsigned int numBonds;
+    unsigned int reserved;
+  };
+
+  /**
+   * The maximum counts over the molecules in a chunk, a pattern can only
+   * match in the chunk if these contain the pattern's required counts.
+   */
+  struct MoleculeStoreChunkSummary
+  {
+    enum {
+      NumElements = 128
+    };
+
+    SmartsCounts counts() const;
+    void add(const SmartsCounts &counts);
+
+    /**
+     * Check if a molecule in the chunk can contain a match of a pattern
+     * with the @p required counts.
+     */
+    bool mayContain(const SmartsCounts &required) const;
+
+    unsigned int maxAtoms;
+    unsigned int maxBonds;
+    unsigned int maxAromaticAtoms;
+    unsigned int maxRingAtoms;
+    unsigned int maxSingleBonds;
+    unsigned int maxDoubleBonds;
+    unsigned int maxTripleBonds;
+    unsigned int maxAromaticBonds;
+    unsigned int maxRingBonds;
+    unsigned int ringSizes; // all ring sizes in the chunk, see IsInRingSize()
+    unsigned short maxElements[NumElements]; // 0 if the element is not present
+  };
+
+  struct MoleculeStoreChunkInfo
+  {
+    std::size_t offset() const
+    {
+      return static_cast<std::size_t>(offsetHigh) << 16 << 16 | offsetLow;
+    }
+
+    unsigned int offsetLow; // in bytes
+    unsigned int offsetHigh;
+    unsigned int size; // in bytes
+    unsigned int numMolecules;
+    MoleculeStoreChunkSummary summary;
+  };
+
+  /**
+   * A chunk in a MoleculeStore.
+   */
+  class MoleculeStoreChunk
+  {
+    public:
+      MoleculeStoreChunk(const MoleculeStoreChunkHeader *header = 0) : m_header(header)
+      {
+      }
+
+      std::size_t numMolecules() const
+      {
+        return m_header ? m_header->numMolecules : 0;
+      }
+
+      /**
+       * Read a molecule into @p mol (the storage is reused). The offsets
+       * are checked by MoleculeStore::open(), the bonds are checked here.
+       *
+       * @return False if a bond refers to an atom outside the molecule.
+       */
+      bool read(std::size_t index, Molecule &mol) const;
+
+    private:
+      const MoleculeStoreChunkHeader *m_header;
+  };
+
+  /**
+   * Read only access to a *.scs file (memory mapped).
+   */
+  class MoleculeStore
+  {
+    public:
+      MoleculeStore();
+      ~MoleculeStore();
+
+      /**
+       * Check if a file is a MoleculeStore.
+       */
+      static bool isStore(const std::string &filename);
+
+      bool open(const std::string &filename);
+      void close();
+
+      bool isOpen() const
+      {
+        return m_header;
+      }
+
+      std::size_t numChunks() const
+      {
+        return m_header ? m_header->numChunks : 0;
+      }
+
+      std::size_t numMolecules() const
+      {
+        return m_firstMolecule.empty() ? 0 : m_firstMolecule.back();
+      }
+
+      const MoleculeStoreChunkInfo& chunkInfo(std::size_t chunk) const
+      {
+        return m_directory[chunk];
+      }
+
+      /**
+       * The index of the first molecule in a chunk.
+       */
+      std::size_t firstMolecule(std::size_t chunk) const
+      {
+        return m_firstMolecule[chunk];
+      }
+
+      MoleculeStoreChunk chunk(std::size_t chunk) const;
+
+      /**
+       * Match a pattern against all molecules using @p numThreads threads.
+       * The pattern is shared by the threads (see CompiledSmarts). The
+       * chunks are handed out to the threads one at a time, chunks whose
+       * summary shows that none of their molecules can contain a match are
+       * skipped.
+       *
+       * @param hits Set to the indices of the matching molecules (sorted).
+       * @return The number of chunks that were skipped.
+       */
+      std::size_t scan(const CompiledSmarts &pattern, std::vector<std::size_t> &hits,
+          int numThreads = 1) const;
+
+    private:
+      // not copyable
+      MoleculeStore(const MoleculeStore&);
+      MoleculeStore& operator=(const MoleculeStore&);
+
+      const MoleculeStoreHeader *m_header;
+      const MoleculeStoreChunkInfo *m_directory;
+      std::vector<std::size_t> m_firstMolecule; // numChunks + 1
+      void *m_mapped;
+      std::size_t m_mappedSize;
+      std::vector<unsigned int> m_buffer; // without mmap
+  };
+
+  /**
+   * Write molecules to a *.scs file. The molecules are collected in
+   * columns until a chunk is full, the directory and header are written by
+   * close().
+   *
+   * @code
+   * MoleculeStoreWriter writer("out.scs");
+   * Molecule mol;
+   * readMoleculeHeader(ifs);
+   * while (readMolecule(ifs, mol))
+   *   writer.write(mol);
+   * @endcode
+   */
+  class MoleculeStoreWriter
+  {
+    public:
+      enum {
+        DefaultChunkSize = 65536
+      };
+
+      MoleculeStoreWriter(const std::string &filename, unsigned int chunkSize = DefaultChunkSize);
+      ~MoleculeStoreWriter();
+
+      bool isOpen() const
+      {
+        return m_ofs.is_open();
+      }
+
+      /**
+       * Add a molecule, all atoms are written (SmilesReader already removes
+       * hydrogens, SnapshotMolecule() doesn't).
+       *
+       * @return False if the molecule has more than 65535 atoms.
+       */
+      bool write(const Molecule &mol);
+      void close();
+
+    private:
+      void writeChunk();
+
+      std::ofstream m_ofs;
+      std::size_t m_offset; // in bytes
+      unsigned int m_chunkSize;
+      std::vector<MoleculeStoreChunkInfo> m_directory;
+      MoleculeStoreChunkSummary m_summary;
+      // the columns of the current chunk
+      std::vector<unsigned int> m_atomOffsets;
+      std::vector<unsigned int> m_bondOffsets;
+      std::vector<unsigned int> m_ringSizes;
+      std::vector<unsigned short> m_mass;
+      std::vector<unsigned short> m_atomClass;
+      std::vector<unsigned short> m_source;
+      std::vector<unsigned short> m_target;
+      std::vector<unsigned char> m_atomFlags;
+      std::vector<unsigned char> m_element;
+      std::vector<unsigned char> m_degree;
+      std::vector<unsigned char> m_valence;
+      std::vector<unsigned char> m_connectivity;
+      std::vector<unsigned char> m_totalH;
+      std::vector<unsigned char> m_implicitH;
+      std::vector<unsigned char> m_ringMembership;
+      std::vector<unsigned char> m_ringConnectivity;
+      std::vector<signed char> m_charge;
+      std::vector<unsigned char> m_bondFlags;
+      std::vector<unsigned char> m_order;
+  };
+
+}
+
+#endif
@@ -5,6 +5,51 @@
 
 namespace SC {
 
+  void GetRingSizeMasks(OpenBabel::OBMol *mol, std::vector<unsigned int> &masks)
+  {
+    masks.clear();
+    masks.resize(mol->NumAtoms(), 0);
+
+    std::vector<OpenBabel::OBRing*> rings = mol->GetSSSR();
+    for (std::size_t i = 0; i < rings.size(); ++i) {
+      int size = rings[i]->Size();
+      unsigned int bit = size > 31 ? RingSizeOverflow : 1u << size;
+      for (std::size_t j = 0; j < rings[i]->_path.size(); ++j)
+        masks[rings[i]->_path[j] - 1] |= bit;
+    }
+  }
+
+  void OpenBabelPropertyCache::attach(OpenBabel::OBMol *mol)
+  {
+    invalidate();
+    m_mol = mol;
+    m_numAtoms = mol->NumAtoms();
+    m_numBonds = mol->NumBonds();
+
+    OpenBabelPropertyCacheData *data = dynamic_cast<OpenBabelPropertyCacheData*>(
+        mol->GetData(OpenBabelPropertyCacheData::Attribute()));
+    if (data)
+      data->cache = this;
+    else
+      mol->SetData(new OpenBabelPropertyCacheData(this));
+  }
+
+  OpenBabelPropertyCache* OpenBabelPropertyCache::get(OpenBabel::OBMol *mol)
+  {
+    OpenBabelPropertyCacheData *data = dynamic_cast<OpenBabelPropertyCacheData*>(
+        mol->GetData(OpenBabelPropertyCacheData::Attribute()));
+    if (!data || !data->cache || data->cache->m_mol != mol)
+      return 0;
+    OpenBabelPropertyCache *cache = data->cache;
+    if (cache->m_numAtoms != mol->NumAtoms() || cache->m_numBonds != mol->NumBonds()) {
+      // atoms or bonds were added or removed since the last match
+      cache->invalidate();
+      cache->m_numAtoms = mol->NumAtoms();
+      cache->m_numBonds = mol->NumBonds();
+    }
+    return cache;
+  }
+
   std::string OpenBabelToolkit::AtomType(enum SmartsCodeGenerator::Language lang)
   {
     return "OBAtom";
@@ -355,43 +400,43 @@ namespace SC {
     switch (atomExprType) {
       case Smiley::AE_Isotope:
         expr = MassAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       case Smiley::AE_AtomicNumber:
         expr = ElementAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       case Smiley::AE_AromaticElement:
         expr = AromaticElementAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       case Smiley::AE_AliphaticElement:
         expr = AliphaticElementAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       case Smiley::AE_TotalH:
         expr = HydrogenCountAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       case Smiley::AE_Charge:
         expr = ChargeAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       case Smiley::AE_Connectivity:
         expr = ConnectAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       case Smiley::AE_Degree:
         expr = DegreeAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       case Smiley::AE_ImplicitH:
         expr = ImplicitAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       case Smiley::AE_RingMembership:
         expr = NumRingsAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       case Smiley::AE_Valence:
         expr = ValenceAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       //case Smiley::AE_HYB:
       //  expr = HybAtomTemplate(lang);
-      //  return expr.substr(0, expr.find(" "));
+      //  return expr.substr(0, expr.find(" == "));
       case Smiley::AE_RingConnectivity:
         expr = RingConnectAtomTemplate(lang);
-        return expr.substr(0, expr.find(" "));
+        return expr.substr(0, expr.find(" == "));
       default:
         return "";
     }
@@ -3,6 +3,7 @@
 
 #include "toolkit.h"
 #include "smartspattern.h"
+#include "ringperception.h"
 #include <openbabel/mol.h>
 #include <openbabel/obiter.h>
 
@@ -166,13 +167,170 @@ namespace SC {
     return EvalBondExpr(index, bond);
   }
 
+  /**
+   * Compute the ring size bitmask for each atom from the SSSR (same rings
+   * as OBAtom::IsInRingSize()). The @p masks are indexed by OBAtom::GetIndex().
+   */
+  void GetRingSizeMasks(OpenBabel::OBMol *mol, std::vector<unsigned int> &masks);
+
+  /**
+   * Cache for the atom properties that are expensive to get from OpenBabel
+   * (hydrogen counts, valence, ring membership, ring connectivity and ring
+   * sizes). Caching is opt-in: the caller owns the cache and attaches it to
+   * the molecule that is matched, OpenBabelAtom then computes a property
+   * the first time a pattern evaluates it and later evaluations (other atom
+   * expressions, backtracking and other patterns) read the cached value.
+   * Without an attached cache every property is read from OpenBabel.
+   *
+   * One cache is reused for a stream of molecules, attach() starts a new
+   * generation instead of clearing or reallocating anything:
+   *
+   * @code
+   * OpenBabelPropertyCache cache;
+   * while (conv.Read(&mol)) {
+   *   cache.attach(&mol);
+   *   for (std::size_t i = 0; i < patterns.size(); ++i)
+   *     if (match(&mol, patterns[i]))
+   *       ...
+   * }
+   * @endcode
+   *
+   * The molecule only stores a pointer to the cache (as generic data, see
+   * OpenBabelPropertyCacheData), the cache has to outlive the matching. The
+   * cache is only used for the molecule it was attached to last and is
+   * invalidated when the number of atoms or bonds changes (e.g.
+   * OBMol::AddHydrogens()). Call attach() again after other changes.
+   *
+   * The cache is not thread-safe, a molecule should not be matched by
+   * multiple threads at the same time (OpenBabel's lazy perception isn't
+   * either).
+   */
+  class OpenBabelPropertyCache
+  {
+    public:
+      enum Property {
+        TotalHydrogens,
+        ImplicitHydrogens,
+        Valence,
+        RingMembership,
+        RingConnectivity,
+        NumProperties
+      };
+
+      OpenBabelPropertyCache() : m_mol(0), m_numAtoms(0), m_numBonds(0),
+          m_generation(1), m_ringSizesGeneration(0)
+      {
+      }
+
+      /**
+       * Use the cache for @p mol, the values of the previous molecule are
+       * invalidated.
+       */
+      void attach(OpenBabel::OBMol *mol);
+
+      /**
+       * Get the cache attached to the molecule, 0 if there is none (or it
+       * was attached to another molecule since).
+       */
+      static OpenBabelPropertyCache* get(OpenBabel::OBMol *mol);
+
+      void invalidate()
+      {
+        if (!++m_generation) {
+          // wrapped around, old stamps would become valid again
+          for (int i = 0; i < NumProperties; ++i)
+            m_stamps[i].assign(m_stamps[i].size(), 0);
+          m_ringSizesGeneration = 0;
+          m_generation = 1;
+        }
+      }
+
+      bool lookup(Property property, unsigned int atom, int &value) const
+      {
+        if (atom >= m_stamps[property].size() || m_stamps[property][atom] != m_generation)
+          return false;
+        value = m_values[property][atom];
+        return true;
+      }
+
+      void store(Property property, unsigned int atom, int value)
+      {
+        if (atom >= m_stamps[property].size()) {
+          m_stamps[property].resize(atom + 1, 0);
+          m_values[property].resize(atom + 1);
+        }
+        m_stamps[property][atom] = m_generation;
+        m_values[property][atom] = value;
+      }
+
+      /**
+       * The ring size bitmask (see IsInRingSize()), computed for all atoms
+       * at once from the SSSR.
+       */
+      unsigned int ringSizes(OpenBabel::OBAtom *atom)
+      {
+        if (m_ringSizesGeneration != m_generation) {
+          GetRingSizeMasks(atom->GetParent(), m_ringSizes);
+          m_ringSizesGeneration = m_generation;
+        }
+        return atom->GetIndex() < m_ringSizes.size() ? m_ringSizes[atom->GetIndex()] : 0;
+      }
+
+    private:
+      // not copyable
+      OpenBabelPropertyCache(const OpenBabelPropertyCache&);
+      OpenBabelPropertyCache& operator=(const OpenBabelPropertyCache&);
+
+      OpenBabel::OBMol *m_mol;
+      unsigned int m_numAtoms;
+      unsigned int m_numBonds;
+      unsigned int m_generation;
+      std::vector<unsigned int> m_stamps[NumProperties];
+      std::vector<int> m_values[NumProperties];
+      std::vector<unsigned int> m_ringSizes;
+      unsigned int m_ringSizesGeneration;
+  };
+
+  /**
+   * The generic data that links a molecule to its OpenBabelPropertyCache.
+   * It doesn't own the cache, OBMol::Clear() only deletes the link.
+   */
+  class OpenBabelPropertyCacheData : public OpenBabel::OBGenericData
+  {
+    public:
+      OpenBabelPropertyCacheData(OpenBabelPropertyCache *cache_)
+          : OpenBabel::OBGenericData(Attribute(), OpenBabel::OBGenericDataType::CustomData7),
+          cache(cache_)
+      {
+      }
+
+      static const char* Attribute()
+      {
+        return "SmartsCompiler property cache";
+      }
+
+      /**
+       * Copies of the molecule are not linked to the cache.
+       */
+      OpenBabel::OBGenericData* Clone(OpenBabel::OBBase*) const
+      {
+        return new OpenBabelPropertyCacheData(0);
+      }
+
+      OpenBabelPropertyCache *cache;
+  };
+
   /**
    * OpenBabel Atom
+   *
+   * The expensive properties are cached if the molecule has an
+   * OpenBabelPropertyCache, the cache is only looked up when one of them is
+   * evaluated.
    */
   class OpenBabelAtom
   {
     public:
-      OpenBabelAtom(OpenBabel::OBAtom *atom) : m_atom(atom)
+      OpenBabelAtom(OpenBabel::OBAtom *atom) : m_atom(atom), m_cache(0), m_cacheChecked(false)
       {
       }
 
@@ -213,7 +371,12 @@ namespace SC {
 
       int valence() const
       {
-        return m_atom->KBOSum() - (m_atom->GetSpinMultiplicity() ? m_atom->GetSpinMultiplicity() - 1 : 0);
+        int value;
+        if (!lookup(OpenBabelPropertyCache::Valence, value)) {
+          value = m_atom->KBOSum() - (m_atom->GetSpinMultiplicity() ? m_atom->GetSpinMultiplicity() - 1 : 0);
+          store(OpenBabelPropertyCache::Valence, value);
+        }
+        return value;
       }
 
       int connectivity() const
@@ -223,27 +386,56 @@ namespace SC {
 
       int totalHydrogens() const
       {
-        return m_atom->ExplicitHydrogenCount() + m_atom->ImplicitHydrogenCount();
+        int value;
+        if (!lookup(OpenBabelPropertyCache::TotalHydrogens, value)) {
+          value = m_atom->ExplicitHydrogenCount() + implicitHydrogens();
+          store(OpenBabelPropertyCache::TotalHydrogens, value);
+        }
+        return value;
       }
 
       int implicitHydrogens() const
       {
-        return m_atom->ImplicitHydrogenCount();
+        int value;
+        if (!lookup(OpenBabelPropertyCache::ImplicitHydrogens, value)) {
+          value = m_atom->ImplicitHydrogenCount();
+          store(OpenBabelPropertyCache::ImplicitHydrogens, value);
+        }
+        return value;
       }
 
       int ringMembership() const
       {
-        return m_atom->MemberOfRingCount();
+        if (!m_atom->IsInRing())
+          return 0;
+        int value;
+        if (!lookup(OpenBabelPropertyCache::RingMembership, value)) {
+          value = m_atom->MemberOfRingCount();
+          store(OpenBabelPropertyCache::RingMembership, value);
+        }
+        return value;
       }
 
       bool isInRingSize(int size) const
       {
-        return m_atom->IsInRingSize(size);
+        if (!m_atom->IsInRing())
+          return false;
+        // larger rings share a bit in the mask
+        if (size > 31 || !cache())
+          return m_atom->IsInRingSize(size);
+        return IsInRingSize(m_cache->ringSizes(m_atom), size);
       }
 
       int ringConnectivity() const
       {
-        return m_atom->CountRingBonds();
+        if (!m_atom->IsInRing())
+          return 0;
+        int value;
+        if (!lookup(OpenBabelPropertyCache::RingConnectivity, value)) {
+          value = m_atom->CountRingBonds();
+          store(OpenBabelPropertyCache::RingConnectivity, value);
+        }
+        return value;
       }
 
       int charge() const
@@ -257,7 +449,29 @@ namespace SC {
       }
 
     private:
+      OpenBabelPropertyCache* cache() const
+      {
+        if (!m_cacheChecked) {
+          m_cache = OpenBabelPropertyCache::get(m_atom->GetParent());
+          m_cacheChecked = true;
+        }
+        return m_cache;
+      }
+
+      bool lookup(OpenBabelPropertyCache::Property property, int &value) const
+      {
+        return cache() && m_cache->lookup(property, m_atom->GetIndex(), value);
+      }
+
+      void store(OpenBabelPropertyCache::Property property, int value) const
+      {
+        if (m_cache)
+          m_cache->store(property, m_atom->GetIndex(), value);
+      }
+
       OpenBabel::OBAtom *m_atom;
+      mutable OpenBabelPropertyCache *m_cache;
+      mutable bool m_cacheChecked;
   };
 
   /**
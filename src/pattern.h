@@ -235,5 +235,52 @@ namespace SC {
     else
       other.push_back(expr->binary.rgt);
   }
+
+  inline int GetExprValue(const SmartsAtomExpr *expr)
+  {
+    return expr->leaf.value;
+  }
+
+  inline int GetExprValue(const SmartsBondExpr *expr)
+  {
+    return 0;
+  }
+
+  /**
+   * Get the canonical key for an expression. Two expressions with the same
+   * key are equivalent: operands of nested AND/OR expressions are flattened
+   * and sorted (duplicate operands are removed) and the high and low
+   * precedence AND are treated the same.
+   */
+  template<typename Expr>
+  std::string GetCanonicalExprKey(Expr *expr)
+  {
+    std::stringstream key;
+    if (IsUnary(expr)) {
+      key << "!(" << GetCanonicalExprKey(expr->unary.arg) << ")";
+    } else if (IsBinary(expr)) {
+      std::vector<Expr*> same, other;
+      FindSameBinaryExpr(expr, same, other);
+      std::vector<std::string> keys;
+      for (std::size_t i = 0; i < other.size(); ++i)
+        keys.push_back(GetCanonicalExprKey(other[i]));
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      if (keys.size() == 1)
+        return keys[0];
+      key << (IsAnd(expr) ? "&(" : ",(");
+      for (std::size_t i = 0; i < keys.size(); ++i) {
+        if (i)
+          key << " ";
+        key << keys[i];
+      }
+      key << ")";
+    } else {
+      key << expr->type;
+      if (IsValued(expr))
+        key << ":" << GetExprValue(expr);
+    }
+    return key.str();
+  }
  
 }
@@ -0,0 +1,403 @@
+#include "ringperception.h"
+
+#include <algorithm>
+
+namespace SC {
+
+  namespace {
+
+    const unsigned int wordBits = 8 * sizeof(unsigned long);
+
+  }
+
+  void RingPerception::findRingBonds(unsigned int numAtoms, const std::vector<unsigned int> &source,
+      const std::vector<unsigned int> &target)
+  {
+    // iterative depth-first search, a bond is a bridge if the subtree below
+    // it has no back edge to an atom above it
+    m_order.assign(numAtoms, -1);
+    m_low.assign(numAtoms, 0);
+    m_parentBond.assign(numAtoms, 0);
+    m_next.assign(numAtoms, 0);
+    m_stack.clear();
+    int time = 0;
+
+    m_numComponents = 0;
+    for (unsigned int root = 0; root < numAtoms; ++root) {
+      if (m_order[root] != -1)
+        continue;
+      ++m_numComponents;
+      m_order[root] = m_low[root] = time++;
+      m_next[root] = m_nbrOffsets[root];
+      m_parentBond[root] = source.size();
+      m_stack.push_back(root);
+
+      while (!m_stack.empty()) {
+        unsigned int atom = m_stack.back();
+        if (m_next[atom] < m_nbrOffsets[atom + 1]) {
+          unsigned int bond = m_nbrBonds[m_next[atom]++];
+          if (bond == m_parentBond[atom])
+            continue;
+          unsigned int nbr = source[bond] == atom ? target[bond] : source[bond];
+          if (m_order[nbr] == -1) {
+            m_order[nbr] = m_low[nbr] = time++;
+            m_next[nbr] = m_nbrOffsets[nbr];
+            m_parentBond[nbr] = bond;
+            m_stack.push_back(nbr);
+          } else {
+            // back edges always close a ring
+            m_low[atom] = std::min(m_low[atom], m_order[nbr]);
+            m_cyclicBonds[bond] = true;
+          }
+        } else {
+          m_stack.pop_back();
+          if (m_stack.empty())
+            break;
+          unsigned int parent = m_stack.back();
+          m_low[parent] = std::min(m_low[parent], m_low[atom]);
+          if (m_low[atom] <= m_order[parent])
+            m_cyclicBonds[m_parentBond[atom]] = true;
+        }
+      }
+    }
+  }
+
+  void RingPerception::findRingSystems(unsigned int numAtoms, const std::vector<unsigned int> &source,
+      const std::vector<unsigned int> &target)
+  {
+    // breadth-first search over the ring bonds, m_order is reused for the
+    // position of the atoms in the queue (-1 if not yet queued) and m_low
+    // for the bond over which they were reached
+    m_order.assign(numAtoms, -1);
+    m_systemOffsets.assign(1, 0);
+    m_systemBonds.clear();
+    m_systemAtoms.clear();
+
+    for (unsigned int root = 0; root < numAtoms; ++root) {
+      if (!m_ringConnectivity[root] || m_order[root] != -1)
+        continue;
+
+      m_order[root] = 0;
+      m_low[root] = -1;
+      m_queue.assign(1, root);
+      for (std::size_t head = 0; head < m_queue.size(); ++head) {
+        unsigned int atom = m_queue[head];
+        for (unsigned int i = m_nbrOffsets[atom]; i < m_nbrOffsets[atom + 1]; ++i) {
+          unsigned int bond = m_nbrBonds[i];
+          if (!m_cyclicBonds[bond])
+            continue;
+          unsigned int nbr = source[bond] == atom ? target[bond] : source[bond];
+          // each bond is added once: when its second atom is queued or, for
+          // ring closures, from the atom that is processed last
+          if (m_order[nbr] == -1) {
+            m_order[nbr] = m_queue.size();
+            m_low[nbr] = bond;
+            m_queue.push_back(nbr);
+            m_systemBonds.push_back(bond);
+          } else if (static_cast<std::size_t>(m_order[nbr]) < head && m_low[atom] != static_cast<int>(bond)) {
+            m_systemBonds.push_back(bond);
+          }
+        }
+      }
+      m_systemAtoms.push_back(m_queue.size());
+      m_systemOffsets.push_back(m_systemBonds.size());
+    }
+  }
+
+  void RingPerception::addRing(const unsigned int *atoms, const unsigned int *bonds, std::size_t size)
+  {
+    m_ringAtoms.insert(m_ringAtoms.end(), atoms, atoms + size);
+    m_ringBonds.insert(m_ringBonds.end(), bonds, bonds + size);
+    m_ringOffsets.push_back(m_ringAtoms.size());
+
+    unsigned int bit = size > 31 ? RingSizeOverflow : 1u << size;
+    for (std::size_t i = 0; i < size; ++i) {
+      ++m_ringMembership[atoms[i]];
+      m_ringSizes[atoms[i]] |= bit;
+    }
+  }
+
+  void RingPerception::walkRing(unsigned int atom, const std::vector<unsigned int> &source,
+      const std::vector<unsigned int> &target)
+  {
+    // each atom of a single ring has exactly two ring bonds
+    m_cycleAtoms.clear();
+    m_cycleBonds.clear();
+    unsigned int first = atom;
+    unsigned int prevBond = source.size();
+    do {
+      unsigned int bond = prevBond;
+      for (unsigned int i = m_nbrOffsets[atom]; i < m_nbrOffsets[atom + 1]; ++i)
+        if (m_cyclicBonds[m_nbrBonds[i]] && m_nbrBonds[i] != prevBond) {
+          bond = m_nbrBonds[i];
+          break;
+        }
+      m_cycleAtoms.push_back(atom);
+      m_cycleBonds.push_back(bond);
+      atom = source[bond] == atom ? target[bond] : source[bond];
+      prevBond = bond;
+    } while (atom != first);
+
+    addRing(&m_cycleAtoms[0], &m_cycleBonds[0], m_cycleAtoms.size());
+  }
+
+  bool RingPerception::findShortestCycle(unsigned int bond, const std::vector<unsigned int> &source,
+      const std::vector<unsigned int> &target)
+  {
+    // breadth-first search from source to target over the other ring bonds
+    unsigned int begin = source[bond];
+    unsigned int end = target[bond];
+
+    nextStamp();
+    m_visited[begin] = m_stamp;
+    m_queue.assign(1, begin);
+    for (std::size_t head = 0; head < m_queue.size() && m_visited[end] != m_stamp; ++head) {
+      unsigned int atom = m_queue[head];
+      for (unsigned int i = m_nbrOffsets[atom]; i < m_nbrOffsets[atom + 1]; ++i) {
+        unsigned int nbrBond = m_nbrBonds[i];
+        if (nbrBond == bond || !m_cyclicBonds[nbrBond])
+          continue;
+        unsigned int nbr = source[nbrBond] == atom ? target[nbrBond] : source[nbrBond];
+        if (m_visited[nbr] == m_stamp)
+          continue;
+        m_visited[nbr] = m_stamp;
+        m_prevBond[nbr] = nbrBond;
+        m_queue.push_back(nbr);
+      }
+    }
+
+    if (m_visited[end] != m_stamp)
+      return false;
+
+    // the cycle in ring order: begin, end, ..., back to begin
+    m_cycleAtoms.assign(1, begin);
+    m_cycleBonds.assign(1, bond);
+    for (unsigned int atom = end; atom != begin; ) {
+      unsigned int b = m_prevBond[atom];
+      m_cycleAtoms.push_back(atom);
+      m_cycleBonds.push_back(b);
+      atom = source[b] == atom ? target[b] : source[b];
+    }
+
+    return true;
+  }
+
+  void RingPerception::addCandidate()
+  {
+    m_candidateOrder.push_back(std::make_pair(static_cast<unsigned int>(m_cycleAtoms.size()),
+          static_cast<unsigned int>(m_candidateOffsets.size() - 1)));
+    m_candidateAtoms.insert(m_candidateAtoms.end(), m_cycleAtoms.begin(), m_cycleAtoms.end());
+    m_candidateBonds.insert(m_candidateBonds.end(), m_cycleBonds.begin(), m_cycleBonds.end());
+    m_candidateOffsets.push_back(m_candidateAtoms.size());
+  }
+
+  void RingPerception::addHortonCandidates(const unsigned int *bonds, unsigned int numBonds,
+      const std::vector<unsigned int> &source, const std::vector<unsigned int> &target)
+  {
+    // the atoms of the system
+    nextStamp();
+    m_systemAtomList.clear();
+    for (unsigned int i = 0; i < numBonds; ++i) {
+      unsigned int ends[2] = { source[bonds[i]], target[bonds[i]] };
+      for (int j = 0; j < 2; ++j)
+        if (m_visited[ends[j]] != m_stamp) {
+          m_visited[ends[j]] = m_stamp;
+          m_systemAtomList.push_back(ends[j]);
+        }
+    }
+
+    unsigned int noBond = source.size();
+    for (std::size_t r = 0; r < m_systemAtomList.size(); ++r) {
+      // breadth-first search tree from the root, m_branch is the root's
+      // neighbor through which an atom was reached
+      unsigned int root = m_systemAtomList[r];
+      nextStamp();
+      m_visited[root] = m_stamp;
+      m_prevBond[root] = noBond;
+      m_branch[root] = root;
+      m_queue.assign(1, root);
+      for (std::size_t head = 0; head < m_queue.size(); ++head) {
+        unsigned int atom = m_queue[head];
+        for (unsigned int i = m_nbrOffsets[atom]; i < m_nbrOffsets[atom + 1]; ++i) {
+          unsigned int nbrBond = m_nbrBonds[i];
+          if (!m_cyclicBonds[nbrBond])
+            continue;
+          unsigned int nbr = source[nbrBond] == atom ? target[nbrBond] : source[nbrBond];
+          if (m_visited[nbr] == m_stamp)
+            continue;
+          m_visited[nbr] = m_stamp;
+          m_prevBond[nbr] = nbrBond;
+          m_branch[nbr] = atom == root ? nbr : m_branch[atom];
+          m_queue.push_back(nbr);
+        }
+      }
+
+      // path root -> x + bond x-y + path y -> root for each bond that is not
+      // in the tree, unless the two paths share more than the root
+      for (unsigned int i = 0; i < numBonds; ++i) {
+        unsigned int bond = bonds[i];
+        unsigned int x = source[bond], y = target[bond];
+        if (m_prevBond[x] == bond || m_prevBond[y] == bond)
+          continue;
+        if (x != root && y != root && m_branch[x] == m_branch[y])
+          continue;
+
+        m_cycleAtoms.clear();
+        m_cycleBonds.clear();
+        for (unsigned int atom = x; atom != root; ) {
+          unsigned int b = m_prevBond[atom];
+          m_cycleAtoms.push_back(atom);
+          m_cycleBonds.push_back(b);
+          atom = source[b] == atom ? target[b] : source[b];
+        }
+        m_cycleAtoms.push_back(root);
+        std::reverse(m_cycleAtoms.begin(), m_cycleAtoms.end());
+        std::reverse(m_cycleBonds.begin(), m_cycleBonds.end());
+        m_cycleBonds.push_back(bond);
+        for (unsigned int atom = y; atom != root; ) {
+          unsigned int b = m_prevBond[atom];
+          m_cycleAtoms.push_back(atom);
+          m_cycleBonds.push_back(b);
+          atom = source[b] == atom ? target[b] : source[b];
+        }
+        addCandidate();
+      }
+    }
+  }
+
+  unsigned int RingPerception::selectRings(const unsigned int *bonds, unsigned int numBonds, unsigned int numRings)
+  {
+    std::sort(m_candidateOrder.begin(), m_candidateOrder.end());
+
+    // select linearly independent rings, smallest first (Gaussian
+    // elimination of the bond sets over GF(2), the bonds are numbered
+    // within the system)
+    for (unsigned int i = 0; i < numBonds; ++i)
+      m_localBond[bonds[i]] = i;
+    std::size_t words = (numBonds + wordBits - 1) / wordBits;
+    m_basis.clear();
+    m_pivots.clear();
+    m_selected.clear();
+    // (a ring found from each of its bonds reduces to zero after the first)
+    for (std::size_t i = 0; i < m_candidateOrder.size() && m_selected.size() < numRings; ++i) {
+      unsigned int candidate = m_candidateOrder[i].second;
+      m_row.assign(words, 0);
+      for (unsigned int j = m_candidateOffsets[candidate]; j < m_candidateOffsets[candidate + 1]; ++j) {
+        unsigned int local = m_localBond[m_candidateBonds[j]];
+        m_row[local / wordBits] |= 1ul << (local % wordBits);
+      }
+
+      for (std::size_t j = 0; j < m_pivots.size(); ++j)
+        if (m_row[m_pivots[j] / wordBits] & (1ul << (m_pivots[j] % wordBits)))
+          for (std::size_t k = 0; k < words; ++k)
+            m_row[k] ^= m_basis[j * words + k];
+
+      std::size_t word = 0;
+      while (word < words && !m_row[word])
+        ++word;
+      if (word == words)
+        continue; // dependent
+
+      unsigned int bit = 0;
+      while (!(m_row[word] & (1ul << bit)))
+        ++bit;
+      m_basis.insert(m_basis.end(), m_row.begin(), m_row.end());
+      m_pivots.push_back(word * wordBits + bit);
+      m_selected.push_back(candidate);
+    }
+
+    return m_selected.size();
+  }
+
+  void RingPerception::findSmallestRings(const unsigned int *bonds, unsigned int numBonds, unsigned int numRings,
+      const std::vector<unsigned int> &source, const std::vector<unsigned int> &target)
+  {
+    // candidate rings: the shortest cycle through each ring bond
+    m_candidateOffsets.assign(1, 0);
+    m_candidateAtoms.clear();
+    m_candidateBonds.clear();
+    m_candidateOrder.clear();
+    for (unsigned int i = 0; i < numBonds; ++i)
+      if (findShortestCycle(bonds[i], source, target))
+        addCandidate();
+
+    // these don't always span the cycle space (e.g. the central ring of
+    // coronene when the ties between the six-membered rings are broken
+    // towards the outer rings), the Horton candidates always contain a
+    // minimum cycle basis
+    if (selectRings(bonds, numBonds, numRings) < numRings) {
+      addHortonCandidates(bonds, numBonds, source, target);
+      selectRings(bonds, numBonds, numRings);
+    }
+
+    for (std::size_t i = 0; i < m_selected.size(); ++i) {
+      unsigned int candidate = m_selected[i];
+      addRing(&m_candidateAtoms[m_candidateOffsets[candidate]], &m_candidateBonds[m_candidateOffsets[candidate]],
+          m_candidateOffsets[candidate + 1] - m_candidateOffsets[candidate]);
+    }
+  }
+
+  void RingPerception::perceive(unsigned int numAtoms, const std::vector<unsigned int> &source,
+      const std::vector<unsigned int> &target)
+  {
+    unsigned int numBonds = source.size();
+
+    m_cyclicBonds.assign(numBonds, false);
+    m_ringMembership.assign(numAtoms, 0);
+    m_ringConnectivity.assign(numAtoms, 0);
+    m_ringSizes.assign(numAtoms, 0);
+    m_ringOffsets.assign(1, 0);
+    m_ringAtoms.clear();
+    m_ringBonds.clear();
+
+    // adjacency
+    m_nbrOffsets.assign(numAtoms + 1, 0);
+    for (unsigned int i = 0; i < numBonds; ++i) {
+      ++m_nbrOffsets[source[i] + 1];
+      ++m_nbrOffsets[target[i] + 1];
+    }
+    for (unsigned int i = 0; i < numAtoms; ++i)
+      m_nbrOffsets[i + 1] += m_nbrOffsets[i];
+    m_nbrBonds.resize(2 * numBonds);
+    m_next.assign(m_nbrOffsets.begin(), m_nbrOffsets.end() - 1);
+    for (unsigned int i = 0; i < numBonds; ++i) {
+      m_nbrBonds[m_next[source[i]]++] = i;
+      m_nbrBonds[m_next[target[i]]++] = i;
+    }
+
+    findRingBonds(numAtoms, source, target);
+
+    // the number of SSSR rings is the cyclomatic number
+    if (numBonds + m_numComponents == numAtoms)
+      return;
+
+    for (unsigned int i = 0; i < numBonds; ++i)
+      if (m_cyclicBonds[i]) {
+        ++m_ringConnectivity[source[i]];
+        ++m_ringConnectivity[target[i]];
+      }
+
+    findRingSystems(numAtoms, source, target);
+
+    if (m_visited.size() < numAtoms) {
+      // the stamps start over with new buffers
+      m_visited.assign(numAtoms, 0);
+      m_prevBond.resize(numAtoms);
+      m_branch.resize(numAtoms);
+      m_stamp = 0;
+    }
+    if (m_localBond.size() < numBonds)
+      m_localBond.resize(numBonds);
+
+    for (std::size_t i = 0; i + 1 < m_systemOffsets.size(); ++i) {
+      const unsigned int *bonds = &m_systemBonds[m_systemOffsets[i]];
+      unsigned int systemBonds = m_systemOffsets[i + 1] - m_systemOffsets[i];
+      unsigned int systemRings = systemBonds - m_systemAtoms[i] + 1;
+      if (systemRings == 1)
+        walkRing(source[bonds[0]], source, target);
+      else
+        findSmallestRings(bonds, systemBonds, systemRings, source, target);
+    }
+  }
+
+}
@@ -0,0 +1,209 @@
+#ifndef SC_RINGPERCEPTION_H
+#define SC_RINGPERCEPTION_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace SC {
+
+  enum RingSizeFlags {
+    RingSizeOverflow = 1
+  };
+
+  /**
+   * Check a ring size bitmask. Bit n is set if the atom is a member of a
+   * (SSSR) ring of size n (3-31), bit 0 (RingSizeOverflow) is set if the
+   * atom is a member of a larger ring. All sizes above 31 share this bit.
+   */
+  inline bool IsInRingSize(unsigned int mask, int size)
+  {
+    if (size < 3)
+      return false;
+    if (size > 31)
+      return mask & RingSizeOverflow;
+    return mask & (1u << size);
+  }
+
+  /**
+   * Ring analysis of a molecular graph given as lists of bond source and
+   * target atom indices. The results have the SMARTS semantics:
+   *
+   * - isCyclicBond(): the bond is in a ring (not a bridge), SMARTS @
+   * - isCyclicAtom(): the atom has a ring bond, SMARTS R
+   * - ringConnectivity(): the number of ring bonds, SMARTS x
+   * - ringMembership(): the number of SSSR rings, SMARTS R<n>
+   * - ringSizes(): the sizes of the SSSR rings, SMARTS r<n>
+   *
+   * Ring bonds are found by bridge detection in a single depth-first search.
+   * The ring bonds are then split into ring systems. A ring system with as
+   * many bonds as atoms is a single ring and is walked directly, this covers
+   * most rings in practice. For fused, bridged and spiro systems the
+   * smallest set of smallest rings (SSSR) is selected from the shortest
+   * cycle through each ring bond of the system, a cycle is added if it is
+   * linearly independent (over GF(2)) of the smaller rings already in the
+   * set. The cost is linear in the molecule size plus quadratic in the size
+   * of each multi-ring system. If these cycles don't give enough rings
+   * (e.g. coronene), the selection is repeated with the Horton candidates
+   * added: for each atom v and each bond x-y, the shortest paths v-x and
+   * y-v closed by the bond.
+   *
+   * All buffers are kept between calls, perceiving many molecules with the
+   * same object does not allocate once it has seen the largest molecule.
+   *
+   * @code
+   * RingPerception rings;
+   * rings.perceive(numAtoms, source, target);
+   * for (unsigned int i = 0; i < numAtoms; ++i)
+   *   if (IsInRingSize(rings.ringSizes(i), 6))
+   *     ...
+   * @endcode
+   */
+  class RingPerception
+  {
+    public:
+      RingPerception() : m_stamp(0)
+      {
+      }
+
+      void perceive(unsigned int numAtoms, const std::vector<unsigned int> &source,
+          const std::vector<unsigned int> &target);
+
+      bool isCyclicAtom(unsigned int atom) const
+      {
+        return m_ringConnectivity[atom];
+      }
+
+      bool isCyclicBond(unsigned int bond) const
+      {
+        return m_cyclicBonds[bond];
+      }
+
+      /**
+       * The number of SSSR rings the atom is a member of.
+       */
+      int ringMembership(unsigned int atom) const
+      {
+        return m_ringMembership[atom];
+      }
+
+      /**
+       * The number of ring bonds around the atom.
+       */
+      int ringConnectivity(unsigned int atom) const
+      {
+        return m_ringConnectivity[atom];
+      }
+
+      /**
+       * The sizes of the SSSR rings the atom is a member of as a bitmask
+       * (see IsInRingSize()).
+       */
+      unsigned int ringSizes(unsigned int atom) const
+      {
+        return m_ringSizes[atom];
+      }
+
+      std::size_t numRings() const
+      {
+        return m_ringOffsets.size() - 1;
+      }
+
+      std::size_t ringSize(std::size_t ring) const
+      {
+        return m_ringOffsets[ring + 1] - m_ringOffsets[ring];
+      }
+
+      /**
+       * The atoms of a ring in ring order.
+       */
+      const unsigned int* ringAtoms(std::size_t ring) const
+      {
+        return &m_ringAtoms[m_ringOffsets[ring]];
+      }
+
+      /**
+       * The bonds of a ring, bond i connects atom i and atom i + 1 (modulo
+       * the ring size).
+       */
+      const unsigned int* ringBonds(std::size_t ring) const
+      {
+        return &m_ringBonds[m_ringOffsets[ring]];
+      }
+
+    private:
+      void findRingBonds(unsigned int numAtoms, const std::vector<unsigned int> &source,
+          const std::vector<unsigned int> &target);
+      void findRingSystems(unsigned int numAtoms, const std::vector<unsigned int> &source,
+          const std::vector<unsigned int> &target);
+      void walkRing(unsigned int atom, const std::vector<unsigned int> &source,
+          const std::vector<unsigned int> &target);
+      void findSmallestRings(const unsigned int *bonds, unsigned int numBonds, unsigned int numRings,
+          const std::vector<unsigned int> &source, const std::vector<unsigned int> &target);
+      bool findShortestCycle(unsigned int bond, const std::vector<unsigned int> &source,
+          const std::vector<unsigned int> &target);
+      void addHortonCandidates(const unsigned int *bonds, unsigned int numBonds,
+          const std::vector<unsigned int> &source, const std::vector<unsigned int> &target);
+      void addCandidate();
+      unsigned int selectRings(const unsigned int *bonds, unsigned int numBonds, unsigned int numRings);
+      void addRing(const unsigned int *atoms, const unsigned int *bonds, std::size_t size);
+
+      /**
+       * Start a new breadth-first search, all atoms become unvisited.
+       */
+      void nextStamp()
+      {
+        if (!++m_stamp) {
+          // wrapped around, old stamps would become valid again
+          m_visited.assign(m_visited.size(), 0);
+          m_stamp = 1;
+        }
+      }
+
+      // results
+      std::vector<bool> m_cyclicBonds;
+      std::vector<int> m_ringMembership;
+      std::vector<int> m_ringConnectivity;
+      std::vector<unsigned int> m_ringSizes;
+      std::vector<unsigned int> m_ringOffsets; // CSR, numRings + 1
+      std::vector<unsigned int> m_ringAtoms;
+      std::vector<unsigned int> m_ringBonds;
+      // adjacency (CSR)
+      std::vector<unsigned int> m_nbrOffsets;
+      std::vector<unsigned int> m_nbrBonds;
+      // depth-first search
+      std::vector<int> m_order;
+      std::vector<int> m_low;
+      std::vector<unsigned int> m_parentBond;
+      std::vector<unsigned int> m_next;
+      std::vector<unsigned int> m_stack;
+      unsigned int m_numComponents;
+      // ring systems (CSR of ring bonds)
+      std::vector<unsigned int> m_systemOffsets;
+      std::vector<unsigned int> m_systemBonds;
+      std::vector<unsigned int> m_systemAtoms; // number of atoms per system
+      // breadth-first search, visited atoms are marked with the current stamp
+      std::vector<unsigned int> m_visited;
+      std::vector<unsigned int> m_prevBond;
+      std::vector<unsigned int> m_branch;
+      std::vector<unsigned int> m_queue;
+      unsigned int m_stamp;
+      // candidate rings
+      std::vector<unsigned int> m_cycleAtoms;
+      std::vector<unsigned int> m_cycleBonds;
+      std::vector<unsigned int> m_candidateOffsets;
+      std::vector<unsigned int> m_candidateAtoms;
+      std::vector<unsigned int> m_candidateBonds;
+      std::vector<std::pair<unsigned int, unsigned int> > m_candidateOrder; // (size, index)
+      std::vector<unsigned int> m_systemAtomList;
+      std::vector<unsigned int> m_selected;
+      // Gaussian elimination, bond sets as bitsets over the system's bonds
+      std::vector<unsigned int> m_localBond;
+      std::vector<unsigned long> m_basis;
+      std::vector<unsigned long> m_row;
+      std::vector<unsigned int> m_pivots;
+  };
+
+}
+
+#endif
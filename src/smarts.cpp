@@ -303,6 +303,8 @@ namespace SC {
         smarts->atoms[smarts->bonds[i].source].bonds.push_back(&smarts->bonds[i]);
         smarts->atoms[smarts->bonds[i].target].bonds.push_back(&smarts->bonds[i]);
       }
+
+      smarts->plan = CreateSearchPlan(smarts);
     }
 
     std::vector<SmartsAtomExpr*> atomExpr;
@@ -310,6 +312,73 @@ namespace SC {
     Smarts *smarts;
   };
 
+  std::vector<SmartsSearchStep> CreateSearchPlan(const Smarts *smarts, const std::vector<int> &order,
+      const std::vector<int> &parents)
+  {
+    std::vector<SmartsSearchStep> plan;
+    std::vector<bool> mapped(smarts->atoms.size(), false);
+    std::vector<bool> checked(smarts->bonds.size(), false);
+
+    for (std::size_t i = 0; i < order.size(); ++i) {
+      int atomIndex = order[i];
+      if (parents[i] < 0) {
+        plan.push_back(SmartsSearchStep(-1, -1, atomIndex, false));
+      } else {
+        const SmartsBond &bond = smarts->bonds[parents[i]];
+        plan.push_back(SmartsSearchStep(bond.index, bond.other(atomIndex), atomIndex, false));
+        checked[bond.index] = true;
+      }
+      mapped[atomIndex] = true;
+
+      // ring closures to atoms that are already mapped
+      const SmartsAtom &atom = smarts->atoms[atomIndex];
+      for (std::size_t j = 0; j < atom.bonds.size(); ++j) {
+        const SmartsBond *bond = atom.bonds[j];
+        if (checked[bond->index] || !mapped[bond->other(atomIndex)])
+          continue;
+        plan.push_back(SmartsSearchStep(bond->index, atomIndex, bond->other(atomIndex), true));
+        checked[bond->index] = true;
+      }
+    }
+
+    return plan;
+  }
+
+  std::vector<SmartsSearchStep> CreateSearchPlan(const Smarts *smarts)
+  {
+    std::vector<int> order, parents;
+    std::vector<bool> visited(smarts->atoms.size(), false);
+
+    for (std::size_t i = 0; i < smarts->atoms.size(); ++i) {
+      if (visited[i])
+        continue;
+
+      // iterative depth-first search: (atom, parent bond) pairs
+      std::vector<std::pair<int, int> > stack;
+      stack.push_back(std::make_pair(static_cast<int>(i), -1));
+      while (!stack.empty()) {
+        int atomIndex = stack.back().first;
+        int parent = stack.back().second;
+        stack.pop_back();
+        if (visited[atomIndex])
+          continue;
+        visited[atomIndex] = true;
+        order.push_back(atomIndex);
+        parents.push_back(parent);
+
+        // push in reverse to visit the neighbors in their original order
+        const SmartsAtom &atom = smarts->atoms[atomIndex];
+        for (std::size_t j = atom.bonds.size(); j > 0; --j) {
+          int nbrIndex = atom.bonds[j - 1]->other(atomIndex);
+          if (!visited[nbrIndex])
+            stack.push_back(std::make_pair(nbrIndex, atom.bonds[j - 1]->index));
+        }
+      }
+    }
+
+    return CreateSearchPlan(smarts, order, parents);
+  }
+
   Smarts* parse(const std::string &smarts)
   {
     SmartsCallback callback(new Smarts);
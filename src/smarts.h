@@ -110,6 +110,26 @@ namespace SC {
     bool chiral;
   };
 
+  /**
+   * A step in the order in which the pattern is matched. The first atom of
+   * each connected component has no source and bond (-1). For other steps
+   * the source atom is already mapped and the target atom is mapped by
+   * following the bond. For a ring closure both atoms are already mapped and
+   * only the bond between them is checked.
+   */
+  struct SmartsSearchStep
+  {
+    SmartsSearchStep(int bnd, int src, int trg, bool cls)
+        : bond(bnd), source(src), target(trg), closure(cls)
+    {
+    }
+
+    int bond;
+    int source;
+    int target;
+    bool closure;
+  };
+
   struct Smarts
   {
     typedef const SmartsAtom& atom_type;
@@ -131,6 +151,7 @@ namespace SC {
     {
       atoms.clear();
       bonds.clear();
+      plan.clear();
       chiral = false;
     }
 
@@ -154,6 +175,11 @@ namespace SC {
       return bonds[index];
     }
 
+    const std::vector<SmartsSearchStep>& searchPlan() const
+    {
+      return plan;
+    }
+
     template<typename AtomType>
     bool matchAtom(const SmartsAtom &smartsAtom, const AtomType &atom) const
     {
@@ -256,6 +282,7 @@ namespace SC {
 
     std::vector<SmartsAtom> atoms;
     std::vector<SmartsBond> bonds;
+    std::vector<SmartsSearchStep> plan;
     bool chiral;
   };
 
@@ -266,6 +293,21 @@ namespace SC {
     typedef typename SmartsType::bond_type bond_type;
   };
 
+  /**
+   * Create a search plan mapping the atoms in the given order. The atom
+   * order[i] is reached by following the bond parents[i] from an atom
+   * earlier in the order, -1 starts a new connected component. Ring
+   * closures are checked as soon as both atoms are mapped.
+   */
+  std::vector<SmartsSearchStep> CreateSearchPlan(const Smarts *smarts, const std::vector<int> &order,
+      const std::vector<int> &parents);
+
+  /**
+   * Create the default search plan: a depth-first search starting from the
+   * first atom of each connected component.
+   */
+  std::vector<SmartsSearchStep> CreateSearchPlan(const Smarts *smarts);
+
   /**
    * Parse a SMARTS string and create an expression trees.
    *
@@ -0,0 +1,504 @@
+#include "smartsanalysis.h"
+#include "smarts.h"
+#include "molecule.h"
+#include "moleculefile.h"
+#include "util.h"
+
+#include <algorithm>
+
+namespace SC {
+
+  /**
+   * The properties every atom matching an atom expression has, -1 when
+   * unknown. For aromatic and cyclic 1 is true and 0 is false.
+   */
+  struct AtomConstraints
+  {
+    AtomConstraints() : satisfiable(true), element(-1), aromatic(-1), cyclic(-1),
+        maxDegree(-1), maxRingBonds(-1), ringSizes(0)
+    {
+    }
+
+    bool satisfiable;
+    int element;
+    int aromatic;
+    int cyclic;
+    int maxDegree;
+    int maxRingBonds;
+    unsigned int ringSizes; // ring sizes 3-31 the atom must be in (bit n for size n)
+  };
+
+  /**
+   * The properties every bond matching a bond expression has, -1 when
+   * unknown.
+   */
+  struct BondConstraints
+  {
+    BondConstraints() : satisfiable(true), order(-1), aromatic(-1), cyclic(-1)
+    {
+    }
+
+    bool satisfiable;
+    int order;
+    int aromatic;
+    int cyclic;
+  };
+
+  /**
+   * and(x, y): both values hold, conflicting known values can't be true.
+   */
+  int AndValue(int value1, int value2, bool &satisfiable)
+  {
+    if (value1 == -1)
+      return value2;
+    if (value2 != -1 && value1 != value2)
+      satisfiable = false;
+    return value1;
+  }
+
+  /**
+   * or(x, y): only a value both sides share is known.
+   */
+  int OrValue(int value1, int value2)
+  {
+    return value1 == value2 ? value1 : -1;
+  }
+
+  int AndBound(int bound1, int bound2)
+  {
+    if (bound1 == -1)
+      return bound2;
+    if (bound2 == -1)
+      return bound1;
+    return std::min(bound1, bound2);
+  }
+
+  int OrBound(int bound1, int bound2)
+  {
+    if (bound1 == -1 || bound2 == -1)
+      return -1;
+    return std::max(bound1, bound2);
+  }
+
+  /**
+   * Derive the implied properties. Aromatic atoms are in a ring, ring atoms
+   * have at least two (ring) bonds and atoms without ring bonds are acyclic.
+   */
+  void Normalize(AtomConstraints &c)
+  {
+    if (c.aromatic == 1)
+      c.cyclic = AndValue(c.cyclic, 1, c.satisfiable);
+    if (c.maxRingBonds == 0)
+      c.cyclic = AndValue(c.cyclic, 0, c.satisfiable);
+    if (c.cyclic == 1 && ((c.maxRingBonds != -1 && c.maxRingBonds < 2) ||
+                          (c.maxDegree != -1 && c.maxDegree < 2)))
+      c.satisfiable = false;
+  }
+
+  void Normalize(BondConstraints &c)
+  {
+    if (c.aromatic == 1)
+      c.cyclic = AndValue(c.cyclic, 1, c.satisfiable);
+  }
+
+  AtomConstraints GetAtomConstraints(const SmartsAtomExpr *expr)
+  {
+    AtomConstraints c;
+    switch (expr->type) {
+      case Smiley::OP_Not:
+        switch (expr->unary.arg->type) {
+          case Smiley::AE_True:
+            c.satisfiable = false;
+            break;
+          case Smiley::AE_Aromatic:
+            c.aromatic = 0;
+            break;
+          case Smiley::AE_Aliphatic:
+            c.aromatic = 1;
+            break;
+          case Smiley::AE_Cyclic:
+            c.cyclic = 0;
+            break;
+          case Smiley::AE_Acyclic:
+            c.cyclic = 1;
+            break;
+          case Smiley::AE_RingMembership:
+          case Smiley::AE_RingConnectivity:
+            if (expr->unary.arg->leaf.value == 0)
+              c.cyclic = 1;
+            break;
+        }
+        break;
+      case Smiley::OP_AndHi:
+      case Smiley::OP_AndLo:
+        {
+          AtomConstraints lft = GetAtomConstraints(expr->binary.lft);
+          AtomConstraints rgt = GetAtomConstraints(expr->binary.rgt);
+          c.satisfiable = lft.satisfiable && rgt.satisfiable;
+          c.element = AndValue(lft.element, rgt.element, c.satisfiable);
+          c.aromatic = AndValue(lft.aromatic, rgt.aromatic, c.satisfiable);
+          c.cyclic = AndValue(lft.cyclic, rgt.cyclic, c.satisfiable);
+          c.maxDegree = AndBound(lft.maxDegree, rgt.maxDegree);
+          c.maxRingBonds = AndBound(lft.maxRingBonds, rgt.maxRingBonds);
+          c.ringSizes = lft.ringSizes | rgt.ringSizes;
+        }
+        break;
+      case Smiley::OP_Or:
+        {
+          AtomConstraints lft = GetAtomConstraints(expr->binary.lft);
+          AtomConstraints rgt = GetAtomConstraints(expr->binary.rgt);
+          if (!lft.satisfiable)
+            return rgt;
+          if (!rgt.satisfiable)
+            return lft;
+          c.element = OrValue(lft.element, rgt.element);
+          c.aromatic = OrValue(lft.aromatic, rgt.aromatic);
+          c.cyclic = OrValue(lft.cyclic, rgt.cyclic);
+          c.maxDegree = OrBound(lft.maxDegree, rgt.maxDegree);
+          c.maxRingBonds = OrBound(lft.maxRingBonds, rgt.maxRingBonds);
+          c.ringSizes = lft.ringSizes & rgt.ringSizes;
+        }
+        break;
+      case Smiley::AE_False:
+        c.satisfiable = false;
+        break;
+      case Smiley::AE_Aromatic:
+        c.aromatic = 1;
+        break;
+      case Smiley::AE_Aliphatic:
+        c.aromatic = 0;
+        break;
+      case Smiley::AE_Cyclic:
+        c.cyclic = 1;
+        break;
+      case Smiley::AE_Acyclic:
+        c.cyclic = 0;
+        c.maxRingBonds = 0;
+        break;
+      case Smiley::AE_AtomicNumber:
+        c.element = expr->leaf.value;
+        break;
+      case Smiley::AE_AromaticElement:
+        c.element = expr->leaf.value;
+        c.aromatic = 1;
+        break;
+      case Smiley::AE_AliphaticElement:
+        c.element = expr->leaf.value;
+        c.aromatic = 0;
+        break;
+      case Smiley::AE_Degree:
+      case Smiley::AE_Connectivity:
+        // explicit connections (X also counts the implicit hydrogens)
+        c.maxDegree = expr->leaf.value;
+        break;
+      case Smiley::AE_RingMembership:
+        if (expr->leaf.value == 0) {
+          c.cyclic = 0;
+          c.maxRingBonds = 0;
+        } else
+          c.cyclic = 1;
+        break;
+      case Smiley::AE_RingSize:
+        c.cyclic = 1;
+        if (expr->leaf.value >= 3 && expr->leaf.value <= 31)
+          c.ringSizes = 1u << expr->leaf.value;
+        break;
+      case Smiley::AE_RingConnectivity:
+        c.maxRingBonds = expr->leaf.value;
+        break;
+      default:
+        break;
+    }
+
+    Normalize(c);
+    return c;
+  }
+
+  BondConstraints GetBondConstraints(const SmartsBondExpr *expr)
+  {
+    BondConstraints c;
+    switch (expr->type) {
+      case Smiley::OP_Not:
+        switch (expr->unary.arg->type) {
+          case Smiley::BE_True:
+            c.satisfiable = false;
+            break;
+          case Smiley::BE_Aromatic:
+            c.aromatic = 0;
+            break;
+          case Smiley::BE_Ring:
+            c.cyclic = 0;
+            break;
+        }
+        break;
+      case Smiley::OP_AndHi:
+      case Smiley::OP_AndLo:
+        {
+          BondConstraints lft = GetBondConstraints(expr->binary.lft);
+          BondConstraints rgt = GetBondConstraints(expr->binary.rgt);
+          c.satisfiable = lft.satisfiable && rgt.satisfiable;
+          c.order = AndValue(lft.order, rgt.order, c.satisfiable);
+          c.aromatic = AndValue(lft.aromatic, rgt.aromatic, c.satisfiable);
+          c.cyclic = AndValue(lft.cyclic, rgt.cyclic, c.satisfiable);
+        }
+        break;
+      case Smiley::OP_Or:
+        {
+          BondConstraints lft = GetBondConstraints(expr->binary.lft);
+          BondConstraints rgt = GetBondConstraints(expr->binary.rgt);
+          if (!lft.satisfiable)
+            return rgt;
+          if (!rgt.satisfiable)
+            return lft;
+          c.order = OrValue(lft.order, rgt.order);
+          c.aromatic = OrValue(lft.aromatic, rgt.aromatic);
+          c.cyclic = OrValue(lft.cyclic, rgt.cyclic);
+        }
+        break;
+      case Smiley::BE_False:
+        c.satisfiable = false;
+        break;
+      case Smiley::BE_Single:
+        c.order = 1;
+        c.aromatic = 0;
+        break;
+      case Smiley::BE_Double:
+        c.order = 2;
+        c.aromatic = 0;
+        break;
+      case Smiley::BE_Triple:
+        c.order = 3;
+        break;
+      case Smiley::BE_Quadriple:
+        c.order = 4;
+        break;
+      case Smiley::BE_Aromatic:
+        c.aromatic = 1;
+        break;
+      case Smiley::BE_Ring:
+        c.cyclic = 1;
+        break;
+      default:
+        break;
+    }
+
+    Normalize(c);
+    return c;
+  }
+
+  /**
+   * Check if a pattern bond is part of a ring in the pattern. Since the
+   * mapping is injective, the matching molecule bond is a ring bond.
+   */
+  bool IsPatternRingBond(const Smarts *pattern, int bondIndex)
+  {
+    const SmartsBond &bond = pattern->bond(bondIndex);
+    std::vector<bool> visited(pattern->numAtoms(), false);
+    std::vector<int> stack(1, bond.source);
+    visited[bond.source] = true;
+    while (!stack.empty()) {
+      int index = stack.back();
+      stack.pop_back();
+      const SmartsAtom &atom = pattern->atom(index);
+      for (std::size_t i = 0; i < atom.bonds.size(); ++i) {
+        if (atom.bonds[i] == &bond)
+          continue;
+        int other = atom.bonds[i]->other(index);
+        if (other == bond.target)
+          return true;
+        if (!visited[other]) {
+          visited[other] = true;
+          stack.push_back(other);
+        }
+      }
+    }
+    return false;
+  }
+
+  /**
+   * The atom and bond constraints of a pattern after propagating the bond
+   * constraints to the atoms they connect.
+   */
+  struct PatternConstraints
+  {
+    PatternConstraints(const Smarts *pattern) : satisfiable(true)
+    {
+      for (int i = 0; i < pattern->numAtoms(); ++i) {
+        atoms.push_back(GetAtomConstraints(pattern->atom(i).expr));
+        if (!atoms.back().satisfiable)
+          setError(make_string("atom ", i + 1, " can't match any atom"));
+      }
+
+      std::vector<int> ringBonds(pattern->numAtoms(), 0);
+      for (int i = 0; i < pattern->numBonds(); ++i) {
+        const SmartsBond &bond = pattern->bond(i);
+        bonds.push_back(GetBondConstraints(bond.expr));
+        BondConstraints &c = bonds.back();
+        if (!c.satisfiable)
+          setError(make_string("bond ", i + 1, " can't match any bond"));
+        if (IsPatternRingBond(pattern, i)) {
+          if (c.cyclic == 0)
+            setError(make_string("bond ", i + 1, " is part of a ring but must be acyclic"));
+          c.cyclic = 1;
+        }
+
+        int ends[2] = { bond.source, bond.target };
+        for (int j = 0; j < 2; ++j) {
+          AtomConstraints &atom = atoms[ends[j]];
+          if (c.aromatic == 1 && atom.aromatic == 0)
+            setError(make_string("aromatic bond ", i + 1, " to aliphatic atom ", ends[j] + 1));
+          if (c.cyclic == 1 && atom.cyclic == 0)
+            setError(make_string("ring bond ", i + 1, " to acyclic atom ", ends[j] + 1));
+          if (c.aromatic == 1)
+            atom.aromatic = 1;
+          if (c.cyclic == 1) {
+            atom.cyclic = 1;
+            ++ringBonds[ends[j]];
+          }
+        }
+      }
+
+      for (int i = 0; i < pattern->numAtoms(); ++i) {
+        const AtomConstraints &atom = atoms[i];
+        if (atom.maxDegree != -1 && pattern->atom(i).degree() > atom.maxDegree)
+          setError(make_string("atom ", i + 1, " has ", pattern->atom(i).degree(),
+                " neighbors but at most ", atom.maxDegree, " connections"));
+        if (atom.maxRingBonds != -1 && ringBonds[i] > atom.maxRingBonds)
+          setError(make_string("atom ", i + 1, " has ", ringBonds[i],
+                " ring bonds but at most ", atom.maxRingBonds));
+      }
+    }
+
+    void setError(const std::string &error)
+    {
+      // keep the first contradiction
+      if (satisfiable)
+        reason = error;
+      satisfiable = false;
+    }
+
+    std::vector<AtomConstraints> atoms;
+    std::vector<BondConstraints> bonds;
+    bool satisfiable;
+    std::string reason;
+  };
+
+  bool SmartsCounts::contains(const SmartsCounts &required) const
+  {
+    if (numAtoms < required.numAtoms || numBonds < required.numBonds ||
+        numAromaticAtoms < required.numAromaticAtoms || numRingAtoms < required.numRingAtoms ||
+        numSingleBonds < required.numSingleBonds || numDoubleBonds < required.numDoubleBonds ||
+        numTripleBonds < required.numTripleBonds || numAromaticBonds < required.numAromaticBonds ||
+        numRingBonds < required.numRingBonds || (ringSizes & required.ringSizes) != required.ringSizes)
+      return false;
+
+    std::map<int, int>::const_iterator element = required.elements.begin();
+    for (; element != required.elements.end(); ++element) {
+      std::map<int, int>::const_iterator count = elements.find(element->first);
+      if (count == elements.end() || count->second < element->second)
+        return false;
+    }
+
+    return true;
+  }
+
+  bool IsSatisfiable(const Smarts *pattern, std::string *reason)
+  {
+    PatternConstraints constraints(pattern);
+    if (!constraints.satisfiable && reason)
+      *reason = constraints.reason;
+    return constraints.satisfiable;
+  }
+
+  SmartsCounts GetRequiredCounts(const Smarts *pattern)
+  {
+    PatternConstraints constraints(pattern);
+
+    SmartsCounts counts;
+    counts.numAtoms = pattern->numAtoms();
+    counts.numBonds = pattern->numBonds();
+    for (std::size_t i = 0; i < constraints.atoms.size(); ++i) {
+      const AtomConstraints &atom = constraints.atoms[i];
+      if (atom.element != -1)
+        ++counts.elements[atom.element];
+      if (atom.aromatic == 1)
+        ++counts.numAromaticAtoms;
+      if (atom.cyclic == 1)
+        ++counts.numRingAtoms;
+      counts.ringSizes |= atom.ringSizes;
+    }
+    for (std::size_t i = 0; i < constraints.bonds.size(); ++i) {
+      const BondConstraints &bond = constraints.bonds[i];
+      if (bond.aromatic == 1)
+        ++counts.numAromaticBonds;
+      else if (bond.order == 1 && bond.aromatic == 0)
+        ++counts.numSingleBonds;
+      else if (bond.order == 2 && bond.aromatic == 0)
+        ++counts.numDoubleBonds;
+      else if (bond.order == 3)
+        ++counts.numTripleBonds;
+      if (bond.cyclic == 1)
+        ++counts.numRingBonds;
+    }
+
+    return counts;
+  }
+
+  template<typename MoleculeType>
+  SmartsCounts GetMoleculeCounts(MoleculeType *mol, const SmartsCounts *required)
+  {
+    typedef typename molecule_traits<MoleculeType>::atom_arg_type AtomArgType;
+    typedef typename molecule_traits<MoleculeType>::mol_atom_iterator_type MolAtomIter;
+    typedef typename molecule_traits<MoleculeType>::atom_bond_iterator_type AtomBondIter;
+    typedef typename molecule_traits<MoleculeType>::atom_wrapper_type AtomWrapperType;
+    typedef typename molecule_traits<MoleculeType>::bond_wrapper_type BondWrapperType;
+
+    SmartsCounts counts;
+    MolAtomIter atom = GetBeginAtoms<MoleculeType*, MolAtomIter>(mol);
+    MolAtomIter atoms_end = GetEndAtoms<MoleculeType*, MolAtomIter>(mol);
+    for (; atom != atoms_end; ++atom) {
+      AtomWrapperType wrapper(*atom);
+      ++counts.numAtoms;
+      if (!required || required->elements.find(wrapper.element()) != required->elements.end())
+        ++counts.elements[wrapper.element()];
+      if (wrapper.isAromatic())
+        ++counts.numAromaticAtoms;
+      if (wrapper.isCyclic()) {
+        ++counts.numRingAtoms;
+        // only the ring sizes that are needed
+        unsigned int ringSizes = required ? required->ringSizes & ~counts.ringSizes : ~counts.ringSizes;
+        for (int size = 3; size <= 31; ++size)
+          if ((ringSizes & (1u << size)) && wrapper.isInRingSize(size))
+            counts.ringSizes |= 1u << size;
+      }
+
+      // count each bond once, from the atom with the lowest index
+      std::size_t index = GetAtomIndex(mol, *atom);
+      AtomBondIter bond = GetBeginBonds<MoleculeType*, AtomArgType, AtomBondIter>(mol, *atom);
+      AtomBondIter bonds_end = GetEndBonds<MoleculeType*, AtomArgType, AtomBondIter>(mol, *atom);
+      for (; bond != bonds_end; ++bond) {
+        if (GetAtomIndex(mol, GetOtherAtom(mol, *bond, *atom)) < index)
+          continue;
+        BondWrapperType bondWrapper(*bond);
+        ++counts.numBonds;
+        if (bondWrapper.isAromatic())
+          ++counts.numAromaticBonds;
+        else if (bondWrapper.order() == 1)
+          ++counts.numSingleBonds;
+        else if (bondWrapper.order() == 2)
+          ++counts.numDoubleBonds;
+        if (bondWrapper.order() == 3)
+          ++counts.numTripleBonds;
+        if (bondWrapper.isCyclic())
+          ++counts.numRingBonds;
+      }
+    }
+
+    return counts;
+  }
+
+  template SmartsCounts GetMoleculeCounts<Molecule>(Molecule *mol, const SmartsCounts *required);
+  template SmartsCounts GetMoleculeCounts<OpenBabel::OBMol>(OpenBabel::OBMol *mol, const SmartsCounts *required);
+  template SmartsCounts GetMoleculeCounts<MoleculeView>(MoleculeView *mol, const SmartsCounts *required);
+
+}
@@ -0,0 +1,78 @@
+#ifndef SC_SMARTSANALYSIS_H
+#define SC_SMARTSANALYSIS_H
+
+#include <map>
+#include <string>
+
+namespace SC {
+
+  struct Smarts;
+
+  /**
+   * Molecule level counts. For a molecule these are the actual counts, for
+   * a pattern they are the minimum counts any molecule containing a match
+   * must have (see GetRequiredCounts()).
+   */
+  struct SmartsCounts
+  {
+    SmartsCounts() : numAtoms(0), numBonds(0), numAromaticAtoms(0), numRingAtoms(0),
+        numSingleBonds(0), numDoubleBonds(0), numTripleBonds(0), numAromaticBonds(0),
+        numRingBonds(0), ringSizes(0)
+    {
+    }
+
+    /**
+     * Check if these (molecule) counts meet all the @p required counts.
+     */
+    bool contains(const SmartsCounts &required) const;
+
+    int numAtoms;
+    int numBonds;
+    int numAromaticAtoms;
+    int numRingAtoms;
+    int numSingleBonds;
+    int numDoubleBonds;
+    int numTripleBonds;
+    int numAromaticBonds;
+    int numRingBonds;
+    unsigned int ringSizes; // SSSR ring sizes 3-31 (bit n for size n)
+    std::map<int, int> elements; // element -> count
+  };
+
+  /**
+   * Check if a pattern can match any molecule.
+   *
+   * The atom and bond expressions are reduced to the properties every
+   * matching atom or bond must have (element, aromaticity, ring membership,
+   * maximum degree and ring bond count). A pattern is unsatisfiable when
+   * these contradict each other across atoms, e.g. an aromatic bond to an
+   * atom that must be aliphatic ([C]:c), a ring bond or a pattern ring on an
+   * atom forced R0 (C1CC[C;R0]1) or fewer connections than pattern
+   * neighbors (C[CD1]C). The analysis is conservative, true does not mean
+   * a match exists.
+   *
+   * @param reason Set to a description of the contradiction when the
+   *        pattern is unsatisfiable.
+   */
+  bool IsSatisfiable(const Smarts *pattern, std::string *reason = 0);
+
+  /**
+   * Get the necessary conditions for a molecule to contain a match of the
+   * pattern: the minimum number of atoms of each element, aromatic and ring
+   * atoms, the minimum number of bonds of each type and the ring sizes
+   * (r<n>) that must be present. Molecules for which
+   * GetMoleculeCounts(mol).contains(required) is false can be rejected
+   * without searching.
+   */
+  SmartsCounts GetRequiredCounts(const Smarts *pattern);
+
+  /**
+   * Count the atoms and bonds of a molecule (only the elements in
+   * @p required are counted when given).
+   */
+  template<typename MoleculeType>
+  SmartsCounts GetMoleculeCounts(MoleculeType *mol, const SmartsCounts *required = 0);
+
+}
+
+#endif
@@ -0,0 +1,401 @@
+#include "smartscache.h"
+#include "smartsscores.h"
+#include "pattern.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace SC {
+
+  /**
+   * The labeled pattern graph used for canonical numbering.
+   */
+  struct CanonicalGraph
+  {
+    std::vector<std::string> atomKeys;
+    std::vector<std::string> bondKeys;
+    // (bond label, neighbor) for each atom, the labels are the ranks of the
+    // bond keys so they don't depend on the atom order
+    std::vector<std::vector<std::pair<int, int> > > nbrs;
+  };
+
+  /**
+   * Canonical numbering stops trying alternatives for tied atoms after this
+   * many complete numberings. Highly symmetric patterns may then get a key
+   * that depends on the atom order, this only causes a cache miss.
+   */
+  static const int maxCanonicalNumberings = 256;
+
+  bool HasNonCanonicalExpr(const SmartsAtomExpr *expr)
+  {
+    switch (expr->type) {
+      case Smiley::OP_Not:
+        return HasNonCanonicalExpr(expr->unary.arg);
+      case Smiley::OP_AndHi:
+      case Smiley::OP_AndLo:
+      case Smiley::OP_Or:
+        return HasNonCanonicalExpr(expr->binary.lft) || HasNonCanonicalExpr(expr->binary.rgt);
+      case Smiley::AE_Chirality:
+      case Smiley::AE_AtomClass:
+      case Smiley::AE_Recursive:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /**
+   * Replace each invariant by its rank among the distinct invariants.
+   *
+   * @return The number of distinct invariants.
+   */
+  int AssignRanks(const std::vector<std::vector<int> > &invariants, std::vector<int> &ranks)
+  {
+    std::vector<std::vector<int> > sorted(invariants);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    for (std::size_t i = 0; i < invariants.size(); ++i)
+      ranks[i] = std::lower_bound(sorted.begin(), sorted.end(), invariants[i]) - sorted.begin();
+    return sorted.size();
+  }
+
+  template<typename T>
+  std::vector<int> GetLabels(const std::vector<T> &keys)
+  {
+    std::vector<T> sorted(keys);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    std::vector<int> labels(keys.size());
+    for (std::size_t i = 0; i < keys.size(); ++i)
+      labels[i] = std::lower_bound(sorted.begin(), sorted.end(), keys[i]) - sorted.begin();
+    return labels;
+  }
+
+  /**
+   * Refine the ranks using the ranks of the neighbors (and the bonds to
+   * them) until the number of classes no longer increases. Atoms keep the
+   * relative order of their previous ranks.
+   */
+  int RefineRanks(const CanonicalGraph &graph, std::vector<int> &ranks)
+  {
+    std::size_t numAtoms = ranks.size();
+    int classes = -1;
+    while (true) {
+      std::vector<std::vector<int> > invariants(numAtoms);
+      for (std::size_t i = 0; i < numAtoms; ++i) {
+        std::vector<std::pair<int, int> > nbrs;
+        for (std::size_t j = 0; j < graph.nbrs[i].size(); ++j)
+          nbrs.push_back(std::make_pair(graph.nbrs[i][j].first, ranks[graph.nbrs[i][j].second]));
+        std::sort(nbrs.begin(), nbrs.end());
+        invariants[i].push_back(ranks[i]);
+        for (std::size_t j = 0; j < nbrs.size(); ++j) {
+          invariants[i].push_back(nbrs[j].first);
+          invariants[i].push_back(nbrs[j].second);
+        }
+      }
+      int refined = AssignRanks(invariants, ranks);
+      if (refined == classes)
+        return classes;
+      classes = refined;
+    }
+  }
+
+  /**
+   * The key for the pattern with the atoms numbered by rank.
+   */
+  std::string GetNumberedKey(const Smarts *pattern, const CanonicalGraph &graph, const std::vector<int> &ranks)
+  {
+    std::vector<std::string> atoms(ranks.size());
+    for (std::size_t i = 0; i < ranks.size(); ++i)
+      atoms[ranks[i]] = graph.atomKeys[i];
+
+    std::vector<std::string> bonds;
+    for (int i = 0; i < pattern->numBonds(); ++i) {
+      const SmartsBond &bond = pattern->bond(i);
+      int source = ranks[bond.source], target = ranks[bond.target];
+      if (source > target)
+        std::swap(source, target);
+      std::stringstream ss;
+      ss << source << "-" << target << ":" << graph.bondKeys[i];
+      bonds.push_back(ss.str());
+    }
+    std::sort(bonds.begin(), bonds.end());
+
+    std::stringstream key;
+    for (std::size_t i = 0; i < atoms.size(); ++i)
+      key << atoms[i] << ";";
+    key << "|";
+    for (std::size_t i = 0; i < bonds.size(); ++i)
+      key << bonds[i] << ";";
+    return key.str();
+  }
+
+  /**
+   * Predicate for the ranks shared by more than one atom.
+   */
+  struct IsTied
+  {
+    bool operator()(int count) const
+    {
+      return count > 1;
+    }
+  };
+
+  /**
+   * Find the smallest key over the numberings obtained by breaking the
+   * remaining ties, one atom of the first tied class at a time.
+   */
+  void CanonicalSearch(const Smarts *pattern, const CanonicalGraph &graph, std::vector<int> ranks,
+      std::string &best, std::vector<int> &bestRanks, int &numberings)
+  {
+    std::size_t numAtoms = ranks.size();
+    if (RefineRanks(graph, ranks) == static_cast<int>(numAtoms)) {
+      std::string key = GetNumberedKey(pattern, graph, ranks);
+      if (best.empty() || key < best) {
+        best = key;
+        bestRanks = ranks;
+      }
+      ++numberings;
+      return;
+    }
+
+    // the lowest rank shared by more than one atom
+    std::vector<int> counts(numAtoms, 0);
+    for (std::size_t i = 0; i < numAtoms; ++i)
+      ++counts[ranks[i]];
+    int tied = std::find_if(counts.begin(), counts.end(), IsTied()) - counts.begin();
+
+    for (std::size_t i = 0; i < numAtoms; ++i) {
+      if (ranks[i] != tied)
+        continue;
+      if (numberings >= maxCanonicalNumberings)
+        return;
+      // give atom i a rank of its own, before the other tied atoms
+      std::vector<int> individualized(ranks);
+      for (std::size_t j = 0; j < numAtoms; ++j)
+        if (j != i && ranks[j] >= tied)
+          ++individualized[j];
+      CanonicalSearch(pattern, graph, individualized, best, bestRanks, numberings);
+    }
+  }
+
+  std::string GetCanonicalSmartsKey(const Smarts *pattern, std::vector<int> *order)
+  {
+    if (pattern->chiral)
+      return std::string();
+
+    CanonicalGraph graph;
+    for (int i = 0; i < pattern->numAtoms(); ++i) {
+      const SmartsAtom &atom = pattern->atom(i);
+      if (atom.chiral || atom.atomClass || HasNonCanonicalExpr(atom.expr))
+        return std::string();
+      graph.atomKeys.push_back(GetCanonicalExprKey(atom.expr));
+    }
+    for (int i = 0; i < pattern->numBonds(); ++i)
+      graph.bondKeys.push_back(GetCanonicalExprKey(pattern->bond(i).expr));
+
+    std::vector<int> bondLabels = GetLabels(graph.bondKeys);
+    graph.nbrs.resize(pattern->numAtoms());
+    for (int i = 0; i < pattern->numBonds(); ++i) {
+      const SmartsBond &bond = pattern->bond(i);
+      graph.nbrs[bond.source].push_back(std::make_pair(bondLabels[i], bond.target));
+      graph.nbrs[bond.target].push_back(std::make_pair(bondLabels[i], bond.source));
+    }
+
+    std::string best;
+    std::vector<int> ranks;
+    int numberings = 0;
+    CanonicalSearch(pattern, graph, GetLabels(graph.atomKeys), best, ranks, numberings);
+    if (order)
+      order->swap(ranks);
+    return best;
+  }
+
+  /**
+   * The cache key: the canonical key followed by the canonical rank of each
+   * atom in the order in which the atoms were written. Equivalent spellings
+   * only share a pattern (and its mappings) if they list the atoms in the
+   * same order.
+   */
+  std::string GetCacheKey(const Smarts *pattern)
+  {
+    std::vector<int> order;
+    std::string key = GetCanonicalSmartsKey(pattern, &order);
+    if (key.empty())
+      return key;
+    std::stringstream ss;
+    ss << key << "|";
+    for (std::size_t i = 0; i < order.size(); ++i)
+      ss << order[i] << ";";
+    return ss.str();
+  }
+
+  /**
+   * Locks a mutex for the lifetime of the object.
+   */
+  class MutexLocker
+  {
+    public:
+      MutexLocker(pthread_mutex_t *mutex) : m_mutex(mutex)
+      {
+        pthread_mutex_lock(m_mutex);
+      }
+
+      ~MutexLocker()
+      {
+        pthread_mutex_unlock(m_mutex);
+      }
+
+    private:
+      pthread_mutex_t *m_mutex;
+  };
+
+  /**
+   * Keep at most this many spellings of a pattern, later spellings are
+   * found by their canonical key after parsing.
+   */
+  static const std::size_t maxSpellings = 16;
+
+  CompiledSmartsCache::CompiledSmartsCache(std::size_t capacity, SmartsScores *scores, int opts)
+      : m_capacity(capacity), m_scores(scores), m_opts(opts), m_hits(0), m_misses(0)
+  {
+    pthread_mutex_init(&m_mutex, 0);
+    pthread_mutex_init(&m_compileMutex, 0);
+  }
+
+  CompiledSmartsCache::~CompiledSmartsCache()
+  {
+    pthread_mutex_destroy(&m_mutex);
+    pthread_mutex_destroy(&m_compileMutex);
+  }
+
+  CompiledSmartsCache& CompiledSmartsCache::instance()
+  {
+    static CompiledSmartsCache cache;
+    return cache;
+  }
+
+  CompiledSmarts CompiledSmartsCache::get(const std::string &smarts)
+  {
+    {
+      MutexLocker lock(&m_mutex);
+      std::map<std::string, EntryIter>::iterator spelling = m_spellings.find(smarts);
+      if (spelling != m_spellings.end()) {
+        ++m_hits;
+        touch(spelling->second);
+        return spelling->second->pattern;
+      }
+    }
+
+    // parse and optimize without holding the lock (the scores memoize while
+    // optimizing, shared scores need the compile lock)
+    Smarts *pattern = parse(smarts);
+    if (!pattern)
+      return CompiledSmarts();
+    if (m_scores) {
+      MutexLocker lock(&m_compileMutex);
+      SmartsOptimizer(m_scores).Optimize(pattern, m_opts);
+    } else {
+      PrettySmartsScores scores;
+      SmartsOptimizer(&scores).Optimize(pattern, m_opts);
+    }
+    std::string key = GetCacheKey(pattern);
+
+    {
+      MutexLocker lock(&m_mutex);
+      std::map<std::string, EntryIter>::iterator entry = m_keys.find(key);
+      if (!key.empty() && entry != m_keys.end()) {
+        ++m_hits;
+        delete pattern;
+        touch(entry->second);
+        addSpelling(entry->second, smarts);
+        return entry->second->pattern;
+      }
+    }
+
+    // plan the new pattern outside the lock
+    CompiledSmarts compiled(smarts, pattern);
+
+    MutexLocker lock(&m_mutex);
+    // another thread may have added the pattern in the mean time
+    std::map<std::string, EntryIter> &index = key.empty() ? m_spellings : m_keys;
+    std::map<std::string, EntryIter>::iterator entry = index.find(key.empty() ? smarts : key);
+    if (entry == index.end()) {
+      ++m_misses;
+      m_entries.push_front(Entry());
+      m_entries.front().key = key;
+      m_entries.front().pattern = compiled;
+      if (!key.empty())
+        m_keys[key] = m_entries.begin();
+      addSpelling(m_entries.begin(), smarts);
+      evict();
+      return compiled;
+    }
+
+    ++m_hits;
+    touch(entry->second);
+    addSpelling(entry->second, smarts);
+    return entry->second->pattern;
+  }
+
+  void CompiledSmartsCache::clear()
+  {
+    MutexLocker lock(&m_mutex);
+    m_entries.clear();
+    m_keys.clear();
+    m_spellings.clear();
+    m_hits = m_misses = 0;
+  }
+
+  void CompiledSmartsCache::setCapacity(std::size_t capacity)
+  {
+    MutexLocker lock(&m_mutex);
+    m_capacity = capacity;
+    evict();
+  }
+
+  std::size_t CompiledSmartsCache::size() const
+  {
+    MutexLocker lock(&m_mutex);
+    return m_entries.size();
+  }
+
+  unsigned long CompiledSmartsCache::hits() const
+  {
+    MutexLocker lock(&m_mutex);
+    return m_hits;
+  }
+
+  unsigned long CompiledSmartsCache::misses() const
+  {
+    MutexLocker lock(&m_mutex);
+    return m_misses;
+  }
+
+  void CompiledSmartsCache::touch(EntryIter entry)
+  {
+    // move to the front, iterators stay valid
+    m_entries.splice(m_entries.begin(), m_entries, entry);
+  }
+
+  void CompiledSmartsCache::addSpelling(EntryIter entry, const std::string &smarts)
+  {
+    if (entry->spellings.size() >= maxSpellings || m_spellings.find(smarts) != m_spellings.end())
+      return;
+    entry->spellings.push_back(smarts);
+    m_spellings[smarts] = entry;
+  }
+
+  void CompiledSmartsCache::evict()
+  {
+    while (m_entries.size() > m_capacity) {
+      Entry &entry = m_entries.back();
+      if (!entry.key.empty())
+        m_keys.erase(entry.key);
+      for (std::size_t i = 0; i < entry.spellings.size(); ++i)
+        m_spellings.erase(entry.spellings[i]);
+      m_entries.pop_back();
+    }
+  }
+
+}
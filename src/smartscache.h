@@ -0,0 +1,125 @@
+#ifndef SC_SMARTSCACHE_H
+#define SC_SMARTSCACHE_H
+
+#include "compiledsmarts.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+namespace SC {
+
+  class SmartsScores;
+
+  /**
+   * Get a canonical key for an (optimized) pattern. Two patterns with the
+   * same key are equivalent: the atom and bond expressions are compared
+   * using GetCanonicalExprKey() (sorted operands of commutative operators,
+   * duplicates removed) and the atoms are numbered in a canonical order
+   * that does not depend on the order in which they were written.
+   *
+   * Run the SmartsOptimizer first, it normalizes the primitives (e.g.
+   * [#6&A] becomes [C]) so more equivalent spellings share a key.
+   *
+   * @param order Set to the canonical number of each atom (if not null).
+   * @return The key or an empty string for patterns that can't be
+   *         canonicalized (chirality, atom classes and recursive SMARTS).
+   */
+  std::string GetCanonicalSmartsKey(const Smarts *pattern, std::vector<int> *order = 0);
+
+  /**
+   * A thread-safe least recently used cache of compiled patterns.
+   *
+   * Patterns are looked up by the SMARTS string first, a new spelling is
+   * parsed and optimized and looked up by its canonical key and atom order.
+   * Only patterns with a new key are planned and added to the cache,
+   * equivalent spellings that list the atoms in the same order ([CH3],
+   * [C;H3], [H3C], [#6&A&H3]) share one CompiledSmarts. Spellings with a
+   * different atom order (CCO and OCC) are compiled separately so the
+   * mappings always follow the atoms of the requested SMARTS. Patterns
+   * without a canonical key are only cached by SMARTS string.
+   *
+   * @code
+   * CompiledSmarts pattern = CompiledSmartsCache::instance().get(smarts);
+   * bool found = match(&mol, pattern);
+   * @endcode
+   */
+  class CompiledSmartsCache
+  {
+    public:
+      /**
+       * Create a cache for @p capacity distinct patterns. The @p scores are
+       * used while optimizing (PrettySmartsScores if none are given).
+       */
+      CompiledSmartsCache(std::size_t capacity = 1024, SmartsScores *scores = 0,
+          int opts = SmartsOptimizer::O5);
+      ~CompiledSmartsCache();
+
+      /**
+       * The process-wide cache.
+       */
+      static CompiledSmartsCache& instance();
+
+      /**
+       * Get the compiled pattern for a SMARTS, compiling it if no
+       * equivalent pattern is cached.
+       */
+      CompiledSmarts get(const std::string &smarts);
+
+      void clear();
+
+      void setCapacity(std::size_t capacity);
+
+      std::size_t capacity() const
+      {
+        return m_capacity;
+      }
+
+      /**
+       * The number of distinct compiled patterns in the cache.
+       */
+      std::size_t size() const;
+
+      /**
+       * The number of lookups that found a cached pattern (by SMARTS or by
+       * canonical key) and the number of patterns that had to be compiled.
+       */
+      unsigned long hits() const;
+      unsigned long misses() const;
+
+    private:
+      struct Entry
+      {
+        std::string key;
+        CompiledSmarts pattern;
+        std::vector<std::string> spellings;
+      };
+
+      typedef std::list<Entry>::iterator EntryIter;
+
+      // not copyable
+      CompiledSmartsCache(const CompiledSmartsCache&);
+      CompiledSmartsCache& operator=(const CompiledSmartsCache&);
+
+      void touch(EntryIter entry);
+      void addSpelling(EntryIter entry, const std::string &smarts);
+      void evict();
+
+      std::list<Entry> m_entries; // most recently used first
+      std::map<std::string, EntryIter> m_keys;
+      std::map<std::string, EntryIter> m_spellings;
+      std::size_t m_capacity;
+      SmartsScores *m_scores;
+      int m_opts;
+      unsigned long m_hits;
+      unsigned long m_misses;
+      mutable pthread_mutex_t m_mutex;
+      pthread_mutex_t m_compileMutex;
+  };
+
+}
+
+#endif
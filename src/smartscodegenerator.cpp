@@ -1,4 +1,5 @@
 #include "smartscodegenerator.h"
+#include "compiledsmarts.h"
 #include "smartspattern.h"
 #include "smartsprint.h"
 #include "util.h"
@@ -9,7 +10,11 @@
 #include "openbabel.h"
 
 #include <set>
+#include <fstream>
 #include <cassert>
+#include <iomanip>
+#include <tr1/unordered_map>
+#include <tr1/unordered_set>
 
 namespace SC {
 
@@ -27,6 +32,98 @@ namespace SC {
   static const char *python_op_template = "def $function($arg):\n"
                                           "  return $expr\n";
  
+  /**
+   * Symbol table for the generated expression functions. Functions are
+   * looked up by the key of the expression they evaluate. The final name
+   * of a function is assigned once when it is added to the table so no
+   * renaming of the generated code is needed afterwards.
+   */
+  class FunctionSymbolTable
+  {
+    public:
+      FunctionSymbolTable() : m_shortNames(false)
+      {
+      }
+
+      /**
+       * Use short function names (i.e. f1, f2, ...) instead of the
+       * descriptive names.
+       */
+      void SetShortNames(bool shortNames)
+      {
+        m_shortNames = shortNames;
+      }
+
+      /**
+       * Get the function name for an expression key.
+       *
+       * @return The function name or an empty string if there is no
+       * function for the key.
+       */
+      std::string Find(const std::string &key) const
+      {
+        std::tr1::unordered_map<std::string, std::string>::const_iterator i = m_symbols.find(key);
+        if (i == m_symbols.end())
+          return std::string();
+        return i->second;
+      }
+
+      /**
+       * Add a function for an expression key. The descriptive @p name is
+       * made unique if needed.
+       *
+       * @return The name of the function.
+       */
+      std::string Add(const std::string &key, const std::string &name)
+      {
+        std::string functionName = m_shortNames ? make_string("f", m_symbols.size() + 1) : name;
+        for (int i = 2; m_names.find(functionName) != m_names.end(); ++i)
+          functionName = make_string(name, "_", i);
+        m_symbols[key] = functionName;
+        m_names.insert(functionName);
+        return functionName;
+      }
+
+    private:
+      std::tr1::unordered_map<std::string, std::string> m_symbols; // key -> name
+      std::tr1::unordered_set<std::string> m_names;
+      bool m_shortNames;
+  };
+
+  /**
+   * A generated expression function. The functions are kept in emission
+   * order until the module is written, a function is always added after
+   * the functions it calls.
+   */
+  struct CodeBlock
+  {
+    CodeBlock(int pattern_, const std::string &name_, const std::string &code_)
+        : pattern(pattern_), name(name_), code(code_)
+    {
+    }
+
+    int pattern; // index of the pattern that generated the block
+    std::string name;
+    std::string code;
+    std::vector<std::string> calls; // functions called by this function
+  };
+
+  /**
+   * The per pattern code (i.e. EvalAtomExpr_N, EvalBondExpr_N,
+   * SingleAtomMatch_N and custom functions). This is generated when the
+   * module is written.
+   */
+  struct PatternCode
+  {
+    std::vector<std::string> atomEvalExpr; // atom index -> function
+    std::vector<std::string> bondEvalExpr; // bond index -> function
+    std::string atomExpr; // expression for single atom patterns
+    std::string function; // custom function name
+    bool nomap;
+    bool count;
+    bool atom;
+  };
+
   struct SmartsCodeGeneratorPrivate
   {
     Toolkit *m_toolkit;
@@ -36,28 +133,36 @@ namespace SC {
     int m_or;
     int m_switch;
 
-    std::stringstream m_os;
-    std::map<int, std::string> m_atomEvalExpr;
-    std::map<int, std::string> m_bondEvalExpr;
+    std::string m_name;
+    std::vector<PatternCode> m_patternCode;
     std::vector<std::string> m_smarts;
     std::vector<SmartsPattern<OBAtom, OBBond> > m_patterns;
     std::set<int> m_singleatoms;
-    std::vector<std::string> m_functions;
+    FunctionSymbolTable m_symbols;
+    std::vector<CodeBlock> m_blocks;
+    std::tr1::unordered_map<std::string, std::size_t> m_blockIndex; // name -> index in m_blocks
+    std::vector<std::vector<std::string> > m_calls; // functions called by the functions being generated
 
     bool m_noinline;
     bool m_noswitch;
     bool m_nomatch;
     bool m_optfunc;
+    bool m_lookup;
+    bool m_sharded;
+    bool m_extension;
 
     SmartsCodeGeneratorPrivate(Toolkit *toolkit, enum SmartsCodeGenerator::Language language)
-        : m_toolkit(toolkit), m_language(language), m_and(0), m_or(0), m_not(0),
-        m_switch(0), m_noinline(false), m_noswitch(false), m_optfunc(false)
+        : m_toolkit(toolkit), m_language(language == SmartsCodeGenerator::PythonExtension ? SmartsCodeGenerator::Cpp : language),
+        m_and(0), m_or(0), m_not(0),
+        m_switch(0), m_noinline(false), m_noswitch(false), m_optfunc(false),
+        m_lookup(false), m_sharded(false), m_extension(language == SmartsCodeGenerator::PythonExtension)
     {
     }
 
     std::string CommentString()
     {
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           return "// ";
         case SmartsCodeGenerator::Python:
@@ -68,6 +173,7 @@ namespace SC {
     std::string UnaryNotString()
     {
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           return "!";
         case SmartsCodeGenerator::Python:
@@ -80,6 +186,7 @@ namespace SC {
     std::string BinaryAndString()
     {
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           return " && ";
         case SmartsCodeGenerator::Python:
@@ -92,6 +199,7 @@ namespace SC {
     std::string BinaryOrString()
     {
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           return " || ";
         case SmartsCodeGenerator::Python:
@@ -310,6 +418,7 @@ namespace SC {
     {
       std::string temp;
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           temp = cpp_template;
           break;
@@ -343,19 +452,41 @@ namespace SC {
     }
 
 
-    int GetValue(SmartsAtomExpr *expr)
+    int GetValue(const SmartsAtomExpr *expr)
     {
       return expr->leaf.value;
     }
 
-    int GetValue(SmartsBondExpr *expr)
+    int GetValue(const SmartsBondExpr *expr)
     {
       return 0;
     }
 
+    /**
+     * Get the symbol table key for an expression. This is the canonical
+     * expression key so equivalent expressions from all patterns in the
+     * module share a single generated function.
+     */
+    template<typename Expr>
+    std::string ExprKey(Expr *expr)
+    {
+      return make_string(SameType<SmartsAtomExpr, Expr>::result ? "a" : "b", GetCanonicalExprKey(expr));
+    }
+
+    /**
+     * Add the code for a generated function. The function name should be
+     * obtained from the symbol table first.
+     */
+    std::string AddFunction(const std::string &functionName, const std::string &code)
+    {
+      m_blockIndex[functionName] = m_blocks.size();
+      m_blocks.push_back(CodeBlock(m_smarts.size(), functionName, code));
+      return functionName;
+    }
+
     // function
     template<typename Expr>
-    std::string ExprFunction(std::ostream &os, const std::string &function, const std::string &exprTemplate, Expr *expr)
+    std::string ExprFunction(const std::string &function, const std::string &exprTemplate, Expr *expr)
     {
       std::string functionName = function;
       std::string expr2 = exprTemplate;
@@ -365,16 +496,14 @@ namespace SC {
         replace_all(expr2, "$value", make_string(value));
       }
 
-      if (std::find(m_functions.begin(), m_functions.end(), functionName) != m_functions.end())
-        return functionName;
-      
       enum SmartsCodeGenerator::ArgType argType = SameType<SmartsAtomExpr, Expr>::result ? SmartsCodeGenerator::AtomArg : SmartsCodeGenerator::BondArg;
+      functionName = m_symbols.Add(ExprKey(expr), functionName);
+      std::stringstream os;
       os << CommentString() << GetExprString(expr) << std::endl;
       os << FunctionTemplate(functionName, argType, expr2, false);
       os << std::endl;
 
-      m_functions.push_back(functionName);
-      return functionName;
+      return AddFunction(functionName, os.str());
     }
 
     enum UnaryOp
@@ -384,7 +513,7 @@ namespace SC {
 
     // unary function
     template<typename Expr>
-    std::string UnaryExprFunction(std::ostream &os, enum UnaryOp op, const Expr *expr)
+    std::string UnaryExprFunction(enum UnaryOp op, Expr *expr)
     {
       enum SmartsCodeGenerator::ArgType argType = SameType<Expr, SmartsAtomExpr>::result ? SmartsCodeGenerator::AtomArg : SmartsCodeGenerator::BondArg;
       std::string arg = argType == SmartsCodeGenerator::AtomArg ? "(atom)" : "(bond)";
@@ -396,7 +525,7 @@ namespace SC {
         switch (op) {
           case UnaryNot:
             functionName = make_string("EvalNotExpr_", ++m_not);
-            std::string argFunctionName = GenerateExprFunction(os, expr->unary.arg);
+            std::string argFunctionName = GenerateExprFunction(expr->unary.arg);
             expr_str = UnaryNotString() + argFunctionName + arg;
             break;
         }
@@ -404,19 +533,18 @@ namespace SC {
         switch (op) {
           case UnaryNot:
             functionName = ExprFunctionName(expr);
-            if (std::find(m_functions.begin(), m_functions.end(), functionName) != m_functions.end())
-              return functionName;
             expr_str = code;
             break;
         }
       }
 
+      functionName = m_symbols.Add(ExprKey(expr), functionName);
+      std::stringstream os;
       os << CommentString() << GetExprString(expr) << std::endl;
       os << FunctionTemplate(functionName, argType, expr_str, true);
       os << std::endl;
 
-      m_functions.push_back(functionName);
-      return functionName;
+      return AddFunction(functionName, os.str());
     }
 
 
@@ -428,7 +556,7 @@ namespace SC {
 
     // binary function
     template<typename Expr>
-    std::string BinaryExprFunction(std::ostream &os, enum BinaryOp op, const Expr *expr)
+    std::string BinaryExprFunction(enum BinaryOp op, Expr *expr)
     {
       enum SmartsCodeGenerator::ArgType argType = SameType<Expr, SmartsAtomExpr>::result ? SmartsCodeGenerator::AtomArg : SmartsCodeGenerator::BondArg;
       std::string arg = argType == SmartsCodeGenerator::AtomArg ? "(atom)" : "(bond)";
@@ -450,19 +578,17 @@ namespace SC {
  
       bool lft_leaf = true, rgt_leaf = true;
       if (lft_expr.empty()) {
-        lft_expr = GenerateExprFunction(os, expr->binary.lft) + arg;
+        lft_expr = GenerateExprFunction(expr->binary.lft) + arg;
         lft_leaf = false;
       }
       if (rgt_expr.empty()) {
-        rgt_expr = GenerateExprFunction(os, expr->binary.rgt) + arg;
+        rgt_expr = GenerateExprFunction(expr->binary.rgt) + arg;
         rgt_leaf = false;
       }
         
       std::string functionName;
       if (lft_leaf && rgt_leaf && !m_noinline) {
         functionName = ExprFunctionName(expr->binary.lft) + "_" + op_str + "_" + ExprFunctionName(expr->binary.rgt);
-        if (std::find(m_functions.begin(), m_functions.end(), functionName) != m_functions.end())
-          return functionName;
       } else
         switch (op) {
           case BinaryAnd:
@@ -473,13 +599,14 @@ namespace SC {
             break;
         }
       
+      functionName = m_symbols.Add(ExprKey(expr), functionName);
+      std::stringstream os;
       os << CommentString() << GetExprString(expr) << std::endl;
       std::string expr_str = lft_expr + op_expr + rgt_expr ;
       os << FunctionTemplate(functionName, argType, expr_str, true);
       os << std::endl;
 
-      m_functions.push_back(functionName);
-      return functionName;
+      return AddFunction(functionName, os.str());
     }
 
 
@@ -892,7 +1019,7 @@ namespace SC {
       return true;
     }
     
-    std::string GenerateHighAndSwitchFunction(std::ostream &os, SmartsAtomExpr *expr)
+    std::string GenerateHighAndSwitchFunction(SmartsAtomExpr *expr)
     {
       if (m_noswitch)
         return "";
@@ -906,16 +1033,16 @@ namespace SC {
       std::string arg_type = m_toolkit->AtomArgType(m_language);
       if (arg_type.size())
         arg_type = make_string(arg_type, " ");
+      std::string functionName = m_symbols.Add(ExprKey(expr), make_string("EvalAndExpr_", ++m_and));
+      std::stringstream os;
       os << CommentString() + GetExprString(expr) << std::endl;
-      os << "inline bool EvalAndExpr_" << ++m_and << "(" << arg_type << "atom)" << std::endl;
+      os << "inline bool " << functionName << "(" << arg_type << "atom)" << std::endl;
       os << "{" << std::endl;
       // code
       os << code.str();
       os << "}" << std::endl;
       os << std::endl;
-      std::string functionName = make_string("EvalAndExpr_", m_and);
-      m_functions.push_back(functionName);
-      return functionName;
+      return AddFunction(functionName, os.str());
     }
 
     std::string ExtractCase(const std::string &str)
@@ -1626,7 +1753,7 @@ namespace SC {
       return true;
     }
     
-    std::string GenerateOrSwitchFunction(std::ostream &os, SmartsAtomExpr *expr)
+    std::string GenerateOrSwitchFunction(SmartsAtomExpr *expr)
     {
       return ""; // DISABLED for now until I finsish this...
 
@@ -1642,16 +1769,16 @@ namespace SC {
       std::string arg_type = m_toolkit->AtomArgType(m_language);
       if (arg_type.size())
         arg_type = make_string(arg_type, " ");
+      std::string functionName = m_symbols.Add(ExprKey(expr), make_string("EvalOrExpr_", ++m_or));
+      std::stringstream os;
       os << CommentString() + GetExprString(expr) << std::endl;
-      os << "inline bool EvalOrExpr_" << ++m_or << "(" << arg_type << "atom)" << std::endl;
+      os << "inline bool " << functionName << "(" << arg_type << "atom)" << std::endl;
       os << "{" << std::endl;
       // code
       os << code.str();
       os << "}" << std::endl;
       os << std::endl;
-      std::string functionName = make_string("EvalOrExpr_", m_or);
-      m_functions.push_back(functionName);
-      return functionName;
+      return AddFunction(functionName, os.str());
     }
     
     bool GenerateLowAndSwitchCode(std::ostream &os, std::vector<SmartsAtomExpr*> &and_same, std::vector<SmartsAtomExpr*> &and_other)
@@ -1884,7 +2011,7 @@ namespace SC {
       return true;  
     }
     
-    std::string GenerateLowAndSwitchFunction(std::ostream &os, SmartsAtomExpr *expr)
+    std::string GenerateLowAndSwitchFunction(SmartsAtomExpr *expr)
     {
       return ""; // DISABLED for now until I finsish this...
 
@@ -1900,154 +2027,356 @@ namespace SC {
       std::string arg_type = m_toolkit->AtomArgType(m_language);
       if (arg_type.size())
         arg_type = make_string(arg_type, " ");
+      std::string functionName = m_symbols.Add(ExprKey(expr), make_string("EvalAndExpr_", ++m_and));
+      std::stringstream os;
       os << CommentString() + GetExprString(expr) << std::endl;
-      os << "inline bool EvalAndExpr_" << ++m_and << "(" << arg_type << "atom)" << std::endl;
+      os << "inline bool " << functionName << "(" << arg_type << "atom)" << std::endl;
       os << "{" << std::endl;
       // code
       os << code.str();
       os << "}" << std::endl;
       os << std::endl;
-      std::string functionName = make_string("EvalAndExpr_", m_and);
-      m_functions.push_back(functionName);
-      return functionName;
+      return AddFunction(functionName, os.str());
+    }
+
+
+
+    /**
+     * Get the switchable leaf for a lookup table. For OR expressions these
+     * are the switchable leafs, for AND expressions the negated switchable
+     * leafs (i.e. [!C&!N] is the negation of [C,N]).
+     *
+     * @return The leaf or 0 if @p expr can't be used in a lookup table.
+     */
+    SmartsAtomExpr* GetLookupTableLeaf(SmartsAtomExpr *expr, enum BinaryOp op)
+    {
+      if (op == BinaryAnd) {
+        if (!IsNot(expr))
+          return 0;
+        expr = expr->unary.arg;
+      }
+      if (!IsLeaf(expr) || !m_toolkit->IsSwitchable(expr->type))
+        return 0;
+      return expr;
+    }
+
+    /**
+     * Get the size (in bits) of the lookup table for a set of leafs with the
+     * same switchable type. An offset is used to handle negative values
+     * (e.g. charges).
+     *
+     * @return The table size or 0 if the values are out of range.
+     */
+    int GetLookupTableSize(const std::vector<SmartsAtomExpr*> &leafs, int &offset)
+    {
+      int minValue = leafs[0]->leaf.value, maxValue = leafs[0]->leaf.value;
+      for (std::size_t i = 1; i < leafs.size(); ++i) {
+        minValue = std::min(minValue, leafs[i]->leaf.value);
+        maxValue = std::max(maxValue, leafs[i]->leaf.value);
+      }
+      offset = minValue < 0 ? -minValue : 0;
+      int size = ((maxValue + offset) / 32 + 1) * 32;
+      return size > 256 ? 0 : size;
     }
 
+    /**
+     * Lookup table for a set of leafs with the same switchable type. The
+     * table is a bit mask with a bit set for each leaf value.
+     *
+     * C++:
+     *
+     *   static const unsigned int EvalOrExpr_1_table0[4] = { 0x0, 0x1c0, 0x0, 0x0 };
+     *   ...
+     *   return LookupTable(EvalOrExpr_1_table0, 128, atom->GetAtomicNum());
+     *
+     * Python:
+     *
+     *   return LookupTable(0x1c0, 128, atom.GetAtomicNum())
+     */
+    std::string LookupTableTerm(std::ostream &os, const std::string &table, const std::vector<SmartsAtomExpr*> &leafs, enum BinaryOp op)
+    {
+      int type = leafs[0]->type;
+      int offset;
+      int size = GetLookupTableSize(leafs, offset);
+
+      std::vector<unsigned int> words(size / 32, 0);
+      for (std::size_t i = 0; i < leafs.size(); ++i) {
+        int value = leafs[i]->leaf.value + offset;
+        words[value / 32] |= 1u << (value % 32);
+      }
 
+      std::string value_expr = m_toolkit->GetSwitchExpr(m_language, type);
+      if (offset)
+        value_expr = make_string(value_expr, " + ", offset);
 
-    std::string GenerateExprFunction(std::ostream &os, SmartsAtomExpr *expr)
+      std::stringstream term;
+      switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
+        case SmartsCodeGenerator::Cpp:
+          os << "static const unsigned int " << table << "[" << words.size() << "] = { ";
+          for (std::size_t i = 0; i < words.size(); ++i) {
+            if (i)
+              os << ", ";
+            os << "0x" << std::hex << words[i] << std::dec;
+          }
+          os << " };" << std::endl;
+          term << "LookupTable(" << table << ", " << size << ", " << value_expr << ")";
+          break;
+        case SmartsCodeGenerator::Python:
+          term << "LookupTable(0x";
+          for (std::size_t i = words.size(); i > 0; --i)
+            if (i == words.size())
+              term << std::hex << words[i - 1];
+            else
+              term << std::hex << std::setw(8) << std::setfill('0') << words[i - 1];
+          term << std::dec << ", " << size << ", " << value_expr << ")";
+          break;
+      }
+
+      std::string code = term.str();
+      std::string pred_code = m_toolkit->GetSwitchPredicate(m_language, type);
+      if (pred_code.size())
+        code = make_string("(", pred_code, BinaryAndString(), code, ")");
+      if (op == BinaryAnd)
+        code = UnaryNotString() + code;
+      return code;
+    }
+
+    /**
+     * Generate a function using lookup tables for the switchable leafs in
+     * an AND/OR expression. All leafs with the same switchable type are
+     * evaluated using a single table lookup without data dependent
+     * branches. The remaining operands are evaluated as usual.
+     *
+     * @return The function name or an empty string if there are no
+     * switchable leafs that can be combined.
+     */
+    std::string GenerateLookupTableFunction(SmartsAtomExpr *expr)
     {
+      if (!m_lookup)
+        return "";
+      enum BinaryOp op = IsAnd(expr) ? BinaryAnd : BinaryOr;
+      std::vector<SmartsAtomExpr*> same, other; // [expr]
+      FindSameBinaryExpr(expr, same, other);
+
+      std::map<int, std::vector<SmartsAtomExpr*> > type_to_leafs; // type -> [leaf]
+      for (std::size_t i = 0; i < other.size(); ++i) {
+        SmartsAtomExpr *leaf = GetLookupTableLeaf(other[i], op);
+        if (leaf)
+          type_to_leafs[leaf->type].push_back(leaf);
+      }
+
+      // only use tables for types with multiple leafs and a small range
+      std::vector<int> table_types;
+      for (std::map<int, std::vector<SmartsAtomExpr*> >::iterator i = type_to_leafs.begin(); i != type_to_leafs.end(); ++i) {
+        int offset;
+        if (i->second.size() > 1 && GetLookupTableSize(i->second, offset))
+          table_types.push_back(i->first);
+      }
+      if (table_types.empty())
+        return "";
+
+      std::string functionName = m_symbols.Add(ExprKey(expr), make_string(op == BinaryAnd ? "EvalAndExpr_" : "EvalOrExpr_", op == BinaryAnd ? ++m_and : ++m_or));
+
+      std::stringstream tables;
+      std::vector<std::string> terms;
+      for (std::size_t i = 0; i < table_types.size(); ++i)
+        terms.push_back(LookupTableTerm(tables, make_string(functionName, "_table", i), type_to_leafs[table_types[i]], op));
+
+      for (std::size_t i = 0; i < other.size(); ++i) {
+        SmartsAtomExpr *leaf = GetLookupTableLeaf(other[i], op);
+        if (leaf && std::find(table_types.begin(), table_types.end(), leaf->type) != table_types.end())
+          continue;
+        std::string code = m_noinline ? "" : Bracket(ExprString(other[i]));
+        if (code.empty())
+          code = GenerateExprFunction(other[i]) + "(atom)";
+        terms.push_back(code);
+      }
+
+      std::string expr_str;
+      for (std::size_t i = 0; i < terms.size(); ++i) {
+        if (i)
+          expr_str += op == BinaryAnd ? BinaryAndString() : BinaryOrString();
+        expr_str += terms[i];
+      }
+
+      std::stringstream os;
+      os << CommentString() << GetExprString(expr) << std::endl;
+      os << tables.str();
+      os << FunctionTemplate(functionName, SmartsCodeGenerator::AtomArg, expr_str, true);
+      os << std::endl;
+
+      return AddFunction(functionName, os.str());
+    }
+
+    /**
+     * Get the function for an expression. The function (and the functions it
+     * calls) is generated if it doesn't exist yet. The functions called by
+     * each generated function are recorded so the functions needed by a
+     * subset of the patterns can be found when writing a sharded module.
+     */
+    template<typename Expr>
+    std::string GenerateExprFunction(Expr *expr)
+    {
+      std::string functionName = m_symbols.Find(ExprKey(expr));
+      if (functionName.empty()) {
+        m_calls.push_back(std::vector<std::string>());
+        functionName = GenerateNewExprFunction(expr);
+        m_blocks[m_blockIndex[functionName]].calls = m_calls.back();
+        m_calls.pop_back();
+      }
+      if (m_calls.size())
+        m_calls.back().push_back(functionName);
+      return functionName;
+    }
+
+    std::string GenerateNewExprFunction(SmartsAtomExpr *expr)
+    {
+      std::string functionName;
       switch (expr->type) {
         case Smiley::OP_AndHi:
           {
-            std::string functionName = GenerateHighAndSwitchFunction(os, expr);
+            functionName = GenerateLookupTableFunction(expr);
             if (functionName.size())
               return functionName;
-            return BinaryExprFunction(os, BinaryAnd, expr);
+            functionName = GenerateHighAndSwitchFunction(expr);
+            if (functionName.size())
+              return functionName;
+            return BinaryExprFunction(BinaryAnd, expr);
           }
         case Smiley::OP_AndLo:
           {
-            std::string functionName = GenerateLowAndSwitchFunction(os, expr);
+            functionName = GenerateLookupTableFunction(expr);
+            if (functionName.size())
+              return functionName;
+            functionName = GenerateLowAndSwitchFunction(expr);
             if (functionName.size())
               return functionName;
-            return BinaryExprFunction(os, BinaryAnd, expr);
+            return BinaryExprFunction(BinaryAnd, expr);
           }
         case Smiley::OP_Or:
           {
-            std::string functionName = GenerateOrSwitchFunction(os, expr);
+            functionName = GenerateLookupTableFunction(expr);
+            if (functionName.size())
+              return functionName;
+            functionName = GenerateOrSwitchFunction(expr);
             if (functionName.size())
               return functionName;
-            return BinaryExprFunction(os, BinaryOr, expr);
+            return BinaryExprFunction(BinaryOr, expr);
           }
         //case AE_RECUR:
         //  break;
         case Smiley::OP_Not:
-          return UnaryExprFunction(os, UnaryNot, expr);
+          return UnaryExprFunction(UnaryNot, expr);
         case Smiley::AE_True:
-          return ExprFunction(os, "EvalTrueExpr", "true", expr);
+          return ExprFunction("EvalTrueExpr", "true", expr);
         case Smiley::AE_False:
-          return ExprFunction(os, "EvalFalseExpr", "false", expr);
+          return ExprFunction("EvalFalseExpr", "false", expr);
         case Smiley::AE_Aromatic:
-          return ExprFunction(os, "EvalAromaticExpr", m_toolkit->AromaticAtomTemplate(m_language), expr);
+          return ExprFunction("EvalAromaticExpr", m_toolkit->AromaticAtomTemplate(m_language), expr);
         case Smiley::AE_Aliphatic:
-          return ExprFunction(os, "EvalAliphaticExpr", m_toolkit->AliphaticAtomTemplate(m_language), expr);
+          return ExprFunction("EvalAliphaticExpr", m_toolkit->AliphaticAtomTemplate(m_language), expr);
         case Smiley::AE_Cyclic:
-          return ExprFunction(os, "EvalCyclicExpr", m_toolkit->CyclicAtomTemplate(m_language), expr);
+          return ExprFunction("EvalCyclicExpr", m_toolkit->CyclicAtomTemplate(m_language), expr);
         case Smiley::AE_Acyclic:
-          return ExprFunction(os, "EvalAcyclicExpr", m_toolkit->AcyclicAtomTemplate(m_language), expr);
+          return ExprFunction("EvalAcyclicExpr", m_toolkit->AcyclicAtomTemplate(m_language), expr);
         case Smiley::AE_Isotope:
-          return ExprFunction(os, "EvalMassExpr", m_toolkit->MassAtomTemplate(m_language), expr);
+          return ExprFunction("EvalMassExpr", m_toolkit->MassAtomTemplate(m_language), expr);
         case Smiley::AE_AtomicNumber:
-          return ExprFunction(os, "EvalElementExpr", m_toolkit->ElementAtomTemplate(m_language), expr);
+          return ExprFunction("EvalElementExpr", m_toolkit->ElementAtomTemplate(m_language), expr);
         case Smiley::AE_AromaticElement:
-          return ExprFunction(os, "EvalAromaticElementExpr", m_toolkit->AromaticElementAtomTemplate(m_language), expr);
+          return ExprFunction("EvalAromaticElementExpr", m_toolkit->AromaticElementAtomTemplate(m_language), expr);
         case Smiley::AE_AliphaticElement:
-          return ExprFunction(os, "EvalAliphaticElementExpr", m_toolkit->AliphaticElementAtomTemplate(m_language), expr);
+          return ExprFunction("EvalAliphaticElementExpr", m_toolkit->AliphaticElementAtomTemplate(m_language), expr);
         case Smiley::AE_TotalH:
-          return ExprFunction(os, "EvalHydrogenCountExpr", m_toolkit->HydrogenCountAtomTemplate(m_language), expr);
+          return ExprFunction("EvalHydrogenCountExpr", m_toolkit->HydrogenCountAtomTemplate(m_language), expr);
         case Smiley::AE_Charge:
-          return ExprFunction(os, "EvalChargeExpr", m_toolkit->ChargeAtomTemplate(m_language), expr);
+          return ExprFunction("EvalChargeExpr", m_toolkit->ChargeAtomTemplate(m_language), expr);
         case Smiley::AE_Connectivity:
-          return ExprFunction(os, "EvalConnectExpr", m_toolkit->ConnectAtomTemplate(m_language), expr);
+          return ExprFunction("EvalConnectExpr", m_toolkit->ConnectAtomTemplate(m_language), expr);
         case Smiley::AE_Degree:
-          return ExprFunction(os, "EvalDegreeExpr", m_toolkit->DegreeAtomTemplate(m_language), expr);
+          return ExprFunction("EvalDegreeExpr", m_toolkit->DegreeAtomTemplate(m_language), expr);
         case Smiley::AE_ImplicitH:
-          return ExprFunction(os, "EvalImplicitExpr", m_toolkit->ImplicitAtomTemplate(m_language), expr);
+          return ExprFunction("EvalImplicitExpr", m_toolkit->ImplicitAtomTemplate(m_language), expr);
         case Smiley::AE_RingMembership:
-          return ExprFunction(os, "EvalRingsExpr", m_toolkit->NumRingsAtomTemplate(m_language), expr);
+          return ExprFunction("EvalRingsExpr", m_toolkit->NumRingsAtomTemplate(m_language), expr);
         case Smiley::AE_RingSize:
-          return ExprFunction(os, "EvalSizeExpr", m_toolkit->RingSizeAtomTemplate(m_language), expr);
+          return ExprFunction("EvalSizeExpr", m_toolkit->RingSizeAtomTemplate(m_language), expr);
         case Smiley::AE_Valence:
-          return ExprFunction(os, "EvalValenceExpr", m_toolkit->ValenceAtomTemplate(m_language), expr);
+          return ExprFunction("EvalValenceExpr", m_toolkit->ValenceAtomTemplate(m_language), expr);
         case Smiley::AE_Chirality:
-          return ExprFunction(os, "EvalChiralExpr", "true", expr);
+          return ExprFunction("EvalChiralExpr", "true", expr);
         //case AE_HYB:
-        //  return ExprFunction(os, "EvalHybridizationExpr", m_toolkit->HybAtomTemplate(m_language), expr);
+        //  return ExprFunction("EvalHybridizationExpr", m_toolkit->HybAtomTemplate(m_language), expr);
         case Smiley::AE_RingConnectivity:
-          return ExprFunction(os, "EvalRingConnectExpr", m_toolkit->RingConnectAtomTemplate(m_language), expr);
+          return ExprFunction("EvalRingConnectExpr", m_toolkit->RingConnectAtomTemplate(m_language), expr);
         default:
-          return ExprFunction(os, "EvalTrueExpr", "true", expr);
+          return ExprFunction("EvalTrueExpr", "true", expr);
       }
 
       return "";
     }
 
-    std::string GenerateExprFunction(std::ostream &os, SmartsBondExpr *expr)
+    std::string GenerateNewExprFunction(SmartsBondExpr *expr)
     {
       switch (expr->type) {
         case Smiley::OP_AndHi:
         case Smiley::OP_AndLo:
-          return BinaryExprFunction(os, BinaryAnd, expr);
+          return BinaryExprFunction(BinaryAnd, expr);
         case Smiley::OP_Or:
-          return BinaryExprFunction(os, BinaryOr, expr);
+          return BinaryExprFunction(BinaryOr, expr);
         case Smiley::OP_Not:
-          return UnaryExprFunction(os, UnaryNot, expr);
+          return UnaryExprFunction(UnaryNot, expr);
         case Smiley::BE_True:
-          return ExprFunction(os, "EvalAnyExpr", "true", expr);
+          return ExprFunction("EvalAnyExpr", "true", expr);
         case BE_DEFAULT:
-          return ExprFunction(os, "EvalDefaultExpr", m_toolkit->DefaultBondTemplate(m_language), expr);
+          return ExprFunction("EvalDefaultExpr", m_toolkit->DefaultBondTemplate(m_language), expr);
         case Smiley::BE_Single:
-          return ExprFunction(os, "EvalSingleExpr", m_toolkit->SingleBondTemplate(m_language), expr);
+          return ExprFunction("EvalSingleExpr", m_toolkit->SingleBondTemplate(m_language), expr);
         case Smiley::BE_Double:
-          return ExprFunction(os, "EvalDoubleExpr", m_toolkit->DoubleBondTemplate(m_language), expr);
+          return ExprFunction("EvalDoubleExpr", m_toolkit->DoubleBondTemplate(m_language), expr);
         case Smiley::BE_Triple:
-          return ExprFunction(os, "EvalTripleExpr", m_toolkit->TripleBondTemplate(m_language), expr);
+          return ExprFunction("EvalTripleExpr", m_toolkit->TripleBondTemplate(m_language), expr);
         case Smiley::BE_Aromatic:
-          return ExprFunction(os, "EvalAromaticExpr", m_toolkit->AromaticBondTemplate(m_language), expr);
+          return ExprFunction("EvalAromaticExpr", m_toolkit->AromaticBondTemplate(m_language), expr);
         case Smiley::BE_Ring:
-          return ExprFunction(os, "EvalRingExpr", m_toolkit->RingBondTemplate(m_language), expr);
+          return ExprFunction("EvalRingExpr", m_toolkit->RingBondTemplate(m_language), expr);
         case Smiley::BE_Up:
         case Smiley::BE_Down:
         //case Smiley::BE_UpUNSPEC:
         //case BE_DOWNUNSPEC:
         default:
-          return ExprFunction(os, "EvalAnyExpr", "true", expr);
+          return ExprFunction("EvalAnyExpr", "true", expr);
       }
     }
   
-    void GenerateEvalExprFunction(std::ostream &os, Smarts *pattern)
+    void GenerateEvalExprFunction(std::ostream &os, int index)
     {
-      if (pattern->atoms.size() < 2)
+      const PatternCode &code = m_patternCode[index];
+      // single atom patterns only need EvalAtomExpr_N for sharded modules
+      if (code.atomEvalExpr.size() < 2 && !m_sharded)
         return;
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
-          os << "bool EvalAtomExpr_" << m_smarts.size() << "(int index, " + m_toolkit->AtomArgType(m_language) + " atom)" << std::endl;
+          os << "bool EvalAtomExpr_" << index << "(int index, " + m_toolkit->AtomArgType(m_language) + " atom)" << std::endl;
           os << "{" << std::endl;
           os << "  switch (index) {" << std::endl;
-          for (int i = 0; i < pattern->atoms.size(); ++i) {
+          for (int i = 0; i < code.atomEvalExpr.size(); ++i) {
             os << "    case " << i << ":" << std::endl;
-            os << "      return " << m_atomEvalExpr[i] << "(atom);" << std::endl;
+            os << "      return " << code.atomEvalExpr[i] << "(atom);" << std::endl;
           }
           os << "  }" << std::endl;
           os << "}" << std::endl;
           os << std::endl;
 
-          if (pattern->bonds.size()) {
-            os << "bool EvalBondExpr_" << m_smarts.size() << "(int index, " + m_toolkit->BondArgType(m_language) + " bond)" << std::endl;
+          if (code.bondEvalExpr.size()) {
+            os << "bool EvalBondExpr_" << index << "(int index, " + m_toolkit->BondArgType(m_language) + " bond)" << std::endl;
             os << "{" << std::endl;
             os << "  switch (index) {" << std::endl;
-            for (int i = 0; i < pattern->bonds.size(); ++i) {
+            for (int i = 0; i < code.bondEvalExpr.size(); ++i) {
               os << "    case " << i << ":" << std::endl;
-              os << "      return " << m_bondEvalExpr[i] << "(bond);" << std::endl;
+              os << "      return " << code.bondEvalExpr[i] << "(bond);" << std::endl;
             }
             os << "  }" << std::endl;
             os << "}" << std::endl;
@@ -2055,26 +2384,26 @@ namespace SC {
           }
           break;
         case SmartsCodeGenerator::Python:
-          os << "def EvalAtomExpr_" << m_smarts.size() << "(index, atom):" << std::endl;
-          os << "  return { " << 0 << ": " << m_atomEvalExpr[0];
-          if (pattern->atoms.size() > 1)
+          os << "def EvalAtomExpr_" << index << "(index, atom):" << std::endl;
+          os << "  return { " << 0 << ": " << code.atomEvalExpr[0];
+          if (code.atomEvalExpr.size() > 1)
             os << "," << std::endl;
-          for (int i = 1; i < pattern->atoms.size(); ++i) {
-            os << "           " << i << ": " << m_atomEvalExpr[i];
-            if (i + 1 < pattern->atoms.size())
+          for (int i = 1; i < code.atomEvalExpr.size(); ++i) {
+            os << "           " << i << ": " << code.atomEvalExpr[i];
+            if (i + 1 < code.atomEvalExpr.size())
               os << "," << std::endl;
           }
           os << " }[index](atom)" << std::endl;
           os << std::endl;
 
-          if (pattern->bonds.size()) {
-            os << "def EvalBondExpr_" << m_smarts.size() << "(index, bond):" << std::endl;
-            os << "  return { " << 0 << ": " << m_bondEvalExpr[0];
-            if (pattern->bonds.size() > 1)
+          if (code.bondEvalExpr.size()) {
+            os << "def EvalBondExpr_" << index << "(index, bond):" << std::endl;
+            os << "  return { " << 0 << ": " << code.bondEvalExpr[0];
+            if (code.bondEvalExpr.size() > 1)
               os << "," << std::endl;
-            for (int i = 1; i < pattern->bonds.size(); ++i) {
-              os << "           " << i << ": " << m_bondEvalExpr[i];
-              if (i + 1 < pattern->bonds.size())
+            for (int i = 1; i < code.bondEvalExpr.size(); ++i) {
+              os << "           " << i << ": " << code.bondEvalExpr[i];
+              if (i + 1 < code.bondEvalExpr.size())
                 os << "," << std::endl;
             }
             os << " }[index](bond)" << std::endl;
@@ -2084,9 +2413,256 @@ namespace SC {
       }
     }
 
+    /**
+     * Declarations for the EvalAtomExpr_N and EvalBondExpr_N functions
+     * defined in the shards.
+     */
+    void GenerateEvalExprDeclarations(std::ostream &os)
+    {
+      for (std::size_t i = 0; i < m_patternCode.size(); ++i) {
+        os << "bool EvalAtomExpr_" << i << "(int index, " + m_toolkit->AtomArgType(m_language) + " atom);" << std::endl;
+        if (m_patternCode[i].bondEvalExpr.size())
+          os << "bool EvalBondExpr_" << i << "(int index, " + m_toolkit->BondArgType(m_language) + " bond);" << std::endl;
+      }
+      os << std::endl;
+    }
+
+    /**
+     * Get the expression to evaluate the atom of a single atom pattern.
+     */
+    std::string SingleAtomExpr(int index, const std::string &atom)
+    {
+      if (m_sharded)
+        return make_string("EvalAtomExpr_", index, "(0, ", atom, ")");
+      return make_string(m_patternCode[index].atomEvalExpr[0], "(", atom, ")");
+    }
+
+    /**
+     * Get the functions needed by a set of patterns.
+     *
+     * @return The indices in m_blocks (i.e. in emission order).
+     */
+    std::vector<std::size_t> GetNeededFunctions(const std::vector<int> &patterns)
+    {
+      std::set<std::size_t> needed;
+      std::vector<std::string> names;
+      for (std::size_t i = 0; i < patterns.size(); ++i) {
+        const PatternCode &code = m_patternCode[patterns[i]];
+        names.insert(names.end(), code.atomEvalExpr.begin(), code.atomEvalExpr.end());
+        names.insert(names.end(), code.bondEvalExpr.begin(), code.bondEvalExpr.end());
+      }
+      while (names.size()) {
+        std::size_t block = m_blockIndex[names.back()];
+        names.pop_back();
+        if (!needed.insert(block).second)
+          continue;
+        names.insert(names.end(), m_blocks[block].calls.begin(), m_blocks[block].calls.end());
+      }
+      return std::vector<std::size_t>(needed.begin(), needed.end());
+    }
+
+    void GenerateIncludes(std::ostream &os)
+    {
+      switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
+        case SmartsCodeGenerator::Cpp:
+          // Python.h has to be included before any standard headers
+          if (m_extension)
+            os << "#include <Python.h>" << std::endl;
+          os << "#include <openbabel/atom.h>" << std::endl;
+          os << "#include <openbabel/bond.h>" << std::endl;
+          os << "#include \"smartspattern.h\"" << std::endl;
+          os << "#include \"smartsmatcher.h\"" << std::endl;
+          os << std::endl;
+          os << "using namespace OpenBabel;" << std::endl;
+          os << "using namespace SC;" << std::endl;
+          os << std::endl;
+          break;
+        case SmartsCodeGenerator::Python:
+          os << "from smartscompiler import *" << std::endl;
+          os << "from openbabel import *" << std::endl;
+          os << std::endl;
+          os << "mol = OBMol()" << std::endl;
+          os << std::endl;
+          break;
+      }
+    }
+
+    /**
+     * Generate the CPython extension module for the Match function. The
+     * Python functions accept an openbabel.OBMol or pybel.Molecule object
+     * or a SMILES string and release the GIL while matching.
+     *
+     *   Match(mol, smarts) -> bool
+     *   MatchAll(mol, smarts) -> [(atom indices), ...]
+     *
+     * OBMol proxies are converted using the SWIG runtime of the openbabel
+     * module, the generated code needs the swigpyrun.h header written by
+     * "swig -python -external-runtime". OpenBabel's perception uses global
+     * typers that are not thread-safe, all lazily perceived properties are
+     * computed while the GIL is still held.
+     */
+    void GenerateExtensionModule(std::ostream &os)
+    {
+      os << "//" << std::endl;
+      os << "// Python extension module" << std::endl;
+      os << "//" << std::endl;
+      os << std::endl;
+      os << "#include <openbabel/mol.h>" << std::endl;
+      os << "#include <openbabel/obconversion.h>" << std::endl;
+      os << "#include \"swigpyrun.h\"" << std::endl;
+      os << std::endl;
+      os << "namespace {" << std::endl;
+      os << std::endl;
+      os << "  OpenBabel::OBMol* GetMolecule(PyObject *obj, OpenBabel::OBMol &tmp)" << std::endl;
+      os << "  {" << std::endl;
+      os << "    // SMILES string" << std::endl;
+      os << "#if PY_MAJOR_VERSION >= 3" << std::endl;
+      os << "    if (PyUnicode_Check(obj)) {" << std::endl;
+      os << "      const char *smiles = PyUnicode_AsUTF8(obj);" << std::endl;
+      os << "#else" << std::endl;
+      os << "    if (PyString_Check(obj)) {" << std::endl;
+      os << "      const char *smiles = PyString_AsString(obj);" << std::endl;
+      os << "#endif" << std::endl;
+      os << "      OpenBabel::OBConversion conv;" << std::endl;
+      os << "      conv.SetInFormat(\"smi\");" << std::endl;
+      os << "      if (!smiles || !conv.ReadString(&tmp, smiles))" << std::endl;
+      os << "        return 0;" << std::endl;
+      os << "      return &tmp;" << std::endl;
+      os << "    }" << std::endl;
+      os << "    // pybel.Molecule" << std::endl;
+      os << "    if (PyObject_HasAttrString(obj, \"OBMol\")) {" << std::endl;
+      os << "      PyObject *obmol = PyObject_GetAttrString(obj, \"OBMol\");" << std::endl;
+      os << "      OpenBabel::OBMol *mol = GetMolecule(obmol, tmp);" << std::endl;
+      os << "      Py_DECREF(obmol);" << std::endl;
+      os << "      return mol;" << std::endl;
+      os << "    }" << std::endl;
+      os << "    // openbabel.OBMol" << std::endl;
+      os << "    static swig_type_info *type = SWIG_TypeQuery(\"OpenBabel::OBMol *\");" << std::endl;
+      os << "    void *ptr = 0;" << std::endl;
+      os << "    if (!type || !SWIG_IsOK(SWIG_ConvertPtr(obj, &ptr, type, 0)))" << std::endl;
+      os << "      return 0;" << std::endl;
+      os << "    return static_cast<OpenBabel::OBMol*>(ptr);" << std::endl;
+      os << "  }" << std::endl;
+      os << std::endl;
+      os << "  /**" << std::endl;
+      os << "   * Run OpenBabel's lazy perception (rings, aromaticity, implicit" << std::endl;
+      os << "   * hydrogens, Kekule bonds), its typers are global and must not run" << std::endl;
+      os << "   * without the GIL." << std::endl;
+      os << "   */" << std::endl;
+      os << "  void PerceiveProperties(OpenBabel::OBMol *mol)" << std::endl;
+      os << "  {" << std::endl;
+      os << "    mol->GetSSSR();" << std::endl;
+      os << "    FOR_ATOMS_OF_MOL (atom, mol) {" << std::endl;
+      os << "      atom->IsInRing();" << std::endl;
+      os << "      atom->IsAromatic();" << std::endl;
+      os << "      atom->GetImplicitValence();" << std::endl;
+      os << "      atom->KBOSum();" << std::endl;
+      os << "    }" << std::endl;
+      os << "    FOR_BONDS_OF_MOL (bond, mol) {" << std::endl;
+      os << "      bond->IsInRing();" << std::endl;
+      os << "      bond->IsAromatic();" << std::endl;
+      os << "    }" << std::endl;
+      os << "  }" << std::endl;
+      os << std::endl;
+      os << "  PyObject* PyMatch(PyObject *self, PyObject *args)" << std::endl;
+      os << "  {" << std::endl;
+      os << "    PyObject *obj;" << std::endl;
+      os << "    const char *smarts;" << std::endl;
+      os << "    if (!PyArg_ParseTuple(args, \"Os\", &obj, &smarts))" << std::endl;
+      os << "      return 0;" << std::endl;
+      os << "    OpenBabel::OBMol tmp;" << std::endl;
+      os << "    OpenBabel::OBMol *mol = GetMolecule(obj, tmp);" << std::endl;
+      os << "    if (!mol) {" << std::endl;
+      os << "      PyErr_SetString(PyExc_TypeError, \"expected an OBMol, pybel.Molecule or SMILES string\");" << std::endl;
+      os << "      return 0;" << std::endl;
+      os << "    }" << std::endl;
+      os << "    PerceiveProperties(mol);" << std::endl;
+      os << "    std::string str(smarts);" << std::endl;
+      os << "    SC::SingleVectorMapping mapping;" << std::endl;
+      os << "    bool result;" << std::endl;
+      os << "    Py_BEGIN_ALLOW_THREADS" << std::endl;
+      os << "    result = " << m_name << "::Match(*mol, str, mapping);" << std::endl;
+      os << "    Py_END_ALLOW_THREADS" << std::endl;
+      os << "    return PyBool_FromLong(result);" << std::endl;
+      os << "  }" << std::endl;
+      os << std::endl;
+      os << "  PyObject* PyMatchAll(PyObject *self, PyObject *args)" << std::endl;
+      os << "  {" << std::endl;
+      os << "    PyObject *obj;" << std::endl;
+      os << "    const char *smarts;" << std::endl;
+      os << "    if (!PyArg_ParseTuple(args, \"Os\", &obj, &smarts))" << std::endl;
+      os << "      return 0;" << std::endl;
+      os << "    OpenBabel::OBMol tmp;" << std::endl;
+      os << "    OpenBabel::OBMol *mol = GetMolecule(obj, tmp);" << std::endl;
+      os << "    if (!mol) {" << std::endl;
+      os << "      PyErr_SetString(PyExc_TypeError, \"expected an OBMol, pybel.Molecule or SMILES string\");" << std::endl;
+      os << "      return 0;" << std::endl;
+      os << "    }" << std::endl;
+      os << "    PerceiveProperties(mol);" << std::endl;
+      os << "    std::string str(smarts);" << std::endl;
+      os << "    SC::VectorMappingList mapping;" << std::endl;
+      os << "    Py_BEGIN_ALLOW_THREADS" << std::endl;
+      os << "    " << m_name << "::Match(*mol, str, mapping);" << std::endl;
+      os << "    Py_END_ALLOW_THREADS" << std::endl;
+      os << "    PyObject *result = PyList_New(mapping.size());" << std::endl;
+      os << "    for (std::size_t i = 0; i < mapping.size(); ++i) {" << std::endl;
+      os << "      PyObject *map = PyTuple_New(mapping[i].size());" << std::endl;
+      os << "      for (std::size_t j = 0; j < mapping[i].size(); ++j)" << std::endl;
+      os << "        PyTuple_SET_ITEM(map, j, PyLong_FromLong(mapping[i][j]));" << std::endl;
+      os << "      PyList_SET_ITEM(result, i, map);" << std::endl;
+      os << "    }" << std::endl;
+      os << "    return result;" << std::endl;
+      os << "  }" << std::endl;
+      os << std::endl;
+      os << "  PyMethodDef methods[] = {" << std::endl;
+      os << "    { \"Match\", PyMatch, METH_VARARGS, \"Match(mol, smarts) -> bool\" }," << std::endl;
+      os << "    { \"MatchAll\", PyMatchAll, METH_VARARGS, \"MatchAll(mol, smarts) -> [(atom indices), ...]\" }," << std::endl;
+      os << "    { 0, 0, 0, 0 }" << std::endl;
+      os << "  };" << std::endl;
+      os << std::endl;
+      os << "}" << std::endl;
+      os << std::endl;
+      os << "#if PY_MAJOR_VERSION >= 3" << std::endl;
+      os << "static struct PyModuleDef module = { PyModuleDef_HEAD_INIT, \"" << m_name << "\", 0, -1, methods };" << std::endl;
+      os << std::endl;
+      os << "PyMODINIT_FUNC PyInit_" << m_name << "()" << std::endl;
+      os << "{" << std::endl;
+      os << "  return PyModule_Create(&module);" << std::endl;
+      os << "}" << std::endl;
+      os << "#else" << std::endl;
+      os << "PyMODINIT_FUNC init" << m_name << "()" << std::endl;
+      os << "{" << std::endl;
+      os << "  Py_InitModule(\"" << m_name << "\", methods);" << std::endl;
+      os << "}" << std::endl;
+      os << "#endif" << std::endl;
+    }
+
+    void GenerateHelperFunctions(std::ostream &os)
+    {
+      if (!m_lookup)
+        return;
+      switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
+        case SmartsCodeGenerator::Cpp:
+          os << "inline bool LookupTable(const unsigned int *table, unsigned int size, unsigned int value)" << std::endl;
+          os << "{" << std::endl;
+          os << "  return value < size && (table[value >> 5] >> (value & 31)) & 1;" << std::endl;
+          os << "}" << std::endl;
+          os << std::endl;
+          break;
+        case SmartsCodeGenerator::Python:
+          os << "def LookupTable(table, size, value):" << std::endl;
+          os << "  return 0 <= value < size and (table >> value) & 1 == 1" << std::endl;
+          os << std::endl;
+          break;
+      }
+    }
+
     void GenerateSmartsIndexFunction(std::ostream &os)
     {
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           os << "int SmartsIndex(const std::string &smarts)" << std::endl;
           os << "{" << std::endl;
@@ -2127,6 +2703,7 @@ namespace SC {
         return;
 
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           os << "bool IsSingleAtom(int index)" << std::endl;
           os << "{" << std::endl;
@@ -2160,6 +2737,7 @@ namespace SC {
     void GenerateSmartsPatternFunction(std::ostream &os)
     {
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           os << "SmartsPattern<" << m_toolkit->AtomType(m_language) << ", "
              << m_toolkit->BondType(m_language) << ">* GetSmartsPattern(int index)" << std::endl;
@@ -2223,6 +2801,7 @@ namespace SC {
     void GenerateMatchFunction(std::ostream &os)
     {
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           os << "template<typename MappingType>" << std::endl;
           os << "bool Match(OpenBabel::OBMol &mol, const std::string &smarts, MappingType &mapping)" << std::endl;
@@ -2280,16 +2859,17 @@ namespace SC {
       }
     }
      
-    void GenerateSingleAtomMatch(std::ostream &os, SmartsAtomExpr *expr)
+    void GenerateSingleAtomMatch(std::ostream &os, int index)
     {
-      os << CommentString() << "[" << GetExprString(expr) << "]" << std::endl;
+      os << CommentString() << "[" << m_patternCode[index].atomExpr << "]" << std::endl;
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           os << "template<typename MappingType>" << std::endl;
-          os << "bool SingleAtomMatch_" << m_smarts.size() << "(OpenBabel::OBMol &mol, MappingType &mapping)" << std::endl;
+          os << "bool SingleAtomMatch_" << index << "(OpenBabel::OBMol &mol, MappingType &mapping)" << std::endl;
           os << "{" << std::endl;
           os << "  FOR_ATOMS_OF_MOL (atom, mol) {" << std::endl;
-          os << "    if (" << m_atomEvalExpr[0] << "(&*atom)) {" << std::endl;
+          os << "    if (" << SingleAtomExpr(index, "&*atom") << ") {" << std::endl;
           os << "      AddMapping(mapping, std::vector<int>(1, atom->GetIdx()));" << std::endl;
           os << "      if (DoSingleMapping<MappingType>::result)" << std::endl;
           os << "        return true;" << std::endl;
@@ -2300,9 +2880,9 @@ namespace SC {
           os << std::endl;
           break;
         case SmartsCodeGenerator::Python:
-          os << "def SingleAtomMatch_" << m_smarts.size() << "(molecule, mapping):" << std::endl;
+          os << "def SingleAtomMatch_" << index << "(molecule, mapping):" << std::endl;
           os << "  for atom in OBMolAtomIter(molecule):" << std::endl;
-          os << "    if " << m_atomEvalExpr[0] << "(atom.GetIdx()):" << std::endl;
+          os << "    if " << SingleAtomExpr(index, "atom.GetIdx()") << ":" << std::endl;
           os << "      mapping.append([atom.GetIdx()])" << std::endl;
           //os << "      if single:" << std::endl;
           //os << "        return True" << std::endl;
@@ -2312,10 +2892,14 @@ namespace SC {
       }
     }
 
-    void GenerateCustomFunction(std::ostream &os, const std::string &function, bool nomap, bool count, bool atom)
+    void GenerateCustomFunction(std::ostream &os, int index)
     {
+      const std::string &function = m_patternCode[index].function;
+      bool nomap = m_patternCode[index].nomap;
+      bool count = m_patternCode[index].count;
+      bool atom = m_patternCode[index].atom;
       // comment: SMARTS [options]
-      os << CommentString() << *m_smarts.rbegin();
+      os << CommentString() << m_smarts[index];
       if (nomap)
         os << " nomap";
       if (count)
@@ -2327,12 +2911,13 @@ namespace SC {
           os << " ";
         os << "atom)" << std::endl;
         os << "{" << std::endl;
-        os << "  return " << m_atomEvalExpr[0] << "(atom);" << std::endl;
+        os << "  return " << SingleAtomExpr(index, "atom") << ";" << std::endl;
         os << "}" << std::endl;
         os << std::endl;
         return;
       }
       switch (m_language) {
+        case SmartsCodeGenerator::PythonExtension:
         case SmartsCodeGenerator::Cpp:
           // template<typename>                                      [for !nomap/!count]
           if (!nomap && !count)
@@ -2359,8 +2944,8 @@ namespace SC {
             os << "  ";
           else
             os << "  return ";
-          if (m_singleatoms.size() && *m_singleatoms.rbegin() == m_smarts.size() - 1) {
-            os << "SingleAtomMatch_" << m_smarts.size() - 1 << "(mol";
+          if (m_singleatoms.find(index) != m_singleatoms.end()) {
+            os << "SingleAtomMatch_" << index << "(mol";
           } else
             os << "Match(mol";
           if (count || nomap)
@@ -2382,6 +2967,23 @@ namespace SC {
   };
 
 
+  /**
+   * Write a file, the file is only written if the contents changed to
+   * avoid rebuilding unchanged shards.
+   */
+  static void WriteFileIfChanged(const std::string &filename, const std::string &contents)
+  {
+    std::ifstream ifs(filename.c_str());
+    if (ifs) {
+      std::stringstream current;
+      current << ifs.rdbuf();
+      if (current.str() == contents)
+        return;
+    }
+    std::ofstream ofs(filename.c_str());
+    ofs << contents;
+  }
+
   SmartsCodeGenerator::SmartsCodeGenerator(Toolkit *toolkit, enum Language language) : d(new SmartsCodeGeneratorPrivate(toolkit, language))
   {
   }
@@ -2391,49 +2993,38 @@ namespace SC {
     delete d;
   }
 
-  void SmartsCodeGenerator::StartSmartsModule(const std::string &name, bool noinline, bool noswitch, bool nomatch, bool optfunc)
+  void SmartsCodeGenerator::StartSmartsModule(const std::string &name, bool noinline, bool noswitch, bool nomatch, bool optfunc,
+      bool lookupTables)
   {
+    d->m_name = name;
     d->m_noinline = noinline;
     d->m_noswitch = noswitch;
     d->m_nomatch = nomatch;
     d->m_optfunc = optfunc;
-
-    if (d->m_language == Cpp) {
-      d->m_os << "#include <openbabel/atom.h>" << std::endl;
-      d->m_os << "#include <openbabel/bond.h>" << std::endl;
-      d->m_os << "#include \"smartspattern.h\"" << std::endl;
-      d->m_os << "#include \"smartsmatcher.h\"" << std::endl;
-      d->m_os << std::endl;
-      d->m_os << "using namespace OpenBabel;" << std::endl;
-      d->m_os << "using namespace SC;" << std::endl;
-      d->m_os << std::endl;
-      d->m_os << "namespace " << name << " {" << std::endl;
-      d->m_os << std::endl;
-    } else {
-      d->m_os << "from smartscompiler import *" << std::endl;
-      d->m_os << "from openbabel import *" << std::endl;
-      d->m_os << std::endl;
-      d->m_os << "mol = OBMol()" << std::endl;
-      d->m_os << std::endl;
-    }
+    d->m_lookup = lookupTables;
+    d->m_symbols.SetShortNames(optfunc);
   }
 
   void SmartsCodeGenerator::GeneratePatternCode(const std::string &smarts, Smarts *pattern, const std::string &function,
       bool nomap, bool count, bool atom)
   {
-    d->m_atomEvalExpr.clear();
-    d->m_bondEvalExpr.clear();
+    // the bonds are listed in search plan order
+    std::vector<SmartsSearchStep> plan = pattern->plan.empty() ? CreateSearchPlan(pattern) : pattern->plan;
 
+    PatternCode code;
     for (int i = 0; i < pattern->atoms.size(); ++i)
-      d->m_atomEvalExpr[i] = d->GenerateExprFunction(d->m_os, pattern->atoms[i].expr);
-    for (int i = 0; i < pattern->bonds.size(); ++i)
-      d->m_bondEvalExpr[i] = d->GenerateExprFunction(d->m_os, pattern->bonds[i].expr);
-
-    d->GenerateEvalExprFunction(d->m_os, pattern);
+      code.atomEvalExpr.push_back(d->GenerateExprFunction(pattern->atoms[i].expr));
+    for (std::size_t i = 0; i < plan.size(); ++i)
+      if (plan[i].bond >= 0)
+        code.bondEvalExpr.push_back(d->GenerateExprFunction(pattern->bonds[plan[i].bond].expr));
+    code.function = function;
+    code.nomap = nomap;
+    code.count = count;
+    code.atom = atom;
 
     if (pattern->atoms.size() == 1) {
       // special case for single atom pattern
-      d->GenerateSingleAtomMatch(d->m_os, pattern->atoms[0].expr);
+      code.atomExpr = GetExprString(pattern->atoms[0].expr);
       d->m_singleatoms.insert(d->m_patterns.size());
       // dummy pattern
       d->m_patterns.push_back(SmartsPattern<OBAtom, OBBond>());
@@ -2441,38 +3032,158 @@ namespace SC {
       SmartsPattern<OBAtom, OBBond> cpattern;
       cpattern.numAtoms = pattern->atoms.size();
       cpattern.ischiral = pattern->chiral;
-      for (int i = 0; i < pattern->bonds.size(); ++i)
-        cpattern.bonds.push_back(SmartsBond(pattern->bonds[i].source, pattern->bonds[i].target, pattern->bonds[i].grow));
+      // bonds are oriented from the mapped atom, grow is false for ring closures
+      for (std::size_t i = 0; i < plan.size(); ++i)
+        if (plan[i].bond >= 0)
+          cpattern.bonds.push_back(SmartsBond(plan[i].source, plan[i].target, !plan[i].closure));
       d->m_patterns.push_back(cpattern);
     }
     
     d->m_smarts.push_back(smarts);
+    d->m_patternCode.push_back(code);
+  }
 
-    if (function.size())
-        d->GenerateCustomFunction(d->m_os, function, nomap, count, atom);
+  void SmartsCodeGenerator::GeneratePatternCode(const CompiledSmarts &pattern, const std::string &function,
+      bool nomap, bool count, bool atom)
+  {
+    // the code generator only reads the pattern
+    GeneratePatternCode(pattern.smarts(), const_cast<Smarts*>(pattern.pattern()), function, nomap, count, atom);
   }
 
   void SmartsCodeGenerator::StopSmartsModule(std::ostream &os)
   {
-    if (!d->m_nomatch) {
-      d->GenerateSmartsIndexFunction(d->m_os);
-      d->GenerateIsSingleAtomFunction(d->m_os);
-      d->GenerateSmartsPatternFunction(d->m_os);
-      d->GenerateMatchFunction(d->m_os);
+    d->m_sharded = false;
+
+    d->GenerateIncludes(os);
+    if (d->m_language == Cpp) {
+      os << "namespace " << d->m_name << " {" << std::endl;
+      os << std::endl;
+    }
+    d->GenerateHelperFunctions(os);
+
+    std::size_t block = 0;
+    for (std::size_t i = 0; i < d->m_patternCode.size(); ++i) {
+      for (; block < d->m_blocks.size() && d->m_blocks[block].pattern == static_cast<int>(i); ++block)
+        os << d->m_blocks[block].code;
+      d->GenerateEvalExprFunction(os, i);
+      if (d->m_singleatoms.find(i) != d->m_singleatoms.end())
+        d->GenerateSingleAtomMatch(os, i);
+      if (d->m_patternCode[i].function.size())
+        d->GenerateCustomFunction(os, i);
     }
 
-    if (d->m_optfunc) {
-      std::string code = d->m_os.str();
-      std::sort(d->m_functions.begin(), d->m_functions.end(), SortContainers<std::string, ContainerSize, std::greater>());
-      for (std::size_t i = 0; i < d->m_functions.size(); ++i) {
-        replace_all(code, d->m_functions[i], make_string("f", i + 1));
-      }
-      os << code;
-    } else
-      os << d->m_os.str();
+    if (!d->m_nomatch) {
+      d->GenerateSmartsIndexFunction(os);
+      d->GenerateIsSingleAtomFunction(os);
+      d->GenerateSmartsPatternFunction(os);
+      d->GenerateMatchFunction(os);
+    }
 
     if (d->m_language == Cpp)
       os << "} // end namespace" << std::endl;
+
+    if (d->m_extension && !d->m_nomatch) {
+      os << std::endl;
+      d->GenerateExtensionModule(os);
+    }
+  }
+
+  void SmartsCodeGenerator::StopSmartsModule(const std::string &prefix, int numShards)
+  {
+    if (d->m_language != Cpp || d->m_extension || numShards < 1) {
+      // sharding is only supported for C++
+      std::ofstream ofs((d->m_language == Cpp ? prefix + ".cpp" : prefix + ".py").c_str());
+      StopSmartsModule(ofs);
+      return;
+    }
+
+    d->m_sharded = true;
+    std::string base = prefix.substr(prefix.find_last_of("/\\") == std::string::npos ? 0 : prefix.find_last_of("/\\") + 1);
+    int numPatterns = d->m_patternCode.size();
+
+    // shared header: declarations, templates and the Match function
+    std::stringstream header;
+    std::string guard = make_string("SC_MODULE_", d->m_name, "_H");
+    std::transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+    header << "#ifndef " << guard << std::endl;
+    header << "#define " << guard << std::endl;
+    header << std::endl;
+    d->GenerateIncludes(header);
+    header << "namespace " << d->m_name << " {" << std::endl;
+    header << std::endl;
+    d->GenerateEvalExprDeclarations(header);
+    if (!d->m_nomatch) {
+      header << "int SmartsIndex(const std::string &smarts);" << std::endl;
+      if (d->m_singleatoms.size())
+        header << "bool IsSingleAtom(int index);" << std::endl;
+      header << "SmartsPattern<" << d->m_toolkit->AtomType(Cpp) << ", "
+             << d->m_toolkit->BondType(Cpp) << ">* GetSmartsPattern(int index);" << std::endl;
+      header << std::endl;
+    }
+    for (std::set<int>::iterator i = d->m_singleatoms.begin(); i != d->m_singleatoms.end(); ++i)
+      d->GenerateSingleAtomMatch(header, *i);
+    if (!d->m_nomatch)
+      d->GenerateMatchFunction(header);
+    for (int i = 0; i < numPatterns; ++i)
+      if (d->m_patternCode[i].function.size())
+        d->GenerateCustomFunction(header, i);
+    header << "} // end namespace" << std::endl;
+    header << std::endl;
+    header << "#endif" << std::endl;
+    WriteFileIfChanged(prefix + ".h", header.str());
+
+    // shards: the expression functions needed by the shard's patterns and
+    // the EvalAtomExpr_N/EvalBondExpr_N functions
+    std::stringstream manifest;
+    manifest << "# SMARTS module " << d->m_name << ": " << numPatterns << " patterns in " << numShards << " shards" << std::endl;
+    manifest << "set(" << d->m_name << "_HEADER ${CMAKE_CURRENT_LIST_DIR}/" << base << ".h)" << std::endl;
+    manifest << "set(" << d->m_name << "_SOURCES" << std::endl;
+    if (!d->m_nomatch)
+      manifest << "  ${CMAKE_CURRENT_LIST_DIR}/" << base << "_dispatch.cpp" << std::endl;
+    for (int shard = 0; shard < numShards; ++shard) {
+      std::vector<int> patterns;
+      for (int i = shard * numPatterns / numShards; i < (shard + 1) * numPatterns / numShards; ++i)
+        patterns.push_back(i);
+
+      std::stringstream code;
+      code << "// SMARTS module " << d->m_name << ", shard " << shard;
+      if (patterns.size())
+        code << " (patterns " << patterns.front() << "-" << patterns.back() << ")";
+      code << std::endl;
+      d->GenerateIncludes(code);
+      code << "namespace " << d->m_name << " {" << std::endl;
+      code << std::endl;
+      d->GenerateHelperFunctions(code);
+      std::vector<std::size_t> functions = d->GetNeededFunctions(patterns);
+      for (std::size_t i = 0; i < functions.size(); ++i)
+        code << d->m_blocks[functions[i]].code;
+      for (std::size_t i = 0; i < patterns.size(); ++i)
+        d->GenerateEvalExprFunction(code, patterns[i]);
+      code << "} // end namespace" << std::endl;
+      WriteFileIfChanged(make_string(prefix, "_", shard, ".cpp"), code.str());
+
+      if (patterns.size())
+        manifest << "  # patterns " << patterns.front() << "-" << patterns.back() << std::endl;
+      manifest << "  ${CMAKE_CURRENT_LIST_DIR}/" << base << "_" << shard << ".cpp" << std::endl;
+    }
+    manifest << "  )" << std::endl;
+
+    // dispatch table: SMARTS -> index -> pattern
+    if (!d->m_nomatch) {
+      std::stringstream dispatch;
+      dispatch << "#include \"" << base << ".h\"" << std::endl;
+      dispatch << std::endl;
+      dispatch << "namespace " << d->m_name << " {" << std::endl;
+      dispatch << std::endl;
+      d->GenerateSmartsIndexFunction(dispatch);
+      d->GenerateIsSingleAtomFunction(dispatch);
+      d->GenerateSmartsPatternFunction(dispatch);
+      dispatch << "} // end namespace" << std::endl;
+      WriteFileIfChanged(prefix + "_dispatch.cpp", dispatch.str());
+    }
+
+    WriteFileIfChanged(prefix + ".cmake", manifest.str());
+    d->m_sharded = false;
   }
 
 }
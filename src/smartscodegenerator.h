@@ -7,6 +7,7 @@
 namespace SC {
 
   struct Smarts;
+  class CompiledSmarts;
   class Toolkit;
 
   struct SmartsCodeGeneratorPrivate;
@@ -17,7 +18,12 @@ namespace SC {
       enum Language
       {
         Cpp,
-        Python
+        Python,
+        /**
+         * C++ code with a CPython extension module providing Match and
+         * MatchAll functions.
+         */
+        PythonExtension
       };
 
       enum ArgType
@@ -30,11 +36,32 @@ namespace SC {
       ~SmartsCodeGenerator();
 
       void StartSmartsModule(const std::string &name,bool noInline = false, 
-          bool noSwitch = false, bool noMatch = false, bool optimizeFunctioNames = false);
+          bool noSwitch = false, bool noMatch = false, bool optimizeFunctioNames = false,
+          bool lookupTables = false);
       void GeneratePatternCode(const std::string &smarts, Smarts *pattern,
           const std::string &function = std::string(), bool nomap = false, 
           bool count = false, bool atom = false);
+      /**
+       * @overload
+       */
+      void GeneratePatternCode(const CompiledSmarts &pattern,
+          const std::string &function = std::string(), bool nomap = false,
+          bool count = false, bool atom = false);
       void StopSmartsModule(std::ostream &os);
+      /**
+       * Write the module as @p numShards translation units that can be
+       * compiled in parallel. The files written are:
+       *
+       * - prefix.h: shared header with declarations, the templates and Match
+       * - prefix_N.cpp: shard N with the code for a contiguous range of patterns
+       * - prefix_dispatch.cpp: SmartsIndex, IsSingleAtom and GetSmartsPattern
+       * - prefix.cmake: build manifest listing the sources for each shard
+       *
+       * Files are only written when their contents changed so only the
+       * shards with changed patterns are rebuilt. Sharding is only supported
+       * for C++, other languages are written to a single file.
+       */
+      void StopSmartsModule(const std::string &prefix, int numShards);
 
     private:
       SmartsCodeGeneratorPrivate * const d;
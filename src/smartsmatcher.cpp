@@ -1,10 +1,14 @@
 #include "smartsmatcher.h"
+#include "compiledsmarts.h"
 #include "smartspattern.h"
+#include "smartsscores.h"
+#include "pattern.h"
 #include "defines.h"
 #include "util.h"
 
 #include "openbabel.h"
 #include "molecule.h"
+#include "moleculefile.h"
 
 #include <openbabel/mol.h>
 #include <openbabel/stereo/stereo.h>
@@ -118,6 +122,134 @@ namespace SC {
   };
 
 
+  /**
+   * Smarts wrapper that records the result of every (sub)expression it
+   * evaluates.
+   */
+  class ProfileSmarts
+  {
+    public:
+      typedef const SmartsAtom& atom_type;
+      typedef const SmartsBond& bond_type;
+
+      ProfileSmarts(Smarts *smarts, ProfileSmartsScores &scores) : m_smarts(smarts), m_scores(&scores)
+      {
+        for (std::size_t i = 0; i < smarts->atoms.size(); ++i)
+          AddKeys(smarts->atoms[i].expr);
+        for (std::size_t i = 0; i < smarts->bonds.size(); ++i)
+          AddKeys(smarts->bonds[i].expr);
+      }
+
+      int numAtoms() const
+      {
+        return m_smarts->numAtoms();
+      }
+
+      const SmartsAtom& atom(int index) const
+      {
+        return m_smarts->atom(index);
+      }
+
+      int numBonds() const
+      {
+        return m_smarts->numBonds();
+      }
+
+      const SmartsBond& bond(int index) const
+      {
+        return m_smarts->bond(index);
+      }
+
+      const std::vector<SmartsSearchStep>& searchPlan() const
+      {
+        return m_smarts->searchPlan();
+      }
+
+      Smarts* smarts() const
+      {
+        return m_smarts;
+      }
+
+      template<typename AtomType>
+      bool matchAtom(const SmartsAtom &smartsAtom, const AtomType &atom) const
+      {
+        return matchAtomExpr(smartsAtom.expr, atom);
+      }
+
+      template<typename AtomType>
+      bool matchAtomExpr(const SmartsAtomExpr *expr, const AtomType &atom) const
+      {
+        bool result;
+        switch (expr->type) {
+          case Smiley::OP_Not:
+            result = !matchAtomExpr(expr->unary.arg, atom);
+            break;
+          case Smiley::OP_AndHi:
+          case Smiley::OP_AndLo:
+            result = matchAtomExpr(expr->binary.lft, atom);
+            result = matchAtomExpr(expr->binary.rgt, atom) && result;
+            break;
+          case Smiley::OP_Or:
+            result = matchAtomExpr(expr->binary.lft, atom);
+            result = matchAtomExpr(expr->binary.rgt, atom) || result;
+            break;
+          default:
+            result = m_smarts->matchAtomExpr(expr, atom);
+            break;
+        }
+        m_scores->AddExprResult(m_keys.find(expr)->second, result);
+        return result;
+      }
+
+      template<typename BondType>
+      bool matchBond(const SmartsBond &smartsBond, const BondType &bond) const
+      {
+        return matchBondExpr(smartsBond.expr, bond);
+      }
+
+      template<typename BondType>
+      bool matchBondExpr(const SmartsBondExpr *expr, const BondType &bond) const
+      {
+        bool result;
+        switch (expr->type) {
+          case Smiley::OP_Not:
+            result = !matchBondExpr(expr->unary.arg, bond);
+            break;
+          case Smiley::OP_AndHi:
+          case Smiley::OP_AndLo:
+            result = matchBondExpr(expr->binary.lft, bond);
+            result = matchBondExpr(expr->binary.rgt, bond) && result;
+            break;
+          case Smiley::OP_Or:
+            result = matchBondExpr(expr->binary.lft, bond);
+            result = matchBondExpr(expr->binary.rgt, bond) || result;
+            break;
+          default:
+            result = m_smarts->matchBondExpr(expr, bond);
+            break;
+        }
+        m_scores->AddExprResult(m_keys.find(expr)->second, result);
+        return result;
+      }
+
+    private:
+      template<typename Expr>
+      void AddKeys(Expr *expr)
+      {
+        m_keys[expr] = ProfileSmartsScores::GetExprKey(expr);
+        if (IsUnary(expr))
+          AddKeys(expr->unary.arg);
+        else if (IsBinary(expr)) {
+          AddKeys(expr->binary.lft);
+          AddKeys(expr->binary.rgt);
+        }
+      }
+
+      Smarts *m_smarts;
+      ProfileSmartsScores *m_scores;
+      std::map<const void*, std::string> m_keys;
+  };
+
   template<typename MoleculeType, typename SmartsType, typename MappingType>
   class SmartsMatcherImpl
   {
@@ -132,123 +264,121 @@ namespace SC {
       typedef typename molecule_traits<MoleculeType>::atom_wrapper_type AtomWrapperType;
       typedef typename molecule_traits<MoleculeType>::bond_wrapper_type BondWrapperType;
 
-      SmartsMatcherImpl(MoleculeType *mol, SmartsType *smarts)
+      SmartsMatcherImpl(MoleculeType *mol, SmartsType *smarts) : m_plan(&smarts->searchPlan())
       {
         m_mol = mol;
         m_smarts = smarts;
         m_map.resize(smarts->numAtoms(), -1);
-        m_bonds.resize(smarts->numBonds(), false);
+        m_atoms.resize(smarts->numAtoms());
       }
 
-      void match(MappingType &mapping, SmartsAtomType smartsAtom, AtomArgType atom, int prevAtom = -1)
+      /**
+       * Map pattern atom @p index to @p atom and continue with the next
+       * step in the search plan.
+       */
+      void matchAtom(MappingType &mapping, std::size_t step, int index, AtomArgType atom)
       {
+        int atomIndex = GetAtomIndex(m_mol, atom);
+        // each molecule atom is mapped at most once
+        if (std::find(m_map.begin(), m_map.end(), atomIndex) != m_map.end())
+          return;
         // if the atom properties don't match, there is nothing to do
-        if (!m_smarts->matchAtom(smartsAtom, AtomWrapperType(atom)))
+        if (!m_smarts->matchAtom(m_smarts->atom(index), AtomWrapperType(atom)))
           return;
 
-        m_map[smartsAtom.index] = GetAtomIndex(m_mol, atom);
-        //std::cout << smartsAtom.index << " -> " << GetAtomIndex(m_mol, atom) << std::endl;
+        m_map[index] = atomIndex;
+        m_atoms[index] = atom;
+        match(mapping, step + 1);
+        m_map[index] = -1;
+      }
 
+      void match(MappingType &mapping, std::size_t step)
+      {
         // check for mapping
-        if (std::find(m_map.begin(), m_map.end(), -1) == m_map.end()) {
-          // ring closures
-          bool ringClosuresMatch = true;
-          for (std::size_t i = 0; i < m_bonds.size(); ++i) {
-            SmartsBondType smartsBond = m_smarts->bond(i);
-            if (!m_bonds[smartsBond.index]) {
-              ringClosuresMatch = false;
-
-              MolAtomIter source = GetBeginAtoms<MoleculeType*, MolAtomIter>(m_mol);
-              std::advance(source, m_map[smartsBond.source]);
-              MolAtomIter target = GetBeginAtoms<MoleculeType*, MolAtomIter>(m_mol);
-              std::advance(target, m_map[smartsBond.target]);
-
-              //std::cout << "Ring Closure: " << (*source)->GetIndex() << "-" << (*target)->GetIndex() << std::endl;
-
-              AtomBondIter bond = GetBeginBonds<MoleculeType*, AtomArgType, AtomBondIter>(m_mol, *source);
-              AtomBondIter bonds_end = GetEndBonds<MoleculeType*, AtomArgType, AtomBondIter>(m_mol, *source);
-              for (; bond != bonds_end; ++bond)
-                if (GetAtomIndex(m_mol, GetOtherAtom(m_mol, *bond, *source)) == GetAtomIndex(m_mol, *target)) {
-                  //std::cout << "..." << std::endl;
-                  if (m_smarts->matchBond(smartsBond, BondWrapperType(*bond))) {
-                    ringClosuresMatch = true;
-                    break;
-                  }
-                }
-
-              if (!ringClosuresMatch)
-                break;
-            }
-          }
-
-          if (ringClosuresMatch) {
-            //std::cout << "found mapping..." << std::endl;
-            AddMapping(mapping, m_map);
-          }
-
-          m_map[smartsAtom.index] = -1;
+        if (step == m_plan->size()) {
+          std::vector<int> map(m_map);
+          AddMapping(mapping, map);
           return;
         }
 
-        for (int i = 0; i < smartsAtom.degree(); ++i) {
-          SmartsBondType smartsBond = smartsAtom.bond(i);
+        const SmartsSearchStep &searchStep = (*m_plan)[step];
 
-          if (m_bonds[smartsBond.index])
-            continue;
-          
+        // first atom of a connected component: try each atom in the molecule
+        if (searchStep.source < 0) {
+          MolAtomIter atom = GetBeginAtoms<MoleculeType*, MolAtomIter>(m_mol);
+          MolAtomIter atoms_end = GetEndAtoms<MoleculeType*, MolAtomIter>(m_mol);
+          for (; atom != atoms_end; ++atom) {
+            matchAtom(mapping, step, searchStep.target, *atom);
 
-          SmartsAtomType nbrSmartsAtom = m_smarts->atom(smartsBond.other(smartsAtom.index));
+            if (DoSingleMapping<MappingType>::result && !EmptyMapping(mapping))
+              return;
+          }
+          return;
+        }
 
-          if (m_map[nbrSmartsAtom.index] != -1)
-            continue;
+        SmartsBondType smartsBond = m_smarts->bond(searchStep.bond);
+        AtomArgType source = m_atoms[searchStep.source];
 
-          AtomBondIter bond = GetBeginBonds<MoleculeType*, AtomArgType, AtomBondIter>(m_mol, atom);
-          AtomBondIter bonds_end = GetEndBonds<MoleculeType*, AtomArgType, AtomBondIter>(m_mol, atom);
-          for (; bond != bonds_end; ++bond) {
-            if (!m_smarts->matchBond(smartsBond, BondWrapperType(*bond)))
-              continue;
+        AtomBondIter bond = GetBeginBonds<MoleculeType*, AtomArgType, AtomBondIter>(m_mol, source);
+        AtomBondIter bonds_end = GetEndBonds<MoleculeType*, AtomArgType, AtomBondIter>(m_mol, source);
+        for (; bond != bonds_end; ++bond) {
+          AtomArgType nbrAtom = GetOtherAtom(m_mol, *bond, source);
 
-            AtomArgType nbrAtom = GetOtherAtom(m_mol, *bond, atom);
-            if (GetAtomIndex(m_mol, nbrAtom) == prevAtom)
+          // ring closure: check the bond between two mapped atoms
+          if (searchStep.closure) {
+            if (static_cast<int>(GetAtomIndex(m_mol, nbrAtom)) != m_map[searchStep.target])
               continue;
+            if (m_smarts->matchBond(smartsBond, BondWrapperType(*bond)))
+              match(mapping, step + 1);
+            return;
+          }
 
-            m_bonds[smartsBond.index] = true;
-            match(mapping, nbrSmartsAtom, nbrAtom, GetAtomIndex(m_mol, atom));
-
-            if (DoSingleMapping<MappingType>::result && !EmptyMapping(mapping))
-              return;
+          if (!m_smarts->matchBond(smartsBond, BondWrapperType(*bond)))
+            continue;
 
+          matchAtom(mapping, step, searchStep.target, nbrAtom);
 
-            m_bonds[smartsBond.index] = false;
-          }
-          
+          if (DoSingleMapping<MappingType>::result && !EmptyMapping(mapping))
+            return;
         }
-
-        m_map[smartsAtom.index] = -1;
       }
 
       void match(MappingType &mapping)
       {
-        if (m_smarts->atoms.empty())
+        if (!m_smarts->numAtoms())
           return;
 
-        // try to match each atom in the molecule against the first atom
-        // epxression in the SMARTS 
-        MolAtomIter atom = GetBeginAtoms<MoleculeType*, MolAtomIter>(m_mol);
-        MolAtomIter atoms_end = GetEndAtoms<MoleculeType*, MolAtomIter>(m_mol);
-        for (; atom != atoms_end; ++atom) {
-          match(mapping, m_smarts->atom(0), *atom);
-
-          if (DoSingleMapping<MappingType>::result && !EmptyMapping(mapping))
-            return;
+        // patterns that were not parsed have no search plan yet
+        if (m_plan->empty()) {
+          m_defaultPlan = CreateSearchPlan(m_smarts);
+          m_plan = &m_defaultPlan;
         }
+
+        match(mapping, 0);
       }
 
     private:
+      std::vector<SmartsSearchStep> CreateSearchPlan(Smarts *smarts)
+      {
+        return SC::CreateSearchPlan(smarts);
+      }
+
+      std::vector<SmartsSearchStep> CreateSearchPlan(ProfileSmarts *smarts)
+      {
+        return SC::CreateSearchPlan(smarts->smarts());
+      }
+
+      std::vector<SmartsSearchStep> CreateSearchPlan(const CompiledSmarts *smarts)
+      {
+        return SC::CreateSearchPlan(smarts->pattern());
+      }
+
       MoleculeType *m_mol;
       SmartsType *m_smarts;
-      std::vector<int>  m_map;
-      std::vector<bool> m_bonds;
+      const std::vector<SmartsSearchStep> *m_plan;
+      std::vector<SmartsSearchStep> m_defaultPlan;
+      std::vector<int> m_map;
+      std::vector<AtomArgType> m_atoms;
   };
 
   template<typename MoleculeType, typename SmartsType, typename MappingType>
@@ -265,12 +395,64 @@ namespace SC {
     return !EmptyMapping(mapping);
   }
 
+  template<typename MoleculeType>
+  bool profile(MoleculeType *mol, Smarts *smarts, ProfileSmartsScores &scores)
+  {
+    typedef typename molecule_traits<MoleculeType>::atom_arg_type AtomArgType;
+    typedef typename molecule_traits<MoleculeType>::mol_atom_iterator_type MolAtomIter;
+    typedef typename molecule_traits<MoleculeType>::atom_bond_iterator_type AtomBondIter;
+    typedef typename molecule_traits<MoleculeType>::atom_wrapper_type AtomWrapperType;
+    typedef typename molecule_traits<MoleculeType>::bond_wrapper_type BondWrapperType;
+
+    // expression pass rates from the actual search
+    ProfileSmarts profileSmarts(smarts, scores);
+    NoMapping mapping;
+    bool result = match(mol, &profileSmarts, mapping);
+
+    // branching factor for each pattern bond in both directions
+    for (int i = 0; i < smarts->numBonds(); ++i) {
+      const SmartsBond &smartsBond = smarts->bond(i);
+      for (int j = 0; j < 2; ++j) {
+        int source = j ? smartsBond.target : smartsBond.source;
+        const SmartsAtom &sourceAtom = smarts->atom(source);
+        const SmartsAtom &targetAtom = smarts->atom(smartsBond.other(source));
+        std::string key = ProfileSmartsScores::GetBondKey(smarts, &smartsBond, source);
+
+        MolAtomIter atom = GetBeginAtoms<MoleculeType*, MolAtomIter>(mol);
+        MolAtomIter atoms_end = GetEndAtoms<MoleculeType*, MolAtomIter>(mol);
+        for (; atom != atoms_end; ++atom) {
+          if (!smarts->matchAtom(sourceAtom, AtomWrapperType(*atom)))
+            continue;
+
+          unsigned long edges = 0;
+          AtomBondIter bond = GetBeginBonds<MoleculeType*, AtomArgType, AtomBondIter>(mol, *atom);
+          AtomBondIter bonds_end = GetEndBonds<MoleculeType*, AtomArgType, AtomBondIter>(mol, *atom);
+          for (; bond != bonds_end; ++bond)
+            if (smarts->matchBond(smartsBond, BondWrapperType(*bond)) &&
+                smarts->matchAtom(targetAtom, AtomWrapperType(GetOtherAtom(mol, *bond, *atom))))
+              ++edges;
+
+          scores.AddBranching(key, edges);
+        }
+      }
+    }
+
+    return result;
+  }
+
   template bool match<Molecule, Smarts, SingleVectorMapping>(Molecule *mol, Smarts *smarts, SingleVectorMapping &mapping);
   template bool match<Molecule, Smarts, VectorMappingList>(Molecule *mol, Smarts *smarts, VectorMappingList &mapping);
   template bool match<Molecule, Smarts, NoMapping>(Molecule *mol, Smarts *smarts, NoMapping &mapping);
   template bool match<Molecule, Smarts, SingleMapping>(Molecule *mol, Smarts *smarts, SingleMapping &mapping);
   template bool match<Molecule, Smarts, CountMapping>(Molecule *mol, Smarts *smarts, CountMapping &mapping);
   template bool match<Molecule, Smarts, MappingList>(Molecule *mol, Smarts *smarts, MappingList &mapping);
+  template bool profile<Molecule>(Molecule *mol, Smarts *smarts, ProfileSmartsScores &scores);
+  template bool match<Molecule, const CompiledSmarts, SingleVectorMapping>(Molecule *mol, const CompiledSmarts *smarts, SingleVectorMapping &mapping);
+  template bool match<Molecule, const CompiledSmarts, VectorMappingList>(Molecule *mol, const CompiledSmarts *smarts, VectorMappingList &mapping);
+  template bool match<Molecule, const CompiledSmarts, NoMapping>(Molecule *mol, const CompiledSmarts *smarts, NoMapping &mapping);
+  template bool match<Molecule, const CompiledSmarts, SingleMapping>(Molecule *mol, const CompiledSmarts *smarts, SingleMapping &mapping);
+  template bool match<Molecule, const CompiledSmarts, CountMapping>(Molecule *mol, const CompiledSmarts *smarts, CountMapping &mapping);
+  template bool match<Molecule, const CompiledSmarts, MappingList>(Molecule *mol, const CompiledSmarts *smarts, MappingList &mapping);
 
 
   // OpenBabel
@@ -280,5 +462,27 @@ namespace SC {
   template bool match<OpenBabel::OBMol, Smarts, SingleMapping>(OpenBabel::OBMol *mol, Smarts *smarts, SingleMapping &mapping);
   template bool match<OpenBabel::OBMol, Smarts, CountMapping>(OpenBabel::OBMol *mol, Smarts *smarts, CountMapping &mapping);
   template bool match<OpenBabel::OBMol, Smarts, MappingList>(OpenBabel::OBMol *mol, Smarts *smarts, MappingList &mapping);
+  template bool profile<OpenBabel::OBMol>(OpenBabel::OBMol *mol, Smarts *smarts, ProfileSmartsScores &scores);
+  template bool match<OpenBabel::OBMol, const CompiledSmarts, SingleVectorMapping>(OpenBabel::OBMol *mol, const CompiledSmarts *smarts, SingleVectorMapping &mapping);
+  template bool match<OpenBabel::OBMol, const CompiledSmarts, VectorMappingList>(OpenBabel::OBMol *mol, const CompiledSmarts *smarts, VectorMappingList &mapping);
+  template bool match<OpenBabel::OBMol, const CompiledSmarts, NoMapping>(OpenBabel::OBMol *mol, const CompiledSmarts *smarts, NoMapping &mapping);
+  template bool match<OpenBabel::OBMol, const CompiledSmarts, SingleMapping>(OpenBabel::OBMol *mol, const CompiledSmarts *smarts, SingleMapping &mapping);
+  template bool match<OpenBabel::OBMol, const CompiledSmarts, CountMapping>(OpenBabel::OBMol *mol, const CompiledSmarts *smarts, CountMapping &mapping);
+  template bool match<OpenBabel::OBMol, const CompiledSmarts, MappingList>(OpenBabel::OBMol *mol, const CompiledSmarts *smarts, MappingList &mapping);
+
+  // MoleculeView (binary *.scm files)
+  template bool match<MoleculeView, Smarts, SingleVectorMapping>(MoleculeView *mol, Smarts *smarts, SingleVectorMapping &mapping);
+  template bool match<MoleculeView, Smarts, VectorMappingList>(MoleculeView *mol, Smarts *smarts, VectorMappingList &mapping);
+  template bool match<MoleculeView, Smarts, NoMapping>(MoleculeView *mol, Smarts *smarts, NoMapping &mapping);
+  template bool match<MoleculeView, Smarts, SingleMapping>(MoleculeView *mol, Smarts *smarts, SingleMapping &mapping);
+  template bool match<MoleculeView, Smarts, CountMapping>(MoleculeView *mol, Smarts *smarts, CountMapping &mapping);
+  template bool match<MoleculeView, Smarts, MappingList>(MoleculeView *mol, Smarts *smarts, MappingList &mapping);
+  template bool profile<MoleculeView>(MoleculeView *mol, Smarts *smarts, ProfileSmartsScores &scores);
+  template bool match<MoleculeView, const CompiledSmarts, SingleVectorMapping>(MoleculeView *mol, const CompiledSmarts *smarts, SingleVectorMapping &mapping);
+  template bool match<MoleculeView, const CompiledSmarts, VectorMappingList>(MoleculeView *mol, const CompiledSmarts *smarts, VectorMappingList &mapping);
+  template bool match<MoleculeView, const CompiledSmarts, NoMapping>(MoleculeView *mol, const CompiledSmarts *smarts, NoMapping &mapping);
+  template bool match<MoleculeView, const CompiledSmarts, SingleMapping>(MoleculeView *mol, const CompiledSmarts *smarts, SingleMapping &mapping);
+  template bool match<MoleculeView, const CompiledSmarts, CountMapping>(MoleculeView *mol, const CompiledSmarts *smarts, CountMapping &mapping);
+  template bool match<MoleculeView, const CompiledSmarts, MappingList>(MoleculeView *mol, const CompiledSmarts *smarts, MappingList &mapping);
 
 }
@@ -5,6 +5,9 @@
 
 namespace SC {
 
+  struct Smarts;
+  class ProfileSmartsScores;
+
   typedef std::vector<int> SingleVectorMapping;
   typedef std::vector<std::vector<int> > VectorMappingList;
 
@@ -70,6 +73,15 @@ namespace SC {
     return match(mol, smarts, mapping);
   }
 
+  /**
+   * Match a SMARTS against a molecule while recording the pass rate of all
+   * atom and bond (sub)expressions and the branching factor of every pattern
+   * bond in @p scores. Binary expressions are evaluated without short-circuit
+   * so that every operand is observed.
+   */
+  template<typename MoleculeType>
+  bool profile(MoleculeType *mol, Smarts *smarts, ProfileSmartsScores &scores);
+
 }
 
 #endif
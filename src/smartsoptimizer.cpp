@@ -1,6 +1,7 @@
 #include "smartsoptimizer.h"
 #include "smartsscores.h"
 #include "smartsprint.h"
+#include "smartsanalysis.h"
 #include "pattern.h"
 #include "util.h"
 
@@ -418,8 +419,8 @@ namespace SC {
       std::vector<Expr*> same, other;
       FindSameBinaryExpr(expr, same, other);
       //assert(same.size() == other.size() || same.size() + 1 == other.size());
-      // sort the other expressions by score
-      scores->Sort(other, IsAnd(expr));
+      // sort the other expressions by expected evaluation cost
+      scores->SortOperands(other, IsAnd(expr));
       /*
          for (std::size_t i = 0; i < other.size(); ++i)
          std::cout << GetExprString(other[i]) << " ";
@@ -467,7 +468,7 @@ namespace SC {
   }
 
   /**
-   * Swap binary node children based on score.
+   * Swap binary node children based on score and cost.
    */
   template<typename Expr>
   void OptimizeBinaryExpr2(Expr *expr, SmartsScores *scores)
@@ -479,7 +480,7 @@ namespace SC {
       std::vector<Expr*> children(2);
       children[0] = expr->binary.lft;
       children[1] = expr->binary.rgt;
-      scores->Sort(children, IsAnd(expr));
+      scores->SortOperands(children, IsAnd(expr));
       expr->binary.lft = children[0];
       expr->binary.rgt = children[1];
 
@@ -679,6 +680,23 @@ namespace SC {
       ExprFactorization(expr->unary.arg);
   }
 
+  /**
+   * Invalidate the memoized scores of an expression tree. Called before a
+   * pass reads scores since the previous passes may have rewritten the
+   * tree (dead nodes are never read, their addresses may be reused).
+   */
+  template<typename Expr>
+  void InvalidateExprScores(Expr *expr, SmartsScores *scores)
+  {
+    scores->InvalidateExpr(expr);
+    if (IsUnary(expr))
+      InvalidateExprScores(expr->unary.arg, scores);
+    if (IsBinary(expr)) {
+      InvalidateExprScores(expr->binary.lft, scores);
+      InvalidateExprScores(expr->binary.rgt, scores);
+    }
+  }
+
   template<typename Expr>
   Expr* OptimizeExpr(Expr *expr, int opts, SmartsScores *scores)
   {
@@ -695,14 +713,20 @@ namespace SC {
         expr = DuplicateElimination(expr);
       if (opts & SmartsOptimizer::NegationElim)
         expr = Negation(expr);
-      if (opts & SmartsOptimizer::BinaryExpr1)
+      if (opts & SmartsOptimizer::BinaryExpr1) {
+        InvalidateExprScores(expr, scores);
         expr = OptimizeBinaryExpr1(expr, scores);
-      if (opts & SmartsOptimizer::BinaryExpr2)
+      }
+      if (opts & SmartsOptimizer::BinaryExpr2) {
+        InvalidateExprScores(expr, scores);
         OptimizeBinaryExpr2(expr, scores);
+      }
       if (opts & SmartsOptimizer::ExprFactor)
         ExprFactorization(expr);
 
     } while ((count = CountExpr(expr)) < last_count);
+
+    InvalidateExprScores(expr, scores);
     return expr;
   }
 
@@ -716,6 +740,7 @@ namespace SC {
     // reset counts
     pattern->atoms.clear();
     pattern->bonds.clear();
+    pattern->plan.clear();
     // create single atom false spec
     pattern->atoms.resize(1);
     //pattern->atoms[0].part = 0;
@@ -743,6 +768,15 @@ namespace SC {
         }
   }
 
+  void PatternFalsePropagation(Smarts *pattern)
+  {
+    std::string reason;
+    if (!IsSatisfiable(pattern, &reason)) {
+      std::cerr << "SMARTS Error: Pattern can't match, " << reason << "." << std::endl;
+      FalsePropagation(pattern);
+    }
+  }
+
   bool IsOpposite(SmartsAtomExpr *expr1, SmartsAtomExpr *expr2)
   {
     if (expr2->type == Smiley::OP_Not && expr1->type == expr2->unary.arg->type) {
@@ -874,8 +908,96 @@ namespace SC {
       ErrorDetection(root, expr->unary.arg);
   }
 
+  /**
+   * Greedy search order planner.
+   *
+   * The first atom of each connected component is the atom with the lowest
+   * environment score (AtomOrder). The search is then extended with the
+   * unmapped atom that closes the most rings, breaking ties by the lowest
+   * expected branching factor of the bond used to reach it (BondOrder).
+   * Both keep the expected number of partial mappings small.
+   */
+  std::vector<SmartsSearchStep> PlanSearchOrder(Smarts *pattern, int opts, SmartsScores *scores)
+  {
+    const int radius = 3;
+    std::size_t numAtoms = pattern->atoms.size();
+    std::vector<bool> mapped(numAtoms, false);
+    std::vector<int> order, parents;
+
+    while (order.size() < numAtoms) {
+      // start a new component
+      int start = -1;
+      double startScore = 0.0, startExprScore = 0.0;
+      for (std::size_t i = 0; i < numAtoms; ++i) {
+        if (mapped[i])
+          continue;
+        if (!(opts & SmartsOptimizer::AtomOrder)) {
+          start = i;
+          break;
+        }
+        double score = scores->GetExprEnvironmentScore(pattern, pattern->atoms[i].expr, radius);
+        double exprScore = scores->GetExprScore(pattern->atoms[i].expr);
+        if (start == -1 || score < startScore || (score == startScore && exprScore < startExprScore)) {
+          start = i;
+          startScore = score;
+          startExprScore = exprScore;
+        }
+      }
+      order.push_back(start);
+      parents.push_back(-1);
+      mapped[start] = true;
+
+      // grow the component
+      while (true) {
+        int nextAtom = -1, nextBond = -1, nextClosures = 0;
+        double nextBranching = 0.0;
+        for (std::size_t i = 0; i < order.size(); ++i) {
+          const SmartsAtom &atom = pattern->atoms[order[i]];
+          for (int j = 0; j < atom.degree(); ++j) {
+            const SmartsBond &bond = atom.bond(j);
+            int nbr = bond.other(order[i]);
+            if (mapped[nbr])
+              continue;
+            if (!(opts & SmartsOptimizer::BondOrder)) {
+              nextAtom = nbr;
+              nextBond = bond.index;
+              break;
+            }
+            int closures = -1;
+            const SmartsAtom &nbrAtom = pattern->atoms[nbr];
+            for (int k = 0; k < nbrAtom.degree(); ++k)
+              if (mapped[nbrAtom.bond(k).other(nbr)])
+                ++closures;
+            double branching = scores->GetBranchingFactor(pattern, &bond, order[i]);
+            if (nextAtom == -1 || closures > nextClosures ||
+                (closures == nextClosures && branching < nextBranching)) {
+              nextAtom = nbr;
+              nextBond = bond.index;
+              nextClosures = closures;
+              nextBranching = branching;
+            }
+          }
+          if (nextAtom != -1 && !(opts & SmartsOptimizer::BondOrder))
+            break;
+        }
+
+        if (nextAtom == -1)
+          break;
+        order.push_back(nextAtom);
+        parents.push_back(nextBond);
+        mapped[nextAtom] = true;
+      }
+    }
+
+    return CreateSearchPlan(pattern, order, parents);
+  }
+
   void SmartsOptimizer::Optimize(Smarts *pattern, int opts)
   {
+    // memoize the scores, each pass computes the score of a node once
+    bool cacheEnabled = m_scores->IsCacheEnabled();
+    m_scores->SetCacheEnabled(true);
+
     // Optimize atom expressions
     for (int i = 0; i < pattern->atoms.size(); ++i)
       pattern->atoms[i].expr = OptimizeExpr(pattern->atoms[i].expr, opts, m_scores);
@@ -887,38 +1009,16 @@ namespace SC {
       AtomFalsePropagation(pattern);
     if (opts & BondFalseProp)
       BondFalsePropagation(pattern);
+    if (opts & PatternFalseProp)
+      PatternFalsePropagation(pattern);
+    if (opts & (AtomFalseProp | BondFalseProp | PatternFalseProp))
+      m_scores->ClearCache();
 
-    // Keep track of original indices & neighbors
-    /*
-       std::map<SmartsAtom*, int> specToIndex;
-       std::vector<std::vector<SmartsAtom*> > nbrs(pattern->atoms.size());
-       for (int i = 0; i < pattern->atoms.size(); ++i) {
-       specToIndex[&pattern->atoms[i]] = i;
-       for (int j = 0; j < pattern->atoms[i].nbrs.size(); ++j)
-       nbrs[i].push_back(&pattern->atoms[pattern->atoms[i].nbrs[j]]);
-    // Sort SmartsAtom's neighbors
-    std::sort(nbrs[i].begin(), nbrs[i].end(), OptimizeSmartsAtomSort(m_scores));
-    }
-    */
-
-    // Sort the pattern's SmartsAtoms
-    if (opts & AtomOrder) {
-      std::vector<SmartsAtom*> specs;
-      for (int i = 0; i < pattern->atoms.size(); ++i)
-        specs.push_back(&pattern->atoms[i]);
-      m_scores->Sort(specs);
-    }
+    // Plan the search order
+    if (opts & (AtomOrder | BondOrder))
+      pattern->plan = PlanSearchOrder(pattern, opts, m_scores);
 
-    // Update neighbor indices
-    /*
-       for (int i = 0; i < pattern->atoms.size(); ++i) {
-       SmartsAtom &spec = pattern->atoms[i];
-       int index = specToIndex[&spec];
-       spec.nbrs.clear();
-       for (int j = 0; j < nbrs[index].size(); ++j)
-       spec.nbrs.push_back(nbrs[index][j] - pattern->atom);
-       }
-       */
+    m_scores->SetCacheEnabled(cacheEnabled);
 
     // atom expression error detection
     for (int i = 0; i < pattern->atoms.size(); ++i)
@@ -14,13 +14,21 @@ namespace SC {
    * because once we have a match, the right expression is not evaluated.
    * For an AND expression the lowest scoring expression is placed left
    * because once the left expression does not match the right expression
-   * is not evaluated.
+   * is not evaluated. When the scores are probabilities, the cost of
+   * evaluating each operand is also taken into account: AND operands are
+   * ordered by increasing cost / (1 - p) and OR operands by increasing
+   * cost / p (see SmartsScores::SortOperands). The scores are memoized
+   * while optimizing, each pass computes the score of a node only once.
    *
-   * SMARTS matching starts with the first pattern atom. The atom with the lowest
-   * score is used as first atom.
+   * The order in which the pattern atoms and bonds are matched is stored in
+   * the pattern's search plan. With AtomOrder, matching starts with the
+   * atom with the lowest environment score. With BondOrder, the search
+   * continues with the atom that closes the most rings, then with the bond
+   * with the lowest branching factor.
    *
-   * Neighbor atoms are matched in the order in which they occur in the AtomSpec's
-   * nbrs vector. The neighbors will be sorted by increasing score.
+   * With PatternFalseProp, patterns that can't match any molecule because
+   * of contradictions between atoms and bonds (see IsSatisfiable()) are
+   * replaced by a single false atom.
    */
   class SmartsOptimizer
   {
@@ -40,9 +48,10 @@ namespace SC {
         ExprFactor = 512,
         AtomOrder = 1024,
         BondOrder = 2048,
+        PatternFalseProp = 4096,
         O0 = NoOptimization,
         O1 = DoubleNegationElim | TrueElim | FalseElim | DuplicateElim | NegationElim,
-        O2 = O1 | BinaryExpr1 | BinaryExpr2 | AtomFalseProp | BondFalseProp,
+        O2 = O1 | BinaryExpr1 | BinaryExpr2 | AtomFalseProp | BondFalseProp | PatternFalseProp,
         O3 = O2 | ExprFactor,
         O4 = O3 | AtomOrder,
         O5 = O4 | BondOrder
@@ -16,7 +16,7 @@ namespace SC {
 
 
     int numAtoms;
-    std::vector<SmartsBond> bonds;
+    std::vector<SmartsBond> bonds; // search order
     bool ischiral;
 
     bool (*EvalAtomExpr)(int, AtomType*);
@@ -1,13 +1,120 @@
 #include "smartsscores.h"
 #include "defines.h"
 #include "util.h"
+#include "pattern.h"
 
 #include <cassert>
+#include <cstring>
 #include <fstream>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace SC {
 
-  double PrettySmartsScores::GetExprScore(const SmartsAtomExpr *expr)
+  SmartsScores::SmartsScores() : m_cacheEnabled(false)
+  {
+    // default costs for the OpenBabel adapter, relative to an element test
+    m_costs[Smiley::AE_True] = 0.0;
+    m_costs[Smiley::AE_False] = 0.0;
+    m_costs[Smiley::AE_Aromatic] = 1.0;
+    m_costs[Smiley::AE_Aliphatic] = 1.0;
+    m_costs[Smiley::AE_Cyclic] = 2.0;
+    m_costs[Smiley::AE_Acyclic] = 2.0;
+    m_costs[Smiley::AE_Isotope] = 1.0;
+    m_costs[Smiley::AE_AtomicNumber] = 1.0;
+    m_costs[Smiley::AE_AromaticElement] = 1.5;
+    m_costs[Smiley::AE_AliphaticElement] = 1.5;
+    m_costs[Smiley::AE_Degree] = 1.0;
+    m_costs[Smiley::AE_Valence] = 3.0;
+    m_costs[Smiley::AE_Connectivity] = 3.0;
+    m_costs[Smiley::AE_TotalH] = 3.0;
+    m_costs[Smiley::AE_ImplicitH] = 3.0;
+    m_costs[Smiley::AE_RingMembership] = 5.0;
+    m_costs[Smiley::AE_RingSize] = 10.0;
+    m_costs[Smiley::AE_RingConnectivity] = 4.0;
+    m_costs[Smiley::AE_Charge] = 1.0;
+    m_costs[Smiley::AE_Chirality] = 10.0;
+    m_costs[Smiley::AE_AtomClass] = 1.0;
+    m_costs[Smiley::AE_Recursive] = 100.0;
+    m_costs[Smiley::BE_True] = 0.0;
+    m_costs[Smiley::BE_False] = 0.0;
+    m_costs[Smiley::BE_Single] = 1.5;
+    m_costs[Smiley::BE_Double] = 1.5;
+    m_costs[Smiley::BE_Triple] = 1.0;
+    m_costs[Smiley::BE_Quadriple] = 1.0;
+    m_costs[Smiley::BE_Aromatic] = 1.0;
+    m_costs[Smiley::BE_Ring] = 2.0;
+  }
+
+  double SmartsScores::GetPrimitiveCost(int type) const
+  {
+    std::map<int, double>::const_iterator cost = m_costs.find(type);
+    return cost != m_costs.end() ? cost->second : 1.0;
+  }
+
+  void SmartsScores::SetPrimitiveCost(int type, double cost)
+  {
+    m_costs[type] = cost;
+  }
+
+  bool SmartsScores::ParseCost(const std::string &line)
+  {
+    if (line.compare(0, 5, "cost ") != 0)
+      return false;
+    std::stringstream ss(line.substr(5));
+    int type;
+    double cost;
+    if (ss >> type >> cost)
+      m_costs[type] = cost;
+    return true;
+  }
+
+  template<typename Expr>
+  double ExprCost(SmartsScores *scores, const Expr *expr)
+  {
+    switch (expr->type) {
+      case Smiley::OP_Not:
+        return scores->GetExprCost(expr->unary.arg);
+      case Smiley::OP_AndHi:
+      case Smiley::OP_AndLo:
+        // right is only evaluated when left is true
+        return scores->GetExprCost(expr->binary.lft) +
+          scores->GetExprScore(expr->binary.lft) * scores->GetExprCost(expr->binary.rgt);
+      case Smiley::OP_Or:
+        // right is only evaluated when left is false
+        return scores->GetExprCost(expr->binary.lft) +
+          (1.0 - scores->GetExprScore(expr->binary.lft)) * scores->GetExprCost(expr->binary.rgt);
+      default:
+        return scores->GetPrimitiveCost(expr->type);
+    }
+  }
+
+  double SmartsScores::ComputeExprCost(const SmartsAtomExpr *expr)
+  {
+    return ExprCost(this, expr);
+  }
+
+  double SmartsScores::ComputeExprCost(const SmartsBondExpr *expr)
+  {
+    return ExprCost(this, expr);
+  }
+
+  void SmartsScores::SortOperands(std::vector<SmartsAtomExpr*> &list, bool isAnd)
+  {
+    std::stable_sort(list.begin(), list.end(), CostSortFunctor<SmartsAtomExpr>(this, isAnd));
+  }
+
+  void SmartsScores::SortOperands(std::vector<SmartsBondExpr*> &list, bool isAnd)
+  {
+    std::stable_sort(list.begin(), list.end(), CostSortFunctor<SmartsBondExpr>(this, isAnd));
+  }
+
+  double PrettySmartsScores::ComputeExprScore(const SmartsAtomExpr *expr)
   {
     switch (expr->type) {
       case Smiley::OP_AndHi:
@@ -68,7 +175,7 @@ namespace SC {
     }
   }
 
-  double PrettySmartsScores::GetExprScore(const SmartsBondExpr *expr)
+  double PrettySmartsScores::ComputeExprScore(const SmartsBondExpr *expr)
   {
     switch (expr->type) {
       case Smiley::OP_AndHi:
@@ -115,6 +222,16 @@ namespace SC {
     std::sort(list.begin(), list.end(), ScoreSortFunctor<SmartsBondExpr, std::less>(this));
   }
 
+  void PrettySmartsScores::SortOperands(std::vector<SmartsAtomExpr*> &list, bool isAnd)
+  {
+    Sort(list, isAnd);
+  }
+
+  void PrettySmartsScores::SortOperands(std::vector<SmartsBondExpr*> &list, bool isAnd)
+  {
+    Sort(list, isAnd);
+  }
+
 
 
   double ListSmartsScores::EnvironmentScoreDFS(const Smarts *pattern, const SmartsBond *bond, int radius, int depth)
@@ -135,116 +252,435 @@ namespace SC {
     return score;
   }
 
-  ListSmartsScores::ListSmartsScores(const std::string &filename) : SmartsScores()
+  /**
+   * Bounds checked table read, values outside the table were not observed.
+   */
+  inline double TableScore(const double *table, int size, int value)
+  {
+    return value >= 0 && value < size ? table[value] : 0.0;
+  }
+
+  /**
+   * Divide the counts by @p total.
+   */
+  void NormalizeCounts(double *counts, int size, double total)
+  {
+    for (int i = 0; i < size; ++i)
+      counts[i] = total > 0.0 ? counts[i] / total : 0.0;
+  }
+
+  /**
+   * Index in SmartsScoresTable::bondPairs for a smartsscores bond type
+   * (bond order, 5 is aromatic), -1 for other types.
+   */
+  int GetBondPairType(int type)
+  {
+    switch (type) {
+      case 1:
+      case 2:
+      case 3:
+        return type - 1;
+      case 5:
+        return 3;
+      default:
+        return -1;
+    }
+  }
+
+  /**
+   * Parse "<name>  <value>: <count>" lines, the value may be prefixed by
+   * the SMARTS primitive character (e.g. "AE_HCOUNT  H3: 10").
+   */
+  void ParseCount(const std::string &line, std::size_t nameSize, double *counts, int size, int offset = 0)
+  {
+    int value = string2number<int>(line.substr(nameSize, line.find(":") - nameSize)) + offset;
+    if (value >= 0 && value < size)
+      counts[value] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+  }
+
+  /**
+   * Parse "<name>  <element> <value>: <count>" joint statistics lines.
+   */
+  void ParseJointCount(const std::string &line, std::size_t nameSize, double *counts, int size, int offset = 0)
+  {
+    std::stringstream ss(line.substr(nameSize, line.find(":") - nameSize));
+    int element, value;
+    ss >> element >> value;
+    value += offset;
+    if (element >= 0 && element < SmartsScoresTable::NumElements && value >= 0 && value < size)
+      counts[element * size + value] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+  }
+
+  /**
+   * Parse "BE_PAIR  <bond type> <element> <element>: <count>" lines. Both
+   * directions are added, a pair of the same elements counts twice.
+   */
+  void ParseBondPair(const std::string &line, SmartsScoresTable *table)
+  {
+    std::stringstream ss(line.substr(9, line.find(":") - 9));
+    int type, element1, element2;
+    ss >> type >> element1 >> element2;
+    type = GetBondPairType(type);
+    if (type == -1 || element1 < 0 || element1 >= SmartsScoresTable::NumPairElements ||
+        element2 < 0 || element2 >= SmartsScoresTable::NumPairElements)
+      return;
+    double count = string2number<unsigned long>(line.substr(line.find(":") + 2));
+    table->bondPairs[type][element1][element2] += count;
+    table->bondPairs[type][element2][element1] += count;
+  }
+
+  ListSmartsScores::ListSmartsScores(const std::string &filename) : SmartsScores(),
+      m_table(0), m_ownedTable(0), m_mapped(0), m_mappedSize(0)
+  {
+    if (!MapBinary(filename))
+      ReadText(filename);
+  }
+
+  ListSmartsScores::~ListSmartsScores()
+  {
+#ifndef _WIN32
+    if (m_mapped)
+      munmap(m_mapped, m_mappedSize);
+#endif
+    delete m_ownedTable;
+  }
+
+  bool ListSmartsScores::MapBinary(const std::string &filename)
   {
+#ifdef _WIN32
+    std::ifstream ifs(filename.c_str(), std::ios::binary);
+    SmartsScoresTable *table = new SmartsScoresTable;
+    if (!ifs.read(reinterpret_cast<char*>(table), sizeof(SmartsScoresTable)) ||
+        table->magic != SmartsScoresTable::Magic || table->version != SmartsScoresTable::Version ||
+        table->size != sizeof(SmartsScoresTable)) {
+      delete table;
+      return false;
+    }
+    m_ownedTable = table;
+    m_table = table;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size != static_cast<off_t>(sizeof(SmartsScoresTable))) {
+      close(fd);
+      return false;
+    }
+    void *mapped = mmap(0, sizeof(SmartsScoresTable), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+      return false;
+
+    const SmartsScoresTable *table = static_cast<const SmartsScoresTable*>(mapped);
+    if (table->magic != SmartsScoresTable::Magic || table->version != SmartsScoresTable::Version ||
+        table->size != sizeof(SmartsScoresTable)) {
+      munmap(mapped, sizeof(SmartsScoresTable));
+      return false;
+    }
+    m_mapped = mapped;
+    m_mappedSize = sizeof(SmartsScoresTable);
+    m_table = table;
+#endif
+
+    for (int i = 0; i < SmartsScoresTable::NumTypes; ++i)
+      if (m_table->costs[i] >= 0.0)
+        m_costs[i] = m_table->costs[i];
+
+    return true;
+  }
+
+  void ListSmartsScores::ReadText(const std::string &filename)
+  {
+    SmartsScoresTable *table = new SmartsScoresTable;
+    std::memset(table, 0, sizeof(SmartsScoresTable));
+    table->magic = SmartsScoresTable::Magic;
+    table->version = SmartsScoresTable::Version;
+    table->size = sizeof(SmartsScoresTable);
+    m_ownedTable = table;
+    m_table = table;
+
     std::ifstream ifs(filename.c_str());
     std::string line;
     assert(std::getline(ifs, line));
-    m_numAtoms = string2number<unsigned long>(line.substr(9));
+    double numAtoms = string2number<unsigned long>(line.substr(9));
     assert(std::getline(ifs, line));
-    m_numBonds = string2number<unsigned long>(line.substr(9));
+    double numBonds = string2number<unsigned long>(line.substr(9));
 
     while (std::getline(ifs, line)) {
-      if (line.find("Smiley::AE_AROMATIC") != std::string::npos) {
-        m_numAromaticAtoms = string2number<unsigned long>(line.substr(16));
+      if (ParseCost(line))
+        continue;
+      // joint statistics (checked first, the names contain AE_ELEM)
+      if (line.find("AE_ELEM_HCOUNT") != std::string::npos) {
+        ParseJointCount(line, 16, &table->elemHCount[0][0], SmartsScoresTable::NumCounts);
+        table->flags |= SmartsScoresTable::HasElemHCount;
+        continue;
+      }
+      if (line.find("AE_ELEM_CHARGE") != std::string::npos) {
+        ParseJointCount(line, 16, &table->elemCharge[0][0], SmartsScoresTable::NumCharges, SmartsScoresTable::ChargeOffset);
+        table->flags |= SmartsScoresTable::HasElemCharge;
+        continue;
+      }
+      if (line.find("AE_ELEM_RINGS") != std::string::npos) {
+        ParseJointCount(line, 15, &table->elemRings[0][0], SmartsScoresTable::NumCounts);
+        table->flags |= SmartsScoresTable::HasElemRings;
+        continue;
+      }
+      if (line.find("BE_PAIR") != std::string::npos) {
+        ParseBondPair(line, table);
+        table->flags |= SmartsScoresTable::HasBondPairs;
         continue;
       }
-      if (line.find("Smiley::AE_ALIPHATIC") != std::string::npos) {
-        m_numAliphaticAtoms = string2number<unsigned long>(line.substr(17));
+      if (line.find("AE_AROMATIC") != std::string::npos) {
+        table->aromatic = string2number<unsigned long>(line.substr(16));
         continue;
       }
-      if (line.find("Smiley::AE_CYCLIC") != std::string::npos) {
-        m_numCyclicAtoms = string2number<unsigned long>(line.substr(14));
+      if (line.find("AE_ALIPHATIC") != std::string::npos) {
+        table->aliphatic = string2number<unsigned long>(line.substr(17));
         continue;
       }
-      if (line.find("Smiley::AE_ACYCLIC") != std::string::npos) {
-        m_numAcyclicAtoms = string2number<unsigned long>(line.substr(16));
+      if (line.find("AE_CYCLIC") != std::string::npos) {
+        table->cyclic = string2number<unsigned long>(line.substr(14));
         continue;
       }
-      if (line.find("Smiley::AE_MASS") != std::string::npos) {
-        m_mass[string2number<int>(line.substr(9, line.find(":") - 9))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_ACYCLIC") != std::string::npos) {
+        table->acyclic = string2number<unsigned long>(line.substr(16));
         continue;
       }
-      if (line.find("Smiley::AE_ELEM") != std::string::npos) {
-        m_elem[string2number<int>(line.substr(9, line.find(":") - 9))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_MASS") != std::string::npos) {
+        ParseCount(line, 9, table->mass, SmartsScoresTable::NumMasses);
         continue;
       }
-      if (line.find("Smiley::AE_AROMELEM") != std::string::npos) {
-        m_aromelem[string2number<int>(line.substr(13, line.find(":") - 13))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_ELEM") != std::string::npos) {
+        ParseCount(line, 9, table->elem, SmartsScoresTable::NumElements);
         continue;
       }
-      if (line.find("Smiley::AE_ALIPHELEM") != std::string::npos) {
-        m_aliphelem[string2number<int>(line.substr(14, line.find(":") - 14))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_AROMELEM") != std::string::npos) {
+        ParseCount(line, 13, table->aromelem, SmartsScoresTable::NumElements);
         continue;
       }
-      if (line.find("Smiley::AE_HCOUNT") != std::string::npos) {
-        m_hcount[string2number<int>(line.substr(12, line.find(":") - 12))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_ALIPHELEM") != std::string::npos) {
+        ParseCount(line, 14, table->aliphelem, SmartsScoresTable::NumElements);
         continue;
       }
-      if (line.find("Smiley::AE_CHARGE") != std::string::npos) {
-        m_charge[string2number<int>(line.substr(11, line.find(":") - 11))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_HCOUNT") != std::string::npos) {
+        ParseCount(line, 12, table->hcount, SmartsScoresTable::NumCounts);
         continue;
       }
-      if (line.find("Smiley::AE_CONNECT") != std::string::npos) {
-        m_connect[string2number<int>(line.substr(13, line.find(":") - 13))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_CHARGE") != std::string::npos) {
+        ParseCount(line, 11, table->charge, SmartsScoresTable::NumCharges, SmartsScoresTable::ChargeOffset);
         continue;
       }
-      if (line.find("Smiley::AE_DEGREE") != std::string::npos) {
-        m_degree[string2number<int>(line.substr(12, line.find(":") - 12))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_CONNECT") != std::string::npos) {
+        ParseCount(line, 13, table->connect, SmartsScoresTable::NumCounts);
         continue;
       }
-      if (line.find("Smiley::AE_IMPLICIT") != std::string::npos) {
-        m_implicit[string2number<int>(line.substr(14, line.find(":") - 14))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_DEGREE") != std::string::npos) {
+        ParseCount(line, 12, table->degree, SmartsScoresTable::NumCounts);
         continue;
       }
-      if (line.find("Smiley::AE_RINGS") != std::string::npos) {
-        m_rings[string2number<int>(line.substr(11, line.find(":") - 11))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_IMPLICIT") != std::string::npos) {
+        ParseCount(line, 14, table->implicit, SmartsScoresTable::NumCounts);
         continue;
       }
-      if (line.find("Smiley::AE_SIZE") != std::string::npos) {
-        m_size[string2number<int>(line.substr(10, line.find(":") - 10))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_RINGS") != std::string::npos) {
+        ParseCount(line, 11, table->rings, SmartsScoresTable::NumCounts);
         continue;
       }
-      if (line.find("Smiley::AE_VALENCE") != std::string::npos) {
-        m_valence[string2number<int>(line.substr(13, line.find(":") - 13))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_SIZE") != std::string::npos) {
+        ParseCount(line, 10, table->ringSize, SmartsScoresTable::NumRingSizes);
         continue;
       }
-      if (line.find("Smiley::AE_HYB") != std::string::npos) {
-        m_hyb[string2number<int>(line.substr(9, line.find(":") - 9))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_VALENCE") != std::string::npos) {
+        ParseCount(line, 13, table->valence, SmartsScoresTable::NumCounts);
         continue;
       }
-      if (line.find("Smiley::AE_RINGCONNECT") != std::string::npos) {
-        m_ringconnect[string2number<int>(line.substr(17, line.find(":") - 17))] = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("AE_HYB") != std::string::npos)
+        continue;
+      if (line.find("AE_RINGCONNECT") != std::string::npos) {
+        ParseCount(line, 17, table->ringconnect, SmartsScoresTable::NumCounts);
         continue;
       }
-      if (line.find("Smiley::BE_SINGLE") != std::string::npos) {
-        m_numSingleBonds = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("BE_SINGLE") != std::string::npos) {
+        table->singleBond = string2number<unsigned long>(line.substr(line.find(":") + 2));
         continue;
       }
-      if (line.find("Smiley::BE_DOUBLE") != std::string::npos) {
-        m_numDoubleBonds = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("BE_DOUBLE") != std::string::npos) {
+        table->doubleBond = string2number<unsigned long>(line.substr(line.find(":") + 2));
         continue;
       }
-      if (line.find("Smiley::BE_TRIPLE") != std::string::npos) {
-        m_numTripleBonds = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("BE_TRIPLE") != std::string::npos) {
+        table->tripleBond = string2number<unsigned long>(line.substr(line.find(":") + 2));
         continue;
       }
-      if (line.find("Smiley::BE_AROM") != std::string::npos) {
-        m_numAromaticBonds = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("BE_AROM") != std::string::npos) {
+        table->aromaticBond = string2number<unsigned long>(line.substr(line.find(":") + 2));
         continue;
       }
-      if (line.find("Smiley::BE_RING") != std::string::npos) {
-        m_numRingBonds = string2number<unsigned long>(line.substr(line.find(":") + 2));
+      if (line.find("BE_RING") != std::string::npos) {
+        table->ringBond = string2number<unsigned long>(line.substr(line.find(":") + 2));
         continue;
       }
     }
+
+    // the joint statistics are conditional on the element counts
+    for (int i = 0; i < SmartsScoresTable::NumElements; ++i) {
+      NormalizeCounts(table->elemHCount[i], SmartsScoresTable::NumCounts, table->elem[i]);
+      NormalizeCounts(table->elemCharge[i], SmartsScoresTable::NumCharges, table->elem[i]);
+      NormalizeCounts(table->elemRings[i], SmartsScoresTable::NumCounts, table->elem[i]);
+    }
+    for (int i = 0; i < SmartsScoresTable::NumBondTypes; ++i)
+      for (int j = 0; j < SmartsScoresTable::NumPairElements; ++j)
+        NormalizeCounts(table->bondPairs[i][j], SmartsScoresTable::NumPairElements, table->elem[j]);
+
+    NormalizeCounts(&table->aromatic, 1, numAtoms);
+    NormalizeCounts(&table->aliphatic, 1, numAtoms);
+    NormalizeCounts(&table->cyclic, 1, numAtoms);
+    NormalizeCounts(&table->acyclic, 1, numAtoms);
+    NormalizeCounts(table->mass, SmartsScoresTable::NumMasses, numAtoms);
+    NormalizeCounts(table->elem, SmartsScoresTable::NumElements, numAtoms);
+    NormalizeCounts(table->aromelem, SmartsScoresTable::NumElements, numAtoms);
+    NormalizeCounts(table->aliphelem, SmartsScoresTable::NumElements, numAtoms);
+    NormalizeCounts(table->hcount, SmartsScoresTable::NumCounts, numAtoms);
+    NormalizeCounts(table->charge, SmartsScoresTable::NumCharges, numAtoms);
+    NormalizeCounts(table->connect, SmartsScoresTable::NumCounts, numAtoms);
+    NormalizeCounts(table->degree, SmartsScoresTable::NumCounts, numAtoms);
+    NormalizeCounts(table->implicit, SmartsScoresTable::NumCounts, numAtoms);
+    NormalizeCounts(table->rings, SmartsScoresTable::NumCounts, numAtoms);
+    NormalizeCounts(table->ringSize, SmartsScoresTable::NumRingSizes, numAtoms);
+    NormalizeCounts(table->valence, SmartsScoresTable::NumCounts, numAtoms);
+    NormalizeCounts(table->ringconnect, SmartsScoresTable::NumCounts, numAtoms);
+
+    NormalizeCounts(&table->singleBond, 1, numBonds);
+    NormalizeCounts(&table->doubleBond, 1, numBonds);
+    NormalizeCounts(&table->tripleBond, 1, numBonds);
+    NormalizeCounts(&table->aromaticBond, 1, numBonds);
+    NormalizeCounts(&table->ringBond, 1, numBonds);
+  }
+
+  bool ListSmartsScores::WriteBinary(const std::string &filename) const
+  {
+    SmartsScoresTable *table = new SmartsScoresTable(*m_table);
+    for (int i = 0; i < SmartsScoresTable::NumTypes; ++i) {
+      std::map<int, double>::const_iterator cost = m_costs.find(i);
+      table->costs[i] = cost != m_costs.end() ? cost->second : -1.0;
+    }
+
+    std::ofstream ofs(filename.c_str(), std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(table), sizeof(SmartsScoresTable));
+    delete table;
+
+    return ofs.good();
+  }
+
+  /**
+   * Collect the operands of nested AND expressions (both precedences).
+   */
+  void FindAndOperands(const SmartsAtomExpr *expr, std::vector<const SmartsAtomExpr*> &operands)
+  {
+    if (expr->type == Smiley::OP_AndHi || expr->type == Smiley::OP_AndLo) {
+      FindAndOperands(expr->binary.lft, operands);
+      FindAndOperands(expr->binary.rgt, operands);
+    } else
+      operands.push_back(expr);
+  }
+
+  /**
+   * Get the element tested by an expression, -1 if there is no single
+   * element.
+   */
+  int GetExprElement(const SmartsAtomExpr *expr)
+  {
+    switch (expr->type) {
+      case Smiley::AE_AtomicNumber:
+      case Smiley::AE_AromaticElement:
+      case Smiley::AE_AliphaticElement:
+        return expr->leaf.value;
+      case Smiley::OP_AndHi:
+      case Smiley::OP_AndLo:
+        {
+          std::vector<const SmartsAtomExpr*> operands;
+          FindAndOperands(expr, operands);
+          for (std::size_t i = 0; i < operands.size(); ++i)
+            if (IsLeaf(const_cast<SmartsAtomExpr*>(operands[i])) && GetExprElement(operands[i]) != -1)
+              return GetExprElement(operands[i]);
+        }
+        return -1;
+      default:
+        return -1;
+    }
+  }
+
+  double ListSmartsScores::GetConditionalScore(const SmartsAtomExpr *expr, int element)
+  {
+    double elementScore = TableScore(m_table->elem, SmartsScoresTable::NumElements, element);
+    if (elementScore == 0.0)
+      return 0.0;
+
+    switch (expr->type) {
+      case Smiley::OP_Not:
+        if (IsLeaf(expr->unary.arg))
+          return 1.0 - GetConditionalScore(expr->unary.arg, element);
+        break;
+      case Smiley::AE_AtomicNumber:
+        return expr->leaf.value == element ? 1.0 : 0.0;
+      case Smiley::AE_AromaticElement:
+        return expr->leaf.value == element ? m_table->aromelem[element] / elementScore : 0.0;
+      case Smiley::AE_AliphaticElement:
+        return expr->leaf.value == element ? m_table->aliphelem[element] / elementScore : 0.0;
+      case Smiley::AE_Aromatic:
+        return m_table->aromelem[element] / elementScore;
+      case Smiley::AE_Aliphatic:
+        return m_table->aliphelem[element] / elementScore;
+      case Smiley::AE_TotalH:
+        if (m_table->flags & SmartsScoresTable::HasElemHCount)
+          return TableScore(m_table->elemHCount[element], SmartsScoresTable::NumCounts, expr->leaf.value);
+        break;
+      case Smiley::AE_Charge:
+        if (m_table->flags & SmartsScoresTable::HasElemCharge)
+          return TableScore(m_table->elemCharge[element], SmartsScoresTable::NumCharges,
+              expr->leaf.value + SmartsScoresTable::ChargeOffset);
+        break;
+      case Smiley::AE_RingMembership:
+        if (m_table->flags & SmartsScoresTable::HasElemRings)
+          return TableScore(m_table->elemRings[element], SmartsScoresTable::NumCounts, expr->leaf.value);
+        break;
+      case Smiley::AE_Cyclic:
+        if (m_table->flags & SmartsScoresTable::HasElemRings)
+          return 1.0 - m_table->elemRings[element][0];
+        break;
+      case Smiley::AE_Acyclic:
+        if (m_table->flags & SmartsScoresTable::HasElemRings)
+          return m_table->elemRings[element][0];
+        break;
+      default:
+        break;
+    }
+
+    // no joint statistics, assume independence
+    return GetExprScore(expr);
   }
 
-  double ListSmartsScores::GetExprScore(const SmartsAtomExpr *expr)
+  double ListSmartsScores::ComputeExprScore(const SmartsAtomExpr *expr)
   {
     switch (expr->type) {
       case Smiley::OP_AndHi:
       case Smiley::OP_AndLo:
+        {
+          // conjunctions with an element: P(element) * P(operand | element) ...
+          std::vector<const SmartsAtomExpr*> operands;
+          FindAndOperands(expr, operands);
+          for (std::size_t i = 0; i < operands.size(); ++i) {
+            if (!IsLeaf(const_cast<SmartsAtomExpr*>(operands[i])) || GetExprElement(operands[i]) == -1)
+              continue;
+            int element = GetExprElement(operands[i]);
+            double score = GetExprScore(operands[i]);
+            for (std::size_t j = 0; j < operands.size(); ++j)
+              if (j != i)
+                score *= GetConditionalScore(operands[j], element);
+            return score;
+          }
+        }
         return std::min(GetExprScore(expr->binary.lft), GetExprScore(expr->binary.rgt));
       case Smiley::OP_Or:
         return std::max(GetExprScore(expr->binary.lft), GetExprScore(expr->binary.rgt));
@@ -257,49 +693,47 @@ namespace SC {
       case Smiley::AE_False:
         return 0.0;
       case Smiley::AE_Aromatic:
-        return m_numAromaticAtoms / static_cast<double>(m_numAtoms);
+        return m_table->aromatic;
       case Smiley::AE_Aliphatic:
-        return m_numAliphaticAtoms / static_cast<double>(m_numAtoms);
+        return m_table->aliphatic;
       case Smiley::AE_Cyclic:
-        return m_numCyclicAtoms / static_cast<double>(m_numAtoms);
+        return m_table->cyclic;
       case Smiley::AE_Acyclic:
-        return m_numAcyclicAtoms / static_cast<double>(m_numAtoms);
+        return m_table->acyclic;
       case Smiley::AE_Isotope:
-        return m_mass[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->mass, SmartsScoresTable::NumMasses, expr->leaf.value);
       case Smiley::AE_AtomicNumber:
-        return m_elem[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->elem, SmartsScoresTable::NumElements, expr->leaf.value);
       case Smiley::AE_AromaticElement:
-        return m_aromelem[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->aromelem, SmartsScoresTable::NumElements, expr->leaf.value);
       case Smiley::AE_AliphaticElement:
-        return m_aliphelem[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->aliphelem, SmartsScoresTable::NumElements, expr->leaf.value);
       case Smiley::AE_TotalH:
-        return m_hcount[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->hcount, SmartsScoresTable::NumCounts, expr->leaf.value);
       case Smiley::AE_Charge:
-        return m_charge[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->charge, SmartsScoresTable::NumCharges, expr->leaf.value + SmartsScoresTable::ChargeOffset);
       case Smiley::AE_Connectivity:
-        return m_connect[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->connect, SmartsScoresTable::NumCounts, expr->leaf.value);
       case Smiley::AE_Degree:
-        return m_degree[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->degree, SmartsScoresTable::NumCounts, expr->leaf.value);
       case Smiley::AE_ImplicitH:
-        return m_implicit[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->implicit, SmartsScoresTable::NumCounts, expr->leaf.value);
       case Smiley::AE_RingMembership:
-        return m_rings[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->rings, SmartsScoresTable::NumCounts, expr->leaf.value);
       case Smiley::AE_RingSize:
-        return m_size[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->ringSize, SmartsScoresTable::NumRingSizes, expr->leaf.value);
       case Smiley::AE_Valence:
-        return m_valence[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->valence, SmartsScoresTable::NumCounts, expr->leaf.value);
       case Smiley::AE_Chirality:
         return 1.0;
-      //case Smiley::AE_HYB:
-      //  return m_hyb[expr->leaf.value] / static_cast<double>(m_numAtoms);
       case Smiley::AE_RingConnectivity:
-        return m_ringconnect[expr->leaf.value] / static_cast<double>(m_numAtoms);
+        return TableScore(m_table->ringconnect, SmartsScoresTable::NumCounts, expr->leaf.value);
       default:
         return 1.0;
     }
   }
 
-  double ListSmartsScores::GetExprScore(const SmartsBondExpr *expr)
+  double ListSmartsScores::ComputeExprScore(const SmartsBondExpr *expr)
   {
     switch (expr->type) {
       case Smiley::OP_AndHi:
@@ -312,20 +746,59 @@ namespace SC {
       case Smiley::BE_True:
         return 1.0;
       case Smiley::BE_Single:
-        return m_numSingleBonds / static_cast<double>(m_numBonds);
+        return m_table->singleBond;
       case Smiley::BE_Double:
-        return m_numDoubleBonds / static_cast<double>(m_numBonds);
+        return m_table->doubleBond;
       case Smiley::BE_Triple:
-        return m_numTripleBonds / static_cast<double>(m_numBonds);
+        return m_table->tripleBond;
       case Smiley::BE_Aromatic:
-        return m_numAromaticBonds / static_cast<double>(m_numBonds);
+        return m_table->aromaticBond;
       case Smiley::BE_Ring:
-        return m_numRingBonds / static_cast<double>(m_numBonds);
+        return m_table->ringBond;
       default:
         return 1.0;
     }
   }
 
+  double ListSmartsScores::GetBranchingFactor(const Smarts *pattern, const SmartsBond *bond, int source)
+  {
+    const SmartsAtomExpr *sourceExpr = pattern->atoms[source].expr;
+    const SmartsAtomExpr *targetExpr = pattern->atoms[bond->other(source)].expr;
+    int sourceElement = GetExprElement(sourceExpr);
+    int targetElement = GetExprElement(targetExpr);
+    if (!(m_table->flags & SmartsScoresTable::HasBondPairs) ||
+        sourceElement < 0 || sourceElement >= SmartsScoresTable::NumPairElements ||
+        targetElement < 0 || targetElement >= SmartsScoresTable::NumPairElements ||
+        m_table->elem[sourceElement] == 0.0 || m_table->elem[targetElement] == 0.0)
+      return SmartsScores::GetBranchingFactor(pattern, bond, source);
+
+    // number of neighbors with the target element per source element atom
+    double neighbors = 0.0;
+    switch (bond->expr->type) {
+      case Smiley::BE_True:
+        for (int i = 0; i < SmartsScoresTable::NumBondTypes; ++i)
+          neighbors += m_table->bondPairs[i][sourceElement][targetElement];
+        break;
+      case Smiley::BE_Single:
+        neighbors = m_table->bondPairs[GetBondPairType(1)][sourceElement][targetElement];
+        break;
+      case Smiley::BE_Double:
+        neighbors = m_table->bondPairs[GetBondPairType(2)][sourceElement][targetElement];
+        break;
+      case Smiley::BE_Triple:
+        neighbors = m_table->bondPairs[GetBondPairType(3)][sourceElement][targetElement];
+        break;
+      case Smiley::BE_Aromatic:
+        neighbors = m_table->bondPairs[GetBondPairType(5)][sourceElement][targetElement];
+        break;
+      default:
+        return SmartsScores::GetBranchingFactor(pattern, bond, source);
+    }
+
+    // the rest of the target expression given its element
+    return neighbors * std::min(1.0, GetExprScore(targetExpr) / m_table->elem[targetElement]);
+  }
+
   double ListSmartsScores::GetExprEnvironmentScore(const Smarts *pattern, const SmartsAtomExpr *expr, int radius)
   {
     double score = GetExprScore(expr);
@@ -384,4 +857,209 @@ namespace SC {
       std::sort(list.begin(), list.end(), ScoreSortFunctor<SmartsBondExpr, std::greater>(this));
   }
 
+  ProfileSmartsScores::ProfileSmartsScores(const std::string &filename) : SmartsScores(),
+      m_loaded(false)
+  {
+    Load(filename);
+  }
+
+  bool ProfileSmartsScores::Load(const std::string &filename)
+  {
+    m_loaded = false;
+    std::ifstream ifs(filename.c_str());
+    if (!ifs)
+      return false;
+
+    // each line: <expr|bond> <total> <passed> <key>
+    std::string line;
+    while (std::getline(ifs, line)) {
+      if (line.empty() || line[0] == '#' || ParseCost(line))
+        continue;
+      std::stringstream ss(line);
+      std::string type;
+      Count count;
+      if (!(ss >> type >> count.total >> count.passed))
+        return false;
+      std::string key;
+      std::getline(ss, key);
+      strip(key);
+
+      Count &c = type == "bond" ? m_bonds[key] : m_exprs[key];
+      c.total += count.total;
+      c.passed += count.passed;
+    }
+
+    m_loaded = true;
+    return true;
+  }
+
+  bool ProfileSmartsScores::Save(const std::string &filename) const
+  {
+    std::ofstream ofs(filename.c_str());
+    if (!ofs)
+      return false;
+
+    ofs << "# SmartsCompiler profile: <expr|bond> <total> <passed> <key> or cost <type> <cost>" << std::endl;
+    for (std::map<std::string, Count>::const_iterator i = m_exprs.begin(); i != m_exprs.end(); ++i)
+      ofs << "expr " << i->second.total << " " << i->second.passed << " " << i->first << std::endl;
+    for (std::map<std::string, Count>::const_iterator i = m_bonds.begin(); i != m_bonds.end(); ++i)
+      ofs << "bond " << i->second.total << " " << i->second.passed << " " << i->first << std::endl;
+    for (std::map<int, double>::const_iterator i = m_costs.begin(); i != m_costs.end(); ++i)
+      ofs << "cost " << i->first << " " << i->second << std::endl;
+
+    return true;
+  }
+
+  std::string ProfileSmartsScores::GetExprKey(const SmartsAtomExpr *expr)
+  {
+    return "a" + GetCanonicalExprKey(const_cast<SmartsAtomExpr*>(expr));
+  }
+
+  std::string ProfileSmartsScores::GetExprKey(const SmartsBondExpr *expr)
+  {
+    return "b" + GetCanonicalExprKey(const_cast<SmartsBondExpr*>(expr));
+  }
+
+  std::string ProfileSmartsScores::GetBondKey(const Smarts *pattern, const SmartsBond *bond, int source)
+  {
+    return GetExprKey(pattern->atoms[source].expr) + " | " + GetExprKey(bond->expr) + " | " +
+      GetExprKey(pattern->atoms[bond->other(source)].expr);
+  }
+
+  void ProfileSmartsScores::AddExprResult(const std::string &key, bool result)
+  {
+    Count &count = m_exprs[key];
+    ++count.total;
+    if (result)
+      ++count.passed;
+  }
+
+  void ProfileSmartsScores::AddBranching(const std::string &key, unsigned long edges)
+  {
+    Count &count = m_bonds[key];
+    ++count.total;
+    count.passed += edges;
+  }
+
+  double ProfileSmartsScores::GetBranchingFactor(const Smarts *pattern, const SmartsBond *bond, int source)
+  {
+    std::map<std::string, Count>::const_iterator count = m_bonds.find(GetBondKey(pattern, bond, source));
+    if (count != m_bonds.end() && count->second.total)
+      return count->second.passed / static_cast<double>(count->second.total);
+    // not observed: a single candidate neighbor with the measured pass rates
+    return GetExprScore(bond->expr) * GetExprScore(pattern->atoms[bond->other(source)].expr);
+  }
+
+  double ProfileSmartsScores::ComputeExprScore(const SmartsAtomExpr *expr)
+  {
+    std::map<std::string, Count>::const_iterator count = m_exprs.find(GetExprKey(expr));
+    if (count != m_exprs.end() && count->second.total)
+      return count->second.passed / static_cast<double>(count->second.total);
+
+    switch (expr->type) {
+      case Smiley::OP_AndHi:
+      case Smiley::OP_AndLo:
+        return GetExprScore(expr->binary.lft) * GetExprScore(expr->binary.rgt);
+      case Smiley::OP_Or:
+        return 1.0 - (1.0 - GetExprScore(expr->binary.lft)) * (1.0 - GetExprScore(expr->binary.rgt));
+      case Smiley::OP_Not:
+        return 1.0 - GetExprScore(expr->unary.arg);
+      case Smiley::AE_False:
+        return 0.0;
+      default:
+        return 1.0;
+    }
+  }
+
+  double ProfileSmartsScores::ComputeExprScore(const SmartsBondExpr *expr)
+  {
+    std::map<std::string, Count>::const_iterator count = m_exprs.find(GetExprKey(expr));
+    if (count != m_exprs.end() && count->second.total)
+      return count->second.passed / static_cast<double>(count->second.total);
+
+    switch (expr->type) {
+      case Smiley::OP_AndHi:
+      case Smiley::OP_AndLo:
+        return GetExprScore(expr->binary.lft) * GetExprScore(expr->binary.rgt);
+      case Smiley::OP_Or:
+        return 1.0 - (1.0 - GetExprScore(expr->binary.lft)) * (1.0 - GetExprScore(expr->binary.rgt));
+      case Smiley::OP_Not:
+        return 1.0 - GetExprScore(expr->unary.arg);
+      case Smiley::BE_False:
+        return 0.0;
+      default:
+        return 1.0;
+    }
+  }
+
+  double ProfileSmartsScores::EnvironmentScoreDFS(const Smarts *pattern, int atom, int prev, int radius, int depth)
+  {
+    ++depth;
+    if (depth == radius)
+      return 0.0;
+
+    double score = 0.0;
+    const SmartsAtom &smartsAtom = pattern->atoms[atom];
+    for (int i = 0; i < smartsAtom.degree(); ++i) {
+      const SmartsBond &bond = smartsAtom.bond(i);
+      int nbr = bond.other(atom);
+      if (nbr == prev)
+        continue;
+      double branching = GetBranchingFactor(pattern, &bond, atom);
+      score += branching * (1.0 + EnvironmentScoreDFS(pattern, nbr, atom, radius, depth));
+    }
+
+    return score;
+  }
+
+  double ProfileSmartsScores::GetExprEnvironmentScore(const Smarts *pattern, const SmartsAtomExpr *expr, int radius)
+  {
+    for (int i = 0; i < pattern->atoms.size(); ++i)
+      if (pattern->atoms[i].expr == expr)
+        return GetExprScore(expr) * (1.0 + EnvironmentScoreDFS(pattern, i, -1, radius, 0));
+    return GetExprScore(expr);
+  }
+
+  double ProfileSmartsScores::GetExprEnvironmentScore(const Smarts *pattern, const SmartsBondExpr *expr, int radius)
+  {
+    for (int i = 0; i < pattern->bonds.size(); ++i)
+      if (pattern->bonds[i].expr == expr) {
+        const SmartsBond *bond = &pattern->bonds[i];
+        return 0.5 * (GetBranchingFactor(pattern, bond, bond->source) + GetBranchingFactor(pattern, bond, bond->target));
+      }
+    return GetExprScore(expr);
+  }
+
+  void ProfileSmartsScores::Sort(std::vector<SmartsAtom*> &list, bool increasing)
+  {
+    if (increasing)
+      std::sort(list.begin(), list.end(), ScoreSortFunctor<SmartsAtom, std::less>(this));
+    else
+      std::sort(list.begin(), list.end(), ScoreSortFunctor<SmartsAtom, std::greater>(this));
+  }
+
+  void ProfileSmartsScores::Sort(std::vector<SmartsBond*> &list, bool increasing)
+  {
+    if (increasing)
+      std::sort(list.begin(), list.end(), ScoreSortFunctor<SmartsBond, std::less>(this));
+    else
+      std::sort(list.begin(), list.end(), ScoreSortFunctor<SmartsBond, std::greater>(this));
+  }
+
+  void ProfileSmartsScores::Sort(std::vector<SmartsAtomExpr*> &list, bool increasing)
+  {
+    if (increasing)
+      std::sort(list.begin(), list.end(), ScoreSortFunctor<SmartsAtomExpr, std::less>(this));
+    else
+      std::sort(list.begin(), list.end(), ScoreSortFunctor<SmartsAtomExpr, std::greater>(this));
+  }
+
+  void ProfileSmartsScores::Sort(std::vector<SmartsBondExpr*> &list, bool increasing)
+  {
+    if (increasing)
+      std::sort(list.begin(), list.end(), ScoreSortFunctor<SmartsBondExpr, std::less>(this));
+    else
+      std::sort(list.begin(), list.end(), ScoreSortFunctor<SmartsBondExpr, std::greater>(this));
+  }
+
 }
@@ -5,21 +5,34 @@
 
 namespace SC {
 
+  /**
+   * Expression scores and costs for the optimizer. The memoized values are
+   * stored in the instance (even by the const looking getters), an instance
+   * must not be shared between threads without a lock.
+   */
   class SmartsScores
   {
     public:
+      SmartsScores();
+
       virtual ~SmartsScores()
       {
       }
 
+      /**
+       * Get the expression score. The score is memoized by node while the
+       * cache is enabled (see SetCacheEnabled()). Subclasses should
+       * implement ComputeExprScore(), an override of this function is used
+       * but bypasses the cache.
+       */
       virtual double GetExprScore(const SmartsAtomExpr *expr)
       {
-        return 1.0;
+        return CachedValue(m_scoreCache, expr, &SmartsScores::ComputeExprScore);
       }
 
       virtual double GetExprScore(const SmartsBondExpr *expr)
       {
-        return 1.0;
+        return CachedValue(m_scoreCache, expr, &SmartsScores::ComputeExprScore);
       }
 
       virtual double GetExprEnvironmentScore(const Smarts *pattern, const SmartsAtomExpr *expr, int radius)
@@ -32,6 +45,15 @@ namespace SC {
         return 1.0;
       }
 
+      /**
+       * Get the expected number of neighbors matching @p bond and the other
+       * atom for an atom matching the @p source atom.
+       */
+      virtual double GetBranchingFactor(const Smarts *pattern, const SmartsBond *bond, int source)
+      {
+        return GetExprScore(bond->expr) * GetExprScore(pattern->atoms[bond->other(source)].expr);
+      }
+
       virtual void Sort(std::vector<SmartsAtom*> &list, bool increasing = true)
       {
       }
@@ -47,6 +69,108 @@ namespace SC {
       virtual void Sort(std::vector<SmartsBondExpr*> &list, bool increasing = true)
       {
       }
+
+      /**
+       * Get the expected cost of evaluating an expression relative to an
+       * element test. Binary expressions are evaluated left to right and
+       * the right operand is only evaluated when needed. The cost is
+       * memoized like the score (implement ComputeExprCost() in
+       * subclasses).
+       */
+      virtual double GetExprCost(const SmartsAtomExpr *expr)
+      {
+        return CachedValue(m_costCache, expr, &SmartsScores::ComputeExprCost);
+      }
+
+      virtual double GetExprCost(const SmartsBondExpr *expr)
+      {
+        return CachedValue(m_costCache, expr, &SmartsScores::ComputeExprCost);
+      }
+
+      double GetPrimitiveCost(int type) const;
+      void SetPrimitiveCost(int type, double cost);
+
+      /**
+       * Sort the operands of an AND (@p isAnd) or OR expression to minimize
+       * the expected evaluation cost. AND operands are sorted by increasing
+       * cost / (1 - p), OR operands by increasing cost / p where p is the
+       * expression score.
+       */
+      virtual void SortOperands(std::vector<SmartsAtomExpr*> &list, bool isAnd);
+      virtual void SortOperands(std::vector<SmartsBondExpr*> &list, bool isAnd);
+
+      /**
+       * Memoize the expression scores and costs in a side table keyed by
+       * node. The cached values are only valid while the expressions are
+       * not modified, a rewritten (or deleted) node and its ancestors have
+       * to be invalidated. Disabling the cache clears it.
+       */
+      void SetCacheEnabled(bool enabled)
+      {
+        m_cacheEnabled = enabled;
+        ClearCache();
+      }
+
+      bool IsCacheEnabled() const
+      {
+        return m_cacheEnabled;
+      }
+
+      void ClearCache()
+      {
+        m_scoreCache.clear();
+        m_costCache.clear();
+      }
+
+      void InvalidateExpr(const void *expr)
+      {
+        m_scoreCache.erase(expr);
+        m_costCache.erase(expr);
+      }
+
+    protected:
+      /**
+       * Compute the score, the default considers all expressions equal.
+       */
+      virtual double ComputeExprScore(const SmartsAtomExpr *expr)
+      {
+        return 1.0;
+      }
+
+      virtual double ComputeExprScore(const SmartsBondExpr *expr)
+      {
+        return 1.0;
+      }
+
+      virtual double ComputeExprCost(const SmartsAtomExpr *expr);
+      virtual double ComputeExprCost(const SmartsBondExpr *expr);
+
+      /**
+       * Parse a "cost <type> <cost>" line where type is the Smiley
+       * primitive type.
+       */
+      bool ParseCost(const std::string &line);
+
+      std::map<int, double> m_costs;
+
+    private:
+      template<typename Expr>
+      double CachedValue(std::map<const void*, double> &cache, const Expr *expr,
+          double (SmartsScores::*compute)(const Expr*))
+      {
+        if (!m_cacheEnabled)
+          return (this->*compute)(expr);
+        std::map<const void*, double>::iterator value = cache.find(expr);
+        if (value != cache.end())
+          return value->second;
+        double result = (this->*compute)(expr);
+        cache[expr] = result;
+        return result;
+      }
+
+      bool m_cacheEnabled;
+      std::map<const void*, double> m_scoreCache;
+      std::map<const void*, double> m_costCache;
   };
 
   template<typename AtomBondExpr, template<typename> class Compare>
@@ -71,61 +195,255 @@ namespace SC {
     Compare<double> compare;
   };
 
+  template<typename Expr>
+  struct CostSortFunctor
+  {
+    CostSortFunctor(SmartsScores *scores_, bool isAnd_) : scores(scores_), isAnd(isAnd_)
+    {
+    }
+
+    double Rank(const Expr *expr) const
+    {
+      double p = scores->GetExprScore(expr);
+      // probability that evaluating the expression decides the result
+      double decides = isAnd ? 1.0 - p : p;
+      return scores->GetExprCost(expr) / std::max(decides, 1e-9);
+    }
+
+    bool operator()(const Expr *left, const Expr *right) const
+    {
+      return Rank(left) < Rank(right);
+    }
+
+    SmartsScores *scores;
+    bool isAnd;
+  };
+
+  /**
+   * The scores are not probabilities, operands are ordered by score.
+   */
   class PrettySmartsScores : public SmartsScores
   {
     public:
-      virtual double GetExprScore(const SmartsAtomExpr *expr);
-      virtual double GetExprScore(const SmartsBondExpr *expr);
       virtual void Sort(std::vector<SmartsAtom*> &list, bool increasing = true);
       virtual void Sort(std::vector<SmartsBond*> &list, bool increasing = true);
       virtual void Sort(std::vector<SmartsAtomExpr*> &list, bool increasing = true);
       virtual void Sort(std::vector<SmartsBondExpr*> &list, bool increasing = true);
+      virtual void SortOperands(std::vector<SmartsAtomExpr*> &list, bool isAnd);
+      virtual void SortOperands(std::vector<SmartsBondExpr*> &list, bool isAnd);
+
+    protected:
+      double ComputeExprScore(const SmartsAtomExpr *expr);
+      double ComputeExprScore(const SmartsBondExpr *expr);
   };
 
 
+  /**
+   * Dense score tables indexed by primitive value. Atom and bond scores
+   * are stored as fractions and the joint statistics as P(value | element)
+   * so scoring is a single array read. Values outside the tables score 0.
+   *
+   * The struct is written as is (native byte order) to binary scores files
+   * which are memory mapped when loaded.
+   */
+  struct SmartsScoresTable
+  {
+    enum {
+      Magic = 0x53435342, // "SCSB"
+      Version = 1,
+      NumTypes = 128, // Smiley primitive types (costs)
+      NumElements = 128,
+      NumMasses = 256,
+      NumCounts = 16,
+      NumRingSizes = 32,
+      NumCharges = 17,
+      ChargeOffset = 8,
+      NumPairElements = 64,
+      NumBondTypes = 4 // single, double, triple, aromatic
+    };
+
+    enum Flags {
+      HasElemHCount = 1,
+      HasElemCharge = 2,
+      HasElemRings = 4,
+      HasBondPairs = 8
+    };
+
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size; // sizeof(SmartsScoresTable)
+    unsigned int flags;
+
+    // primitive costs, negative if not set
+    double costs[NumTypes];
+
+    double aromatic;
+    double aliphatic;
+    double cyclic;
+    double acyclic;
+    double mass[NumMasses];
+    double elem[NumElements];
+    double aromelem[NumElements];
+    double aliphelem[NumElements];
+    double hcount[NumCounts];
+    double charge[NumCharges];
+    double connect[NumCounts];
+    double degree[NumCounts];
+    double implicit[NumCounts];
+    double rings[NumCounts];
+    double ringSize[NumRingSizes];
+    double valence[NumCounts];
+    double ringconnect[NumCounts];
+    // P(value | element)
+    double elemHCount[NumElements][NumCounts];
+    double elemCharge[NumElements][NumCharges];
+    double elemRings[NumElements][NumCounts];
+
+    double singleBond;
+    double doubleBond;
+    double tripleBond;
+    double aromaticBond;
+    double ringBond;
+    // expected number of neighbors with the second element for an atom
+    // with the first element
+    double bondPairs[NumBondTypes][NumPairElements][NumPairElements];
+  };
+
+  /**
+   * Scores from the statistics written by the smartsscores tool. Both the
+   * text format and the binary format (see SmartsScoresTable) are
+   * accepted, binary files are recognized by their magic number.
+   */
   class ListSmartsScores : public SmartsScores
   {
     public:
       ListSmartsScores(const std::string &filename);
-      double GetExprScore(const SmartsAtomExpr *expr);
-      double GetExprScore(const SmartsBondExpr *expr);
+      ~ListSmartsScores();
+      /**
+       * Write the scores in the binary format.
+       */
+      bool WriteBinary(const std::string &filename) const;
       double GetExprEnvironmentScore(const Smarts *pattern, const SmartsAtomExpr *expr, int radius);
       double GetExprEnvironmentScore(const Smarts *pattern, const SmartsBondExpr *expr, int radius);
+      /**
+       * Uses the neighbor pair statistics when both atoms test an element.
+       */
+      double GetBranchingFactor(const Smarts *pattern, const SmartsBond *bond, int source);
       virtual void Sort(std::vector<SmartsAtom*> &list, bool increasing = true);
       virtual void Sort(std::vector<SmartsBond*> &list, bool increasing = true);
       virtual void Sort(std::vector<SmartsAtomExpr*> &list, bool increasing = true);
       virtual void Sort(std::vector<SmartsBondExpr*> &list, bool increasing = true);
 
+    protected:
+      double ComputeExprScore(const SmartsAtomExpr *expr);
+      double ComputeExprScore(const SmartsBondExpr *expr);
+
     private:
+      ListSmartsScores(const ListSmartsScores&);
+      ListSmartsScores& operator=(const ListSmartsScores&);
+
+      bool MapBinary(const std::string &filename);
+      void ReadText(const std::string &filename);
       double EnvironmentScoreDFS(const Smarts *pattern, const SmartsBond *bond, int radius, int depth);
+      /**
+       * P(expr | element) from the joint statistics, falls back to the
+       * marginal score when there are none.
+       */
+      double GetConditionalScore(const SmartsAtomExpr *expr, int element);
+
+      const SmartsScoresTable *m_table;
+      SmartsScoresTable *m_ownedTable; // text files
+      void *m_mapped; // binary files
+      std::size_t m_mappedSize;
+  };
+
+  /**
+   * Scores measured by an instrumented matching run over a sample of
+   * molecules (see profile() in smartsmatcher.h). The pass rate of every
+   * atom and bond (sub)expression is stored by its canonical key. For each
+   * pattern bond the branching factor is stored: the average number of
+   * neighbors matching the bond and the other atom for a matched atom.
+   *
+   * Expressions that were not observed are scored by combining the scores
+   * of their children as if these were independent.
+   */
+  class ProfileSmartsScores : public SmartsScores
+  {
+    public:
+      ProfileSmartsScores() : m_loaded(false)
+      {
+      }
+
+      /**
+       * Load a profile file written by Save(), check IsLoaded() for errors.
+       */
+      ProfileSmartsScores(const std::string &filename);
+
+      /**
+       * True if the last Load() (or the constructor) read the whole file.
+       */
+      bool IsLoaded() const
+      {
+        return m_loaded;
+      }
+
+      bool Load(const std::string &filename);
+      bool Save(const std::string &filename) const;
+
+      static std::string GetExprKey(const SmartsAtomExpr *expr);
+      static std::string GetExprKey(const SmartsBondExpr *expr);
+      /**
+       * Key for a pattern bond traversed starting from @p source.
+       */
+      static std::string GetBondKey(const Smarts *pattern, const SmartsBond *bond, int source);
+
+      /**
+       * Record the result of evaluating an expression.
+       */
+      void AddExprResult(const std::string &key, bool result);
+      /**
+       * Record the number of matching neighbors (@p edges) found for a
+       * single matched atom.
+       */
+      void AddBranching(const std::string &key, unsigned long edges);
+
+      /**
+       * The measured branching factor, the default estimate is used for
+       * bonds that were not observed.
+       */
+      double GetBranchingFactor(const Smarts *pattern, const SmartsBond *bond, int source);
+
+      /**
+       * The expected number of partial mappings when matching starts with
+       * the atom (up to @p radius bonds away).
+       */
+      double GetExprEnvironmentScore(const Smarts *pattern, const SmartsAtomExpr *expr, int radius);
+      double GetExprEnvironmentScore(const Smarts *pattern, const SmartsBondExpr *expr, int radius);
+      virtual void Sort(std::vector<SmartsAtom*> &list, bool increasing = true);
+      virtual void Sort(std::vector<SmartsBond*> &list, bool increasing = true);
+      virtual void Sort(std::vector<SmartsAtomExpr*> &list, bool increasing = true);
+      virtual void Sort(std::vector<SmartsBondExpr*> &list, bool increasing = true);
+
+    protected:
+      double ComputeExprScore(const SmartsAtomExpr *expr);
+      double ComputeExprScore(const SmartsBondExpr *expr);
+
+    private:
+      struct Count
+      {
+        Count() : total(0), passed(0)
+        {
+        }
+
+        unsigned long total;
+        unsigned long passed;
+      };
+
+      double EnvironmentScoreDFS(const Smarts *pattern, int atom, int prev, int radius, int depth);
 
-      unsigned long m_numAtoms;
-      unsigned long m_numAromaticAtoms;
-      unsigned long m_numCyclicAtoms;
-      unsigned long m_numAliphaticAtoms;
-      unsigned long m_numAcyclicAtoms;
-      std::map<int, unsigned long> m_mass;
-      std::map<int, unsigned long> m_elem;
-      std::map<int, unsigned long> m_aromelem;
-      std::map<int, unsigned long> m_aliphelem;
-      std::map<int, unsigned long> m_hcount;
-      std::map<int, unsigned long> m_charge;
-      std::map<int, unsigned long> m_connect;
-      std::map<int, unsigned long> m_degree;
-      std::map<int, unsigned long> m_implicit;
-      std::map<int, unsigned long> m_rings;
-      std::map<int, unsigned long> m_size;
-      std::map<int, unsigned long> m_valence;
-      std::map<int, unsigned long> m_chiral;
-      std::map<int, unsigned long> m_hyb;
-      std::map<int, unsigned long> m_ringconnect;
-
-      unsigned long m_numBonds;
-      unsigned long m_numSingleBonds;
-      unsigned long m_numDoubleBonds;
-      unsigned long m_numTripleBonds;
-      unsigned long m_numAromaticBonds;
-      unsigned long m_numRingBonds;
+      std::map<std::string, Count> m_exprs; // total = evaluated, passed = true
+      std::map<std::string, Count> m_bonds; // total = matched atoms, passed = edges
+      bool m_loaded;
   };
 
 }
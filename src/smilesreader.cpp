@@ -0,0 +1,423 @@
+#include "smilesreader.h"
+#include "smiley.h"
+
+#include <algorithm>
+
+namespace SC {
+
+  namespace {
+
+    /**
+     * The lowest normal valence for the organic subset (and some other
+     * elements that can be aromatic), 0 if there is none.
+     */
+    int LowestValence(int element)
+    {
+      switch (element) {
+        case 5: // B
+        case 7: // N
+        case 15: // P
+        case 33: // As
+          return 3;
+        case 6: // C
+          return 4;
+        case 8: // O
+        case 16: // S
+        case 34: // Se
+        case 52: // Te
+          return 2;
+        case 9: // F
+        case 17: // Cl
+        case 35: // Br
+        case 53: // I
+          return 1;
+        default:
+          return 0;
+      }
+    }
+
+    /**
+     * The hydrogens needed to reach the lowest normal valence that is at
+     * least @p bondOrderSum (N 3/5, P 3/5, S 2/4/6).
+     */
+    int ImplicitHydrogens(int element, int bondOrderSum)
+    {
+      int valence = LowestValence(element);
+      while (valence && valence < bondOrderSum) {
+        if ((element == 7 || element == 15) && valence < 5)
+          valence = 5;
+        else if (element == 16 && valence < 6)
+          valence += 2;
+        else
+          return 0;
+      }
+      return valence ? valence - bondOrderSum : 0;
+    }
+
+    /**
+     * The lowest valence of a charged atom (N+ and O+ gain a valence, C+
+     * and C- lose one, B- gains one).
+     */
+    int ChargedValence(int element, int charge)
+    {
+      int valence = LowestValence(element);
+      if (!valence || !charge)
+        return valence;
+      switch (element) {
+        case 5:
+          return valence - charge;
+        case 6:
+          return valence - (charge < 0 ? -charge : charge);
+        default:
+          return valence + charge;
+      }
+    }
+
+    /**
+     * The pi electrons an atom without a double bond contributes to a ring:
+     * 2 for a lone pair, 0 for an empty p orbital and -1 if the atom is sp3.
+     */
+    int LonePairElectrons(int element, int charge, int connectivity)
+    {
+      switch (element) {
+        case 5: // B
+          return !charge && connectivity == 3 ? 0 : -1;
+        case 6: // C
+          if (connectivity != 3)
+            return -1;
+          return charge == -1 ? 2 : charge == 1 ? 0 : -1;
+        case 7: // N
+          if (!charge && connectivity == 3)
+            return 2;
+          return charge == -1 && connectivity == 2 ? 2 : -1;
+        case 8: // O
+        case 16: // S
+        case 34: // Se
+          return !charge && connectivity == 2 ? 2 : -1;
+        default:
+          return -1;
+      }
+    }
+
+  }
+
+  struct SmilesAtom
+  {
+    int element;
+    bool aromatic;
+    int mass;
+    int hCount; // -1 for organic subset atoms
+    int charge;
+    int atomClass;
+  };
+
+  struct SmilesBond
+  {
+    unsigned int source;
+    unsigned int target;
+    int order; // 5 for aromatic
+  };
+
+  /**
+   * Callback for the Smiley SMILES parser.
+   */
+  struct SmilesCallback : public Smiley::CallbackBase
+  {
+    void clear()
+    {
+      atoms.clear();
+      bonds.clear();
+    }
+
+    void addAtom(int element, bool aromatic, int isotope, int hCount, int charge, int atomClass)
+    {
+      SmilesAtom atom;
+      atom.element = element;
+      atom.aromatic = aromatic;
+      atom.mass = isotope > 0 ? isotope : 0;
+      atom.hCount = hCount;
+      atom.charge = charge;
+      atom.atomClass = atomClass > 0 ? atomClass : 0;
+      atoms.push_back(atom);
+    }
+
+    void addBond(int source, int target, int order, bool isUp, bool isDown)
+    {
+      SmilesBond bond;
+      bond.source = source;
+      bond.target = target;
+      bond.order = order;
+      bonds.push_back(bond);
+    }
+
+    std::vector<SmilesAtom> atoms;
+    std::vector<SmilesBond> bonds;
+  };
+
+  struct SmilesReaderPrivate
+  {
+    SmilesReaderPrivate() : parser(callback, Smiley::Parser<SmilesCallback>::SmilesMode),
+        valid(true)
+    {
+    }
+
+    bool createMolecule(Molecule &mol);
+    void perceiveAromaticity();
+
+    SmilesCallback callback;
+    Smiley::Parser<SmilesCallback> parser;
+    RingPerception rings;
+    std::string line;
+    bool valid; // the last SMILES read from a stream
+    // scratch
+    std::vector<int> indices; // callback atom index -> molecule atom index
+    std::vector<int> explicitH; // folded [H] atoms
+    std::vector<int> degree;
+    std::vector<int> bondOrderSum;
+    std::vector<unsigned int> source;
+    std::vector<unsigned int> target;
+    std::vector<int> order;
+    std::vector<int> implicitH;
+    std::vector<int> electrons; // pi electrons, -1 if the atom can't be aromatic
+    std::vector<bool> written; // written as aromatic
+    std::vector<bool> aromaticAtoms;
+    std::vector<bool> aromaticBonds;
+    std::vector<int> ringElectrons; // -1 if the ring can't be aromatic
+    std::vector<unsigned int> atomMarks;
+    std::vector<unsigned int> bondMarks;
+  };
+
+  void SmilesReaderPrivate::perceiveAromaticity()
+  {
+    const std::vector<SmilesAtom> &atoms = callback.atoms;
+    unsigned int numAtoms = implicitH.size();
+
+    // pi electrons from double bonds: 1 for a ring double bond, 0 for an
+    // exocyclic C=O, C=N or C=S
+    electrons.assign(numAtoms, -2);
+    for (std::size_t i = 0; i < source.size(); ++i) {
+      if (order[i] == 1)
+        continue;
+      for (int j = 0; j < 2; ++j) {
+        unsigned int atom = j ? target[i] : source[i];
+        unsigned int other = j ? source[i] : target[i];
+        int e = -1;
+        if (order[i] == 2 && electrons[atom] == -2) {
+          if (rings.isCyclicBond(i))
+            e = 1;
+          else if (atoms[indices[atom]].element == 6 && (atoms[indices[other]].element == 7 ||
+                atoms[indices[other]].element == 8 || atoms[indices[other]].element == 16))
+            e = 0;
+        }
+        electrons[atom] = e;
+      }
+    }
+    // lone pairs and empty p orbitals
+    for (unsigned int i = 0; i < numAtoms; ++i)
+      if (electrons[i] == -2) {
+        const SmilesAtom &atom = atoms[indices[i]];
+        electrons[i] = LonePairElectrons(atom.element, atom.charge, degree[i] + implicitH[i]);
+      }
+
+    // rings written without aromatic atoms with 4n + 2 pi electrons
+    ringElectrons.assign(rings.numRings(), -1);
+    for (std::size_t r = 0; r < rings.numRings(); ++r) {
+      const unsigned int *ringAtoms = rings.ringAtoms(r);
+      int sum = 0;
+      for (std::size_t i = 0; i < rings.ringSize(r) && sum >= 0; ++i)
+        if (written[ringAtoms[i]] || electrons[ringAtoms[i]] < 0)
+          sum = -1;
+        else
+          sum += electrons[ringAtoms[i]];
+      ringElectrons[r] = sum;
+    }
+
+    for (std::size_t r = 0; r < rings.numRings(); ++r) {
+      if (ringElectrons[r] < 0 || ringElectrons[r] % 4 != 2)
+        continue;
+      for (std::size_t i = 0; i < rings.ringSize(r); ++i) {
+        aromaticAtoms[rings.ringAtoms(r)[i]] = true;
+        aromaticBonds[rings.ringBonds(r)[i]] = true;
+      }
+    }
+
+    // pairs of fused rings (e.g. azulene, the 5 and 7 membered rings are
+    // not aromatic by themselves)
+    atomMarks.assign(numAtoms, 0);
+    bondMarks.assign(source.size(), 0);
+    for (std::size_t r1 = 0; r1 < rings.numRings(); ++r1) {
+      if (ringElectrons[r1] < 0)
+        continue;
+      for (std::size_t i = 0; i < rings.ringSize(r1); ++i) {
+        atomMarks[rings.ringAtoms(r1)[i]] = r1 + 1;
+        bondMarks[rings.ringBonds(r1)[i]] = r1 + 1;
+      }
+      for (std::size_t r2 = r1 + 1; r2 < rings.numRings(); ++r2) {
+        if (ringElectrons[r2] < 0 || (ringElectrons[r1] % 4 == 2 && ringElectrons[r2] % 4 == 2))
+          continue;
+        bool fused = false;
+        int sum = ringElectrons[r1] + ringElectrons[r2];
+        for (std::size_t i = 0; i < rings.ringSize(r2); ++i) {
+          if (bondMarks[rings.ringBonds(r2)[i]] == r1 + 1)
+            fused = true;
+          if (atomMarks[rings.ringAtoms(r2)[i]] == r1 + 1)
+            sum -= electrons[rings.ringAtoms(r2)[i]];
+        }
+        if (!fused || sum % 4 != 2)
+          continue;
+        for (std::size_t i = 0; i < rings.ringSize(r1); ++i) {
+          aromaticAtoms[rings.ringAtoms(r1)[i]] = true;
+          aromaticBonds[rings.ringBonds(r1)[i]] = true;
+        }
+        for (std::size_t i = 0; i < rings.ringSize(r2); ++i) {
+          aromaticAtoms[rings.ringAtoms(r2)[i]] = true;
+          aromaticBonds[rings.ringBonds(r2)[i]] = true;
+        }
+      }
+    }
+  }
+
+  bool SmilesReaderPrivate::createMolecule(Molecule &mol)
+  {
+    const std::vector<SmilesAtom> &atoms = callback.atoms;
+    const std::vector<SmilesBond> &bonds = callback.bonds;
+
+    // fold hydrogens bonded to a heavy atom into the heavy atom
+    indices.assign(atoms.size(), 0);
+    for (std::size_t i = 0; i < bonds.size(); ++i) {
+      const SmilesAtom &s = atoms[bonds[i].source];
+      const SmilesAtom &t = atoms[bonds[i].target];
+      if (s.element == 1 && t.element != 1)
+        indices[bonds[i].source] = -1;
+      if (t.element == 1 && s.element != 1)
+        indices[bonds[i].target] = -1;
+    }
+    unsigned int numAtoms = 0;
+    for (std::size_t i = 0; i < atoms.size(); ++i)
+      if (indices[i] != -1)
+        indices[i] = numAtoms++;
+
+    explicitH.assign(numAtoms, 0);
+    degree.assign(numAtoms, 0);
+    bondOrderSum.assign(numAtoms, 0);
+    source.clear();
+    target.clear();
+    order.clear();
+    for (std::size_t i = 0; i < bonds.size(); ++i) {
+      int s = indices[bonds[i].source];
+      int t = indices[bonds[i].target];
+      int bondOrder = bonds[i].order == 5 ? 1 : bonds[i].order;
+      if (s == -1 || t == -1) {
+        int heavy = s == -1 ? t : s;
+        ++explicitH[heavy];
+        ++degree[heavy];
+        bondOrderSum[heavy] += bondOrder;
+        continue;
+      }
+      source.push_back(s);
+      target.push_back(t);
+      order.push_back(bonds[i].order);
+      ++degree[s];
+      ++degree[t];
+      bondOrderSum[s] += bondOrder;
+      bondOrderSum[t] += bondOrder;
+    }
+
+    rings.perceive(numAtoms, source, target);
+
+    implicitH.resize(numAtoms);
+    written.resize(numAtoms);
+    for (std::size_t i = 0; i < atoms.size(); ++i) {
+      if (indices[i] == -1)
+        continue;
+      const SmilesAtom &atom = atoms[i];
+      unsigned int index = indices[i];
+      // the callback atom for each molecule atom
+      indices[index] = i;
+
+      int h = atom.hCount;
+      if (h < 0)
+        h = atom.aromatic ? std::max(0, LowestValence(atom.element) - bondOrderSum[index] - 1) :
+                            ImplicitHydrogens(atom.element, bondOrderSum[index]);
+      implicitH[index] = h;
+      written[index] = atom.aromatic;
+    }
+
+    aromaticAtoms.assign(written.begin(), written.end());
+    aromaticBonds.assign(source.size(), false);
+    for (std::size_t i = 0; i < source.size(); ++i)
+      aromaticBonds[i] = order[i] == 5 || (order[i] == 1 && rings.isCyclicBond(i) &&
+          written[source[i]] && written[target[i]]);
+    if (rings.numRings())
+      perceiveAromaticity();
+
+    mol.clear();
+    for (unsigned int index = 0; index < numAtoms; ++index) {
+      const SmilesAtom &atom = atoms[indices[index]];
+      int totalH = implicitH[index] + explicitH[index];
+      int valence = bondOrderSum[index] - explicitH[index] + totalH;
+      if (atom.aromatic && ChargedValence(atom.element, atom.charge) > valence)
+        ++valence; // pi bond
+
+      mol.addAtom(aromaticAtoms[index], rings.isCyclicAtom(index), atom.element, atom.mass,
+          degree[index], valence, degree[index] + implicitH[index], totalH, implicitH[index],
+          rings.ringMembership(index), rings.ringConnectivity(index), atom.charge,
+          atom.atomClass, rings.ringSizes(index));
+    }
+
+    for (std::size_t i = 0; i < source.size(); ++i)
+      mol.addBond(source[i], target[i], aromaticBonds[i], rings.isCyclicBond(i),
+          aromaticBonds[i] ? 5 : order[i]);
+
+    mol.buildAdjacency();
+    return true;
+  }
+
+  SmilesReader::SmilesReader() : d(new SmilesReaderPrivate)
+  {
+  }
+
+  SmilesReader::~SmilesReader()
+  {
+    delete d;
+  }
+
+  bool SmilesReader::read(const std::string &smiles, Molecule &mol)
+  {
+    try {
+      d->parser.parse(smiles);
+    } catch (Smiley::Exception&) {
+      mol.clear();
+      return false;
+    }
+
+    return d->createMolecule(mol);
+  }
+
+  bool SmilesReader::isValid() const
+  {
+    return d->valid;
+  }
+
+  bool SmilesReader::read(std::istream &is, Molecule &mol, std::string *title)
+  {
+    if (!std::getline(is, d->line))
+      return false;
+
+    std::size_t end = d->line.find_first_of(" \t");
+    std::size_t pos = end == std::string::npos ? end : d->line.find_first_not_of(" \t", end);
+    if (title) {
+      if (pos == std::string::npos)
+        title->clear();
+      else
+        title->assign(d->line, pos, std::string::npos);
+    }
+
+    // the parser takes a string, truncate the line to the SMILES
+    if (end != std::string::npos)
+      d->line.resize(end);
+    d->valid = read(d->line, mol);
+    return true;
+  }
+
+}
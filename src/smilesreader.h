@@ -0,0 +1,93 @@
+#ifndef SC_SMILESREADER_H
+#define SC_SMILESREADER_H
+
+#include "molecule.h"
+
+#include <istream>
+#include <string>
+
+namespace SC {
+
+  struct SmilesReaderPrivate;
+
+  /**
+   * Read SMILES into a Molecule without OpenBabel.
+   *
+   * The SMILES is parsed using Smiley and the properties needed for
+   * matching are derived natively:
+   *
+   * - implicit hydrogens: organic subset atoms get the hydrogens to reach
+   *   their lowest normal valence (B 3, C 4, N 3/5, O 2, P 3/5, S 2/4/6,
+   *   halogens 1). Aromatic atoms use one valence for the pi bond and only
+   *   their lowest valence (c gets 1 H in benzene, n and o none).
+   * - degree counts the explicit neighbors (including bracket [H] atoms),
+   *   connectivity the explicit neighbors plus the implicit hydrogens.
+   * - valence is the bond order sum (aromatic bonds count as 1) plus the
+   *   hydrogens plus 1 for aromatic atoms that have a pi bond.
+   * - ring bonds, ring membership, ring connectivity and ring sizes are
+   *   computed by RingPerception.
+   * - aromaticity written in the SMILES is kept: lowercase atoms are
+   *   aromatic and ring bonds between two aromatic atoms (or ':' bonds) are
+   *   aromatic.
+   * - SSSR rings written without aromatic atoms (Kekulé form) are aromatic
+   *   if they have 4n + 2 pi electrons. Each atom contributes 1 for a ring
+   *   double bond, 0 for an exocyclic C=O, C=N or C=S, 2 for a lone pair
+   *   (3-connected N, 2-connected O, S and Se, C- and 2-connected N-) and 0
+   *   for C+ and 3-connected B. A ring with any other atom (e.g. sp3 carbon)
+   *   is not aromatic. Two fused rings that are not aromatic by themselves
+   *   are also tested together (e.g. azulene). The aromatic atoms and ring
+   *   bonds are marked aromatic (bond order 5), the hydrogen counts and
+   *   valences are those of the Kekulé form.
+   *
+   * Hydrogens written as bracket atoms bonded to a heavy atom are removed
+   * and counted in the heavy atom's total hydrogen count (same as
+   * writeMolecule()).
+   *
+   * Use one reader and one Molecule for a stream of molecules, both keep
+   * their storage between molecules.
+   *
+   * @code
+   * SmilesReader reader;
+   * Molecule mol;
+   * std::string title;
+   * while (reader.read(ifs, mol, &title))
+   *   if (match(&mol, pattern))
+   *     std::cout << title << std::endl;
+   * @endcode
+   */
+  class SmilesReader
+  {
+    public:
+      SmilesReader();
+      ~SmilesReader();
+
+      /**
+       * Read a single SMILES.
+       *
+       * @return False if the SMILES is invalid.
+       */
+      bool read(const std::string &smiles, Molecule &mol);
+
+      /**
+       * Read the next line of a SMILES file ("<smiles> <title>"). Invalid
+       * SMILES result in an empty molecule (see isValid()), false is only
+       * returned at the end of the stream.
+       */
+      bool read(std::istream &is, Molecule &mol, std::string *title = 0);
+
+      /**
+       * Check if the last SMILES read from a stream was valid.
+       */
+      bool isValid() const;
+
+    private:
+      // not copyable
+      SmilesReader(const SmilesReader&);
+      SmilesReader& operator=(const SmilesReader&);
+
+      SmilesReaderPrivate *d;
+  };
+
+}
+
+#endif
@@ -307,6 +307,15 @@ namespace SC {
     return tokens;
   }
 
+  /**
+   * Clamp a property to the range of a (binary file) record field.
+   */
+  template<typename T>
+  T ClampField(int value, int min, int max)
+  {
+    return static_cast<T>(value < min ? min : (value > max ? max : value));
+  }
+
   /**
    * Containers
    */
@@ -0,0 +1,35 @@
+# Test the CPython extension module generated by smartscodegenerator
+# -python-extension from data/extension.smarts.
+import smartsext
+
+def compare(a, b, expr):
+    if a != b:
+        print("%s [%s == %s] (FAIL)" % (expr, a, b))
+
+compare(smartsext.Match("CCO", "CO"), True, 'Match("CCO", "CO")')
+compare(smartsext.Match("CCC", "CO"), False, 'Match("CCC", "CO")')
+compare(smartsext.Match("c1ccccc1O", "c1ccccc1"), True, 'Match("c1ccccc1O", "c1ccccc1")')
+compare(smartsext.Match("C1CCCCC1", "c1ccccc1"), False, 'Match("C1CCCCC1", "c1ccccc1")')
+compare(smartsext.Match("C1CC1", "[C;R]"), True, 'Match("C1CC1", "[C;R]")')
+# patterns that are not in the module don't match
+compare(smartsext.Match("CCO", "N"), False, 'Match("CCO", "N")')
+compare(len(smartsext.MatchAll("OCCO", "[OX2H]")), 2, 'len(MatchAll("OCCO", "[OX2H]"))')
+
+try:
+    smartsext.Match(1, "CO")
+    print("Match(1, \"CO\") did not raise TypeError (FAIL)")
+except TypeError:
+    pass
+
+# openbabel.OBMol objects are converted by the SWIG runtime
+try:
+    import openbabel
+except ImportError:
+    openbabel = None
+if openbabel:
+    mol = openbabel.OBMol()
+    conv = openbabel.OBConversion()
+    conv.SetInFormat("smi")
+    conv.ReadString(mol, "OCC=O")
+    compare(smartsext.Match(mol, "[OX2H]"), True, 'Match(mol, "[OX2H]")')
+    compare(len(smartsext.MatchAll(mol, "CO")), 1, 'len(MatchAll(mol, "CO"))')
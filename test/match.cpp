@@ -1,11 +1,19 @@
 #include "../src/smarts.h"
 #include "../src/smartsmatcher.h"
+#include "../src/compiledsmarts.h"
+#include "../src/smartscache.h"
+#include "../src/smilesreader.h"
+#include "../src/moleculestore.h"
+#include "../src/moleculefile.h"
 
 #include "test.h"
 
 #include <openbabel/mol.h>
 #include <openbabel/obconversion.h>
 
+#include <cstdio>
+#include <sstream>
+
 using namespace SC;
 using namespace OpenBabel;
 
@@ -27,10 +35,294 @@ void TestMatch(const std::string &smarts, const std::string &smiles, bool expect
 
   NoMapping mapping;
   COMPARE(match(&mol, s, mapping), expected);
+
+  // snapshot of the OBMol properties
+  Molecule snapshot;
+  COMPARE(match(&mol, s, mapping, snapshot), expected);
+  COMPARE(snapshot.numAtoms(), mol.NumAtoms());
+
+  // native SMILES reader
+  SmilesReader reader;
+  Molecule nativeMol;
+  COMPARE(reader.read(smiles, nativeMol), true);
+  COMPARE(match(&nativeMol, s, mapping), expected);
   
   delete s;
 }
 
+void TestCompiledSmarts()
+{
+  std::cout << "Testing: CompiledSmarts" << std::endl;
+
+  OBMol mol;
+  readSmiles("Oc1ccccc1", mol);
+
+  CompiledSmarts pattern("c1ccccc1[OH]");
+  REQUIRE(!pattern.isNull());
+  COMPARE(pattern.smarts(), std::string("c1ccccc1[OH]"));
+  COMPARE(pattern.refCount(), 1);
+
+  // copies share the pattern
+  CompiledSmarts copy(pattern);
+  COMPARE(copy.pattern(), pattern.pattern());
+  COMPARE(pattern.refCount(), 2);
+
+  COMPARE(match(&mol, pattern), true);
+  CountMapping mapping;
+  COMPARE(match(&mol, copy, mapping), true);
+  COMPARE(mapping.count, 2);
+
+  copy = CompiledSmarts();
+  COMPARE(pattern.refCount(), 1);
+  COMPARE(match(&mol, copy), false);
+}
+
+void TestCompiledSmartsCache()
+{
+  std::cout << "Testing: CompiledSmartsCache" << std::endl;
+
+  OBMol mol;
+  readSmiles("CCO", mol);
+
+  CompiledSmartsCache cache(2);
+  // equivalent spellings share the compiled pattern
+  CompiledSmarts pattern = cache.get("[CH3]");
+  COMPARE(cache.get("[C;H3]").pattern(), pattern.pattern());
+  COMPARE(cache.get("[H3C]").pattern(), pattern.pattern());
+  COMPARE(cache.get("[#6&A&H3]").pattern(), pattern.pattern());
+  COMPARE(cache.get("[CH3]").pattern(), pattern.pattern());
+  COMPARE(cache.size(), static_cast<std::size_t>(1));
+  COMPARE(cache.misses(), 1ul);
+  COMPARE(match(&mol, pattern), true);
+
+  // a different atom order is compiled separately, the mapping follows the
+  // atoms of the requested SMARTS
+  ASSERT(cache.get("OCC").pattern() != cache.get("CCO").pattern());
+  COMPARE(cache.size(), static_cast<std::size_t>(2));
+  COMPARE(cache.misses(), 3ul);
+  SingleMapping cached, direct;
+  COMPARE(match(&mol, cache.get("OCC"), cached), true);
+  COMPARE(match(&mol, CompiledSmarts("OCC"), direct), true);
+  ASSERT(cached.map == direct.map);
+  COMPARE(cache.get("OCC").smarts(), std::string("OCC"));
+
+  // an evicted pattern can still be used
+  cache.get("N");
+  COMPARE(cache.size(), static_cast<std::size_t>(2));
+  COMPARE(match(&mol, pattern), true);
+
+  // the least recently used pattern is evicted
+  CompiledSmartsCache lru(2);
+  CompiledSmarts a = lru.get("[CH3]");
+  CompiledSmarts b = lru.get("N");
+  COMPARE(lru.get("[CH3]").pattern(), a.pattern());
+  lru.get("O");
+  COMPARE(lru.misses(), 3ul);
+  COMPARE(lru.get("[CH3]").pattern(), a.pattern());
+  COMPARE(lru.misses(), 3ul);
+  ASSERT(lru.get("N").pattern() != b.pattern());
+  COMPARE(lru.misses(), 4ul);
+}
+
+void TestPropertyCache()
+{
+  std::cout << "Testing: OpenBabelPropertyCache" << std::endl;
+
+  OBMol mol;
+  readSmiles("CCO", mol);
+
+  // no cache unless one is attached
+  Smarts *s = parse("[CH3;h3]");
+  COMPARE(match(&mol, s), true);
+  COMPARE(OpenBabelPropertyCache::get(&mol) == 0, true);
+
+  OpenBabelPropertyCache cache;
+  cache.attach(&mol);
+  COMPARE(OpenBabelPropertyCache::get(&mol), &cache);
+  COMPARE(match(&mol, s), true);
+  // cached values are used
+  COMPARE(match(&mol, s), true);
+
+  // the implicit hydrogens become explicit, the cache notices the new atoms
+  mol.AddHydrogens();
+  COMPARE(match(&mol, s), false);
+  delete s;
+
+  s = parse("[CH3;h0]");
+  COMPARE(match(&mol, s), true);
+
+  // the cache is reused for the next molecule and only used for that one
+  OBMol other;
+  readSmiles("CCN", other);
+  cache.attach(&other);
+  COMPARE(OpenBabelPropertyCache::get(&mol) == 0, true);
+  COMPARE(match(&mol, s), true);
+  COMPARE(match(&other, s), false);
+
+  // copies and cleared molecules are not linked to the cache
+  OBMol copy(other);
+  COMPARE(OpenBabelPropertyCache::get(&copy) == 0, true);
+  other.Clear();
+  COMPARE(OpenBabelPropertyCache::get(&other) == 0, true);
+  delete s;
+}
+
+void TestMoleculeFileLimits()
+{
+  std::cout << "Testing: MoleculeFileWriter limits" << std::endl;
+
+  SmilesReader reader;
+  Molecule mol;
+  std::string buffer;
+
+  // 2 * numBonds bond indices must fit in AtomRecord::firstBond
+  REQUIRE(reader.read(std::string(32768, 'C'), mol));
+  COMPARE(MoleculeFileWriter::pack(mol, buffer), true);
+  REQUIRE(reader.read(std::string(32769, 'C'), mol));
+  COMPARE(MoleculeFileWriter::pack(mol, buffer), false);
+
+  // at most 255 bonds per atom
+  std::string star("C");
+  for (int i = 0; i < 255; ++i)
+    star += "(C)";
+  REQUIRE(reader.read(star, mol));
+  COMPARE(MoleculeFileWriter::pack(mol, buffer), true);
+  REQUIRE(reader.read(star + "C", mol));
+  COMPARE(MoleculeFileWriter::pack(mol, buffer), false);
+}
+
+void TestMoleculeFileRingSizes()
+{
+  std::cout << "Testing: ring sizes in *.scm files" << std::endl;
+
+  OBMol obmol;
+  readSmiles("Cc1ccccc1", obmol);
+  CompiledSmarts r6("[r6]"), r5("[r5]");
+
+  // text
+  std::stringstream ss;
+  writeMoleculeHeader(ss);
+  writeMolecule(ss, &obmol);
+  Molecule mol;
+  REQUIRE(readMoleculeHeader(ss));
+  REQUIRE(readMolecule(ss, mol));
+  COMPARE(match(&mol, r6), true);
+  COMPARE(match(&mol, r5), false);
+
+  // files written by another version are rejected
+  std::stringstream old("SCM 1\n1 0\n0 0 6 12 0 4 4 4 4 0 0 0 0\n");
+  COMPARE(readMoleculeHeader(old), false);
+  std::stringstream missing("1 0\n0 0 6 12 0 4 4 4 4 0 0 0 0 0\n");
+  COMPARE(readMoleculeHeader(missing), false);
+
+  // binary
+  const std::string filename = "test_ringsizes.scm";
+  MoleculeFileWriter writer(filename);
+  REQUIRE(writer.isOpen());
+  REQUIRE(writer.write(&obmol));
+  writer.close();
+  MoleculeFile file;
+  REQUIRE(file.open(filename));
+  REQUIRE(file.numMolecules() == 1);
+  MoleculeView view = file.molecule(0);
+  COMPARE(match(&view, r6), true);
+  COMPARE(match(&view, r5), false);
+  file.close();
+  std::remove(filename.c_str());
+}
+
+void TestMoleculeTextHydrogens()
+{
+  std::cout << "Testing: explicit hydrogens in text *.scm files" << std::endl;
+
+  // the hydrogen is the first atom, the bond indices are renumbered
+  OBMol obmol1, obmol2;
+  readSmiles("[H]OC", obmol1);
+  readSmiles("CC", obmol2);
+  std::stringstream ss;
+  writeMoleculeHeader(ss);
+  writeMolecule(ss, &obmol1);
+  writeMolecule(ss, &obmol2);
+
+  Molecule mol;
+  REQUIRE(readMoleculeHeader(ss));
+  REQUIRE(readMolecule(ss, mol));
+  COMPARE(mol.numAtoms(), 2u);
+  COMPARE(mol.numBonds(), 1u);
+  COMPARE(mol.element(0), 8);
+  COMPARE(mol.source(0), 0u);
+  COMPARE(mol.target(0), 1u);
+  CompiledSmarts pattern("[OH]C");
+  COMPARE(match(&mol, pattern), true);
+  // the next molecule is still read
+  REQUIRE(readMolecule(ss, mol));
+  COMPARE(mol.numAtoms(), 2u);
+}
+
+void TestMoleculeStore()
+{
+  std::cout << "Testing: MoleculeStore" << std::endl;
+
+  const char *smiles[] = { "CCO", "CCN", "c1ccccc1O", "C1CCCCC1", "CBr", "CC" };
+  const std::string filename = "test_moleculestore.scs";
+
+  SmilesReader reader;
+  Molecule mol;
+  MoleculeStoreWriter writer(filename, 2);
+  REQUIRE(writer.isOpen());
+  for (int i = 0; i < 6; ++i) {
+    REQUIRE(reader.read(smiles[i], mol));
+    COMPARE(writer.write(mol), true);
+  }
+  writer.close();
+
+  MoleculeStore store;
+  REQUIRE(store.open(filename));
+  COMPARE(store.numChunks(), static_cast<std::size_t>(3));
+  COMPARE(store.numMolecules(), static_cast<std::size_t>(6));
+  COMPARE(store.firstMolecule(2), static_cast<std::size_t>(4));
+
+  Molecule stored;
+  COMPARE(store.chunk(1).read(0, stored), true);
+  REQUIRE(reader.read(smiles[2], mol));
+  COMPARE(stored.numAtoms(), mol.numAtoms());
+  COMPARE(stored.numBonds(), mol.numBonds());
+  COMPARE(stored.isAromatic(0), true);
+  COMPARE(match(&stored, CompiledSmarts("c1ccccc1[OH]")), true);
+
+  // only the chunk with aromatic atoms is searched
+  std::vector<std::size_t> hits;
+  COMPARE(store.scan(CompiledSmarts("c1ccccc1"), hits), static_cast<std::size_t>(2));
+  REQUIRE(hits.size() == 1);
+  COMPARE(hits[0], static_cast<std::size_t>(2));
+
+  // element and ring size summaries
+  COMPARE(store.scan(CompiledSmarts("[Br]"), hits, 2), static_cast<std::size_t>(2));
+  REQUIRE(hits.size() == 1);
+  COMPARE(hits[0], static_cast<std::size_t>(4));
+  COMPARE(store.scan(CompiledSmarts("[r6]"), hits, 2), static_cast<std::size_t>(2));
+  REQUIRE(hits.size() == 2);
+  COMPARE(hits[1], static_cast<std::size_t>(3));
+  COMPARE(store.scan(CompiledSmarts("[r5]"), hits), static_cast<std::size_t>(3));
+  COMPARE(hits.size(), static_cast<std::size_t>(0));
+
+  // no summary rules out [#6]
+  COMPARE(store.scan(CompiledSmarts("[#6]"), hits, 4), static_cast<std::size_t>(0));
+  COMPARE(hits.size(), static_cast<std::size_t>(6));
+  store.close();
+
+  // a store with corrupt atom offsets is rejected
+  std::fstream fs(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+  REQUIRE(fs.is_open());
+  unsigned int offset = 65535;
+  fs.seekp(sizeof(MoleculeStoreHeader) + sizeof(MoleculeStoreChunkHeader) + sizeof(unsigned int));
+  fs.write(reinterpret_cast<const char*>(&offset), sizeof(unsigned int));
+  fs.close();
+  COMPARE(store.open(filename), false);
+
+  std::remove(filename.c_str());
+}
+
 int main()
 {
   ////////////////////////////////////////////////
@@ -53,6 +345,9 @@ int main()
   TestMatch("[a]", "c1ccccc1", true);
   TestMatch("a", "C1CCCCC1", false);
   TestMatch("[a]", "C1CCCCC1", false);
+  TestMatch("c", "C1=CC=CC=C1", true);
+  TestMatch("[c;r5]", "C1=CC=C2C=CC=C2C=C1", true); // azulene
+  TestMatch("[c;r7]", "C1=CC=C2C=CC=C2C=C1", true);
   // aliphatic
   TestMatch("A", "c1ccccc1", false);
   TestMatch("[A]", "c1ccccc1", false);
@@ -105,10 +400,19 @@ int main()
   TestMatch("[R1]", "C1CC1", true);
   TestMatch("[R1]", "C12CC1CC2", true);
   TestMatch("[R2]", "C12CC1CC2", true);
+  TestMatch("[R2]", "c1ccc2ccccc2c1", true);
+  TestMatch("[R3]", "c1ccc2ccccc2c1", false);
+  TestMatch("[R3]", "C12C3C4C1C5C2C3C45", true); // cubane
+  TestMatch("[R3]", "c1cc2ccc3ccc4ccc5ccc6ccc1c7c2c3c4c5c67", true); // coronene
+  // a ring with every bond fused to a smaller ring
+  TestMatch("[R3;r6]", "C127CC23CC34CC45CC56CC61C7", true);
   // ring size
   TestMatch("[r3]", "CCC", false);
   TestMatch("[r3]", "C1CC1", true);
   TestMatch("[r4]", "C1CC1", false);
+  TestMatch("[r4]", "C12C3C4C1C5C2C3C45", true);
+  TestMatch("[r6]", "C12C3C4C1C5C2C3C45", false);
+  TestMatch("[r6]", "C127CC23CC34CC45CC56CC61C7", true);
   // ring connectivity
   TestMatch("[x2]", "CCC", false);
   TestMatch("[x2]", "C1CC1", true);
@@ -150,6 +454,21 @@ int main()
   TestMatch("C1CCC12CC2", "C1CCC12CC2", true);
   TestMatch("C1CCC12CC2", "C1CCC1CC", false);
   TestMatch("C1CCC12CC2", "C1CC1CCC", false);
+  // branches: each atom is mapped only once
+  TestMatch("C(C)C", "CC", false);
+  TestMatch("C(C)C", "CCC", true);
+  TestMatch("C(C)(C)C", "CC(C)C", true);
+  // disconnected components
+  TestMatch("C.N", "CN", true);
+  TestMatch("C.N", "CC", false);
+
+  TestCompiledSmarts();
+  TestCompiledSmartsCache();
+  TestPropertyCache();
+  TestMoleculeFileLimits();
+  TestMoleculeFileRingSizes();
+  TestMoleculeTextHydrogens();
+  TestMoleculeStore();
 
 
 
@@ -2,6 +2,7 @@
 #include "../src/smartsscores.h"
 #include "../src/smartsmatcher.h"
 #include "../src/smartsprint.h"
+#include "../src/smartsanalysis.h"
 
 #include "test.h"
 
@@ -29,6 +30,81 @@ bool TestAtomExprOptimization(const std::string &expr, const std::string &correc
   return result == correct;
 }
 
+bool TestSearchPlan(const std::string &smarts, int startAtom, int closures, SmartsScores &scores)
+{
+  std::cout << "Test: " << smarts << " -> start " << startAtom << ", " << closures << " closures" << std::endl;
+
+  Smarts *pattern = parse(smarts);
+
+  SmartsOptimizer optimizer(&scores);
+  optimizer.Optimize(pattern, SmartsOptimizer::AtomOrder | SmartsOptimizer::BondOrder);
+
+  const std::vector<SmartsSearchStep> &plan = pattern->searchPlan();
+  REQUIRE(plan.size() == pattern->atoms.size() + pattern->bonds.size());
+  int numClosures = 0;
+  for (std::size_t i = 0; i < plan.size(); ++i)
+    if (plan[i].closure)
+      ++numClosures;
+  COMPARE(plan[0].target, startAtom);
+  COMPARE(numClosures, closures);
+
+  bool result = plan[0].target == startAtom && numClosures == closures;
+
+  delete pattern;
+
+  return result;
+}
+
+bool TestSatisfiable(const std::string &smarts, bool correct)
+{
+  std::cout << "Test: " << smarts << " -> " << (correct ? "satisfiable" : "unsatisfiable") << std::endl;
+
+  Smarts *pattern = parse(smarts);
+
+  std::string reason;
+  bool result = IsSatisfiable(pattern, &reason);
+  COMPARE(result, correct);
+  if (!result)
+    std::cout << "  " << reason << std::endl;
+
+  delete pattern;
+
+  return result == correct;
+}
+
+bool TestRequiredRingSizes(const std::string &smarts, unsigned int ringSizes)
+{
+  std::cout << "Test: " << smarts << " -> ring sizes " << ringSizes << std::endl;
+
+  Smarts *pattern = parse(smarts);
+  SmartsCounts counts = GetRequiredCounts(pattern);
+  COMPARE(counts.ringSizes, ringSizes);
+  delete pattern;
+
+  return counts.ringSizes == ringSizes;
+}
+
+bool TestRequiredCounts(const std::string &smarts, int carbons, int aromaticAtoms, int ringAtoms, int ringBonds)
+{
+  std::cout << "Test: " << smarts << " -> " << carbons << " C, " << aromaticAtoms << " aromatic, "
+            << ringAtoms << " ring atoms, " << ringBonds << " ring bonds" << std::endl;
+
+  Smarts *pattern = parse(smarts);
+
+  SmartsCounts counts = GetRequiredCounts(pattern);
+  COMPARE(counts.elements[6], carbons);
+  COMPARE(counts.numAromaticAtoms, aromaticAtoms);
+  COMPARE(counts.numRingAtoms, ringAtoms);
+  COMPARE(counts.numRingBonds, ringBonds);
+
+  bool result = counts.elements[6] == carbons && counts.numAromaticAtoms == aromaticAtoms &&
+                counts.numRingAtoms == ringAtoms && counts.numRingBonds == ringBonds;
+
+  delete pattern;
+
+  return result;
+}
+
 int main()
 {
   PrettySmartsScores scores;
@@ -111,4 +187,29 @@ int main()
   ASSERT(TestAtomExprOptimization("[#6,#7,#8;a]", "a;#6,#7,#8", SmartsOptimizer::BinaryExpr2, scores));
 
   ASSERT(TestAtomExprOptimization("", "", SmartsOptimizer::ExprFactor, scores));
+
+  ASSERT(TestSearchPlan("CC", 0, 0, scores));
+  ASSERT(TestSearchPlan("NC", 1, 0, scores));
+  ASSERT(TestSearchPlan("C1CCC1", 0, 1, scores));
+  ASSERT(TestSearchPlan("C1CCC12CC2", 0, 2, scores));
+
+  ASSERT(TestSatisfiable("c1ccccc1", true));
+  ASSERT(TestSatisfiable("C:c", false));
+  ASSERT(TestSatisfiable("[C,c]:c", true));
+  ASSERT(TestSatisfiable("[R0]@C", false));
+  ASSERT(TestSatisfiable("C1CC[C;R0]1", false));
+  ASSERT(TestSatisfiable("C1CCC!@1", false));
+  ASSERT(TestSatisfiable("C[CD1]C", false));
+  ASSERT(TestSatisfiable("C[CD2]C", true));
+  ASSERT(TestSatisfiable("C[C;D1,D3](C)C", true));
+  ASSERT(TestSatisfiable("C1CC[Cx1]1", false));
+  ASSERT(TestSatisfiable("[a;R0]", false));
+
+  ASSERT(TestRequiredCounts("c1ccccc1C", 7, 6, 6, 6));
+  ASSERT(TestRequiredCounts("[#6]@[#7]", 1, 0, 2, 1));
+  ASSERT(TestRequiredCounts("[C,N]", 0, 0, 0, 0));
+  ASSERT(TestRequiredCounts("[C,c]:[#6]", 2, 2, 2, 1));
+  ASSERT(TestRequiredRingSizes("[r5;r6]C[r3]", (1u << 3) | (1u << 5) | (1u << 6)));
+  ASSERT(TestRequiredRingSizes("[r5,r6]", 0));
+  ASSERT(TestRequiredRingSizes("[!r5]", 0));
 }
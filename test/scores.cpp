@@ -1,9 +1,13 @@
 #include "../src/smartsscores.h"
 #include "../src/smarts.h"
 #include "../src/smartsprint.h"
+#include "../src/pattern.h"
 
 #include "test.h"
 
+#include <cstdio>
+#include <fstream>
+
 using namespace SC;
 
 bool TestAtomScoreSort(const std::string &expr, const std::string &correct, SmartsScores &scores, bool increasing)
@@ -32,10 +36,217 @@ bool TestAtomScoreSort(const std::string &expr, const std::string &correct, Smar
   return result == correct;
 }
 
+bool TestProfileScores()
+{
+  std::cout << "Test: ProfileSmartsScores" << std::endl;
+
+  Smarts *pattern = parse("CON");
+
+  ProfileSmartsScores profile;
+  // C passes 3/4, O 1/4 and N never
+  for (int i = 0; i < 4; ++i) {
+    profile.AddExprResult(ProfileSmartsScores::GetExprKey(pattern->atoms[0].expr), i < 3);
+    profile.AddExprResult(ProfileSmartsScores::GetExprKey(pattern->atoms[1].expr), i < 1);
+    profile.AddExprResult(ProfileSmartsScores::GetExprKey(pattern->atoms[2].expr), false);
+  }
+  profile.AddBranching(ProfileSmartsScores::GetBondKey(pattern, &pattern->bonds[0], 0), 2);
+  REQUIRE(profile.Save("profile_test.txt"));
+
+  ProfileSmartsScores scores("profile_test.txt");
+  std::remove("profile_test.txt");
+  REQUIRE(scores.IsLoaded());
+  COMPARE(scores.GetExprScore(pattern->atoms[0].expr), 0.75);
+  COMPARE(scores.GetExprScore(pattern->atoms[1].expr), 0.25);
+  COMPARE(scores.GetBranchingFactor(pattern, &pattern->bonds[0], 0), 2.0);
+
+  delete pattern;
+
+  // missing file
+  ProfileSmartsScores missing("profile_test_missing.txt");
+  COMPARE(missing.IsLoaded(), false);
+
+  return TestAtomScoreSort("CON", "NOC", scores, true) && TestAtomScoreSort("CON", "CON", scores, false);
+}
+
+bool TestOperandCostSort()
+{
+  std::cout << "Test: SortOperands" << std::endl;
+
+  Smarts *pattern = parse("[#6][r6]");
+  SmartsAtomExpr *elem = pattern->atoms[0].expr;
+  SmartsAtomExpr *ringSize = pattern->atoms[1].expr;
+
+  ProfileSmartsScores scores;
+  for (int i = 0; i < 10; ++i) {
+    scores.AddExprResult(ProfileSmartsScores::GetExprKey(elem), i < 5);
+    scores.AddExprResult(ProfileSmartsScores::GetExprKey(ringSize), i < 4);
+  }
+
+  std::vector<SmartsAtomExpr*> operands;
+  operands.push_back(ringSize);
+  operands.push_back(elem);
+
+  // r6 is rarer but 10x more expensive
+  scores.SortOperands(operands, true);
+  bool result = operands[0] == elem;
+  // with equal costs the rarest test goes first
+  scores.SetPrimitiveCost(Smiley::AE_RingSize, 1.0);
+  scores.SortOperands(operands, true);
+  result = result && operands[0] == ringSize;
+  // OR: the most likely test goes first
+  scores.SortOperands(operands, false);
+  result = result && operands[0] == elem;
+
+  delete pattern;
+
+  return result;
+}
+
+/**
+ * Counts the computed (not memoized) scores.
+ */
+class CountingSmartsScores : public PrettySmartsScores
+{
+  public:
+    CountingSmartsScores() : count(0)
+    {
+    }
+
+    int count;
+
+  protected:
+    double ComputeExprScore(const SmartsAtomExpr *expr)
+    {
+      ++count;
+      return PrettySmartsScores::ComputeExprScore(expr);
+    }
+};
+
+bool TestScoreCache()
+{
+  std::cout << "Test: memoized scores" << std::endl;
+
+  Smarts *pattern = parse("[C,N,O,S,P,F,Cl,Br,I,c,n,o,s;R]");
+  SmartsAtomExpr *expr = pattern->atoms[0].expr;
+  int numNodes = CountExpr(expr);
+
+  CountingSmartsScores scores;
+  scores.GetExprScore(expr);
+  scores.GetExprScore(expr);
+  // without cache every call recurses through the tree
+  bool result = scores.count == 2 * numNodes;
+  COMPARE(scores.count, 2 * numNodes);
+
+  scores.count = 0;
+  scores.SetCacheEnabled(true);
+  scores.GetExprScore(expr);
+  scores.GetExprScore(expr);
+  result = result && scores.count == numNodes;
+  COMPARE(scores.count, numNodes);
+
+  // a rewritten node is computed again
+  scores.count = 0;
+  scores.InvalidateExpr(expr);
+  scores.GetExprScore(expr);
+  result = result && scores.count == 1;
+  COMPARE(scores.count, 1);
+
+  delete pattern;
+
+  return result;
+}
+
+class OverridingSmartsScores : public PrettySmartsScores
+{
+  public:
+    using PrettySmartsScores::GetExprScore;
+
+    double GetExprScore(const SmartsAtomExpr *expr)
+    {
+      return expr->type == Smiley::AE_AliphaticElement && expr->leaf.value == 8 ? 0.0 : 1.0;
+    }
+};
+
+bool TestScoreOverride()
+{
+  std::cout << "Test: GetExprScore() override" << std::endl;
+
+  // C is sorted before O by PrettySmartsScores
+  OverridingSmartsScores scores;
+  scores.SetCacheEnabled(true);
+  return TestAtomScoreSort("CO", "OC", scores, true);
+}
+
+void WriteJointScores(const std::string &filename)
+{
+  std::ofstream ofs(filename.c_str());
+  ofs << "# atoms: 100" << std::endl;
+  ofs << "# bonds: 100" << std::endl;
+  ofs << "AE_ELEM  6: 80" << std::endl;
+  ofs << "AE_ELEM  7: 20" << std::endl;
+  ofs << "AE_ALIPHELEM  6: 80" << std::endl;
+  ofs << "AE_HCOUNT  H3: 50" << std::endl;
+  ofs << "AE_ELEM_HCOUNT  6 3: 10" << std::endl;
+  ofs << "AE_ELEM_HCOUNT  7 3: 40" << std::endl;
+}
+
+bool TestJointScores()
+{
+  std::cout << "Test: ListSmartsScores joint statistics" << std::endl;
+
+  WriteJointScores("joint_test.smarts_scores");
+  ListSmartsScores scores("joint_test.smarts_scores");
+  std::remove("joint_test.smarts_scores");
+  Smarts *pattern = parse("[CH3]");
+
+  // P(C) * P(H3 | C) instead of min(P(C), P(H3)) = 0.5
+  double score = scores.GetExprScore(pattern->atoms[0].expr);
+  COMPARE(score, 0.8 * (10 / 80.0));
+
+  delete pattern;
+
+  return score == 0.8 * (10 / 80.0);
+}
+
+bool TestBinaryScores()
+{
+  std::cout << "Test: ListSmartsScores binary format" << std::endl;
+
+  WriteJointScores("binary_test.smarts_scores");
+  ListSmartsScores text("binary_test.smarts_scores");
+  std::remove("binary_test.smarts_scores");
+  text.SetPrimitiveCost(Smiley::AE_RingSize, 7.0);
+  bool written = text.WriteBinary("binary_test.smarts_scores_bin");
+  ListSmartsScores binary("binary_test.smarts_scores_bin");
+  std::remove("binary_test.smarts_scores_bin");
+  REQUIRE(written);
+
+  Smarts *pattern = parse("[CH3][N;H3]O");
+
+  bool result = true;
+  for (std::size_t i = 0; i < pattern->atoms.size(); ++i) {
+    COMPARE(binary.GetExprScore(pattern->atoms[i].expr), text.GetExprScore(pattern->atoms[i].expr));
+    result = result && binary.GetExprScore(pattern->atoms[i].expr) == text.GetExprScore(pattern->atoms[i].expr);
+  }
+  COMPARE(binary.GetPrimitiveCost(Smiley::AE_RingSize), 7.0);
+  result = result && binary.GetPrimitiveCost(Smiley::AE_RingSize) == 7.0;
+
+  delete pattern;
+
+  return result;
+}
+
 int main()
 {
   PrettySmartsScores scores;
 
   ASSERT(TestAtomScoreSort("CO", "CO", scores, true));
   ASSERT(TestAtomScoreSort("OC", "CO", scores, true));
+
+  ASSERT(TestProfileScores());
+  ASSERT(TestOperandCostSort());
+  ASSERT(TestScoreCache());
+  ASSERT(TestScoreOverride());
+  ASSERT(TestJointScores());
+  ASSERT(TestBinaryScores());
 }
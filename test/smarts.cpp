@@ -1,5 +1,6 @@
 #include "../src/smarts.h"
 #include "../src/smartsprint.h"
+#include "../src/pattern.h"
 
 #include "test.h"
 
@@ -15,6 +16,18 @@ void TestParseWrite(const std::string &smarts)
   delete s;
 }
 
+void TestCanonicalExprKey(const std::string &smarts1, const std::string &smarts2, bool same = true)
+{
+  std::cout << "Testing: " << smarts1 << " " << smarts2 << std::endl;
+  Smarts *s1 = parse(smarts1);
+  Smarts *s2 = parse(smarts2);
+
+  COMPARE(GetCanonicalExprKey(s1->atoms[0].expr) == GetCanonicalExprKey(s2->atoms[0].expr), same);
+
+  delete s1;
+  delete s2;
+}
+
 int main()
 {
   //
@@ -36,6 +49,15 @@ int main()
 
   TestParseWrite("[C!*]");
 
+  // canonical expression keys
+  TestCanonicalExprKey("[C,N]", "[N,C]");
+  TestCanonicalExprKey("[C,N,O]", "[O,C,N]");
+  TestCanonicalExprKey("[C;R&X3]", "[X3R;C]");
+  TestCanonicalExprKey("[C,C]", "[C]");
+  TestCanonicalExprKey("[!C,N]", "[N,!C]");
+  TestCanonicalExprKey("[C,N]", "[C;N]", false);
+  TestCanonicalExprKey("[H1]", "[H2]", false);
+
 
 
 }
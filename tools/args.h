@@ -187,7 +187,7 @@ void PrintOptimizationOptions()
   std::cerr << "  -neg                 Negation (-O1) (e.g. [!a] = [A])" << std::endl;
   std::cerr << "  -binary1             Binary expression optimazation (-O2)" << std::endl;
   std::cerr << "  -binary2             Binary expreeion optimization (-O2)" << std::endl;
-  std::cerr << "  -prop                False propagation (-O2) (e.g CC[!*] = [!*])" << std::endl;
+  std::cerr << "  -prop                False propagation (-O2) (e.g CC[!*] = [!*], C:c = [!*])" << std::endl;
   std::cerr << "  -factor              Expression factorization (-O3) (e.g. [OH,O-] = [O;H,-])" << std::endl;
   std::cerr << "  -atomorder           Atom order optimization (-O4)" << std::endl;
   std::cerr << "  -bondorder           Bond order optimization (-O5)" << std::endl;
@@ -212,7 +212,8 @@ int GetOptimizationFlags(ParseArgs &args)
   if (args.IsArg("-binary2"))
     opt |= SC::SmartsOptimizer::BinaryExpr2;
   if (args.IsArg("-prop"))
-    opt |= SC::SmartsOptimizer::AtomFalseProp | SC::SmartsOptimizer::BondFalseProp;
+    opt |= SC::SmartsOptimizer::AtomFalseProp | SC::SmartsOptimizer::BondFalseProp |
+           SC::SmartsOptimizer::PatternFalseProp;
   if (args.IsArg("-factor"))
     opt |= SC::SmartsOptimizer::ExprFactor;
   if (args.IsArg("-atomorder"))
@@ -4,9 +4,13 @@
 #include "../src/smartscodegenerator.h"
 #include "../src/smartsprint.h"
 #include "../src/molecule.h"
+#include "../src/moleculefile.h"
+#include "../src/smilesreader.h"
 
 #include "args.h"
 
+#include <ctime>
+
 #include <openbabel/obconversion.h>
 #include <openbabel/mol.h>
 #include <openbabel/parsmart.h>
@@ -65,6 +69,36 @@ class SCMatcher
     Smarts *m_smarts;
 };
 
+class SCSnapshotMatcher
+{
+  public:
+    SCSnapshotMatcher(const std::string &smarts)
+    {
+      m_smarts = parse(smarts);
+    }
+
+    ~SCSnapshotMatcher()
+    {
+      delete m_smarts;
+    }
+
+    bool match(OpenBabel::OBMol *mol)
+    {
+      NoMapping mapping;
+      return SC::match(mol, m_smarts, mapping, m_snapshot);
+    }
+
+    std::string name() const
+    {
+      return "SmartsCompiler matcher (snapshot)";
+    }
+
+
+  private:
+    Smarts *m_smarts;
+    Molecule m_snapshot;
+};
+
 class SCMatcher2
 {
   public:
@@ -80,7 +114,8 @@ class SCMatcher2
       delete m_smarts;
     }
 
-    bool match(Molecule *mol)
+    template<typename MoleculeType>
+    bool match(MoleculeType *mol)
     {
       return SC::match(mol, m_smarts);
     }
@@ -95,8 +130,149 @@ class SCMatcher2
     Smarts *m_smarts;
 };
 
+class SCProfileMatcher
+{
+  public:
+    SCProfileMatcher(const std::string &smarts, ProfileSmartsScores &scores) : m_scores(scores)
+    {
+      m_smarts = parse(smarts);
+    }
+
+    ~SCProfileMatcher()
+    {
+      delete m_smarts;
+    }
+
+    template<typename MoleculeType>
+    bool match(MoleculeType *mol)
+    {
+      return SC::profile(mol, m_smarts, m_scores);
+    }
+
+    std::string name() const
+    {
+      return "SmartsCompiler matcher (profile)";
+    }
+
+  private:
+    Smarts *m_smarts;
+    ProfileSmartsScores &m_scores;
+};
+
+/**
+ * Micro-benchmark for the atom and bond primitives of a toolkit adapter.
+ */
+template<typename MoleculeType>
+class CostBenchmark
+{
+    typedef typename molecule_traits<MoleculeType>::atom_arg_type AtomArgType;
+    typedef typename molecule_traits<MoleculeType>::mol_atom_iterator_type MolAtomIter;
+    typedef typename molecule_traits<MoleculeType>::atom_bond_iterator_type AtomBondIter;
+    typedef typename molecule_traits<MoleculeType>::atom_wrapper_type AtomWrapperType;
+    typedef typename molecule_traits<MoleculeType>::bond_wrapper_type BondWrapperType;
+
+  public:
+    CostBenchmark() : m_result(0)
+    {
+      AddAtomExpr(Smiley::AE_Aromatic, 0);
+      AddAtomExpr(Smiley::AE_Aliphatic, 0);
+      AddAtomExpr(Smiley::AE_Cyclic, 0);
+      AddAtomExpr(Smiley::AE_Acyclic, 0);
+      AddAtomExpr(Smiley::AE_Isotope, 13);
+      AddAtomExpr(Smiley::AE_AtomicNumber, 6);
+      AddAtomExpr(Smiley::AE_AromaticElement, 6);
+      AddAtomExpr(Smiley::AE_AliphaticElement, 6);
+      AddAtomExpr(Smiley::AE_Degree, 2);
+      AddAtomExpr(Smiley::AE_Valence, 4);
+      AddAtomExpr(Smiley::AE_Connectivity, 4);
+      AddAtomExpr(Smiley::AE_TotalH, 1);
+      AddAtomExpr(Smiley::AE_ImplicitH, 1);
+      AddAtomExpr(Smiley::AE_RingMembership, 1);
+      AddAtomExpr(Smiley::AE_RingSize, 6);
+      AddAtomExpr(Smiley::AE_RingConnectivity, 2);
+      AddAtomExpr(Smiley::AE_Charge, 0);
+      m_bondExprs.push_back(new SmartsBondExpr(Smiley::BE_Single));
+      m_bondExprs.push_back(new SmartsBondExpr(Smiley::BE_Double));
+      m_bondExprs.push_back(new SmartsBondExpr(Smiley::BE_Triple));
+      m_bondExprs.push_back(new SmartsBondExpr(Smiley::BE_Aromatic));
+      m_bondExprs.push_back(new SmartsBondExpr(Smiley::BE_Ring));
+      m_atomTicks.resize(m_atomExprs.size(), 0);
+      m_bondTicks.resize(m_bondExprs.size(), 0);
+    }
+
+    ~CostBenchmark()
+    {
+      for (std::size_t i = 0; i < m_atomExprs.size(); ++i)
+        delete m_atomExprs[i];
+      for (std::size_t i = 0; i < m_bondExprs.size(); ++i)
+        delete m_bondExprs[i];
+    }
+
+    void add(MoleculeType *mol, int repeat = 10)
+    {
+      MolAtomIter atoms_begin = GetBeginAtoms<MoleculeType*, MolAtomIter>(mol);
+      MolAtomIter atoms_end = GetEndAtoms<MoleculeType*, MolAtomIter>(mol);
+
+      // warm up: lazily perceived properties are amortized over all tests
+      for (MolAtomIter atom = atoms_begin; atom != atoms_end; ++atom)
+        for (std::size_t i = 0; i < m_atomExprs.size(); ++i)
+          m_result += m_smarts.matchAtomExpr(m_atomExprs[i], AtomWrapperType(*atom));
+
+      for (std::size_t i = 0; i < m_atomExprs.size(); ++i) {
+        std::clock_t start = std::clock();
+        for (int j = 0; j < repeat; ++j)
+          for (MolAtomIter atom = atoms_begin; atom != atoms_end; ++atom)
+            m_result += m_smarts.matchAtomExpr(m_atomExprs[i], AtomWrapperType(*atom));
+        m_atomTicks[i] += std::clock() - start;
+      }
+
+      for (std::size_t i = 0; i < m_bondExprs.size(); ++i) {
+        std::clock_t start = std::clock();
+        for (int j = 0; j < repeat; ++j)
+          for (MolAtomIter atom = atoms_begin; atom != atoms_end; ++atom) {
+            AtomBondIter bond = GetBeginBonds<MoleculeType*, AtomArgType, AtomBondIter>(mol, *atom);
+            AtomBondIter bonds_end = GetEndBonds<MoleculeType*, AtomArgType, AtomBondIter>(mol, *atom);
+            for (; bond != bonds_end; ++bond)
+              m_result += m_smarts.matchBondExpr(m_bondExprs[i], BondWrapperType(*bond));
+          }
+        m_bondTicks[i] += std::clock() - start;
+      }
+    }
+
+    /**
+     * Write the costs relative to an element test ("cost <type> <cost>"
+     * lines understood by the scores files).
+     */
+    void write(std::ostream &os) const
+    {
+      double unit = 0.0;
+      for (std::size_t i = 0; i < m_atomExprs.size(); ++i)
+        if (m_atomExprs[i]->type == Smiley::AE_AtomicNumber)
+          unit = std::max(1.0, static_cast<double>(m_atomTicks[i]));
+
+      for (std::size_t i = 0; i < m_atomExprs.size(); ++i)
+        os << "cost " << m_atomExprs[i]->type << " " << m_atomTicks[i] / unit << std::endl;
+      for (std::size_t i = 0; i < m_bondExprs.size(); ++i)
+        os << "cost " << m_bondExprs[i]->type << " " << m_bondTicks[i] / unit << std::endl;
+    }
+
+  private:
+    void AddAtomExpr(int type, int value)
+    {
+      m_atomExprs.push_back(new SmartsAtomExpr(type));
+      m_atomExprs.back()->leaf.value = value;
+    }
+
+    Smarts m_smarts;
+    std::vector<SmartsAtomExpr*> m_atomExprs;
+    std::vector<SmartsBondExpr*> m_bondExprs;
+    std::vector<std::clock_t> m_atomTicks;
+    std::vector<std::clock_t> m_bondTicks;
+    unsigned long m_result;
+};
+
 template<typename Matcher>
-void run_ob(const std::string &smarts, const std::string &filename)
+void run_ob(Matcher &matcher, const std::string &filename)
 {
   std::ifstream ifs(filename.c_str());
 
@@ -104,8 +280,7 @@ void run_ob(const std::string &smarts, const std::string &filename)
   OpenBabel::OBConversion conv(&ifs);
   conv.SetInFormat(conv.FormatFromExt(filename));
 
-  Matcher matcher(smarts);
-
+  OpenBabelPropertyCache cache;
   int molCount = 0;
   int hits = 0;
   while (conv.Read(&mol)) {
@@ -114,6 +289,7 @@ void run_ob(const std::string &smarts, const std::string &filename)
       std::cout << "  molecule # " << molCount << std::endl;
     //if (molCount >= 25000)
     //  break;
+    cache.attach(&mol);
 
     if (matcher.match(&mol))
       ++hits;
@@ -123,11 +299,13 @@ void run_ob(const std::string &smarts, const std::string &filename)
 }
 
 template<typename Matcher>
-void run_sc(const std::string &smarts, const std::string &filename)
+void run_sc(Matcher &matcher, const std::string &filename)
 {
   std::ifstream ifs(filename.c_str());
-
-  Matcher matcher(smarts);
+  if (!readMoleculeHeader(ifs)) {
+    std::cerr << filename << " is not a text *.scm file of this version, convert it again" << std::endl;
+    return;
+  }
 
   Molecule mol;
 
@@ -147,21 +325,123 @@ void run_sc(const std::string &smarts, const std::string &filename)
   std::cout << matcher.name() << ": " << hits << "/" << molCount << std::endl;
 }
 
+template<typename Matcher>
+void run_smiles(Matcher &matcher, const std::string &filename)
+{
+  std::ifstream ifs(filename.c_str());
+
+  SmilesReader reader;
+  Molecule mol;
+
+  int molCount = 0;
+  int hits = 0;
+  while (reader.read(ifs, mol)) {
+    ++molCount;
+    if ((molCount % 1000) == 0)
+      std::cout << "  molecule # " << molCount << std::endl;
+
+    if (matcher.match(&mol))
+      ++hits;
+  }
+
+  std::cout << matcher.name() << ": " << hits << "/" << molCount << std::endl;
+}
+
+template<typename Matcher>
+void run_view(Matcher &matcher, const std::string &filename)
+{
+  MoleculeFile file;
+  if (!file.open(filename)) {
+    std::cerr << "Could not open " << filename << std::endl;
+    return;
+  }
+
+  int hits = 0;
+  std::size_t molCount = file.numMolecules();
+  for (std::size_t i = 0; i < molCount; ++i) {
+    MoleculeView mol = file.molecule(i);
+    if (matcher.match(&mol))
+      ++hits;
+  }
+
+  std::cout << matcher.name() << ": " << hits << "/" << molCount << std::endl;
+}
+
+void run_costs(const std::string &filename, const std::string &costsFile)
+{
+  std::ifstream ifs(filename.c_str());
+  std::ofstream ofs(costsFile.c_str());
+
+  int molCount = 0;
+  if (MoleculeFile::isBinary(filename)) {
+    CostBenchmark<MoleculeView> benchmark;
+    MoleculeFile file;
+    if (file.open(filename))
+      for (std::size_t i = 0; i < file.numMolecules(); ++i, ++molCount) {
+        MoleculeView mol = file.molecule(i);
+        benchmark.add(&mol);
+      }
+    benchmark.write(ofs);
+  } else if (filename.substr(filename.size() - 4, 4) == ".scm") {
+    CostBenchmark<Molecule> benchmark;
+    Molecule mol;
+    if (!readMoleculeHeader(ifs)) {
+      std::cerr << filename << " is not a text *.scm file of this version, convert it again" << std::endl;
+      return;
+    }
+    while (readMolecule(ifs, mol)) {
+      ++molCount;
+      benchmark.add(&mol);
+    }
+    benchmark.write(ofs);
+  } else {
+    CostBenchmark<OpenBabel::OBMol> benchmark;
+    OpenBabel::OBMol mol;
+    OpenBabel::OBConversion conv(&ifs);
+    conv.SetInFormat(conv.FormatFromExt(filename));
+    while (conv.Read(&mol)) {
+      ++molCount;
+      benchmark.add(&mol);
+    }
+    benchmark.write(ofs);
+  }
+
+  std::cout << "Primitive costs measured over " << molCount << " molecules" << std::endl;
+}
+
 int main(int argc, char**argv)
 {
   if (argc < 2) {
     std::cout << "Usage: " << argv[0] << " [options] <smarts_file> <molecule_file>" << std::endl;
+    std::cout << "       " << argv[0] << " -costs <file> <molecule_file>" << std::endl;
     std::cerr << "Options:" << std::endl;
     std::cerr << "  -anti                Anti-optimize SMARTS" << std::endl;
     std::cerr << "  -scores <file>       Scores file (default is pretty scores)" << std::endl;
+    std::cerr << "  -profile <file>      Profile the SMARTS and write the measured scores to file" << std::endl;
+    std::cerr << "  -costs <file>        Measure the primitive costs and write them to file" << std::endl;
+    std::cerr << "  -native              Read *.smi files without OpenBabel (SmilesReader)" << std::endl;
+    std::cerr << "  -snapshot            Match a snapshot of the OpenBabel molecule properties" << std::endl;
     PrintOptimizationOptions();
     return 0;
   }
 
-  ParseArgs args(argc, argv, ParseArgs::Args("-anti", "-ob", "-scores(file)"), ParseArgs::Args("smarts_file", "molecule_file"));
+  // measuring the primitive costs doesn't need a SMARTS file
+  bool costs = false;
+  for (int i = 1; i < argc; ++i)
+    if (std::string(argv[i]) == "-costs")
+      costs = true;
+  if (costs) {
+    ParseArgs args(argc, argv, ParseArgs::Args("-costs(file)"), ParseArgs::Args("molecule_file"));
+    run_costs(args.GetArgString("molecule_file"), args.GetArgString("-costs", 0));
+    return 0;
+  }
+
+  ParseArgs args(argc, argv, ParseArgs::Args("-anti", "-ob", "-native", "-snapshot", "-scores(file)", "-profile(file)"), ParseArgs::Args("smarts_file", "molecule_file"));
   SmartsScores *scores = args.IsArg("-scores") ? static_cast<SmartsScores*>(new ListSmartsScores(args.GetArgString("-scores", 0))) : static_cast<SmartsScores*>(new PrettySmartsScores);
   bool anti = args.IsArg("-anti");
   bool ob = args.IsArg("-ob");
+  bool prof = args.IsArg("-profile");
+  ProfileSmartsScores profileScores;
 
   std::string smartsFile = args.GetArgString("smarts_file");
   std::string molFile = args.GetArgString("molecule_file");
@@ -169,8 +449,14 @@ int main(int argc, char**argv)
   std::ifstream ifs(smartsFile.c_str());
 
   bool scmFile = molFile.substr(molFile.size() - 4, 4) == ".scm";
-  if (scmFile)
+  bool binaryFile = scmFile && MoleculeFile::isBinary(molFile);
+  bool smilesFile = args.IsArg("-native") && molFile.substr(molFile.size() - 4, 4) == ".smi";
+  if (binaryFile)
+    std::cout << "Using binary *.scm file..." << std::endl;
+  else if (scmFile)
     std::cout << "Using *.scm file..." << std::endl;
+  else if (smilesFile)
+    std::cout << "Using native SMILES reader..." << std::endl;
  
   int smartsCount = 0;
   std::string line;
@@ -179,14 +465,39 @@ int main(int argc, char**argv)
     std::string smarts = line.substr(0, line.find(" "));
     std::cout << "SMARTS #" << smartsCount << ": " << smarts << std::endl;
 
-    if (scmFile) {
-      run_sc<SCMatcher2>(smarts, molFile);
-    } else {
-      if (ob)
-        run_ob<OBMatcher>(smarts, molFile);
+    if (prof) {
+      SCProfileMatcher matcher(smarts, profileScores);
+      if (binaryFile)
+        run_view(matcher, molFile);
+      else if (scmFile)
+        run_sc(matcher, molFile);
+      else if (smilesFile)
+        run_smiles(matcher, molFile);
       else
-        run_ob<SCMatcher>(smarts, molFile);
+        run_ob(matcher, molFile);
+    } else if (binaryFile) {
+      SCMatcher2 matcher(smarts);
+      run_view(matcher, molFile);
+    } else if (scmFile) {
+      SCMatcher2 matcher(smarts);
+      run_sc(matcher, molFile);
+    } else if (smilesFile) {
+      SCMatcher2 matcher(smarts);
+      run_smiles(matcher, molFile);
+    } else {
+      if (ob) {
+        OBMatcher matcher(smarts);
+        run_ob(matcher, molFile);
+      } else if (args.IsArg("-snapshot")) {
+        SCSnapshotMatcher matcher(smarts);
+        run_ob(matcher, molFile);
+      } else {
+        SCMatcher matcher(smarts);
+        run_ob(matcher, molFile);
+      }
     }
   }
 
+  if (prof && !profileScores.Save(args.GetArgString("-profile", 0)))
+    std::cerr << "Could not write profile file " << args.GetArgString("-profile", 0) << std::endl;
 }
@@ -1,10 +1,19 @@
 #include "../src/molecule.h"
+#include "../src/moleculefile.h"
+#include "../src/moleculestore.h"
+#include "../src/smilesreader.h"
 
 #include "args.h"
 
 #include <openbabel/obconversion.h>
 #include <openbabel/mol.h>
 
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <pthread.h>
+
 using namespace SC;
 
 template<typename Matcher>
@@ -35,25 +44,478 @@ void run(const std::string &smarts, const std::string &filename)
 }
 
 
+/**
+ * The records the input can be split into for the pipeline.
+ */
+enum RecordType {
+  UnknownRecords,
+  SmilesRecords, // one molecule per line
+  SDFRecords // blocks ending with a $$$$ line
+};
+
+RecordType GetRecordType(const std::string &filename)
+{
+  std::string ext = filename.substr(filename.rfind(".") + 1);
+  if (ext == "smi" || ext == "smiles" || ext == "can" || ext == "ism")
+    return SmilesRecords;
+  if (ext == "sdf" || ext == "sd" || ext == "mdl" || ext == "mol")
+    return SDFRecords;
+  return UnknownRecords;
+}
+
+/**
+ * Append the next record to @p chunk, returns false at the end of the input.
+ */
+bool ReadRecord(std::istream &is, RecordType type, std::string &line, std::string &chunk)
+{
+  if (type == SmilesRecords) {
+    while (std::getline(is, line))
+      if (!line.empty()) {
+        chunk += line;
+        chunk += '\n';
+        return true;
+      }
+    return false;
+  }
+
+  bool empty = true;
+  while (std::getline(is, line)) {
+    chunk += line;
+    chunk += '\n';
+    empty = false;
+    if (line.compare(0, 4, "$$$$") == 0)
+      return true;
+  }
+  return !empty;
+}
+
+/**
+ * A chunk of input records and the converted molecules.
+ */
+struct Chunk
+{
+  std::size_t index;
+  std::string input;
+  std::string output;
+  std::vector<std::size_t> recordSizes; // binary records in output
+  std::vector<std::string> errors; // molecules that could not be converted
+};
+
+/**
+ * Pipelined conversion: a reader thread splits the input into chunks of
+ * records, worker threads convert the chunks and the calling thread writes
+ * them in input order. The number of chunks in flight is limited so a slow
+ * chunk doesn't let the memory use grow without bound.
+ *
+ * OpenBabel's perception uses global state (atom and aromaticity typers),
+ * the OpenBabel calls of the workers are serialized. Only reading the
+ * input, packing the records and writing overlap with it. The native SMILES
+ * reader has no shared state, with -native the workers run fully parallel.
+ */
+class ConvertPipeline
+{
+  public:
+    enum {
+      ChunkSize = 1000 // records
+    };
+
+    ConvertPipeline(std::istream &is, RecordType type, OpenBabel::OBFormat *format, bool binary,
+        bool native, int numThreads) : m_is(is), m_type(type), m_format(format), m_binary(binary),
+        m_native(native), m_numThreads(numThreads),
+        m_maxChunks(4 * numThreads), m_numChunks(0), m_inFlight(0), m_readerDone(false)
+    {
+      pthread_mutex_init(&m_mutex, 0);
+      pthread_mutex_init(&m_openbabelMutex, 0);
+      pthread_cond_init(&m_inputCond, 0);
+      pthread_cond_init(&m_outputCond, 0);
+      pthread_cond_init(&m_spaceCond, 0);
+    }
+
+    ~ConvertPipeline()
+    {
+      pthread_mutex_destroy(&m_mutex);
+      pthread_mutex_destroy(&m_openbabelMutex);
+      pthread_cond_destroy(&m_inputCond);
+      pthread_cond_destroy(&m_outputCond);
+      pthread_cond_destroy(&m_spaceCond);
+    }
+
+    /**
+     * Convert the input, @p writer is called for each chunk in order.
+     *
+     * @return False if no threads could be started or a chunk could not be
+     *         written.
+     */
+    template<typename Writer>
+    bool run(Writer &writer)
+    {
+      // the workers wait for the reader, start them first
+      std::vector<pthread_t> workers;
+      for (int i = 0; i < m_numThreads; ++i) {
+        pthread_t worker;
+        if (pthread_create(&worker, 0, &ConvertPipeline::workerThread, this)) {
+          std::cerr << "Warning: could not start worker thread " << i << std::endl;
+          break;
+        }
+        workers.push_back(worker);
+      }
+      if (workers.empty()) {
+        std::cerr << "Could not start the worker threads" << std::endl;
+        return false;
+      }
+
+      pthread_t reader;
+      if (pthread_create(&reader, 0, &ConvertPipeline::readerThread, this)) {
+        std::cerr << "Could not start the reader thread" << std::endl;
+        pthread_mutex_lock(&m_mutex);
+        m_readerDone = true;
+        pthread_cond_broadcast(&m_inputCond);
+        pthread_mutex_unlock(&m_mutex);
+        for (std::size_t i = 0; i < workers.size(); ++i)
+          pthread_join(workers[i], 0);
+        return false;
+      }
+
+      bool result = true;
+
+      for (std::size_t next = 0; ; ++next) {
+        pthread_mutex_lock(&m_mutex);
+        while (m_done.find(next) == m_done.end() && !(m_readerDone && next == m_numChunks))
+          pthread_cond_wait(&m_outputCond, &m_mutex);
+        if (m_done.find(next) == m_done.end()) {
+          pthread_mutex_unlock(&m_mutex);
+          break;
+        }
+        Chunk *chunk = m_done[next];
+        m_done.erase(next);
+        pthread_mutex_unlock(&m_mutex);
+
+        if (!writer.write(*chunk))
+          result = false;
+        for (std::size_t i = 0; i < chunk->errors.size(); ++i)
+          std::cerr << chunk->errors[i] << std::endl;
+        delete chunk;
+
+        pthread_mutex_lock(&m_mutex);
+        --m_inFlight;
+        pthread_cond_signal(&m_spaceCond);
+        pthread_mutex_unlock(&m_mutex);
+      }
+
+      pthread_join(reader, 0);
+      for (std::size_t i = 0; i < workers.size(); ++i)
+        pthread_join(workers[i], 0);
+
+      if (!result)
+        std::cerr << "Could not write the output" << std::endl;
+      return result;
+    }
+
+  private:
+    static void* readerThread(void *pipeline)
+    {
+      static_cast<ConvertPipeline*>(pipeline)->read();
+      return 0;
+    }
+
+    static void* workerThread(void *pipeline)
+    {
+      static_cast<ConvertPipeline*>(pipeline)->work();
+      return 0;
+    }
+
+    void read()
+    {
+      std::string line;
+      bool end = false;
+      while (!end) {
+        Chunk *chunk = new Chunk;
+        for (int i = 0; i < ChunkSize && !end; ++i)
+          end = !ReadRecord(m_is, m_type, line, chunk->input);
+        if (chunk->input.empty()) {
+          delete chunk;
+          break;
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        while (m_inFlight >= m_maxChunks)
+          pthread_cond_wait(&m_spaceCond, &m_mutex);
+        chunk->index = m_numChunks++;
+        ++m_inFlight;
+        m_input.push_back(chunk);
+        pthread_cond_signal(&m_inputCond);
+        pthread_mutex_unlock(&m_mutex);
+      }
+
+      pthread_mutex_lock(&m_mutex);
+      m_readerDone = true;
+      pthread_cond_broadcast(&m_inputCond);
+      pthread_cond_broadcast(&m_outputCond);
+      pthread_mutex_unlock(&m_mutex);
+    }
+
+    void work()
+    {
+      // each worker owns its molecules and readers
+      OpenBabel::OBConversion conv;
+      conv.SetInFormat(m_format);
+      OpenBabel::OBMol obmol;
+      SmilesReader reader;
+      Molecule mol;
+      std::string title;
+      std::ostringstream os;
+
+      while (true) {
+        pthread_mutex_lock(&m_mutex);
+        while (m_input.empty() && !m_readerDone)
+          pthread_cond_wait(&m_inputCond, &m_mutex);
+        if (m_input.empty()) {
+          pthread_mutex_unlock(&m_mutex);
+          break;
+        }
+        Chunk *chunk = m_input.front();
+        m_input.pop_front();
+        pthread_mutex_unlock(&m_mutex);
+
+        std::istringstream is(chunk->input);
+        chunk->input.clear();
+        os.str(std::string());
+        for (std::size_t record = 1; ; ++record) {
+          std::size_t size = chunk->output.size();
+          bool written = true;
+          if (m_native) {
+            if (!reader.read(is, mol, &title))
+              break;
+            if (!reader.isValid()) {
+              std::ostringstream error;
+              error << "Invalid SMILES for molecule #" << chunk->index * ChunkSize + record << " " << title;
+              chunk->errors.push_back(error.str());
+              continue;
+            }
+            if (m_binary)
+              written = MoleculeFileWriter::pack(mol, chunk->output);
+            else
+              writeMolecule(os, mol);
+          } else {
+            pthread_mutex_lock(&m_openbabelMutex);
+            bool read = conv.Read(&obmol, &is);
+            if (read) {
+              title = obmol.GetTitle();
+              if (m_binary)
+                written = MoleculeFileWriter::pack(&obmol, chunk->output);
+              else
+                writeMolecule(os, &obmol);
+            }
+            pthread_mutex_unlock(&m_openbabelMutex);
+            if (!read)
+              break;
+          }
+
+          if (!written)
+            chunk->errors.push_back("Could not write molecule " + title);
+          else if (m_binary)
+            chunk->recordSizes.push_back(chunk->output.size() - size);
+        }
+        if (!m_binary)
+          chunk->output = os.str();
+
+        pthread_mutex_lock(&m_mutex);
+        m_done[chunk->index] = chunk;
+        pthread_cond_signal(&m_outputCond);
+        pthread_mutex_unlock(&m_mutex);
+      }
+    }
+
+    std::istream &m_is;
+    RecordType m_type;
+    OpenBabel::OBFormat *m_format;
+    bool m_binary;
+    bool m_native;
+    int m_numThreads;
+    std::size_t m_maxChunks;
+
+    pthread_mutex_t m_mutex;
+    pthread_mutex_t m_openbabelMutex;
+    pthread_cond_t m_inputCond; // chunks to convert or reader done
+    pthread_cond_t m_outputCond; // chunk converted or reader done
+    pthread_cond_t m_spaceCond; // chunk written
+    std::deque<Chunk*> m_input;
+    std::map<std::size_t, Chunk*> m_done;
+    std::size_t m_numChunks;
+    std::size_t m_inFlight;
+    bool m_readerDone;
+};
+
+/**
+ * Write the converted chunks to a binary *.scm file.
+ */
+struct BinaryChunkWriter
+{
+  BinaryChunkWriter(const std::string &filename) : writer(filename)
+  {
+  }
+
+  bool isOpen() const
+  {
+    return writer.isOpen();
+  }
+
+  bool write(const Chunk &chunk)
+  {
+    const char *record = chunk.output.data();
+    for (std::size_t i = 0; i < chunk.recordSizes.size(); ++i) {
+      if (!writer.writeRecord(record, chunk.recordSizes[i]))
+        return false;
+      record += chunk.recordSizes[i];
+    }
+    return true;
+  }
+
+  MoleculeFileWriter writer;
+};
+
+/**
+ * Write the converted chunks to a text *.scm file.
+ */
+struct TextChunkWriter
+{
+  TextChunkWriter(const std::string &filename) : ofs(filename.c_str())
+  {
+    writeMoleculeHeader(ofs);
+  }
+
+  bool isOpen() const
+  {
+    return ofs.is_open();
+  }
+
+  bool write(const Chunk &chunk)
+  {
+    ofs << chunk.output;
+    return ofs.good();
+  }
+
+  std::ofstream ofs;
+};
+
+/**
+ * Write a chunked *.scs MoleculeStore. Text *.scm files are read with
+ * readMolecule(), SMILES with SmilesReader when @p native is set and all
+ * other files with OpenBabel (hydrogens are removed, same as writeMolecule()).
+ *
+ * @return False if the input or output could not be used.
+ */
+bool WriteStore(std::istream &is, const std::string &inFile, OpenBabel::OBConversion &conv,
+    bool native, const std::string &outFile)
+{
+  MoleculeStoreWriter writer(outFile);
+  if (!writer.isOpen()) {
+    std::cerr << "Could not open " << outFile << std::endl;
+    return false;
+  }
+  Molecule mol;
+  if (inFile.substr(inFile.rfind(".") + 1) == "scm") {
+    if (!readMoleculeHeader(is)) {
+      std::cerr << inFile << " is not a text *.scm file of this version, convert it again" << std::endl;
+      return false;
+    }
+    int index = 0;
+    while (readMolecule(is, mol)) {
+      ++index;
+      if (!writer.write(mol))
+        std::cerr << "Could not write molecule #" << index << std::endl;
+    }
+  } else if (native) {
+    SmilesReader reader;
+    std::string title;
+    for (int index = 1; reader.read(is, mol, &title); ++index)
+      if (!reader.isValid())
+        std::cerr << "Invalid SMILES for molecule #" << index << " " << title << std::endl;
+      else if (!writer.write(mol))
+        std::cerr << "Could not write molecule " << title << std::endl;
+  } else {
+    OpenBabel::OBMol obmol;
+    while (conv.Read(&obmol)) {
+      SnapshotHeavyAtoms(&obmol, mol);
+      if (!writer.write(mol))
+        std::cerr << "Could not write molecule " << obmol.GetTitle() << std::endl;
+    }
+  }
+  return true;
+}
+
 int main(int argc, char**argv)
 {
   if (argc < 2) {
-    std::cout << "Usage: " << argv[0] << " <in_file> <out_file>" << std::endl;
+    std::cout << "Usage: " << argv[0] << " [options] <in_file> <out_file>" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  -binary              Write a binary *.scm file (memory mapped by MoleculeFile)" << std::endl;
+    std::cerr << "  -threads <n>         Convert SMILES or SD files using n worker threads" << std::endl;
+    std::cerr << "  -native              Read *.smi files without OpenBabel (SmilesReader)" << std::endl;
+    std::cerr << "  -store               Write a chunked *.scs MoleculeStore (from text *.scm, SMILES or SD files)" << std::endl;
     return 0;
   }
 
-  ParseArgs args(argc, argv, ParseArgs::Args(), ParseArgs::Args("in_file", "out_file"));
+  ParseArgs args(argc, argv, ParseArgs::Args("-binary", "-threads(n)", "-native", "-store"), ParseArgs::Args("in_file", "out_file"));
   std::string inFile = args.GetArgString("in_file");
   std::string outFile = args.GetArgString("out_file");
+  bool binary = args.IsArg("-binary");
+  bool native = args.IsArg("-native");
+  int numThreads = args.IsArg("-threads") ? args.GetArgInt("-threads", 0) : 1;
 
 
   std::ifstream ifs(inFile.c_str());
-  std::ofstream ofs(outFile.c_str());
 
   OpenBabel::OBMol mol;
   OpenBabel::OBConversion conv(&ifs);
   conv.SetInFormat(conv.FormatFromExt(inFile));
 
+  RecordType recordType = GetRecordType(inFile);
+  if (native && recordType != SmilesRecords) {
+    std::cerr << "The native reader only reads SMILES files" << std::endl;
+    return 1;
+  }
+
+  if (args.IsArg("-store")) {
+    return WriteStore(ifs, inFile, conv, native, outFile) ? 0 : 1;
+  }
+
+  if (recordType != UnknownRecords && (numThreads > 1 || native)) {
+    ConvertPipeline pipeline(ifs, recordType, conv.GetInFormat(), binary, native, std::max(1, numThreads));
+    if (binary) {
+      BinaryChunkWriter writer(outFile);
+      if (!writer.isOpen()) {
+        std::cerr << "Could not open " << outFile << std::endl;
+        return 1;
+      }
+      return pipeline.run(writer) ? 0 : 1;
+    }
+    TextChunkWriter writer(outFile);
+    if (!writer.isOpen()) {
+      std::cerr << "Could not open " << outFile << std::endl;
+      return 1;
+    }
+    return pipeline.run(writer) ? 0 : 1;
+  }
+
+  if (binary) {
+    MoleculeFileWriter writer(outFile);
+    if (!writer.isOpen()) {
+      std::cerr << "Could not open " << outFile << std::endl;
+      return 1;
+    }
+    while (conv.Read(&mol))
+      if (!writer.write(&mol))
+        std::cerr << "Could not write molecule " << mol.GetTitle() << std::endl;
+    return 0;
+  }
+
+  std::ofstream ofs(outFile.c_str());
+  if (!ofs) {
+    std::cerr << "Could not open " << outFile << std::endl;
+    return 1;
+  }
+  writeMoleculeHeader(ofs);
   while (conv.Read(&mol))
     writeMolecule(ofs, &mol);
 
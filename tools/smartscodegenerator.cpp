@@ -17,18 +17,24 @@ int PrintUsage(const char *exe)
   std::cerr << "  -module <name>       Module name (default is smarts_file w/o extension)" << std::endl;
   std::cerr << "  -c++                 Generate C++ code (default)" << std::endl;
   std::cerr << "  -python              Generate python code" << std::endl;
+  std::cerr << "  -python-extension    Generate a C++ python extension module" << std::endl;
   std::cerr << "  -scores <file>       Scores file (default is pretty scores)" << std::endl;
+  std::cerr << "  -profile <file>      Profile file written by benchmark -profile" << std::endl;
   std::cerr << "  -no-inline           No function inlining" << std::endl;
   std::cerr << "  -no-switch           No switch functions" << std::endl;
   std::cerr << "  -opt-function-names  Optimize function names (f1 f2 ...)" << std::endl;
+  std::cerr << "  -lookup-tables       Use bit mask lookup tables for switchable primitives" << std::endl;
+  std::cerr << "  -shards <n>          Split the module in n translation units (output_code_file" << std::endl;
+  std::cerr << "                       w/o extension is used as prefix)" << std::endl;
   PrintOptimizationOptions();
   return 1;
 }
 
 int main(int argc, char**argv)
 {
-  ParseArgs args(argc, argv, ParseArgs::Args("-c++", "-python", "-module(name)", "-scores(file)", "-no-inline",
-      "-no-switch", "-no-match", "-opt-function-names"), ParseArgs::Args("smarts_file", "output_code_file"));
+  ParseArgs args(argc, argv, ParseArgs::Args("-c++", "-python", "-python-extension", "-module(name)", "-scores(file)", "-profile(file)", "-no-inline",
+      "-no-switch", "-no-match", "-opt-function-names",
+      "-lookup-tables", "-shards(n)"), ParseArgs::Args("smarts_file", "output_code_file"));
   if (!args.IsValid())
     return PrintUsage(argv[0]);
 
@@ -40,6 +46,8 @@ int main(int argc, char**argv)
   
   if (args.IsArg("-python"))
     lang = SmartsCodeGenerator::Python;
+  if (args.IsArg("-python-extension"))
+    lang = SmartsCodeGenerator::PythonExtension;
 
   std::string module;
   if (args.IsArg("-module"))
@@ -47,16 +55,31 @@ int main(int argc, char**argv)
   else
     module = smarts_file.substr(0, smarts_file.find("."));
   
-  SmartsScores *scores = args.IsArg("-scores") ? static_cast<SmartsScores*>(new ListSmartsScores(args.GetArgString("-scores", 0))) : static_cast<SmartsScores*>(new PrettySmartsScores);
+  SmartsScores *scores;
+  if (args.IsArg("-profile")) {
+    ProfileSmartsScores *profile = new ProfileSmartsScores(args.GetArgString("-profile", 0));
+    if (!profile->IsLoaded()) {
+      std::cerr << "Could not read profile file " << args.GetArgString("-profile", 0) << std::endl;
+      delete profile;
+      return 1;
+    }
+    scores = profile;
+  } else if (args.IsArg("-scores"))
+    scores = new ListSmartsScores(args.GetArgString("-scores", 0));
+  else
+    scores = new PrettySmartsScores;
 
 
   OpenBabelToolkit toolkit;
   SmartsCodeGenerator compiler(&toolkit, lang);
   SmartsOptimizer optimizer(scores);
 
-  std::ofstream ofs(output_code_file.c_str());
+  std::ofstream ofs;
+  if (!args.IsArg("-shards"))
+    ofs.open(output_code_file.c_str());
 
-  compiler.StartSmartsModule(module, args.IsArg("-no-inline"), args.IsArg("-no-switch"), args.IsArg("-no-match"), args.IsArg("-opt-function-names"));
+  compiler.StartSmartsModule(module, args.IsArg("-no-inline"), args.IsArg("-no-switch"), args.IsArg("-no-match"), args.IsArg("-opt-function-names"),
+      args.IsArg("-lookup-tables"));
   
   std::ifstream ifs(smarts_file.c_str());
   std::string line;
@@ -95,7 +118,10 @@ int main(int argc, char**argv)
     compiler.GeneratePatternCode(line, smarts, function, nomap, count, atom);
   }
   
-  compiler.StopSmartsModule(ofs);
+  if (args.IsArg("-shards"))
+    compiler.StopSmartsModule(output_code_file.substr(0, output_code_file.rfind(".")), args.GetArgInt("-shards", 0));
+  else
+    compiler.StopSmartsModule(ofs);
 
   delete scores;
 }
@@ -1,18 +1,41 @@
+#include "../src/smartsscores.h"
+
+#include "args.h"
+
 #include <openbabel/mol.h>
 #include <openbabel/obconversion.h>
 
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 using namespace OpenBabel;
 
-int main(int argc, char **argv)
+/**
+ * The counts in a score file. Counts are merged by adding them so partial
+ * counts for parts of a molecule collection can be collected independently
+ * and combined in any order.
+ */
+struct ScoreCounts
 {
-  if (argc < 3) {
-    std::cerr << "Usage: " << argv[0] << " <molecule_file> <output_score_file>" << std::endl;
-    return 1;
+  ScoreCounts() : numAtoms(0), numAromaticAtoms(0), numCyclicAtoms(0), numBonds(0), numSingleBonds(0),
+      numDoubleBonds(0), numTripleBonds(0), numAromaticBonds(0), numRingBonds(0)
+  {
   }
 
-  unsigned long numAtoms = 0;
-  unsigned long numAromaticAtoms = 0;
-  unsigned long numCyclicAtoms = 0;
+  void Add(OBMol &mol);
+  /**
+   * Add the counts from a score file written by Write().
+   */
+  bool Read(const std::string &filename);
+  void Write(std::ostream &os) const;
+
+  unsigned long numAtoms;
+  unsigned long numAromaticAtoms;
+  unsigned long numCyclicAtoms;
   std::map<int, unsigned long> mass;
   std::map<int, unsigned long> elem;
   std::map<int, unsigned long> aromelem;
@@ -25,113 +48,417 @@ int main(int argc, char **argv)
   std::map<int, unsigned long> rings;
   std::map<int, unsigned long> size;
   std::map<int, unsigned long> valence;
-  std::map<int, unsigned long> chiral;
   std::map<int, unsigned long> hyb;
   std::map<int, unsigned long> ringconnect;
+  // joint statistics: (element, value) -> count
+  std::map<std::pair<int, int>, unsigned long> elemhcount;
+  std::map<std::pair<int, int>, unsigned long> elemcharge;
+  std::map<std::pair<int, int>, unsigned long> elemrings;
 
-  unsigned long numBonds = 0;
-  unsigned long numSingleBonds = 0;
-  unsigned long numDoubleBonds = 0;
-  unsigned long numTripleBonds = 0;
-  unsigned long numAromaticBonds = 0;
-  unsigned long numRingBonds = 0;
+  unsigned long numBonds;
+  unsigned long numSingleBonds;
+  unsigned long numDoubleBonds;
+  unsigned long numTripleBonds;
+  unsigned long numAromaticBonds;
+  unsigned long numRingBonds;
+  // neighbor pairs: (bond type, (element, element)) -> count, bond type 5 is aromatic
+  std::map<std::pair<int, std::pair<int, int> >, unsigned long> bondpairs;
 
-  OBConversion conv;
-  conv.SetInFormat(conv.FormatFromExt(argv[1]));
-  std::ifstream ifs(argv[1]);
-  conv.SetInStream(&ifs);
+  // "cost <type> <cost>" lines are kept, the last file read wins
+  std::map<int, double> costs;
+};
 
-  OBMol mol;
-  unsigned long molecule = 0;
-  while (conv.Read(&mol)) {
-    ++molecule;
-    //if ((molecule % 1000) == 0)
-    //  std::cout << molecule << std::endl;
-
-    FOR_ATOMS_OF_MOL (atom, mol) {
-      numAtoms++;
-      if (atom->IsAromatic()) {
-        numAromaticAtoms++;
-        aromelem[atom->GetAtomicNum()]++;
-      } else
-        aliphelem[atom->GetAtomicNum()]++;
-      if (atom->IsInRing())
-        numCyclicAtoms++;
-      mass[atom->GetIsotope()]++;
-      elem[atom->GetAtomicNum()]++;
-      hcount[atom->ExplicitHydrogenCount() + atom->ImplicitHydrogenCount()]++;
-      charge[atom->GetFormalCharge()]++;
-      connect[atom->GetImplicitValence()]++;
-      degree[atom->GetValence()]++;
-      implicit[atom->ImplicitHydrogenCount()]++;
-      rings[atom->MemberOfRingCount()]++;
-      for (int i = 3; i < 25; ++i)
-        if (atom->IsInRingSize(i))
-          size[i]++;
-      valence[atom->KBOSum() - (atom->GetSpinMultiplicity() ? atom->GetSpinMultiplicity() - 1 : 0)]++;
-      hyb[atom->GetHyb()]++;
-      ringconnect[atom->CountRingBonds()]++;    
-    }
+void ScoreCounts::Add(OBMol &mol)
+{
+  FOR_ATOMS_OF_MOL (atom, mol) {
+    numAtoms++;
+    if (atom->IsAromatic()) {
+      numAromaticAtoms++;
+      aromelem[atom->GetAtomicNum()]++;
+    } else
+      aliphelem[atom->GetAtomicNum()]++;
+    if (atom->IsInRing())
+      numCyclicAtoms++;
+    mass[atom->GetIsotope()]++;
+    elem[atom->GetAtomicNum()]++;
+    hcount[atom->ExplicitHydrogenCount() + atom->ImplicitHydrogenCount()]++;
+    charge[atom->GetFormalCharge()]++;
+    connect[atom->GetImplicitValence()]++;
+    degree[atom->GetValence()]++;
+    implicit[atom->ImplicitHydrogenCount()]++;
+    rings[atom->MemberOfRingCount()]++;
+    for (int i = 3; i < 25; ++i)
+      if (atom->IsInRingSize(i))
+        size[i]++;
+    valence[atom->KBOSum() - (atom->GetSpinMultiplicity() ? atom->GetSpinMultiplicity() - 1 : 0)]++;
+    hyb[atom->GetHyb()]++;
+    ringconnect[atom->CountRingBonds()]++;
+    elemhcount[std::make_pair(atom->GetAtomicNum(), atom->ExplicitHydrogenCount() + atom->ImplicitHydrogenCount())]++;
+    elemcharge[std::make_pair(atom->GetAtomicNum(), atom->GetFormalCharge())]++;
+    elemrings[std::make_pair(atom->GetAtomicNum(), atom->MemberOfRingCount())]++;
+  }
+
+  FOR_BONDS_OF_MOL (bond, mol) {
+    numBonds++;
+    if (bond->IsSingle())
+      numSingleBonds++;
+    else if (bond->IsDouble())
+      numDoubleBonds++;
+    else if (bond->IsTriple())
+      numTripleBonds++;
+    if (bond->IsAromatic())
+      numAromaticBonds++;
+    if (bond->IsInRing())
+      numRingBonds++;
+    int elem1 = std::min(bond->GetBeginAtom()->GetAtomicNum(), bond->GetEndAtom()->GetAtomicNum());
+    int elem2 = std::max(bond->GetBeginAtom()->GetAtomicNum(), bond->GetEndAtom()->GetAtomicNum());
+    bondpairs[std::make_pair(bond->IsAromatic() ? 5 : bond->GetBO(), std::make_pair(elem1, elem2))]++;
+  }
+}
+
+/**
+ * Parse the key of a "<name>  <key...>: <count>" line. The SMARTS
+ * primitive character before single keys (e.g. "H3") is skipped.
+ */
+std::vector<int> ParseKey(const std::string &line)
+{
+  std::stringstream ss(line.substr(0, line.find(":")));
+  std::string name, token;
+  ss >> name;
+  std::vector<int> key;
+  while (ss >> token) {
+    std::size_t start = token.find_first_of("-0123456789");
+    if (start != std::string::npos)
+      key.push_back(SC::string2number<int>(token.substr(start)));
+  }
+  return key;
+}
+
+bool ScoreCounts::Read(const std::string &filename)
+{
+  std::ifstream ifs(filename.c_str());
+  if (!ifs)
+    return false;
 
-    FOR_BONDS_OF_MOL (bond, mol) {
-      numBonds++;
-      if (bond->IsSingle())
-        numSingleBonds++;
-      else if (bond->IsDouble())
-        numDoubleBonds++;
-      else if (bond->IsTriple())
-        numTripleBonds++;
-      if (bond->IsAromatic())
-        numAromaticBonds++;
-      if (bond->IsInRing())
-        numRingBonds++;;
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (line.compare(0, 5, "cost ") == 0) {
+      std::stringstream ss(line.substr(5));
+      int type;
+      double cost;
+      if (ss >> type >> cost)
+        costs[type] = cost;
+      continue;
     }
+    if (line.compare(0, 9, "# atoms: ") == 0) {
+      numAtoms += SC::string2number<unsigned long>(line.substr(9));
+      continue;
+    }
+    if (line.compare(0, 9, "# bonds: ") == 0) {
+      numBonds += SC::string2number<unsigned long>(line.substr(9));
+      continue;
+    }
+    if (line.find(":") == std::string::npos)
+      continue;
+
+    std::string name = line.substr(0, line.find_first_of(" :"));
+    std::vector<int> key = ParseKey(line);
+    unsigned long count = SC::string2number<unsigned long>(line.substr(line.find(":") + 2));
+
+    // the aliphatic and acyclic counts are derived from the total
+    if (name == "AE_AROMATIC")
+      numAromaticAtoms += count;
+    else if (name == "AE_CYCLIC")
+      numCyclicAtoms += count;
+    else if (name == "BE_SINGLE")
+      numSingleBonds += count;
+    else if (name == "BE_DOUBLE")
+      numDoubleBonds += count;
+    else if (name == "BE_TRIPLE")
+      numTripleBonds += count;
+    else if (name == "BE_AROM")
+      numAromaticBonds += count;
+    else if (name == "BE_RING")
+      numRingBonds += count;
+    else if (key.size() == 1) {
+      if (name == "AE_MASS")
+        mass[key[0]] += count;
+      else if (name == "AE_ELEM")
+        elem[key[0]] += count;
+      else if (name == "AE_AROMELEM")
+        aromelem[key[0]] += count;
+      else if (name == "AE_ALIPHELEM")
+        aliphelem[key[0]] += count;
+      else if (name == "AE_HCOUNT")
+        hcount[key[0]] += count;
+      else if (name == "AE_CHARGE")
+        charge[key[0]] += count;
+      else if (name == "AE_CONNECT")
+        connect[key[0]] += count;
+      else if (name == "AE_DEGREE")
+        degree[key[0]] += count;
+      else if (name == "AE_IMPLICIT")
+        implicit[key[0]] += count;
+      else if (name == "AE_RINGS")
+        rings[key[0]] += count;
+      else if (name == "AE_SIZE")
+        size[key[0]] += count;
+      else if (name == "AE_VALENCE")
+        valence[key[0]] += count;
+      else if (name == "AE_HYB")
+        hyb[key[0]] += count;
+      else if (name == "AE_RINGCONNECT")
+        ringconnect[key[0]] += count;
+    } else if (key.size() == 2) {
+      if (name == "AE_ELEM_HCOUNT")
+        elemhcount[std::make_pair(key[0], key[1])] += count;
+      else if (name == "AE_ELEM_CHARGE")
+        elemcharge[std::make_pair(key[0], key[1])] += count;
+      else if (name == "AE_ELEM_RINGS")
+        elemrings[std::make_pair(key[0], key[1])] += count;
+    } else if (key.size() == 3 && name == "BE_PAIR")
+      bondpairs[std::make_pair(key[0], std::make_pair(key[1], key[2]))] += count;
   }
 
+  return true;
+}
 
+void ScoreCounts::Write(std::ostream &ofs) const
+{
   unsigned long numAliphaticAtoms = numAtoms - numAromaticAtoms;
   unsigned long numAcyclicAtoms = numAtoms - numCyclicAtoms;
 
-  std::ofstream ofs(argv[2]);
-
   ofs << "# atoms: " << numAtoms << std::endl;
   ofs << "# bonds: " << numBonds << std::endl;
   ofs << "AE_AROMATIC  a: " << numAromaticAtoms << std::endl;
   ofs << "AE_ALIPHATIC  A: " << numAliphaticAtoms << std::endl;
   ofs << "AE_CYCLIC  R: " << numCyclicAtoms << std::endl;
   ofs << "AE_ACYCLIC  R0: " << numAcyclicAtoms << std::endl;
-  for (std::map<int, unsigned long>::iterator i = mass.begin(); i != mass.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = mass.begin(); i != mass.end(); ++i)
     ofs << "AE_MASS  " << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = elem.begin(); i != elem.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = elem.begin(); i != elem.end(); ++i)
     ofs << "AE_ELEM  " << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = aromelem.begin(); i != aromelem.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = aromelem.begin(); i != aromelem.end(); ++i)
     ofs << "AE_AROMELEM  " << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = aliphelem.begin(); i != aliphelem.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = aliphelem.begin(); i != aliphelem.end(); ++i)
     ofs << "AE_ALIPHELEM  " << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = hcount.begin(); i != hcount.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = hcount.begin(); i != hcount.end(); ++i)
     ofs << "AE_HCOUNT  H" << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = charge.begin(); i != charge.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = charge.begin(); i != charge.end(); ++i)
     ofs << "AE_CHARGE  " << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = connect.begin(); i != connect.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = connect.begin(); i != connect.end(); ++i)
     ofs << "AE_CONNECT  X" << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = degree.begin(); i != degree.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = degree.begin(); i != degree.end(); ++i)
     ofs << "AE_DEGREE  D" << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = implicit.begin(); i != implicit.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = implicit.begin(); i != implicit.end(); ++i)
     ofs << "AE_IMPLICIT  h" << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = rings.begin(); i != rings.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = rings.begin(); i != rings.end(); ++i)
     ofs << "AE_RINGS  R" << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = size.begin(); i != size.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = size.begin(); i != size.end(); ++i)
     ofs << "AE_SIZE  r" << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = valence.begin(); i != valence.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = valence.begin(); i != valence.end(); ++i)
     ofs << "AE_VALENCE  v" << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = hyb.begin(); i != hyb.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = hyb.begin(); i != hyb.end(); ++i)
     ofs << "AE_HYB  ^" << i->first << ": " << i->second << std::endl;
-  for (std::map<int, unsigned long>::iterator i = ringconnect.begin(); i != ringconnect.end(); ++i)
+  for (std::map<int, unsigned long>::const_iterator i = ringconnect.begin(); i != ringconnect.end(); ++i)
     ofs << "AE_RINGCONNECT  x" << i->first << ": " << i->second << std::endl;
 
+  for (std::map<std::pair<int, int>, unsigned long>::const_iterator i = elemhcount.begin(); i != elemhcount.end(); ++i)
+    ofs << "AE_ELEM_HCOUNT  " << i->first.first << " " << i->first.second << ": " << i->second << std::endl;
+  for (std::map<std::pair<int, int>, unsigned long>::const_iterator i = elemcharge.begin(); i != elemcharge.end(); ++i)
+    ofs << "AE_ELEM_CHARGE  " << i->first.first << " " << i->first.second << ": " << i->second << std::endl;
+  for (std::map<std::pair<int, int>, unsigned long>::const_iterator i = elemrings.begin(); i != elemrings.end(); ++i)
+    ofs << "AE_ELEM_RINGS  " << i->first.first << " " << i->first.second << ": " << i->second << std::endl;
+
   ofs << "BE_SINGLE : " << numSingleBonds << std::endl;
   ofs << "BE_DOUBLE : " << numDoubleBonds << std::endl;
   ofs << "BE_TRIPLE : " << numTripleBonds << std::endl;
   ofs << "BE_AROM : " << numAromaticBonds << std::endl;
   ofs << "BE_RING : " << numRingBonds << std::endl;
+  for (std::map<std::pair<int, std::pair<int, int> >, unsigned long>::const_iterator i = bondpairs.begin(); i != bondpairs.end(); ++i)
+    ofs << "BE_PAIR  " << i->first.first << " " << i->first.second.first << " " << i->first.second.second << ": " << i->second << std::endl;
+
+  for (std::map<int, double>::const_iterator i = costs.begin(); i != costs.end(); ++i)
+    ofs << "cost " << i->first << " " << i->second << std::endl;
+}
+
+/**
+ * Score files start with the atom count, everything else is read as a
+ * molecule file.
+ */
+bool IsScoreFile(const std::string &filename)
+{
+  std::ifstream ifs(filename.c_str());
+  std::string line;
+  return std::getline(ifs, line) && line.compare(0, 9, "# atoms: ") == 0;
+}
+
+/**
+ * Formats that can be split at an arbitrary line: 1 for one molecule per
+ * line, 2 for SD files (records end with "$$$$"), 0 if the file can not be
+ * split.
+ */
+int GetRecordType(const std::string &filename)
+{
+  std::string ext = filename.substr(filename.rfind(".") + 1);
+  if (ext == "smi" || ext == "smiles" || ext == "can" || ext == "ism" || ext == "inchi")
+    return 1;
+  if (ext == "sdf" || ext == "sd" || ext == "mdl" || ext == "mol")
+    return 2;
+  return 0;
+}
+
+/**
+ * Find the first record starting at or after @p offset.
+ */
+std::streamoff FindRecordStart(const std::string &filename, std::streamoff offset, int recordType)
+{
+  if (offset == 0)
+    return 0;
+
+  std::ifstream ifs(filename.c_str(), std::ios::binary);
+  ifs.seekg(offset - 1);
+  std::string line;
+  // the rest of the line containing offset - 1
+  std::getline(ifs, line);
+  if (recordType == 2)
+    while (line.compare(0, 4, "$$$$") != 0 && std::getline(ifs, line))
+      ;
+
+  if (!ifs) {
+    ifs.clear();
+    ifs.seekg(0, std::ios::end);
+  }
+  return ifs.tellg();
+}
+
+/**
+ * Add the molecules starting in [begin, end) to @p counts.
+ */
+void ScanMolecules(const std::string &filename, std::streamoff begin, std::streamoff end, ScoreCounts &counts)
+{
+  std::ifstream ifs(filename.c_str(), std::ios::binary);
+  ifs.seekg(begin);
+
+  OBConversion conv;
+  conv.SetInFormat(conv.FormatFromExt(filename.c_str()));
+  conv.SetInStream(&ifs);
+
+  OBMol mol;
+  while ((end < 0 || ifs.tellg() < end) && conv.Read(&mol))
+    counts.Add(mol);
+}
+
+/**
+ * Scan the molecule file with @p jobs worker processes. Each worker counts
+ * a range of records and writes its partial counts to a temporary score
+ * file which is merged when the worker is done. If a worker can not be
+ * started, the records that are not assigned to a worker are scanned by
+ * this process. The counts are incomplete if false is returned.
+ */
+bool ScanMoleculesParallel(const std::string &filename, const std::string &prefix, int jobs, ScoreCounts &counts)
+{
+  int recordType = GetRecordType(filename);
+  if (jobs < 2 || !recordType) {
+    if (jobs > 1)
+      std::cerr << "Warning: " << filename << " can not be split, using a single job" << std::endl;
+    ScanMolecules(filename, 0, -1, counts);
+    return true;
+  }
+
+  std::ifstream ifs(filename.c_str(), std::ios::binary);
+  ifs.seekg(0, std::ios::end);
+  std::streamoff fileSize = ifs.tellg();
+
+  // record aligned ranges: [ranges[i], ranges[i + 1])
+  std::vector<std::streamoff> ranges(1, 0);
+  for (int i = 1; i < jobs; ++i)
+    ranges.push_back(std::max(ranges.back(), FindRecordStart(filename, fileSize * i / jobs, recordType)));
+  ranges.push_back(fileSize);
+
+  std::vector<pid_t> workers;
+  for (int i = 0; i < jobs; ++i) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      std::cerr << "Warning: could not start worker " << i << ", scanning the remaining records in this process" << std::endl;
+      break;
+    }
+    if (pid == 0) {
+      ScoreCounts partial;
+      ScanMolecules(filename, ranges[i], ranges[i + 1], partial);
+      std::ofstream ofs(SC::make_string(prefix, ".part", i).c_str());
+      partial.Write(ofs);
+      ofs.close();
+      // skip the parent's atexit handlers and stream buffers
+      _exit(ofs ? 0 : 1);
+    }
+    workers.push_back(pid);
+  }
+
+  // the ranges without a worker
+  if (workers.size() < static_cast<std::size_t>(jobs))
+    ScanMolecules(filename, ranges[workers.size()], fileSize, counts);
+
+  bool result = true;
+  for (std::size_t i = 0; i < workers.size(); ++i) {
+    int status;
+    waitpid(workers[i], &status, 0);
+    std::string part = SC::make_string(prefix, ".part", i);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) || !counts.Read(part)) {
+      std::cerr << "Worker " << i << " failed" << std::endl;
+      result = false;
+    }
+    std::remove(part.c_str());
+  }
+
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " [options] <molecule_file> <output_score_file>" << std::endl;
+    std::cerr << "       " << argv[0] << " -convert <score_file> <output_binary_score_file>" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "The molecule_file can also be a score file, its counts are added." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  -jobs <n>    Split the molecule file over n worker processes (SMILES and SD files)" << std::endl;
+    std::cerr << "  -append      Add the counts to the existing output_score_file" << std::endl;
+    return 1;
+  }
+
+  // convert a text score file to the memory mapped binary format
+  if (std::string(argv[1]) == "-convert") {
+    if (argc < 4) {
+      std::cerr << "Usage: " << argv[0] << " -convert <score_file> <output_binary_score_file>" << std::endl;
+      return 1;
+    }
+    SC::ListSmartsScores scores(argv[2]);
+    return scores.WriteBinary(argv[3]) ? 0 : 1;
+  }
+
+  ParseArgs args(argc, argv, ParseArgs::Args("-jobs(n)", "-append"), ParseArgs::Args("molecule_file", "output_score_file"));
+  if (!args.IsValid())
+    return 1;
+  std::string molecule_file = args.GetArgString("molecule_file");
+  std::string output_score_file = args.GetArgString("output_score_file");
+
+  ScoreCounts counts;
+  if (args.IsArg("-append") && !counts.Read(output_score_file)) {
+    std::cerr << "Could not read " << output_score_file << std::endl;
+    return 1;
+  }
+
+  bool result;
+  if (IsScoreFile(molecule_file))
+    result = counts.Read(molecule_file);
+  else
+    result = ScanMoleculesParallel(molecule_file, output_score_file,
+        args.IsArg("-jobs") ? args.GetArgInt("-jobs", 0) : 1, counts);
+  if (!result)
+    return 1;
+
+  std::ofstream ofs(output_score_file.c_str());
+  counts.Write(ofs);
 }